@@ -34,7 +34,8 @@
  * This uses the ETM to connect to AWSIoT via MQTT and publishes an incrementing count
  * to status/<thingname> at specific intervals. It subscribes to update/<thingname> and
  * expects to receive ascii text numeric messages (e.g. '30') which change the interval
- * of the status publishes.
+ * of the status publishes. Counts which can't be published while the ETM isn't ready are kept
+ * in the QSPI flash and sent, in order, once it is.
  *
  * Required hardware:
  * STM32 Discovery board
@@ -62,6 +63,10 @@
 
 /* Library includes */
 #include "etm/etm.h"
+#if democonfigETM_BASIC_STORE
+#include "etm/etm_store.h"
+#include "etm_store_qspi.h"
+#endif
 
 /* Reference to the ETM context created in etm_intf.c */
 extern ETMObject_t ETMC2cObj;
@@ -70,6 +75,11 @@ static uint32_t updatetime = 10000;      /* Periodic update time in mS (default
 static int updatesubidx = -1;
 static int statuspubidx = -1;
 static int lastcount = 1;
+#if democonfigETM_BASIC_STORE
+static ETMStore_t store;
+static bool storeok = false;
+static int storeunsynced = 0;
+#endif
 
 /* Callback function for the 'update' topic to which we are subscribed */
 static void updatecb(uint8_t *data, uint32_t length){
@@ -78,13 +88,52 @@ static void updatecb(uint8_t *data, uint32_t length){
 	configPRINTF(("Poll update %d mS\r\n", updatetime));
 }
 
+#if democonfigETM_BASIC_STORE
+/* Keep a count for later, programming the flash every few */
+static void storecount(char *msg){
+    if(ETMStoreAppend(&store, "status", 1, (uint8_t *)msg, strlen(msg)) != 0){
+        configPRINTF(("Count not stored\r\n"));
+        return;
+    }
+    if(++storeunsynced >= democonfigETM_BASIC_STORE_SYNC){
+        ETMStoreSync(&store);
+        storeunsynced = 0;
+    }
+}
+#endif
+
 /* Publish an incrementing count to the 'status' topic */
 static void publish(void){
     char msg[20];
     sprintf(msg, "Count %d", lastcount++);
-    ETMpublish(&ETMC2cObj, statuspubidx, 1, (uint8_t *)msg, strlen(msg));
+#if democonfigETM_BASIC_STORE
+    /* Counts go behind any still stored so they arrive in order */
+    if(storeok && (ETMC2cObj.currentstate != ETM_MQTTREADY || ETMStorePending(&store))){
+        storecount(msg);
+        return;
+    }
+#endif
+    if(ETMpublish(&ETMC2cObj, statuspubidx, 1, (uint8_t *)msg, strlen(msg)) != 0){
+#if democonfigETM_BASIC_STORE
+        if(storeok)
+            storecount(msg);
+#endif
+    }
 };
 
+/* Report new UART receive buffer overflows, if they keep happening the buffer or the link
+ * needs looking at */
+static void rxstatus(void){
+    static uint32_t overflows = 0;
+    ETM_RxStats_t rx;
+
+    if(ETM_GetRxStats(&ETMC2cObj, &rx) == ETM_RETURN_OK && rx.overflows != overflows){
+        overflows = rx.overflows;
+        configPRINTF(("UART rx overflows %lu, %lu octets lost, high water %u of %u\r\n",
+                      (unsigned long)rx.overflows, (unsigned long)rx.dropped, rx.highwater, rx.size));
+    }
+}
+
 void stateupd(void){
 	configPRINTF(("New state is %d\r\n", ETMC2cObj.currentstate));
 }
@@ -93,6 +142,16 @@ static void ETMBasicTask( void * pvParameters ){
 	/* Holder for the current tick count during timing loop */
     uint32_t tickstart;
     bool toggle_power = true;
+#if democonfigETM_BASIC_STORE
+    ETM_Flash_t fops;
+
+    /* Counts stored before a reset are still sent */
+    storeok = (ETM_QSPIFlashInit(&fops, democonfigETM_BASIC_STORE_BASE, democonfigETM_BASIC_STORE_SIZE) == 0 &&
+               ETMStoreInit(&store, &fops) == 0);
+    if(!storeok){
+        configPRINTF(("Store not available\r\n"));
+    }
+#endif
 
     while(1){
 
@@ -119,29 +178,44 @@ static void ETMBasicTask( void * pvParameters ){
 		    configPRINTF(("Error MQTT not ready\r\n"));
 	    }
 
+	    /* Queue the start-up commands so they go out back to back, the results are collected
+	     * by ETMpoll() in the main loop */
 	    ETMstatecb(&ETMC2cObj, stateupd);
-	    ETMupdateState(&ETMC2cObj, ETM_STATE_ON);
+	    ETMupdateStateAsync(&ETMC2cObj, ETM_STATE_ON, NULL, NULL);
 
 	    /* Subscribe to update/<thingname> topic */
-	    updatesubidx = ETMsubscribe(&ETMC2cObj, (char *)"update", updatecb);
+	    ETMsubscribeAsync(&ETMC2cObj, (char *)"update", updatecb, &updatesubidx, NULL, NULL);
 
 	    /* Register publish topic as status/<thingname> */
-	    statuspubidx = ETMpubreg(&ETMC2cObj, (char *)"status");
+	    ETMpubregAsync(&ETMC2cObj, (char *)"status", &statuspubidx, NULL, NULL);
 
 	    /* Main loop which handles the update timer and publishing status */
         while((ETMC2cObj.urcseen & ETM_REBOOT_REQUIRED) == 0 && (ETMC2cObj.urcseen & ETM_REBOOT) == 0){
     	    tickstart = ETMC2cObj.GetTickCb();
     	    while((ETMC2cObj.GetTickCb() - tickstart) < pdMS_TO_TICKS(updatetime)){
     	        ETMpoll(&ETMC2cObj);
+#if democonfigETM_BASIC_STORE
+    	        /* Send stored counts a few at a time so the ETM is still polled */
+    	        if(storeok){
+    	            ETMStoreDrain(&store, &ETMC2cObj, 4);
+    	        }
+#endif
     	    }
     	    configPRINTF(("Publish\r\n"));
             publish();
+            rxstatus();
         }
         if(ETMC2cObj.urcseen & ETM_REBOOT_REQUIRED){
         	toggle_power = true;
         }else{
         	configPRINTF(("ETM is rebooting...\r\n"));
         }
+#if democonfigETM_BASIC_STORE
+        if(storeok){
+            ETMStoreSync(&store);
+            storeunsynced = 0;
+        }
+#endif
         if(toggle_power == true){
             configPRINTF(("Restarting ETM...\r\n"));
             /* Reboot required */
@@ -62,6 +62,9 @@
 
 /* Library includes */
 #include "etm/etm.h"
+#include "etm/etm_fw.h"
+#include "etm_ota_writer.h"
+#include "etm_ota_codesigner_certificate.h"
 #include "etm_intf.h"
 
 /* Reference to the ETM context created in etm_intf.c */
@@ -91,62 +94,34 @@ static void firmware_check_complete(bool available){
 		get_firmware = OTA_UNAVAILABLE;
 }
 
-static void reportBootBank(void){
-	FLASH_OBProgramInitTypeDef OBInit;
-	HAL_FLASH_Unlock();
-    /* Clear OPTVERR bit set on virgin samples */
-	__HAL_FLASH_CLEAR_FLAG(FLASH_FLAG_OPTVERR);
-	/* Allow Access to option bytes sector */
-	HAL_FLASH_OB_Unlock();
-	/* Get the Dual boot configuration status */
-	HAL_FLASHEx_OBGetConfig(&OBInit);
-	int flash_boot_bank = ((OBInit.USERConfig & OB_BFB2_ENABLE) == OB_BFB2_ENABLE) ? FLASH_BANK_2 : FLASH_BANK_1;
-	configPRINTF(("Flash boot bank set to %d\r\n", flash_boot_bank));
-}
-
-static void swapBootBank(void) {
-	FLASH_OBProgramInitTypeDef OBInit;
-
-	configPRINTF(("Swapping boot image bank\r\n"));
-	vTaskDelay(1000);
-	HAL_FLASH_Unlock();
-
-	/* Clear OPTVERR bit set on virgin samples */
-	__HAL_FLASH_CLEAR_FLAG(FLASH_FLAG_OPTVERR);
-
-	/* Allow Access to option bytes sector */
-	HAL_FLASH_OB_Unlock();
-
-	/* Get the Dual boot configuration status */
-	HAL_FLASHEx_OBGetConfig(&OBInit);
-
-	/* Enable/Disable dual boot feature */
-	OBInit.OptionType = OPTIONBYTE_USER;
-	OBInit.USERType   = OB_USER_BFB2;
-
-	if (((OBInit.USERConfig) & (OB_BFB2_ENABLE)) == OB_BFB2_ENABLE){
-		OBInit.USERConfig = OB_BFB2_DISABLE;
-		configPRINTF(("Enable boot bank 1\r\n"));
-	} else {
-        OBInit.USERConfig = OB_BFB2_ENABLE;
-        configPRINTF(("Enable boot bank 2\r\n"));
-	}
-
-	if(HAL_FLASHEx_OBProgram (&OBInit) == HAL_OK){
-		/* Start the Option Bytes programming process */
-		if (HAL_FLASH_OB_Launch() != HAL_OK){
-			configPRINTF(("OB_Launch failed\r\n"));
-		}
-	} else {
-		configPRINTF(("OBProgram failed\r\n"));
-	}
-}
-
 void stateupd(void){
 	configPRINTF(("New state is %d\r\n", ETMC2cObj.currentstate));
 }
 
-#define MAXCHUNKSIZE 50 /* Make sure this is an even number */
+/* The last page of the bank being written keeps the download's progress, so a download which is
+ * cut short carries on from where it got to, and it is tried this many times */
+#define OTA_JOURNAL			(otaflash.bank + otaflash.banksize - otaflash.pagesize)
+#define OTA_ATTEMPTS		3
+
+static ETMOtaFlash_t otaflash;
+static ETMOtaWriter_t otawriter;
+static ETMFwDownload_t otadownload;
+
+/* Read the image from the ETM into the other bank, checked against the ETM's checksum. Pages
+ * are erased as the image reaches them. The image must be signed (tools/etm_ota) and its CRC
+ * and signature are checked as it is written. */
+static bool otaDownload(void){
+	ETMOtaFlashInit(&otaflash);
+	if(ETMOtaWriterOpen(&otawriter, &otaflash, otaflash.bank, otaflash.banksize - otaflash.pagesize, false) != 0)
+		return false;
+	if(ETMOtaWriterVerify(&otawriter, signingcredentialSIGNER_CERTIFICATE_PEM,
+	                      sizeof(signingcredentialSIGNER_CERTIFICATE_PEM)) != 0){
+		ETMOtaWriterFinish(&otawriter);
+		return false;
+	}
+	memset(&otadownload, 0, sizeof(otadownload));
+	return ETMOtaDownload(&ETMC2cObj, &otawriter, &otadownload, OTA_JOURNAL, OTA_ATTEMPTS) == 0;
+}
 
 static void ETMOtaTask( void * pvParameters ){
 	/* Holder for the current tick count during timing loop */
@@ -155,7 +130,7 @@ static void ETMOtaTask( void * pvParameters ){
     /* Power up the ETM */
     ETM_HwPowerUp();
 
-    reportBootBank();
+    configPRINTF(("Flash boot bank set to %d\r\n", ETMOtaBootBank()));
 
     /* Initialise the ETM context */
 	ETM_Init(&ETMC2cObj, NULL);
@@ -207,145 +182,11 @@ static void ETMOtaTask( void * pvParameters ){
     	ETMpoll(&ETMC2cObj);
 
     if(get_firmware == OTA_AVAILABLE){
-    	uint16_t cs, calccs = 0, collatecs = 0;
-    	uint32_t len;
-    	bool error = false;
-
-    	uint32_t address = 0x8080000; /* Other bank of flash */
-    	FLASH_EraseInitTypeDef EraseInit;
-    	uint32_t PageError = 0;
-
-    	/* Erase the bank we're going to write */
-    	EraseInit.TypeErase = FLASH_TYPEERASE_PAGES;
-    	if (READ_BIT(SYSCFG->MEMRMP, SYSCFG_MEMRMP_FB_MODE) == 0){
-    		/* No Bank swap */
-    		EraseInit.Banks = FLASH_BANK_2;
-    	}else{
-    		/* Bank swap */
-    		EraseInit.Banks = FLASH_BANK_1;
-    	}
-    	EraseInit.Page = 0;
-    	EraseInit.NbPages = (FLASH_BANK_SIZE / FLASH_PAGE_SIZE);
-    	/* Erase the pages */
-    	HAL_FLASH_Unlock();
-    	if (HAL_FLASHEx_Erase(&EraseInit, &PageError) != HAL_OK) {
-    	    /* Failed to erase flash block */
-
+    	bool error = !otaDownload();
 
-
-    	}
-
-    	if(ETMGetHostFWDetails(&ETMC2cObj, &len, &cs) == 0){
-    	    configPRINTF(("Firmware length is %d, cs is %x\r\n", len, cs));
-    	    if(len > 0){
-    	    	uint32_t walk = 0, collatebyteidx = 0;
-    	    	uint32_t dataword[2];
-    	    	uint8_t respbuf[50];
-
-    	    	uint8_t reportpc = 0;
-
-    	    	while(walk < len && error == false){
-    	    		uint32_t getsize = len - walk;
-
-    	    		if(getsize > MAXCHUNKSIZE)
-    	    			getsize = MAXCHUNKSIZE;
-    	    		if(ETMReadHostFW(&ETMC2cObj, walk, getsize, respbuf) == 0){
-    	    			uint16_t octetidx = 0;
-    	    			uint8_t currpc;
-    	    			//configPRINTF(("Got data from %d to %d\r\n", walk, walk + getsize));
-
-    	    			currpc = (len - walk) / (len / 100);
-    	    			currpc = 100 - currpc;
-    	    			if(currpc - reportpc >= 5){
-    	    				reportpc = currpc;
-    	    				configPRINTF(("%d%%\r\n", reportpc));
-    	    			}
-
-    	    		    walk += getsize;
-
-    	    		    while(octetidx < getsize){
-    	    		    	/* collate data into 32-bit words */
-    	    		    	dataword[collatebyteidx / 4] >>= 8;
-    	    		    	dataword[collatebyteidx / 4] |= (respbuf[octetidx] << 24);
-                            /* Collate the 16-bit checksum */
-    	    		    	collatecs <<= 8;
-    	    		    	collatecs |= respbuf[octetidx];
-
-    	    		    	collatebyteidx++;
-    	    		    	octetidx++;
-                            /* On even bytes adjust the running checksum */
-    	    		    	if(collatebyteidx > 0 && collatebyteidx % 2 == 0){
-    	    		    	    calccs ^= collatecs;
-    	    		    	    collatecs = 0;
-    	    		    	}
-
-        	    		    if(collatebyteidx == 8){
-        	    		    	uint64_t datadword;
-        	    		    	datadword = dataword[1];
-        	    		    	datadword <<= 32;
-        	    		    	datadword |= (uint64_t)dataword[0];
-
-    	    		            if (HAL_FLASH_Program(FLASH_TYPEPROGRAM_DOUBLEWORD, address, datadword) == HAL_OK) {
-    	    		    		    /* Data verify */
-    	    		    		    if (*((uint64_t *)address) != datadword) {
-    	    		    		        /* Verify failed, bomb out */
-    	    		    		    	configPRINTF(("Verify fail @ 0x%x\r\n", address));
-    	    		    		        error = true;
-    	    		    		        break;
-    	    		    	        } else {
-    	    		    		        address += 8;
-    	    		    		    }
-    	    		    	    }else{
-    	    		    		    /* Failed to write to flash */
-
-    	    		    	    	error = true;
-    	    		    		    break;
-    	    		    	    }
-    	    		            collatebyteidx = 0;
-    	    		            dataword[0] = 0;
-    	    		            dataword[1] = 0;
-    	    		        }
-    	    		    }
-
-    	    		}else{
-    	    			configPRINTF(("Error reading data\r\n"));
-    	    			error = true;
-    	    			break;
-    	    		}
-    	    	}
-
-    	    	if(collatebyteidx > 0 && error == false){
-    	    		uint64_t datadword = dataword[1];
-    	    		datadword <<= 32;
-    	    		datadword |= (uint64_t)dataword[0];
-    	    		/* Check for odd-byte and add to checksum */
-    	    		if(collatebyteidx % 2 != 0)
-    	    			calccs ^= collatecs;
-    	    		/* Program the remaining part-doubleword to flash */
-    	    	    if (HAL_FLASH_Program(FLASH_TYPEPROGRAM_DOUBLEWORD, address, datadword) == HAL_OK) {
-    	    	    	/* Data verify */
-    	    	    	if (*((uint64_t *)address) != datadword) {
-    	    	    	    /* Verify failed, bomb out */
-
-    	    	    	    error = true;
-    	    	    	}
-    	    	    }else{
-    	    	        /* Failed to write to flash */
-
-    	    	    	error = true;
-    	    	    }
-    	    	}
-    	    	if(error == false && calccs != cs){
-    	    		configPRINTF(("Checksum mismatch (supplied 0x%x, calculated 0x%x\r\n", cs, calccs));
-    	    		error = true;
-    	    	}
-    	    }
-    	}else{
-    		configPRINTF(("Couldn't get firmware details\r\n"));
-    	}
     	if(error == false){
     		configPRINTF(("Firmware update successful\r\n"));
-    		swapBootBank();
+    		ETMOtaSwapBootBank();
     	}else{
     		configPRINTF(("Failed to read and store OTA image \r\n"));
     	}
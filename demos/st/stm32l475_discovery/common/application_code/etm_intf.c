@@ -11,19 +11,72 @@
 
 #include <stdbool.h>
 #include <stdlib.h>
+#include <string.h>
 
+/* Receive ring, a power of two up to 32768 */
 #define RING_BUFFER_SIZE 2048
-
+#define RING_MASK        (RING_BUFFER_SIZE - 1)
+#if (RING_BUFFER_SIZE & RING_MASK) != 0 || RING_BUFFER_SIZE > 32768
+#error RING_BUFFER_SIZE must be a power of two no larger than 32768
+#endif
+/* Commands up to this length are copied and sent by DMA while the caller carries on, longer
+ * data is sent from the caller's buffer and waited for */
+#define TX_BUFFER_SIZE   ETM_CMD_SIZE
+
+/* Single producer (the Rx interrupts) single consumer (the ETM task) ring. The indices run
+ * freely and are masked on use, only the producer writes tail and only the consumer writes
+ * head. The tail only moves at half and full transfer and at an idle line while the DMA
+ * doesn't stop for unread data, so the consumer judges a lap by the DMA's own position and
+ * drops what it hasn't read once that is a whole buffer ahead. */
 typedef struct
 {
   uint8_t  data[RING_BUFFER_SIZE];
-  uint16_t tail;
-  uint16_t head;
+  volatile uint32_t tail;
+  volatile uint32_t head;
+  /* Producer's counters */
+  uint32_t received;
+  uint32_t overflows;
+  uint16_t highwater;
+  /* Consumer's count of octets dropped after an overflow */
+  uint32_t dropped;
 }RingBuffer_t;
 
+/* Per port UART state, one for each ETM */
+typedef struct
+{
+  UART_HandleTypeDef *huart;
+  USART_TypeDef      *Instance;
+  void              (*MspInit)(UART_HandleTypeDef *hUART_c2c);
+  void              (*MspDeInit)(UART_HandleTypeDef *hUART_c2c);
+  RingBuffer_t        RxData;
+  /* Task blocked in UART_C2C_WaitData() (NULL if none) and the number of octets it still
+   * wants (0 to be woken by a line end only) */
+  TaskHandle_t        RxWaiter;
+  uint16_t            RxWanted;
+  /* Framing, noise and overrun errors since UART_C2C_LineErrors() was last called */
+  uint16_t            LineErrors;
+  /* RTS/CTS pins configured by the MSP, only then are they handed back on de-init */
+  uint8_t             FlowPins;
+  /* DMA transmission in progress, TxDone is given when it completes */
+  volatile uint8_t    TxBusy;
+  SemaphoreHandle_t   TxDone;
+  StaticSemaphore_t   TxDoneBuffer;
+  uint8_t             TxData[TX_BUFFER_SIZE];
+}UART_C2C_Port_t;
+
 static void UART_C2C_MspInit(UART_HandleTypeDef *hUART_c2c);
+static void UART_C2C_MspDeInit(UART_HandleTypeDef *hUART_c2c);
+static void UART_C2C_PortConsumeData(UART_C2C_Port_t *Port, uint16_t Length);
 UART_HandleTypeDef huart4;
-RingBuffer_t UART_RxData;
+DMA_HandleTypeDef  hdma_uart4_rx;
+DMA_HandleTypeDef  hdma_uart4_tx;
+
+/* Ports in use, index 0 is the C2C UART described in etm_io.h. Further ports need their own
+ * handle (serviced from their IRQ handler), instance and pin setup. */
+static UART_C2C_Port_t UART_C2C_Ports[UART_C2C_NUM_PORTS] =
+{
+  { &huart4, UART_C2C, UART_C2C_MspInit, UART_C2C_MspDeInit },
+};
 
 /***********************************************************************/
 
@@ -100,8 +153,6 @@ void ETM_HwPowerUp(void){
 
 static void UART_C2C_MspDeInit(UART_HandleTypeDef *hUART_c2c)
 {
-  //static DMA_HandleTypeDef hdma_tx;
-
   /*##-1- Reset peripherals ##################################################*/
   UART_C2C_FORCE_RESET();
   UART_C2C_RELEASE_RESET();
@@ -111,53 +162,137 @@ static void UART_C2C_MspDeInit(UART_HandleTypeDef *hUART_c2c)
   HAL_GPIO_DeInit(UART_C2C_TX_GPIO_PORT, UART_C2C_TX_PIN);
   /* Configure UART Rx as alternate function  */
   HAL_GPIO_DeInit(UART_C2C_RX_GPIO_PORT, UART_C2C_RX_PIN);
+#if UART_C2C_FLOW_CONTROL
+  if(UART_C2C_Ports[0].FlowPins)
+  {
+    HAL_GPIO_DeInit(UART_C2C_RTS_GPIO_PORT, UART_C2C_RTS_PIN);
+    HAL_GPIO_DeInit(UART_C2C_CTS_GPIO_PORT, UART_C2C_CTS_PIN);
+    UART_C2C_Ports[0].FlowPins = 0;
+  }
+#endif
 
   /*##-3- Disable the DMA Channels ###########################################*/
-  /* De-Initialize the DMA Channel associated to transmission process */
-  //HAL_DMA_DeInit(&hdma_tx);
+  HAL_DMA_DeInit(hUART_c2c->hdmarx);
+  HAL_DMA_DeInit(hUART_c2c->hdmatx);
 
   /*##-4- Disable the NVIC for DMA ###########################################*/
+  HAL_NVIC_DisableIRQ(UART_C2C_DMA_RX_IRQn);
   HAL_NVIC_DisableIRQ(UART_C2C_DMA_TX_IRQn);
 }
 
-int8_t UART_C2C_Init(void)
+/**
+  * @brief  Start circular DMA reception into the ring buffer. The DMA channel writes the
+  *         buffer, its position is read into the tail at half and full transfer and when
+  *         the line goes idle, so there is no interrupt per octet.
+  * @param  Port: UART port.
+  * @param  Consumer: true when called from the ETM task, which drops unread data. From an
+  *         interrupt unread data is marked as overwritten and the consumer drops it.
+  * @retval 0 on success, -1 otherwise.
+  */
+static int8_t UART_C2C_PortStartRx(UART_C2C_Port_t *Port, bool Consumer)
 {
+  UART_HandleTypeDef *huart = Port->huart;
+  RingBuffer_t *Rx = &Port->RxData;
+
+  /* The DMA starts at the beginning of the buffer, move the tail up to match */
+  Rx->tail = (Rx->tail + RING_MASK) & ~(uint32_t)RING_MASK;
+  if(Consumer)
+  {
+    Rx->head = Rx->tail;
+  }
+  else if(Rx->head != Rx->tail)
+  {
+    Rx->tail += RING_BUFFER_SIZE;
+    Rx->overflows++;
+  }
+  if(HAL_UART_Receive_DMA(huart, Rx->data, RING_BUFFER_SIZE) != HAL_OK)
+  {
+    return -1;
+  }
+  /* A line error would abort the DMA transfer, they are counted at the idle line instead */
+  CLEAR_BIT(huart->Instance->CR1, USART_CR1_PEIE);
+  CLEAR_BIT(huart->Instance->CR3, USART_CR3_EIE);
+  __HAL_UART_CLEAR_IDLEFLAG(huart);
+  __HAL_UART_ENABLE_IT(huart, UART_IT_IDLE);
+
+  return 0;
+}
+
+/**
+  * @brief  Wait for a DMA transmission to finish, aborting it if it doesn't.
+  * @param  Port: UART port.
+  * @param  Timeout: maximum time to wait in ms.
+  * @retval 0 on success, -1 on timeout.
+  */
+static int8_t UART_C2C_PortWaitSent(UART_C2C_Port_t *Port, uint32_t Timeout)
+{
+  /* TxDone may still be given from a transfer nobody waited for, so check TxBusy again */
+  while(Port->TxBusy)
+  {
+    if(xSemaphoreTake(Port->TxDone, pdMS_TO_TICKS(Timeout)) != pdTRUE)
+    {
+      HAL_UART_AbortTransmit(Port->huart);
+      Port->TxBusy = 0;
+      return -1;
+    }
+  }
+  return 0;
+}
+
+/**
+  * @brief  Apply a changed UART configuration, stopping and restarting the DMA transfers.
+  * @param  Port: UART port.
+  * @retval 0 on success, -1 otherwise.
+  */
+static int8_t UART_C2C_PortReInit(UART_C2C_Port_t *Port)
+{
+  UART_C2C_PortWaitSent(Port, 2000);
+  HAL_UART_Abort(Port->huart);
+  HAL_UART_DeInit(Port->huart);
+  if(HAL_UART_Init(Port->huart) != HAL_OK)
+  {
+    return -1;
+  }
+  return UART_C2C_PortStartRx(Port, true);
+}
+
+static int8_t UART_C2C_PortInit(UART_C2C_Port_t *Port)
+{
+  UART_HandleTypeDef *huart = Port->huart;
+
   /* Set the C2C USART configuration parameters on MCU side */
   /* Attention: make sure the module uart is configured with the same values */
-	huart4.Instance        = UART4;
-	huart4.Init.BaudRate   = ETM_DEFAULT_BAUDRATE;
-	huart4.Init.WordLength = UART_WORDLENGTH_8B;
-	huart4.Init.StopBits   = UART_STOPBITS_1;
-	huart4.Init.Parity     = UART_PARITY_NONE;
-	huart4.Init.HwFlowCtl  = UART_HWCONTROL_NONE;
-	huart4.Init.Mode       = UART_MODE_TX_RX;
-	huart4.Init.OverSampling = UART_OVERSAMPLING_16;
-	huart4.Init.OneBitSampling = UART_ONE_BIT_SAMPLE_DISABLE;
-	huart4.AdvancedInit.AdvFeatureInit = UART_ADVFEATURE_NO_INIT;
-
-	HAL_UART_DeInit(&huart4);
-
-  UART_C2C_MspInit(&huart4);
+	huart->Instance        = Port->Instance;
+	huart->Init.BaudRate   = ETM_DEFAULT_BAUDRATE;
+	huart->Init.WordLength = UART_WORDLENGTH_8B;
+	huart->Init.StopBits   = UART_STOPBITS_1;
+	huart->Init.Parity     = UART_PARITY_NONE;
+	huart->Init.HwFlowCtl  = UART_HWCONTROL_NONE;
+	huart->Init.Mode       = UART_MODE_TX_RX;
+	huart->Init.OverSampling = UART_OVERSAMPLING_16;
+	huart->Init.OneBitSampling = UART_ONE_BIT_SAMPLE_DISABLE;
+	huart->AdvancedInit.AdvFeatureInit = UART_ADVFEATURE_NO_INIT;
+
+	HAL_UART_DeInit(huart);
+
+  if(Port->TxDone == NULL)
+  {
+    Port->TxDone = xSemaphoreCreateBinaryStatic(&Port->TxDoneBuffer);
+  }
+  Port->TxBusy = 0;
+
+  Port->MspInit(huart);
   /* Configure the USART IP */
-  if(HAL_UART_Init(&huart4) != HAL_OK)
+  if(HAL_UART_Init(huart) != HAL_OK)
   {
     return -1;
   }
 
-  /* Once the C2C UART is initialized, start an asynchronous recursive
-   listening. the HAL_UART_Receive_IT() call below will wait until one char is
-   received to trigger the HAL_UART_RxCpltCallback(). The latter will recursively
-   call the former to read another char.  */
-  UART_RxData.head = 0;
-  UART_RxData.tail = 0;
-  HAL_UART_Receive_IT(&huart4, (uint8_t *)&UART_RxData.data[UART_RxData.tail], 1);
-
-  return 0;
+  return UART_C2C_PortStartRx(Port, true);
 }
 
 static void UART_C2C_MspInit(UART_HandleTypeDef *hUART_c2c)
 {
-  //static DMA_HandleTypeDef hdma_tx;
   GPIO_InitTypeDef  GPIO_Init;
 
   /* Enable the GPIO clock */
@@ -186,7 +321,7 @@ static void UART_C2C_MspInit(UART_HandleTypeDef *hUART_c2c)
   UART_C2C_CLK_ENABLE();
 
   /* Enable DMA clock */
-  //DMAx_CLK_ENABLE();
+  DMAx_CLK_ENABLE();
 
   /*##-2- Configure peripheral GPIO ##########################################*/
   /* UART TX GPIO pin configuration  */
@@ -204,18 +339,65 @@ static void UART_C2C_MspInit(UART_HandleTypeDef *hUART_c2c)
 
   //HAL_GPIO_Init(UART_C2C_RX_GPIO_PORT, &GPIO_Init);
 
+#if UART_C2C_FLOW_CONTROL
+  /* RTS/CTS only while flow control is on, so the pins are left alone until then */
+  if(hUART_c2c->Init.HwFlowCtl != UART_HWCONTROL_NONE)
+  {
+    UART_C2C_RTS_GPIO_CLK_ENABLE();
+    UART_C2C_CTS_GPIO_CLK_ENABLE();
+    GPIO_Init.Pin       = UART_C2C_RTS_PIN;
+    GPIO_Init.Alternate = UART_C2C_RTS_AF;
+    HAL_GPIO_Init(UART_C2C_RTS_GPIO_PORT, &GPIO_Init);
+    GPIO_Init.Pin       = UART_C2C_CTS_PIN;
+    GPIO_Init.Alternate = UART_C2C_CTS_AF;
+    HAL_GPIO_Init(UART_C2C_CTS_GPIO_PORT, &GPIO_Init);
+    UART_C2C_Ports[0].FlowPins = 1;
+  }
+#endif
 
-  /*##-3- Configure the NVIC for UART ########################################*/
+  /*##-3- Configure the DMA ##################################################*/
+  /* Reception runs continuously round the ring buffer */
+  hdma_uart4_rx.Instance                 = UART_C2C_RX_DMA_CHANNEL;
+  hdma_uart4_rx.Init.Request             = UART_C2C_RX_DMA_REQUEST;
+  hdma_uart4_rx.Init.Direction           = DMA_PERIPH_TO_MEMORY;
+  hdma_uart4_rx.Init.PeriphInc           = DMA_PINC_DISABLE;
+  hdma_uart4_rx.Init.MemInc              = DMA_MINC_ENABLE;
+  hdma_uart4_rx.Init.PeriphDataAlignment = DMA_PDATAALIGN_BYTE;
+  hdma_uart4_rx.Init.MemDataAlignment    = DMA_MDATAALIGN_BYTE;
+  hdma_uart4_rx.Init.Mode                = DMA_CIRCULAR;
+  hdma_uart4_rx.Init.Priority            = DMA_PRIORITY_HIGH;
+  HAL_DMA_Init(&hdma_uart4_rx);
+  __HAL_LINKDMA(hUART_c2c, hdmarx, hdma_uart4_rx);
+
+  hdma_uart4_tx.Instance                 = UART_C2C_TX_DMA_CHANNEL;
+  hdma_uart4_tx.Init.Request             = UART_C2C_TX_DMA_REQUEST;
+  hdma_uart4_tx.Init.Direction           = DMA_MEMORY_TO_PERIPH;
+  hdma_uart4_tx.Init.PeriphInc           = DMA_PINC_DISABLE;
+  hdma_uart4_tx.Init.MemInc              = DMA_MINC_ENABLE;
+  hdma_uart4_tx.Init.PeriphDataAlignment = DMA_PDATAALIGN_BYTE;
+  hdma_uart4_tx.Init.MemDataAlignment    = DMA_MDATAALIGN_BYTE;
+  hdma_uart4_tx.Init.Mode                = DMA_NORMAL;
+  hdma_uart4_tx.Init.Priority            = DMA_PRIORITY_LOW;
+  HAL_DMA_Init(&hdma_uart4_tx);
+  __HAL_LINKDMA(hUART_c2c, hdmatx, hdma_uart4_tx);
+
+  /*##-4- Configure the NVIC for UART and DMA ################################*/
+  HAL_NVIC_SetPriority(UART_C2C_DMA_RX_IRQn, 5, 0);
+  HAL_NVIC_EnableIRQ(UART_C2C_DMA_RX_IRQn);
+  HAL_NVIC_SetPriority(UART_C2C_DMA_TX_IRQn, 5, 0);
+  HAL_NVIC_EnableIRQ(UART_C2C_DMA_TX_IRQn);
   HAL_NVIC_SetPriority(UART_C2C_IRQn, 5, 0);
   HAL_NVIC_EnableIRQ(UART_C2C_IRQn);
 
 }
 
-int8_t UART_C2C_DeInit(void)
+static int8_t UART_C2C_PortDeInit(UART_C2C_Port_t *Port)
 {
   /* Reset USART configuration to default */
-  HAL_UART_DeInit(&huart4);
-  UART_C2C_MspDeInit(&huart4);
+  UART_C2C_PortWaitSent(Port, 2000);
+  HAL_UART_Abort(Port->huart);
+  HAL_UART_DeInit(Port->huart);
+  Port->MspDeInit(Port->huart);
 
   return 0;
 }
@@ -226,54 +408,166 @@ int8_t UART_C2C_DeInit(void)
   *         This function has to be called after having changed the C2C module baudrate
   *         In order to do that the SMT32 Init shall be done at UG96_DEFAULT_BAUDRATE
   *         After C2C module baudrate is changed this function sets the STM32 baudrate accordingly
-  * @param  None.
+  * @param  Port: UART port.
+  * @param  BaudRate: new baudrate.
   * @retval 0 on success, -1 otherwise.
   */
-int8_t UART_C2C_SetBaudrate(uint32_t BaudRate)
+static int8_t UART_C2C_PortSetBaudrate(UART_C2C_Port_t *Port, uint32_t BaudRate)
+{
+  Port->huart->Init.BaudRate   = BaudRate;
+  return UART_C2C_PortReInit(Port);
+}
+
+/**
+  * @brief  Turn RTS/CTS hardware flow control on or off. The ETM end is set with AT+IFC,
+  *         the driver turns this end on first so the ETM is never held off by a floating CTS.
+  * @param  Port: UART port.
+  * @param  Enable: 1 for RTS/CTS, 0 for none.
+  * @retval 0 on success, -1 otherwise (or if the pins aren't routed).
+  */
+static int8_t UART_C2C_PortFlowControl(UART_C2C_Port_t *Port, uint8_t Enable)
+{
+#if UART_C2C_FLOW_CONTROL
+  /* The MSP takes the RTS/CTS pins when the UART comes back up with flow control on */
+  Port->huart->Init.HwFlowCtl = Enable ? UART_HWCONTROL_RTS_CTS : UART_HWCONTROL_NONE;
+  return UART_C2C_PortReInit(Port);
+#else
+  return Enable ? -1 : 0;
+#endif
+}
+
+/**
+  * @brief  Line errors seen since the last call, used by the driver to step the baud rate
+  *         down when the link is noisy.
+  * @param  Port: UART port.
+  * @retval number of framing, noise and overrun errors.
+  */
+static uint16_t UART_C2C_PortLineErrors(UART_C2C_Port_t *Port)
 {
-  HAL_UART_DeInit(&huart4);
-  huart4.Init.BaudRate   = BaudRate;
-  if(HAL_UART_Init(&huart4) != HAL_OK)
+  uint16_t errors;
+
+  taskENTER_CRITICAL();
+  errors = Port->LineErrors;
+  Port->LineErrors = 0;
+  taskEXIT_CRITICAL();
+
+  return errors;
+}
+
+
+/**
+  * @brief  Flush Ring Buffer. The DMA keeps writing at its own position so the
+  *         received data is discarded rather than the buffer reset.
+  * @param  Port: UART port.
+  * @retval None
+  */
+static void UART_C2C_PortFlushBuffer(UART_C2C_Port_t *Port)
+{
+  Port->RxData.head = Port->RxData.tail;
+}
+
+/**
+  * @brief  Octets waiting in the ring buffer, for the consumer only. If the DMA has come a
+  *         whole buffer past From the data there has been written over, everything unread
+  *         is dropped and, unless the Rx interrupt has already seen it, the lap counted.
+  * @param  Port: UART port.
+  * @param  From: oldest octet still in use, the head or a run the caller has just used.
+  * @retval number of octets available.
+  */
+static uint32_t UART_C2C_PortRxCheck(UART_C2C_Port_t *Port, uint32_t From)
+{
+  RingBuffer_t *Rx = &Port->RxData;
+  uint32_t tail = Rx->tail;
+  /* Where the DMA writes next in the same terms as the tail, which it is less than a lap
+   * ahead of as the half and full transfer interrupts keep up with it */
+  uint32_t written = tail + ((RING_BUFFER_SIZE - __HAL_DMA_GET_COUNTER(Port->huart->hdmarx) - tail) & RING_MASK);
+  uint32_t used = tail - Rx->head;
+
+  if(written - From >= RING_BUFFER_SIZE)
   {
-    return -1;
+    if(tail - From < RING_BUFFER_SIZE)
+    {
+      taskENTER_CRITICAL();
+      Rx->overflows++;
+      taskEXIT_CRITICAL();
+    }
+    Rx->dropped += used;
+    Rx->head = tail;
+    used = 0;
   }
-  /* Once the C2C UART is initialized, start an asynchronous recursive
-   listening. the HAL_UART_Receive_IT() call below will wait until one char is
-   received to trigger the HAL_UART_RxCpltCallback(). The latter will recursively
-   call the former to read another char.  */
-  UART_RxData.head = 0;
-  UART_RxData.tail = 0;
-  HAL_UART_Receive_IT(&huart4, (uint8_t *)&UART_RxData.data[UART_RxData.tail], 1);
-
-  return 0;
+  /* Read the tail before the data it covers */
+  __DMB();
+  return used;
 }
 
+/**
+  * @brief  Octets waiting in the ring buffer, for the consumer only.
+  * @param  Port: UART port.
+  * @retval number of octets available.
+  */
+static uint32_t UART_C2C_PortRxUsed(UART_C2C_Port_t *Port)
+{
+  return UART_C2C_PortRxCheck(Port, Port->RxData.head);
+}
 
 /**
-  * @brief  Flush Ring Buffer
-  * @param  None
+  * @brief  Receive buffer statistics.
+  * @param  Port: UART port.
+  * @param  Stats: filled in.
   * @retval None.
   */
-void UART_C2C_FlushBuffer(void)
+static void UART_C2C_PortRxStats(UART_C2C_Port_t *Port, ETM_RxStats_t *Stats)
 {
-  memset(UART_RxData.data, 0, RING_BUFFER_SIZE);
-  UART_RxData.head = UART_RxData.tail = 0;
+  RingBuffer_t *Rx = &Port->RxData;
+
+  taskENTER_CRITICAL();
+  Stats->received = Rx->received;
+  Stats->overflows = Rx->overflows;
+  Stats->highwater = Rx->highwater;
+  taskEXIT_CRITICAL();
+  Stats->dropped = Rx->dropped;
+  Stats->size = RING_BUFFER_SIZE;
 }
 
 /**
   * @brief  Send Data to the C2C module over the UART interface.
   *         This function allows sending data to the  C2C Module, the
   *         data can be either an AT command or raw data to send over
-  *         a pre-established C2C connection.
+  *         a pre-established C2C connection. Data that fits TxData is
+  *         copied and sent by DMA after returning, longer data is waited for.
+  * @param Port: UART port.
   * @param pData: data to send.
   * @param Length: the data length.
   * @retval 0 on success, -1 otherwise.
   */
-int16_t UART_C2C_SendData(uint8_t* pData, uint16_t Length)
+static int16_t UART_C2C_PortSendData(UART_C2C_Port_t *Port, uint8_t* pData, uint16_t Length)
 {
-  if (HAL_UART_Transmit(&huart4, (uint8_t*)pData, Length, 2000) != HAL_OK)
+  bool copied = false;
+
+  /* The previous transfer may still be sending from TxData */
+  if(UART_C2C_PortWaitSent(Port, 2000) != 0)
   {
-     return -1;
+    return -1;
+  }
+  if(Length == 0)
+  {
+    return 0;
+  }
+  if(Length <= TX_BUFFER_SIZE)
+  {
+    memcpy(Port->TxData, pData, Length);
+    pData = Port->TxData;
+    copied = true;
+  }
+  Port->TxBusy = 1;
+  if(HAL_UART_Transmit_DMA(Port->huart, pData, Length) != HAL_OK)
+  {
+    Port->TxBusy = 0;
+    return -1;
+  }
+  if(!copied)
+  {
+    return UART_C2C_PortWaitSent(Port, 2000);
   }
 
   return 0;
@@ -282,57 +576,310 @@ int16_t UART_C2C_SendData(uint8_t* pData, uint16_t Length)
 
 /**
   * @brief  Retrieve on Data from intermediate IT buffer
+  * @param Port: UART port.
   * @param pData: data to send.
   * @retval 0 data available, -1 no data to retrieve
   */
-int16_t  UART_C2C_ReceiveSingleData(uint8_t* pSingleData)
+static int16_t UART_C2C_PortReceiveSingleData(UART_C2C_Port_t *Port, uint8_t* pSingleData)
 {
-  /* Note: other possible implementation is to retrieve directly one data from UART buffer */
-  /* without using the interrupt and the intermediate buffer */
+  RingBuffer_t *Rx = &Port->RxData;
 
-  if(UART_RxData.head != UART_RxData.tail)
+  if(UART_C2C_PortRxUsed(Port) == 0)
   {
-    /* serial data available, so return data to user */
-    *pSingleData = UART_RxData.data[UART_RxData.head++];
+    return -1;
+  }
+  *pSingleData = Rx->data[Rx->head & RING_MASK];
+  UART_C2C_PortConsumeData(Port, 1);
 
-    /* check for ring buffer wrap */
-    if (UART_RxData.head >= RING_BUFFER_SIZE)
+  return 0;
+}
+
+
+/**
+  * @brief  Get the contiguous run of received data at the head of the ring buffer
+  *         without removing it. The run stops at the buffer wrap so a full read
+  *         may take two calls.
+  * @param Port: UART port.
+  * @param pData: set to the start of the run.
+  * @retval number of octets available at *pData (0 if none).
+  */
+static uint16_t UART_C2C_PortPeekData(UART_C2C_Port_t *Port, uint8_t** pData)
+{
+  uint32_t used = UART_C2C_PortRxUsed(Port);
+  uint32_t head = Port->RxData.head & RING_MASK;
+
+  *pData = &Port->RxData.data[head];
+  return (uint16_t)MIN(used, RING_BUFFER_SIZE - head);
+}
+
+/**
+  * @brief  Release data previously returned by UART_C2C_PortPeekData(). The DMA may have
+  *         written over it while the caller was reading, if so the lap is counted and the
+  *         rest of the unread data dropped.
+  * @param Port: UART port.
+  * @param Length: number of octets to release.
+  * @retval None.
+  */
+static void UART_C2C_PortConsumeData(UART_C2C_Port_t *Port, uint16_t Length)
+{
+  uint32_t head = Port->RxData.head;
+
+  /* Finish with the data before handing its space back */
+  __DMB();
+  Port->RxData.head = head + Length;
+  UART_C2C_PortRxCheck(Port, head);
+}
+
+
+/**
+  * @brief  Block the calling task until received data is worth looking at.
+  *         The task is notified from the Rx interrupt when a line feed arrives or,
+  *         if Needed is non-zero, once Needed octets have arrived, so the ETM task
+  *         sleeps rather than polling the ring buffer every tick.
+  * @param Port: UART port.
+  * @param Needed: octets wanted, 0 to wake on line end only.
+  * @param Timeout: maximum time to block in ms.
+  * @retval 0 data available, -1 timeout with no data
+  */
+static int8_t UART_C2C_PortWaitData(UART_C2C_Port_t *Port, uint16_t Needed, uint32_t Timeout)
+{
+  /* Don't wait for more than the ring buffer can hold */
+  if(Needed > RING_BUFFER_SIZE / 2)
+  {
+    Needed = RING_BUFFER_SIZE / 2;
+  }
+
+  /* Register as the waiter before checking the buffer so an octet arriving in between
+     still wakes us */
+  taskENTER_CRITICAL();
+  if(Port->RxData.head != Port->RxData.tail)
+  {
+    taskEXIT_CRITICAL();
+    return 0;
+  }
+  Port->RxWanted = Needed;
+  Port->RxWaiter = xTaskGetCurrentTaskHandle();
+  taskEXIT_CRITICAL();
+
+  ulTaskNotifyTake(pdTRUE, pdMS_TO_TICKS(Timeout));
+  Port->RxWaiter = NULL;
+
+  return (Port->RxData.head != Port->RxData.tail) ? 0 : -1;
+}
+
+/**
+  * @brief  End UART_C2C_PortWaitData early, from another task. Only a task registered
+  *         as the waiter is notified, as the Rx interrupt does, so no notification is
+  *         left pending for a task that isn't waiting.
+  * @param Port: UART port.
+  */
+static void UART_C2C_PortWakeWaiter(UART_C2C_Port_t *Port)
+{
+  TaskHandle_t waiter;
+
+  taskENTER_CRITICAL();
+  waiter = Port->RxWaiter;
+  Port->RxWaiter = NULL;
+  taskEXIT_CRITICAL();
+
+  if(waiter != NULL)
+  {
+    xTaskNotifyGive(waiter);
+  }
+}
+
+/* ETM_IO_t functions carry no context so each port gets its own set of entry points */
+#define UART_C2C_PORT_IO(n, sfx) \
+  int8_t   UART_C2C_Init##sfx(void) { return UART_C2C_PortInit(&UART_C2C_Ports[n]); } \
+  int8_t   UART_C2C_DeInit##sfx(void) { return UART_C2C_PortDeInit(&UART_C2C_Ports[n]); } \
+  int8_t   UART_C2C_SetBaudrate##sfx(uint32_t BaudRate) { return UART_C2C_PortSetBaudrate(&UART_C2C_Ports[n], BaudRate); } \
+  void     UART_C2C_FlushBuffer##sfx(void) { UART_C2C_PortFlushBuffer(&UART_C2C_Ports[n]); } \
+  int16_t  UART_C2C_SendData##sfx(uint8_t* pData, uint16_t Length) { return UART_C2C_PortSendData(&UART_C2C_Ports[n], pData, Length); } \
+  int16_t  UART_C2C_ReceiveSingleData##sfx(uint8_t* pSingleData) { return UART_C2C_PortReceiveSingleData(&UART_C2C_Ports[n], pSingleData); } \
+  uint16_t UART_C2C_PeekData##sfx(uint8_t** pData) { return UART_C2C_PortPeekData(&UART_C2C_Ports[n], pData); } \
+  void     UART_C2C_ConsumeData##sfx(uint16_t Length) { UART_C2C_PortConsumeData(&UART_C2C_Ports[n], Length); } \
+  int8_t   UART_C2C_WaitData##sfx(uint16_t Needed, uint32_t Timeout) { return UART_C2C_PortWaitData(&UART_C2C_Ports[n], Needed, Timeout); } \
+  void     UART_C2C_WakeWaiter##sfx(void) { UART_C2C_PortWakeWaiter(&UART_C2C_Ports[n]); } \
+  int8_t   UART_C2C_FlowControl##sfx(uint8_t Enable) { return UART_C2C_PortFlowControl(&UART_C2C_Ports[n], Enable); } \
+  uint16_t UART_C2C_LineErrors##sfx(void) { return UART_C2C_PortLineErrors(&UART_C2C_Ports[n]); } \
+  void     UART_C2C_RxStats##sfx(ETM_RxStats_t *Stats) { UART_C2C_PortRxStats(&UART_C2C_Ports[n], Stats); } \
+  static ETM_Return_t UART_C2C_Register##sfx(ETMObject_t *Obj) \
+  { \
+    ETM_Return_t ret = ETM_RegisterBusIO(Obj, UART_C2C_Init##sfx, UART_C2C_DeInit##sfx, UART_C2C_SetBaudrate##sfx, \
+                                         UART_C2C_SendData##sfx, UART_C2C_ReceiveSingleData##sfx, UART_C2C_FlushBuffer##sfx); \
+    ETM_RegisterBusPeekIO(Obj, UART_C2C_PeekData##sfx, UART_C2C_ConsumeData##sfx); \
+    ETM_RegisterBusWaitIO(Obj, UART_C2C_WaitData##sfx, UART_C2C_WakeWaiter##sfx); \
+    ETM_RegisterBusLinkIO(Obj, UART_C2C_FlowControl##sfx, UART_C2C_LineErrors##sfx); \
+    ETM_RegisterBusStatsIO(Obj, UART_C2C_RxStats##sfx); \
+    return ret; \
+  }
+
+/* Port 0 keeps the original UART_C2C_xxx names */
+UART_C2C_PORT_IO(0, )
+
+/* Port serviced by a UART handle, NULL if it isn't an ETM port */
+static UART_C2C_Port_t *UART_C2C_FindPort(UART_HandleTypeDef *UartH)
+{
+  int i;
+
+  for(i = 0; i < UART_C2C_NUM_PORTS; i++)
+  {
+    if(UART_C2C_Ports[i].huart == UartH)
     {
-      /* ring buffer wrap, so reset head pointer to start of buffer */
-      UART_RxData.head = 0;
+      return &UART_C2C_Ports[i];
     }
   }
-  else
+  return NULL;
+}
+
+/**
+  * @brief  Move the ring buffer tail up to the DMA position. Called from interrupts at
+  *         half and full transfer and when the line goes idle.
+  * @param  Port: UART port.
+  * @retval None.
+  */
+static void UART_C2C_PortRxEvent(UART_C2C_Port_t *Port)
+{
+  RingBuffer_t *Rx = &Port->RxData;
+  uint32_t tail = Rx->tail;
+  uint32_t pos = RING_BUFFER_SIZE - __HAL_DMA_GET_COUNTER(Port->huart->hdmarx);
+  uint32_t n = (pos - tail) & RING_MASK;
+  uint32_t unread, x;
+  bool wake = false;
+  uint8_t c;
+
+  if(n == 0)
   {
-   return -1;
+    return;
   }
+  /* Count each time the DMA catches the reader up, the consumer drops what was written over */
+  unread = tail - Rx->head;
+  if(unread + n >= RING_BUFFER_SIZE && unread < RING_BUFFER_SIZE)
+  {
+    Rx->overflows++;
+  }
+  if(unread + n > Rx->highwater)
+  {
+    Rx->highwater = (uint16_t)MIN(unread + n, RING_BUFFER_SIZE);
+  }
+  Rx->received += n;
+  /* Only look at the octets if a task is waiting for a line end or a count */
+  if(Port->RxWaiter != NULL)
+  {
+    for(x = 0; x < n && !wake; x++)
+    {
+      c = Rx->data[(tail + x) & RING_MASK];
+      wake = (c == '\n' || (Port->RxWanted != 0 && --Port->RxWanted == 0));
+    }
+  }
+  /* Publish the tail after the data it covers */
+  __DMB();
+  Rx->tail = tail + n;
 
-  return 0;
+  /* Wake the ETM task on a line end or once it has the octets it asked for */
+  if(wake)
+  {
+    BaseType_t xHigherPriorityTaskWoken = pdFALSE;
+    vTaskNotifyGiveFromISR(Port->RxWaiter, &xHigherPriorityTaskWoken);
+    Port->RxWaiter = NULL;
+    portYIELD_FROM_ISR(xHigherPriorityTaskWoken);
+  }
 }
 
+/**
+  * @brief  UART interrupt for an ETM port, handles the idle line and counts line errors
+  *         before passing on to the HAL.
+  * @param  UartH: Uart handle.
+  * @retval None.
+  */
+void UART_C2C_IRQHandler(UART_HandleTypeDef *UartH)
+{
+  UART_C2C_Port_t *Port = UART_C2C_FindPort(UartH);
+  uint32_t isr = READ_REG(UartH->Instance->ISR);
+
+  if(Port != NULL)
+  {
+    if(isr & (USART_ISR_FE | USART_ISR_NE | USART_ISR_ORE))
+    {
+      __HAL_UART_CLEAR_FLAG(UartH, UART_CLEAR_FEF | UART_CLEAR_NEF | UART_CLEAR_OREF);
+      Port->LineErrors++;
+    }
+    if((isr & USART_ISR_IDLE) && __HAL_UART_GET_IT_SOURCE(UartH, UART_IT_IDLE))
+    {
+      __HAL_UART_CLEAR_IDLEFLAG(UartH);
+      UART_C2C_PortRxEvent(Port);
+    }
+  }
+  HAL_UART_IRQHandler(UartH);
+}
 
 /**
-  * @brief  Rx Callback when new data is received on the UART.
+  * @brief  Rx Callbacks at half and full DMA transfer.
   * @param  UartHandle: Uart handle receiving the data.
   * @retval None.
   */
+void HAL_UART_RxHalfCpltCallback(UART_HandleTypeDef *UartH)
+{
+  UART_C2C_Port_t *Port = UART_C2C_FindPort(UartH);
+
+  if(Port != NULL)
+  {
+    UART_C2C_PortRxEvent(Port);
+  }
+}
+
 void HAL_UART_RxCpltCallback(UART_HandleTypeDef *UartH)
 {
-  /* If ring buffer end is reached reset tail pointer to start of buffer */
-  if(++UART_RxData.tail >= RING_BUFFER_SIZE)
+  UART_C2C_Port_t *Port = UART_C2C_FindPort(UartH);
+
+  if(Port != NULL)
+  {
+    UART_C2C_PortRxEvent(Port);
+  }
+}
+
+/**
+  * @brief  Tx Callback when a DMA transmission has left the UART.
+  * @param  UartHandle: Uart handle.
+  * @retval None.
+  */
+void HAL_UART_TxCpltCallback(UART_HandleTypeDef *UartH)
+{
+  UART_C2C_Port_t *Port = UART_C2C_FindPort(UartH);
+  BaseType_t xHigherPriorityTaskWoken = pdFALSE;
+
+  if(Port != NULL)
+  {
+    Port->TxBusy = 0;
+    xSemaphoreGiveFromISR(Port->TxDone, &xHigherPriorityTaskWoken);
+    portYIELD_FROM_ISR(xHigherPriorityTaskWoken);
+  }
+}
+
+/**
+  * @brief  Error callback. Line errors are counted in UART_C2C_IRQHandler() so this is
+  *         a DMA error, which stops reception, so it is started again with an empty buffer.
+  * @param  UartHandle: Uart handle with the error.
+  * @retval None.
+  */
+void HAL_UART_ErrorCallback(UART_HandleTypeDef *UartH)
+{
+  UART_C2C_Port_t *Port = UART_C2C_FindPort(UartH);
+
+  if(Port == NULL)
+  {
+    return;
+  }
+  Port->LineErrors++;
+  if(UartH->gState == HAL_UART_STATE_READY)
   {
-    UART_RxData.tail = 0;
+    Port->TxBusy = 0;
+    xSemaphoreGiveFromISR(Port->TxDone, NULL);
   }
-  if(UART_RxData.tail == UART_RxData.head)
+  if(UartH->RxState == HAL_UART_STATE_READY)
   {
-	  ++UART_RxData.head;
-	  if (UART_RxData.head >= RING_BUFFER_SIZE)
-	  {
-		  /* ring buffer wrap, so reset head pointer to start of buffer */
-		  UART_RxData.head = 0;
-	  }
+    UART_C2C_PortStartRx(Port, false);
   }
-  HAL_UART_Receive_IT(UartH, (uint8_t *)&UART_RxData.data[UART_RxData.tail], 1);
 }
 
 /* Global ETM context struct */
@@ -342,7 +889,7 @@ void ETM_Run(void){
 	ETM_HwStatusInit();
 
 	ETM_RegisterTickCb(&ETMC2cObj, xTaskGetTickCount);
-	if(ETM_RegisterBusIO(&ETMC2cObj, UART_C2C_Init, UART_C2C_DeInit, UART_C2C_SetBaudrate, UART_C2C_SendData, UART_C2C_ReceiveSingleData, UART_C2C_FlushBuffer) == ETM_RETURN_OK)
+	if(UART_C2C_Register(&ETMC2cObj) == ETM_RETURN_OK)
 	    configPRINTF(("\r\nStartup complete\r\n"));
 	else
 		configPRINTF(("\r\nStartup ERROR!\r\n"));
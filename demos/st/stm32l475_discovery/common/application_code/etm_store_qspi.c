@@ -0,0 +1,52 @@
+
+#ifdef USE_ESEYE
+#include "FreeRTOS.h"
+#include "task.h"
+
+#include "etm/etm_store.h"
+
+#include "etm_store_qspi.h"
+
+#include "stm32l475e_iot01_qspi.h"
+
+/* Flash access for the ETM store through the Discovery board's QSPI BSP. Called from the ETM
+ * task only, so the BSP needs no locking. */
+
+static int8_t QSPI_FlashRead(uint32_t Addr, uint8_t *pData, uint32_t Size){
+  return (BSP_QSPI_Read(pData, Addr, Size) == QSPI_OK) ? 0 : -1;
+}
+
+static int8_t QSPI_FlashProgram(uint32_t Addr, const uint8_t *pData, uint32_t Size){
+  return (BSP_QSPI_Write((uint8_t *)pData, Addr, Size) == QSPI_OK) ? 0 : -1;
+}
+
+/* The BSP starts the erase and returns, wait for it letting other tasks run */
+static int8_t QSPI_FlashEraseSector(uint32_t Addr){
+  TickType_t tickstart;
+
+  if(BSP_QSPI_Erase_Sector(Addr / MX25R6435F_SECTOR_SIZE) != QSPI_OK)
+    return -1;
+  tickstart = xTaskGetTickCount();
+  while(BSP_QSPI_GetStatus() == QSPI_BUSY){
+    if((xTaskGetTickCount() - tickstart) > pdMS_TO_TICKS(MX25R6435F_SECTOR_ERASE_MAX_TIME))
+      return -1;
+    vTaskDelay(1);
+  }
+  return (BSP_QSPI_GetStatus() == QSPI_OK) ? 0 : -1;
+}
+
+int8_t ETM_QSPIFlashInit(ETM_Flash_t *fops, uint32_t base, uint32_t size){
+  if(base % MX25R6435F_SECTOR_SIZE != 0 || size % MX25R6435F_SECTOR_SIZE != 0 || base + size > MX25R6435F_FLASH_SIZE)
+    return -1;
+  if(BSP_QSPI_Init() != QSPI_OK)
+    return -1;
+  fops->Read = QSPI_FlashRead;
+  fops->Program = QSPI_FlashProgram;
+  fops->EraseSector = QSPI_FlashEraseSector;
+  fops->base = base;
+  fops->size = size;
+  fops->sectorsize = MX25R6435F_SECTOR_SIZE;
+  return 0;
+}
+
+#endif
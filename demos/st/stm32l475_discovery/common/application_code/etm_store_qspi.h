@@ -0,0 +1,12 @@
+#ifndef ETM_STORE_QSPI_H
+#define ETM_STORE_QSPI_H
+
+#include <stdint.h>
+
+#include "etm/etm_store.h"
+
+/* Fill in fops for a store in the MX25R6435F QSPI flash from base (sector aligned) for size
+ * octets, initialising the QSPI interface. Returns 0 or -1. */
+int8_t ETM_QSPIFlashInit(ETM_Flash_t *fops, uint32_t base, uint32_t size);
+
+#endif
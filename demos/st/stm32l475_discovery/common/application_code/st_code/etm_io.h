@@ -19,6 +19,8 @@
 /* This section can be used to tailor UART_C2C instance used and associated
    resources */
 #define UART_C2C                           UART4
+/* Number of ETM UART ports (see UART_C2C_Ports in etm_intf.c) */
+#define UART_C2C_NUM_PORTS                 1
 #define UART_C2C_CLK_ENABLE()              __HAL_RCC_UART4_CLK_ENABLE();
 #define DMAx_CLK_ENABLE()                   __HAL_RCC_DMA2_CLK_ENABLE()
 #define UART_C2C_RX_GPIO_CLK_ENABLE()      __HAL_RCC_GPIOA_CLK_ENABLE()
@@ -40,25 +42,29 @@
 #define UART_C2C_RX_GPIO_PORT              GPIOA
 #define UART_C2C_RX_AF                     GPIO_AF8_UART4
 
-#define UART_C2C_RTS_PIN                   GPIO_PIN_2
-#define UART_C2C_RTS_GPIO_PORT             GPIOA
-//#define UART_C2C_RTS_AF                    GPIO_AF7_USART1
-
-#define UART_C2C_CTS_PIN                   GPIO_PIN_14
-#define UART_C2C_CTS_GPIO_PORT             GPIOD
-//#define UART_C2C_CTS_AF                    GPIO_AF7_USART1
+/* RTS/CTS hardware flow control. The ETM shield is only known to route TX/RX (ARD D1/D0) so
+   this is off. A board that wires the lines sets UART_C2C_FLOW_CONTROL to 1 and defines
+   UART_C2C_RTS_PIN/_GPIO_PORT/_AF/_GPIO_CLK_ENABLE() and the same for CTS. UART4_CTS is only
+   on PB7, which is USART1 RX for the ST-LINK console, so it can't be used alongside it. */
+#ifndef UART_C2C_FLOW_CONTROL
+#define UART_C2C_FLOW_CONTROL              0
+#endif
+#if UART_C2C_FLOW_CONTROL && (!defined(UART_C2C_RTS_PIN) || !defined(UART_C2C_CTS_PIN))
+#error "UART_C2C_FLOW_CONTROL needs the RTS and CTS pins of the board's wiring"
+#endif
    
-/* Definition for UART_C2C's NVIC IRQ and IRQ Handlers */
+/* Definition for UART_C2C's NVIC IRQ, UART4_IRQHandler calls UART_C2C_IRQHandler() */
 #define UART_C2C_IRQn                      UART4_IRQn
-//#define UART_C2C_IRQHandler                USART1_IRQHandler
 
 /* Definition for UART_C2C's DMA */
 #define UART_C2C_TX_DMA_CHANNEL            DMA2_Channel3
+#define UART_C2C_RX_DMA_CHANNEL            DMA2_Channel5
 /* Definition for UART_C2C's DMA Request */
 #define UART_C2C_TX_DMA_REQUEST            DMA_REQUEST_2
-/* Definition for UART_C2C's NVIC */
+#define UART_C2C_RX_DMA_REQUEST            DMA_REQUEST_2
+/* Definition for UART_C2C's NVIC, DMA2_Channel3/5_IRQHandler are in stm32l4xx_it.c */
 #define UART_C2C_DMA_TX_IRQn               DMA2_Channel3_IRQn
-//#define UART_C2C_DMA_TX_IRQHandler         DMA1_Channel4_IRQHandler
+#define UART_C2C_DMA_RX_IRQn               DMA2_Channel5_IRQn
 
 /* C2C module Reset pin definitions */
 //#define C2C_RST_PIN                        GPIO_PIN_2
@@ -81,6 +87,13 @@ int8_t  UART_C2C_SetBaudrate(uint32_t BaudRate);
 void    UART_C2C_FlushBuffer(void);
 int16_t UART_C2C_SendData(uint8_t* Buffer, uint16_t Length);
 int16_t UART_C2C_ReceiveSingleData(uint8_t* pData);
+uint16_t UART_C2C_PeekData(uint8_t** pData);
+void    UART_C2C_ConsumeData(uint16_t Length);
+int8_t  UART_C2C_WaitData(uint16_t Needed, uint32_t Timeout);
+void    UART_C2C_WakeWaiter(void);
+int8_t  UART_C2C_FlowControl(uint8_t Enable);
+uint16_t UART_C2C_LineErrors(void);
+void    UART_C2C_IRQHandler(UART_HandleTypeDef *UartH);
 
 #ifdef __cplusplus
 }
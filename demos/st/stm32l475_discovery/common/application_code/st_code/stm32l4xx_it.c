@@ -176,9 +176,29 @@ void EXTI15_10_IRQHandler(void)
 
 #ifdef USE_ESEYE
 extern UART_HandleTypeDef huart4;
+extern DMA_HandleTypeDef hdma_uart4_rx;
+extern DMA_HandleTypeDef hdma_uart4_tx;
+void UART_C2C_IRQHandler(UART_HandleTypeDef *UartH);
+
 void UART4_IRQHandler(void)
 {
-  HAL_UART_IRQHandler(&huart4);
+  UART_C2C_IRQHandler(&huart4);
+}
+
+/**
+* @brief This function handles the UART4 TX DMA channel.
+*/
+void DMA2_Channel3_IRQHandler(void)
+{
+  HAL_DMA_IRQHandler(&hdma_uart4_tx);
+}
+
+/**
+* @brief This function handles the UART4 RX DMA channel.
+*/
+void DMA2_Channel5_IRQHandler(void)
+{
+  HAL_DMA_IRQHandler(&hdma_uart4_rx);
 }
 #endif
 
@@ -84,6 +84,8 @@ void DMA2_Channel2_IRQHandler(void);
 #ifdef USE_ESEYE
 void TIM2_IRQHandler(void);
 void UART4_IRQHandler(void);
+void DMA2_Channel3_IRQHandler(void);
+void DMA2_Channel5_IRQHandler(void);
 #endif
 
 #ifdef __cplusplus
@@ -32,5 +32,13 @@
 #define democonfigETM_BASIC_TASK_STACK_SIZE                  ( configMINIMAL_STACK_SIZE * 4 )
 #define democonfigETM_BASIC_TASK_PRIORITY                    ( tskIDLE_PRIORITY )
 
+/* Status readings which can't be published are kept in the QSPI flash and sent when the ETM is
+ * ready again (0 to drop them). The store's area of the flash and the number of readings gathered
+ * in RAM before they are programmed. */
+#define democonfigETM_BASIC_STORE                            1
+#define democonfigETM_BASIC_STORE_BASE                       0x400000
+#define democonfigETM_BASIC_STORE_SIZE                       0x400000
+#define democonfigETM_BASIC_STORE_SYNC                       4
+
 
 #endif /* _ETM_BASIC_CONFIG_H_ */
@@ -0,0 +1,194 @@
+/**
+  ******************************************************************************
+  * @file    etm_ota_writer.h
+  ******************************************************************************
+  */
+/* Define to prevent recursive inclusion -------------------------------------*/
+#ifndef __ETM_OTA_WRITER_H
+#define __ETM_OTA_WRITER_H
+
+#ifdef __cplusplus
+ extern "C" {
+#endif
+
+/* Includes ------------------------------------------------------------------*/
+#include "stdint.h"
+#include "stdbool.h"
+
+#include "etm/etm_fw.h"
+#include "etm/etm_store.h"
+
+/* Writes a firmware image to the bank of flash that isn't running as it arrives, for the OTA
+ * demos. The flash is reached through an ETMOtaFlash_t, ETMOtaFlashInit() fills one in for the
+ * STM32L4's internal flash.
+ * Octets are gathered into double words (or rows in fast mode) and programmed and verified as
+ * each fills; whole double words or rows in the caller's buffer are programmed from there.
+ * Normally each page is erased just before the first write to it (pages which are already
+ * blank are left alone), so nothing stalls before the first data arrives. Fast mode erases the
+ * whole bank when the writer is opened, as fast row programming needs, and then programs 256
+ * octets at a time.
+ *
+ * A signed image starts with an ETM_OTA_HDR_SIZE header, which isn't written to flash:
+ *   0  magic ETM_OTA_MAGIC                 14  flags, ETM_OTA_FLAG_
+ *   4  length of the image                 16  delta: length of the running image
+ *   8  CRC-32 (IEEE) of the image          20  delta: CRC-32 of the running image
+ *  12  signature length                    24  signature, DER encoded ECDSA over its SHA-256
+ * (multi-octet fields little-endian). Once ETMOtaWriterVerify() has been called the image is
+ * passed through the CRC-32 (the flash's Crc, if it has one) and SHA-256 as it is written, and ETMOtaWriterFinish() only
+ * succeeds if the length, the CRC and the signature all match.
+ *
+ * A compressed image (ETM_OTA_FLAG_LZ) follows the header as a series of tokens, decoded as
+ * they arrive. A token octet has the operation in its top two bits and a count in the rest; a
+ * count of 63 is followed by a LEB128 number to add to it.
+ *   0  count + 1 literal octets follow
+ *   1  copy count + 3 octets of the image from a LEB128 distance back
+ *   2  copy count + 1 octets of the running image (delta images only) from where the last
+ *      such copy ended
+ *   3  as 2, after moving by a zig-zag LEB128 amount first
+ * Copies read the image back from flash, so no window is kept in RAM. tools/etm_ota makes
+ * compressed images, and deltas against the image in the running bank.
+ *
+ * With a journal (ETMOtaWriterResume()) the download's checkpoints are recorded every
+ * ETM_OTA_JOURNAL_INTERVAL octets in a flash page of their own, with the CRC-32 of the image
+ * written so far. After a restart the image in flash is checked against the last one and the
+ * download carries on from there instead of from the beginning. */
+
+/* Octets fast programmed at once, 32 double words */
+#define ETM_OTA_ROW_SIZE                    256
+
+/* Signed image header */
+#define ETM_OTA_MAGIC                       0x41544f45  /* "EOTA" */
+#define ETM_OTA_HDR_SIZE                    96
+#define ETM_OTA_SIG_MAX                     (ETM_OTA_HDR_SIZE - 24)
+#define ETM_OTA_FLAG_LZ                     0x0001      /* Compressed */
+#define ETM_OTA_FLAG_DELTA                  0x0002      /* Copies from the running image */
+
+/* Octets downloaded between checkpoints recorded in the journal */
+#ifndef ETM_OTA_JOURNAL_INTERVAL
+#define ETM_OTA_JOURNAL_INTERVAL            16384
+#endif
+
+/* Exported typedef ----------------------------------------------------------*/
+
+/* Carry a CRC-32 (IEEE, as it runs, not inverted) on over Size octets, a multiple of 4 */
+typedef uint32_t (*Ota_Crc_Func)(uint32_t Crc, const uint8_t *pData, uint32_t Size);
+
+/* Flash the image is written to, addresses as the writer uses them. Program is given whole
+ * double words, not crossing a page. ProgramRow (ETM_OTA_ROW_SIZE octets) and EraseBank (the
+ * bank holding Addr) are only needed for fast mode and Crc is optional, NULL for none. */
+typedef struct {
+  Flash_Read_Func        Read;
+  Flash_Program_Func     Program;
+  Flash_Program_Func     ProgramRow;
+  Flash_EraseSector_Func ErasePage;
+  Flash_EraseSector_Func EraseBank;
+  Ota_Crc_Func           Crc;
+  uint32_t               running;      /* Start of the running image, deltas copy from it */
+  uint32_t               bank;         /* Start of the bank which isn't running */
+  uint32_t               banksize;
+  uint32_t               pagesize;
+} ETMOtaFlash_t;
+
+typedef struct {
+  uint32_t erases;          /* Pages erased */
+  uint32_t blank;           /* Pages found already erased */
+  uint32_t programs;        /* Double words or rows programmed */
+  uint32_t journalled;      /* Checkpoints recorded in the journal */
+} ETMOtaWriterStats_t;
+
+/* Compressed image decoder, where it is in a token */
+typedef struct {
+  uint8_t  state;
+  uint8_t  op;
+  uint8_t  shift;           /* Of the next LEB128 group */
+  uint32_t count;           /* Octets left of a literal run or copy */
+  uint32_t arg;             /* LEB128 being read */
+  uint32_t old;             /* Offset in the running image of the next copy from it */
+} ETMOtaLz_t;
+
+typedef struct {
+  ETMOtaFlash_t fops;
+  uint32_t base;            /* Start of the image, page aligned */
+  uint32_t size;            /* Room for the image */
+  uint32_t address;         /* Next double word or row to program */
+  uint32_t erased;          /* Flash from base up to here is erased */
+  uint32_t written;         /* Octets of the image taken (decoded), not counting a header */
+  uint32_t taken;           /* Octets of the download taken */
+  bool     fast;
+  bool     failed;          /* A program, verify or erase failed, later writes are refused */
+  uint16_t fill;            /* Octets gathered in row */
+  uint64_t row[ETM_OTA_ROW_SIZE / 8];
+  /* Signed images: the signer's certificate (PEM, length including the terminator), the
+   * header as it is gathered, the CRC-32 so far and the SHA-256 context */
+  const char *cert;
+  uint32_t certlen;
+  uint8_t  hdr[ETM_OTA_HDR_SIZE];
+  uint16_t hdrfill;
+  uint32_t imagelen;
+  uint32_t crc;
+  void    *sigctx;
+  /* The header's flags, the length of the running image for a delta and the decoder */
+  uint16_t flags;
+  uint32_t oldlen;
+  ETMOtaLz_t lz;
+  /* Journal: its page (0 for none), where the next record goes in it (0 until the page has been
+   * started for this image) and the download offset last recorded. cp is the last checkpoint. */
+  uint32_t journal;
+  uint16_t jnext;
+  uint32_t jlast;
+  ETMFwCheckpoint_t cp;
+  ETMOtaWriterStats_t stats;
+} ETMOtaWriter_t;
+
+/* Exported functions --------------------------------------------------------*/
+
+/* STM32L4 internal flash (etm_ota_flash.c) */
+/* Fill in fops for the internal flash, with the bank that isn't running to write to */
+void ETMOtaFlashInit(ETMOtaFlash_t *fops);
+/* Start of the bank which isn't running, where an update is written */
+uint32_t ETMOtaOtherBank(void);
+/* Bank the device boots from (FLASH_BANK_1 or FLASH_BANK_2) */
+uint32_t ETMOtaBootBank(void);
+/* Boot from the other bank next time, returns 0 or -1 */
+int ETMOtaSwapBootBank(void);
+
+/* Start writing an image of up to size octets to fops (which is copied) at base, which must be a
+ * page boundary in the bank that isn't running (the start of that bank for fast mode). Returns
+ * 0 or -1. */
+int ETMOtaWriterOpen(ETMOtaWriter_t *w, const ETMOtaFlash_t *fops, uint32_t base, uint32_t size, bool fast);
+/* Expect a signed image, checked against the signer's certificate. Call after
+ * ETMOtaWriterOpen() and before the first write, returns 0 or -1. */
+int ETMOtaWriterVerify(ETMOtaWriter_t *w, const char *cert, uint32_t certlen);
+/* Keep a journal of the download in the page at journal, which must be in the bank that isn't
+ * running and clear of the image. If it holds a checkpoint for an image at this base, and the
+ * image in flash up to there still matches, the writer carries on from it: cp is left at the
+ * checkpoint to give ETMFwDownload() as resume. Otherwise cp is zero. Call after
+ * ETMOtaWriterOpen() (not fast) and any ETMOtaWriterVerify(), before the first write.
+ * Returns 0 or -1. */
+int ETMOtaWriterResume(ETMOtaWriter_t *w, uint32_t journal);
+/* Append len octets of the image, returns 0 or -1 */
+int ETMOtaWriterWrite(ETMOtaWriter_t *w, const uint8_t *buf, uint32_t len);
+/* Program anything still gathered (padded with 0xff). For a signed image
+ * check it is complete, its CRC and its signature. The journal is cleared unless the download
+ * stopped short without a failure. Returns 0 or -1, don't boot the image unless it is 0. */
+int ETMOtaWriterFinish(ETMOtaWriter_t *w);
+/* ETMFwDownload() sink with an ETMOtaWriter_t as ctx. A chunk at offset 0 after others starts
+ * the image again. */
+int ETMOtaWriterSink(void *ctx, uint32_t offset, const uint8_t *data, uint16_t len);
+/* ETMFwDownload() checkpoint callback with an ETMOtaWriter_t as ctx, keeps it in cp and records
+ * it in the journal when it is due */
+void ETMOtaWriterCheckpoint(void *ctx, const ETMFwCheckpoint_t *cp);
+/* Download the ETM's host firmware image through w, which has been opened (and given the
+ * signer's certificate with ETMOtaWriterVerify() for a signed image). With a journal page
+ * (0 for none) the download carries on from its last checkpoint, here or before a restart. A
+ * download that stops part way is tried again from its last checkpoint, up to attempts times
+ * in all, after giving an ETM which is rebooting time to come back. Dl is filled in, apart from
+ * an optional progress callback which gets w as its ctx (percentages are logged without one),
+ * and holds the image's length, checksum and statistics afterwards. w is finished whatever the
+ * result. Returns 0 once the image is complete and checked, -1 otherwise. */
+int ETMOtaDownload(ETMObject_t *Obj, ETMOtaWriter_t *w, ETMFwDownload_t *Dl, uint32_t journal, int attempts);
+
+#ifdef __cplusplus
+}
+#endif
+#endif /*__ETM_OTA_WRITER_H */
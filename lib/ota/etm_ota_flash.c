@@ -0,0 +1,174 @@
+/**
+  ******************************************************************************
+  * @file    etm_ota_flash.c
+  ******************************************************************************
+  */
+/* Includes ------------------------------------------------------------------*/
+#include <string.h>
+#include <stdint.h>
+#include <stdbool.h>
+
+#include "stm32l4xx_hal.h"
+
+#include "FreeRTOS.h"
+#include "task.h"
+
+#include "etm_ota_writer.h"
+
+#define UARTDEBUGPRINTF(x...) configPRINTF((x))
+
+/* The STM32L4's internal flash for ETMOtaWriter_t. The running bank is always mapped at
+ * FLASH_BASE and the other above it, so addresses are the mapped ones and reads are straight
+ * from flash. The flash is unlocked only for each program or erase. */
+
+/* Bank holding a (mapped) flash address, the two swap over when booted from bank 2 */
+static uint32_t OtaBank(uint32_t addr){
+  bool upper = (addr - FLASH_BASE) >= FLASH_BANK_SIZE;
+
+  if(READ_BIT(SYSCFG->MEMRMP, SYSCFG_MEMRMP_FB_MODE) != 0)
+    upper = !upper;
+  return upper ? FLASH_BANK_2 : FLASH_BANK_1;
+}
+
+static int8_t OtaFlashRead(uint32_t Addr, uint8_t *pData, uint32_t Size){
+  memcpy(pData, (const void *)Addr, Size);
+  return 0;
+}
+
+static int8_t OtaFlashProgram(uint32_t Addr, const uint8_t *pData, uint32_t Size){
+  HAL_StatusTypeDef status = HAL_OK;
+  uint64_t dword;
+
+  HAL_FLASH_Unlock();
+  /* HAL_FLASH_Program() won't start with an error left over from before */
+  __HAL_FLASH_CLEAR_FLAG(FLASH_FLAG_ALL_ERRORS);
+  for(; Size > 0 && status == HAL_OK; Size -= 8, Addr += 8, pData += 8){
+    memcpy(&dword, pData, sizeof(dword));
+    status = HAL_FLASH_Program(FLASH_TYPEPROGRAM_DOUBLEWORD, Addr, dword);
+  }
+  HAL_FLASH_Lock();
+  return (status == HAL_OK) ? 0 : -1;
+}
+
+static int8_t OtaFlashProgramRow(uint32_t Addr, const uint8_t *pData, uint32_t Size){
+  HAL_StatusTypeDef status;
+
+  HAL_FLASH_Unlock();
+  __HAL_FLASH_CLEAR_FLAG(FLASH_FLAG_ALL_ERRORS);
+  status = HAL_FLASH_Program(FLASH_TYPEPROGRAM_FAST, Addr, (uint64_t)(uintptr_t)pData);
+  HAL_FLASH_Lock();
+  return (status == HAL_OK) ? 0 : -1;
+}
+
+static int8_t OtaFlashErasePage(uint32_t Addr){
+  FLASH_EraseInitTypeDef EraseInit;
+  uint32_t PageError = 0;
+  HAL_StatusTypeDef status;
+
+  EraseInit.TypeErase = FLASH_TYPEERASE_PAGES;
+  EraseInit.Banks = OtaBank(Addr);
+  EraseInit.Page = ((Addr - FLASH_BASE) % FLASH_BANK_SIZE) / FLASH_PAGE_SIZE;
+  EraseInit.NbPages = 1;
+  HAL_FLASH_Unlock();
+  __HAL_FLASH_CLEAR_FLAG(FLASH_FLAG_ALL_ERRORS);
+  status = HAL_FLASHEx_Erase(&EraseInit, &PageError);
+  HAL_FLASH_Lock();
+  return (status == HAL_OK) ? 0 : -1;
+}
+
+static int8_t OtaFlashEraseBank(uint32_t Addr){
+  FLASH_EraseInitTypeDef EraseInit;
+  uint32_t PageError = 0;
+  HAL_StatusTypeDef status;
+
+  EraseInit.TypeErase = FLASH_TYPEERASE_MASSERASE;
+  EraseInit.Banks = OtaBank(Addr);
+  HAL_FLASH_Unlock();
+  __HAL_FLASH_CLEAR_FLAG(FLASH_FLAG_ALL_ERRORS);
+  status = HAL_FLASHEx_Erase(&EraseInit, &PageError);
+  HAL_FLASH_Lock();
+  return (status == HAL_OK) ? 0 : -1;
+}
+
+/* Whole words through the CRC unit, reflected in and out so its output is the running CRC as
+ * software would have it; the unit starts from that (reflected back) each time so nothing is
+ * kept in it between calls */
+static uint32_t OtaFlashCrc(uint32_t Crc, const uint8_t *pData, uint32_t Size){
+  uint32_t word;
+
+  CRC->CR = CRC_CR_REV_IN | CRC_CR_REV_OUT;
+  CRC->INIT = __RBIT(Crc);
+  CRC->CR |= CRC_CR_RESET;
+  for(; Size >= 4; Size -= 4, pData += 4){
+    memcpy(&word, pData, sizeof(word));
+    CRC->DR = word;
+  }
+  return CRC->DR;
+}
+
+void ETMOtaFlashInit(ETMOtaFlash_t *fops){
+  memset(fops, 0, sizeof(*fops));
+  fops->Read = OtaFlashRead;
+  fops->Program = OtaFlashProgram;
+  fops->ProgramRow = OtaFlashProgramRow;
+  fops->ErasePage = OtaFlashErasePage;
+  fops->EraseBank = OtaFlashEraseBank;
+  fops->Crc = OtaFlashCrc;
+  fops->running = FLASH_BASE;
+  fops->bank = ETMOtaOtherBank();
+  fops->banksize = FLASH_BANK_SIZE;
+  fops->pagesize = FLASH_PAGE_SIZE;
+  __HAL_RCC_CRC_CLK_ENABLE();
+}
+
+uint32_t ETMOtaOtherBank(void){
+  /* The bank booted from is always mapped at FLASH_BASE */
+  return FLASH_BASE + FLASH_BANK_SIZE;
+}
+
+uint32_t ETMOtaBootBank(void){
+  FLASH_OBProgramInitTypeDef OBInit;
+
+  HAL_FLASHEx_OBGetConfig(&OBInit);
+  return ((OBInit.USERConfig & OB_BFB2_ENABLE) == OB_BFB2_ENABLE) ? FLASH_BANK_2 : FLASH_BANK_1;
+}
+
+int ETMOtaSwapBootBank(void){
+  FLASH_OBProgramInitTypeDef OBInit;
+
+  UARTDEBUGPRINTF("Swapping boot image bank\r\n");
+  vTaskDelay(1000);
+  HAL_FLASH_Unlock();
+
+  /* Clear OPTVERR bit set on virgin samples */
+  __HAL_FLASH_CLEAR_FLAG(FLASH_FLAG_OPTVERR);
+
+  /* Allow Access to option bytes sector */
+  HAL_FLASH_OB_Unlock();
+
+  /* Get the Dual boot configuration status */
+  HAL_FLASHEx_OBGetConfig(&OBInit);
+
+  /* Enable/Disable dual boot feature */
+  OBInit.OptionType = OPTIONBYTE_USER;
+  OBInit.USERType   = OB_USER_BFB2;
+
+  if((OBInit.USERConfig & OB_BFB2_ENABLE) == OB_BFB2_ENABLE){
+    OBInit.USERConfig = OB_BFB2_DISABLE;
+    UARTDEBUGPRINTF("Enable boot bank 1\r\n");
+  }else{
+    OBInit.USERConfig = OB_BFB2_ENABLE;
+    UARTDEBUGPRINTF("Enable boot bank 2\r\n");
+  }
+
+  if(HAL_FLASHEx_OBProgram(&OBInit) != HAL_OK){
+    UARTDEBUGPRINTF("OBProgram failed\r\n");
+    return -1;
+  }
+  /* Start the Option Bytes programming process, this resets the device */
+  if(HAL_FLASH_OB_Launch() != HAL_OK){
+    UARTDEBUGPRINTF("OB_Launch failed\r\n");
+    return -1;
+  }
+  return 0;
+}
@@ -0,0 +1,747 @@
+/**
+  ******************************************************************************
+  * @file    etm_ota_writer.c
+  ******************************************************************************
+  */
+/* Includes ------------------------------------------------------------------*/
+#include <stdio.h>
+#include <string.h>
+#include <stdint.h>
+#include <stdbool.h>
+
+#include "FreeRTOS.h"
+
+#include "aws_crypto.h"
+#include "etm_ota_writer.h"
+
+#define UARTDEBUGPRINTF(x...) configPRINTF((x))
+
+/* The journal page starts with an entry for the image: magic, the image's base, its length and
+ * checksum as the ETM gave them, whether it is signed, the signed header and a CRC-32 of the
+ * entry. Checkpoint records follow: the download offset, the octets of the image in flash,
+ * the CRC-32 of those (as it runs, not inverted), the decoder's count, LEB128 and offset in the
+ * running image, the checksum so far, the decoder's state, its operation and shift (op | shift
+ * << 2) and a CRC-32 of the record. Both are whole double words. The last record that checks
+ * out is the one carried on from. */
+#define OTA_JOURNAL_MAGIC       0x4a544f45  /* "EOTJ" */
+#define OTA_JOURNAL_ENTRY       120
+#define OTA_JOURNAL_ENTRY_CRC   112
+#define OTA_JOURNAL_RECORD      32
+#define OTA_JOURNAL_RECORD_CRC  28
+
+/* Decoder states, between tokens, reading the extra count, the LEB128 argument or a literal run.
+ * Copies are made as soon as their token is complete. */
+#define OTA_LZ_TOKEN            0
+#define OTA_LZ_COUNT            1
+#define OTA_LZ_ARG              2
+#define OTA_LZ_LITERAL          3
+#define OTA_LZ_OP_LITERAL       0
+#define OTA_LZ_OP_MATCH         1
+#define OTA_LZ_OP_OLD           2
+#define OTA_LZ_OP_SEEK          3
+/* Octets of a copy from the image made at once */
+#define OTA_LZ_COPY             32
+/* Octets read back from flash at once, a multiple of 8 */
+#define OTA_READ_CHUNK          64
+
+/* Private functions ---------------------------------------------------------*/
+
+static const uint32_t OtaCrcTable[16] = {
+  0x00000000, 0x1db71064, 0x3b6e20c8, 0x26d930ac, 0x76dc4190, 0x6b6b51f4, 0x4db26158, 0x5005713c,
+  0xedb88320, 0xf00f9344, 0xd6d6a3e8, 0xcb61b38c, 0x9b64c2b0, 0x86d3d2d4, 0xa00ae278, 0xbdbdf21c
+};
+
+static uint32_t OtaGet32(const uint8_t *p){
+  return p[0] | (p[1] << 8) | (p[2] << 16) | ((uint32_t)p[3] << 24);
+}
+
+static void OtaPut32(uint8_t *p, uint32_t value){
+  p[0] = value;
+  p[1] = value >> 8;
+  p[2] = value >> 16;
+  p[3] = value >> 24;
+}
+
+/* CRC-32 (IEEE) a nibble at a time, for the few octets not worth the CRC unit */
+static uint32_t OtaCrcBytes(uint32_t crc, const uint8_t *data, uint32_t len){
+  while(len--){
+    crc ^= *data++;
+    crc = (crc >> 4) ^ OtaCrcTable[crc & 0x0f];
+    crc = (crc >> 4) ^ OtaCrcTable[crc & 0x0f];
+  }
+  return crc;
+}
+
+/* Carry the CRC-32 (IEEE) on over len octets. Whole words go through the flash's CRC function
+ * (the CRC unit on the board) if it has one, any odd octets at the end are done in software. */
+static uint32_t OtaCrc(ETMOtaWriter_t *w, uint32_t crc, const uint8_t *data, uint32_t len){
+  uint32_t words = (w->fops.Crc != NULL) ? (len & ~(uint32_t)3) : 0;
+
+  if(words > 0)
+    crc = w->fops.Crc(crc, data, words);
+  return OtaCrcBytes(crc, data + words, len - words);
+}
+
+/* Carry the CRC-32 on over len octets of flash, returns 0 or -1 if it can't be read */
+static int OtaCrcFlash(ETMOtaWriter_t *w, uint32_t *crc, uint32_t addr, uint32_t len){
+  uint32_t buf[OTA_READ_CHUNK / 4];
+  uint32_t n;
+
+  for(; len > 0; len -= n, addr += n){
+    n = MIN(len, sizeof(buf));
+    if(w->fops.Read(addr, (uint8_t *)buf, n) != 0)
+      return -1;
+    *crc = OtaCrc(w, *crc, (const uint8_t *)buf, n);
+  }
+  return 0;
+}
+
+/* Pass len octets of flash through SHA-256, returns 0 or -1 if it can't be read */
+static int OtaHashFlash(ETMOtaWriter_t *w, uint32_t addr, uint32_t len){
+  uint8_t buf[OTA_READ_CHUNK];
+  uint32_t n;
+
+  for(; len > 0; len -= n, addr += n){
+    n = MIN(len, sizeof(buf));
+    if(w->fops.Read(addr, buf, n) != 0)
+      return -1;
+    CRYPTO_SignatureVerificationUpdate(w->sigctx, buf, n);
+  }
+  return 0;
+}
+
+/* Does the flash at addr hold len octets of src */
+static bool OtaSame(ETMOtaWriter_t *w, uint32_t addr, const uint8_t *src, uint32_t len){
+  uint8_t buf[OTA_READ_CHUNK];
+  uint32_t n;
+
+  for(; len > 0; len -= n, addr += n, src += n){
+    n = MIN(len, sizeof(buf));
+    if(w->fops.Read(addr, buf, n) != 0 || memcmp(buf, src, n) != 0)
+      return false;
+  }
+  return true;
+}
+
+/* Check the signed image header once it is all in */
+static int OtaHeader(ETMOtaWriter_t *w){
+  uint16_t siglen = w->hdr[12] | (w->hdr[13] << 8);
+  uint32_t crc = 0xffffffff;
+
+  w->imagelen = OtaGet32(&w->hdr[4]);
+  w->flags = w->hdr[14] | (w->hdr[15] << 8);
+  w->oldlen = (w->flags & ETM_OTA_FLAG_DELTA) ? OtaGet32(&w->hdr[16]) : 0;
+  if(OtaGet32(w->hdr) != ETM_OTA_MAGIC || w->imagelen == 0 || w->imagelen > w->size ||
+     siglen == 0 || siglen > ETM_OTA_SIG_MAX || (w->flags & ~(ETM_OTA_FLAG_LZ | ETM_OTA_FLAG_DELTA)) != 0 ||
+     w->flags == ETM_OTA_FLAG_DELTA || w->oldlen > w->fops.banksize){
+    UARTDEBUGPRINTF("OTA image header not recognised\r\n");
+    w->failed = true;
+    return -1;
+  }
+  /* A delta only makes sense against the image it was made from */
+  if((w->flags & ETM_OTA_FLAG_DELTA) &&
+     (OtaCrcFlash(w, &crc, w->fops.running, w->oldlen) != 0 || (crc ^ 0xffffffff) != OtaGet32(&w->hdr[20]))){
+    UARTDEBUGPRINTF("OTA delta is for another image\r\n");
+    w->failed = true;
+    return -1;
+  }
+  return 0;
+}
+
+/* Check a signed image once it has all been written. The signature check also frees the
+ * SHA-256 context so it is always made. */
+static int OtaCheck(ETMOtaWriter_t *w){
+  uint16_t siglen = w->hdr[12] | (w->hdr[13] << 8);
+  bool ok = !w->failed;
+
+  if(ok && (w->hdrfill < ETM_OTA_HDR_SIZE || w->written != w->imagelen || w->lz.state != OTA_LZ_TOKEN)){
+    UARTDEBUGPRINTF("OTA image is short (%lu of %lu)\r\n", (unsigned long)w->written, (unsigned long)w->imagelen);
+    ok = false;
+  }
+  if(ok && (w->crc ^ 0xffffffff) != OtaGet32(&w->hdr[8])){
+    UARTDEBUGPRINTF("OTA image CRC mismatch\r\n");
+    ok = false;
+  }
+  if(CRYPTO_SignatureVerificationFinal(w->sigctx, (char *)w->cert, w->certlen, &w->hdr[24],
+                                       (siglen <= ETM_OTA_SIG_MAX) ? siglen : 0) != pdTRUE && ok){
+    UARTDEBUGPRINTF("OTA image signature check failed\r\n");
+    ok = false;
+  }
+  w->sigctx = NULL;
+  return ok ? 0 : -1;
+}
+
+/* Is len octets of flash (a multiple of 8) at addr erased */
+static bool OtaBlank(ETMOtaWriter_t *w, uint32_t addr, uint32_t len){
+  uint64_t buf[OTA_READ_CHUNK / 8];
+  uint32_t n, x;
+
+  for(; len > 0; len -= n, addr += n){
+    n = MIN(len, sizeof(buf));
+    if(w->fops.Read(addr, (uint8_t *)buf, n) != 0)
+      return false;
+    for(x = 0; x < n / 8; x++)
+      if(buf[x] != UINT64_MAX)
+        return false;
+  }
+  return true;
+}
+
+static int OtaFail(ETMOtaWriter_t *w, const char *what){
+  UARTDEBUGPRINTF("OTA %s failed @ 0x%lx\r\n", what, (unsigned long)w->address);
+  w->failed = true;
+  return -1;
+}
+
+/* Erase the page at addr unless it is blank already */
+static int OtaErasePage(ETMOtaWriter_t *w, uint32_t addr){
+  if(OtaBlank(w, addr, w->fops.pagesize)){
+    w->stats.blank++;
+    return 0;
+  }
+  if(w->fops.ErasePage(addr) != 0)
+    return -1;
+  w->stats.erases++;
+  return 0;
+}
+
+/* Program and verify a double word, or a row in fast mode (src word aligned), at w->address */
+static int OtaProgram(ETMOtaWriter_t *w, const uint8_t *src, uint16_t len){
+  while(w->erased < w->address + len){
+    if(OtaErasePage(w, w->erased) != 0)
+      return OtaFail(w, "erase");
+    w->erased += w->fops.pagesize;
+  }
+  /* Flash holding the data already, written before a download was carried on with, is left */
+  if(OtaSame(w, w->address, src, len)){
+    w->address += len;
+    return 0;
+  }
+  if(((len == ETM_OTA_ROW_SIZE) ? w->fops.ProgramRow : w->fops.Program)(w->address, src, len) != 0)
+    return OtaFail(w, "program");
+  /* Data verify */
+  if(!OtaSame(w, w->address, src, len))
+    return OtaFail(w, "verify");
+  w->address += len;
+  w->stats.programs++;
+  return 0;
+}
+
+/* Pass len octets of the image (decoded) through the checks and on to flash */
+static int OtaImage(ETMOtaWriter_t *w, const uint8_t *buf, uint32_t len){
+  uint16_t unit = w->fast ? ETM_OTA_ROW_SIZE : 8;
+  uint32_t take;
+
+  if(w->sigctx != NULL){
+    if(len > w->imagelen - w->written)
+      return OtaFail(w, "write past the image");
+    CRYPTO_SignatureVerificationUpdate(w->sigctx, (uint8_t *)buf, len);
+  }
+  if(len > w->size - w->written)
+    return OtaFail(w, "write past the end");
+  /* The journal records the CRC too */
+  if(w->sigctx != NULL || w->journal != 0)
+    w->crc = OtaCrc(w, w->crc, buf, len);
+  w->written += len;
+
+  while(len > 0){
+    /* Whole double words (or word aligned rows) are programmed from the caller's buffer */
+    if(w->fill == 0 && len >= unit && (!w->fast || ((uintptr_t)buf & 3) == 0)){
+      if(OtaProgram(w, buf, unit) != 0)
+        return -1;
+      buf += unit;
+      len -= unit;
+      continue;
+    }
+    take = unit - w->fill;
+    if(take > len)
+      take = len;
+    memcpy((uint8_t *)w->row + w->fill, buf, take);
+    w->fill += take;
+    buf += take;
+    len -= take;
+    if(w->fill == unit){
+      if(OtaProgram(w, (const uint8_t *)w->row, unit) != 0)
+        return -1;
+      w->fill = 0;
+    }
+  }
+  return 0;
+}
+
+/* Copy count octets of the image from dist back. The image so far is in flash apart from what is
+ * gathered in row, a copy at most dist long at a time so it never reads what it writes. */
+static int OtaLzMatch(ETMOtaWriter_t *w, uint32_t dist, uint32_t count){
+  uint8_t copy[OTA_LZ_COPY];
+  uint32_t flashed, from, n, x;
+
+  if(dist == 0 || dist > w->written || count > w->imagelen - w->written)
+    return OtaFail(w, "bad copy");
+  while(count > 0){
+    n = MIN(MIN(count, dist), sizeof(copy));
+    from = w->written - dist;
+    flashed = w->address - w->base;
+    x = (from < flashed) ? MIN(n, flashed - from) : 0;
+    if(x > 0 && w->fops.Read(w->base + from, copy, x) != 0)
+      return OtaFail(w, "read back");
+    memcpy(&copy[x], (const uint8_t *)w->row + (from + x - flashed), n - x);
+    if(OtaImage(w, copy, n) != 0)
+      return -1;
+    count -= n;
+  }
+  return 0;
+}
+
+/* Copy count octets of the running image */
+static int OtaLzOld(ETMOtaWriter_t *w, uint32_t count){
+  uint8_t copy[OTA_READ_CHUNK];
+  uint32_t n;
+
+  if(!(w->flags & ETM_OTA_FLAG_DELTA) || w->lz.old > w->oldlen || count > w->oldlen - w->lz.old)
+    return OtaFail(w, "bad copy from the running image");
+  for(; count > 0; count -= n){
+    n = MIN(count, sizeof(copy));
+    if(w->fops.Read(w->fops.running + w->lz.old, copy, n) != 0)
+      return OtaFail(w, "read of the running image");
+    if(OtaImage(w, copy, n) != 0)
+      return -1;
+    w->lz.old += n;
+  }
+  return 0;
+}
+
+/* State after a token's count is known */
+static uint8_t OtaLzNext(ETMOtaLz_t *lz){
+  if(lz->op == OTA_LZ_OP_LITERAL)
+    return OTA_LZ_LITERAL;
+  if(lz->op == OTA_LZ_OP_OLD)
+    return OTA_LZ_TOKEN;
+  return OTA_LZ_ARG;
+}
+
+/* Decode len octets of a compressed image, carrying on from wherever the last call stopped */
+static int OtaDecode(ETMOtaWriter_t *w, const uint8_t *buf, uint32_t len){
+  ETMOtaLz_t *lz = &w->lz;
+  uint32_t take;
+  uint8_t c;
+  int rc;
+
+  while(len > 0){
+    if(lz->state == OTA_LZ_LITERAL){
+      take = MIN(lz->count, len);
+      if(OtaImage(w, buf, take) != 0)
+        return -1;
+      buf += take;
+      len -= take;
+      lz->count -= take;
+      if(lz->count == 0)
+        lz->state = OTA_LZ_TOKEN;
+      continue;
+    }
+    c = *buf++;
+    len--;
+    if(lz->state == OTA_LZ_TOKEN){
+      lz->op = c >> 6;
+      lz->count = (c & 0x3f) + ((lz->op == OTA_LZ_OP_MATCH) ? 3 : 1);
+      lz->arg = 0;
+      lz->shift = 0;
+      lz->state = ((c & 0x3f) == 0x3f) ? OTA_LZ_COUNT : OtaLzNext(lz);
+    }else{
+      /* LEB128, for the count or the argument */
+      if(lz->shift > 28)
+        return OtaFail(w, "bad token");
+      lz->arg |= (uint32_t)(c & 0x7f) << lz->shift;
+      lz->shift += 7;
+      if(c & 0x80)
+        continue;
+      if(lz->state == OTA_LZ_COUNT){
+        lz->count += lz->arg;
+        lz->arg = 0;
+        lz->shift = 0;
+        lz->state = OtaLzNext(lz);
+      }else{
+        lz->state = OTA_LZ_TOKEN;
+        if(lz->op == OTA_LZ_OP_SEEK)
+          lz->old += (lz->arg >> 1) ^ -(lz->arg & 1);
+      }
+    }
+    /* Copies are made once the token is complete */
+    if(lz->state == OTA_LZ_TOKEN && lz->op != OTA_LZ_OP_LITERAL){
+      rc = (lz->op == OTA_LZ_OP_MATCH) ? OtaLzMatch(w, lz->arg, lz->count) : OtaLzOld(w, lz->count);
+      lz->op = OTA_LZ_OP_LITERAL;
+      if(rc != 0)
+        return -1;
+    }
+  }
+  return 0;
+}
+
+/* Program and verify whole double words of the journal, or of a page put back */
+static int OtaJournalProgram(ETMOtaWriter_t *w, uint32_t addr, const uint8_t *src, uint32_t len){
+  if(w->fops.Program(addr, src, len) != 0 || !OtaSame(w, addr, src, len))
+    return -1;
+  return 0;
+}
+
+/* Start the journal page again with the image's entry */
+static int OtaJournalEntry(ETMOtaWriter_t *w){
+  uint8_t entry[OTA_JOURNAL_ENTRY];
+
+  memset(entry, 0xff, sizeof(entry));
+  OtaPut32(entry, OTA_JOURNAL_MAGIC);
+  OtaPut32(&entry[4], w->base);
+  OtaPut32(&entry[8], w->cp.len);
+  entry[12] = w->cp.cs;
+  entry[13] = w->cp.cs >> 8;
+  entry[14] = (w->sigctx != NULL);
+  entry[15] = 0;
+  memcpy(&entry[16], w->hdr, ETM_OTA_HDR_SIZE);
+  OtaPut32(&entry[OTA_JOURNAL_ENTRY_CRC], OtaCrcBytes(0xffffffff, entry, OTA_JOURNAL_ENTRY_CRC) ^ 0xffffffff);
+
+  if(!OtaBlank(w, w->journal, w->fops.pagesize) && w->fops.ErasePage(w->journal) != 0)
+    return -1;
+  if(OtaJournalProgram(w, w->journal, entry, sizeof(entry)) != 0)
+    return -1;
+  w->jnext = OTA_JOURNAL_ENTRY;
+  return 0;
+}
+
+/* Record the last checkpoint, starting the page again when it is full */
+static int OtaJournalRecord(ETMOtaWriter_t *w){
+  uint8_t rec[OTA_JOURNAL_RECORD];
+
+  if(w->jnext == 0 || (uint32_t)w->jnext + OTA_JOURNAL_RECORD > w->fops.pagesize){
+    if(OtaJournalEntry(w) != 0)
+      return -1;
+  }
+  OtaPut32(rec, w->cp.offset);
+  OtaPut32(&rec[4], w->written);
+  OtaPut32(&rec[8], w->crc);
+  OtaPut32(&rec[12], w->lz.count);
+  OtaPut32(&rec[16], w->lz.arg);
+  OtaPut32(&rec[20], w->lz.old);
+  rec[24] = w->cp.sofar;
+  rec[25] = w->cp.sofar >> 8;
+  rec[26] = w->lz.state;
+  rec[27] = w->lz.op | (w->lz.shift << 2);
+  OtaPut32(&rec[OTA_JOURNAL_RECORD_CRC], OtaCrcBytes(0xffffffff, rec, OTA_JOURNAL_RECORD_CRC) ^ 0xffffffff);
+
+  if(OtaJournalProgram(w, w->journal + w->jnext, rec, sizeof(rec)) != 0)
+    return -1;
+  w->jnext += OTA_JOURNAL_RECORD;
+  w->jlast = w->cp.offset;
+  w->stats.journalled++;
+  return 0;
+}
+
+/* The page the image carries on in has to be blank after the checkpoint, but what was written
+ * after it before the download stopped is still there. The page is erased and the image up to
+ * the checkpoint put back. A restart part way through leaves the CRC not matching. */
+static int OtaJournalTail(ETMOtaWriter_t *w, uint32_t written){
+  uint32_t head = written % w->fops.pagesize;
+  uint32_t page = w->base + written - head;
+  uint8_t *copy;
+  int rc = 0;
+
+  if(head == 0 || OtaBlank(w, page + head, w->fops.pagesize - head))
+    return 0;
+  if((copy = pvPortMalloc(head)) == NULL)
+    return -1;
+  if(w->fops.Read(page, copy, head) != 0 || w->fops.ErasePage(page) != 0 ||
+     OtaJournalProgram(w, page, copy, head) != 0)
+    rc = -1;
+  vPortFree(copy);
+  return rc;
+}
+
+/* Take up the journal's last checkpoint if it is for this image's base and what is in flash up
+ * to it still has the CRC recorded. The image there is then passed through SHA-256 again. */
+static bool OtaJournalLoad(ETMOtaWriter_t *w){
+  uint8_t entry[OTA_JOURNAL_ENTRY], rec[OTA_JOURNAL_RECORD];
+  bool sig = (w->sigctx != NULL);
+  uint32_t off, last = 0, written;
+
+  if(w->fops.Read(w->journal, entry, sizeof(entry)) != 0 ||
+     OtaGet32(entry) != OTA_JOURNAL_MAGIC || OtaGet32(&entry[4]) != w->base || entry[14] != sig ||
+     (OtaCrcBytes(0xffffffff, entry, OTA_JOURNAL_ENTRY_CRC) ^ 0xffffffff) != OtaGet32(&entry[OTA_JOURNAL_ENTRY_CRC]))
+    return false;
+  for(off = OTA_JOURNAL_ENTRY; off + OTA_JOURNAL_RECORD <= w->fops.pagesize; off += OTA_JOURNAL_RECORD){
+    if(w->fops.Read(w->journal + off, rec, sizeof(rec)) != 0 ||
+       (OtaCrcBytes(0xffffffff, rec, OTA_JOURNAL_RECORD_CRC) ^ 0xffffffff) != OtaGet32(&rec[OTA_JOURNAL_RECORD_CRC]))
+      break;
+    last = off;
+  }
+  if(last == 0 || w->fops.Read(w->journal + last, rec, sizeof(rec)) != 0)
+    return false;
+
+  if(sig){
+    memcpy(w->hdr, &entry[16], ETM_OTA_HDR_SIZE);
+    w->hdrfill = ETM_OTA_HDR_SIZE;
+    if(OtaHeader(w) != 0)
+      return false;
+  }
+  written = OtaGet32(&rec[4]);
+  if(OtaGet32(rec) < w->hdrfill || written % 8 != 0 || written > w->size || (sig && written > w->imagelen) ||
+     (!(w->flags & ETM_OTA_FLAG_LZ) && written != OtaGet32(rec) - w->hdrfill))
+    return false;
+  if(OtaCrcFlash(w, &w->crc, w->base, written) != 0 || w->crc != OtaGet32(&rec[8])){
+    UARTDEBUGPRINTF("OTA image in flash doesn't match the journal\r\n");
+    return false;
+  }
+  if(OtaJournalTail(w, written) != 0){
+    UARTDEBUGPRINTF("OTA page at the checkpoint couldn't be cleared\r\n");
+    return false;
+  }
+  if(sig && OtaHashFlash(w, w->base, written) != 0)
+    return false;
+
+  w->cp.len = OtaGet32(&entry[8]);
+  w->cp.cs = entry[12] | (entry[13] << 8);
+  w->cp.offset = OtaGet32(rec);
+  w->cp.sofar = rec[24] | (rec[25] << 8);
+  w->lz.count = OtaGet32(&rec[12]);
+  w->lz.arg = OtaGet32(&rec[16]);
+  w->lz.old = OtaGet32(&rec[20]);
+  w->lz.state = rec[26];
+  w->lz.op = rec[27] & 3;
+  w->lz.shift = rec[27] >> 2;
+  w->taken = w->cp.offset;
+  w->jlast = w->cp.offset;
+  /* A torn record after the last good one means the page has to be started again */
+  w->jnext = OtaBlank(w, w->journal + off, w->fops.pagesize - off) ? off : w->fops.pagesize;
+  w->written = written;
+  w->address = w->base + written;
+  /* The page being written is blank from here (OtaJournalTail()), the rest are seen to as usual */
+  w->erased = w->base + (written + w->fops.pagesize - 1) / w->fops.pagesize * w->fops.pagesize;
+  return true;
+}
+
+/* The download has started from the beginning again, the ETM's image has changed */
+static int OtaRestart(ETMOtaWriter_t *w){
+  UARTDEBUGPRINTF("OTA image started again\r\n");
+  w->address = w->erased = w->base;
+  w->written = 0;
+  w->taken = 0;
+  w->fill = 0;
+  w->hdrfill = 0;
+  w->imagelen = 0;
+  w->flags = 0;
+  w->oldlen = 0;
+  memset(&w->lz, 0, sizeof(w->lz));
+  w->crc = 0xffffffff;
+  w->jnext = 0;
+  w->jlast = 0;
+  if(w->sigctx != NULL){
+    /* The check frees the SHA-256 context */
+    CRYPTO_SignatureVerificationFinal(w->sigctx, (char *)w->cert, w->certlen, w->hdr, 0);
+    w->sigctx = NULL;
+    if(CRYPTO_SignatureVerificationStart(&w->sigctx, cryptoASYMMETRIC_ALGORITHM_ECDSA, cryptoHASH_ALGORITHM_SHA256) != pdTRUE){
+      w->sigctx = NULL;
+      return OtaFail(w, "restart");
+    }
+  }
+  return 0;
+}
+
+/* Exported functions --------------------------------------------------------*/
+
+int ETMOtaWriterOpen(ETMOtaWriter_t *w, const ETMOtaFlash_t *fops, uint32_t base, uint32_t size, bool fast){
+  uint32_t bank = fops->bank;
+
+  memset(w, 0, sizeof(*w));
+  if(base < bank || base % fops->pagesize != 0 || size > bank + fops->banksize - base ||
+     (fast && (base != bank || fops->EraseBank == NULL || fops->ProgramRow == NULL)))
+    return -1;
+  w->fops = *fops;
+  w->base = w->address = w->erased = base;
+  w->size = size;
+  w->fast = fast;
+
+  if(fast){
+    /* Fast programming is only allowed once the bank has been mass erased */
+    if(w->fops.EraseBank(base) != 0)
+      return OtaFail(w, "mass erase");
+    w->erased = bank + w->fops.banksize;
+    w->stats.erases = w->fops.banksize / w->fops.pagesize;
+  }
+  return 0;
+}
+
+int ETMOtaWriterVerify(ETMOtaWriter_t *w, const char *cert, uint32_t certlen){
+  if(w->written != 0 || w->sigctx != NULL)
+    return -1;
+  CRYPTO_ConfigureHeap();
+  if(CRYPTO_SignatureVerificationStart(&w->sigctx, cryptoASYMMETRIC_ALGORITHM_ECDSA, cryptoHASH_ALGORITHM_SHA256) != pdTRUE){
+    w->sigctx = NULL;
+    return -1;
+  }
+  w->cert = cert;
+  w->certlen = certlen;
+  w->crc = 0xffffffff;
+  return 0;
+}
+
+int ETMOtaWriterResume(ETMOtaWriter_t *w, uint32_t journal){
+  uint32_t bank = w->fops.bank;
+
+  if(w->fast || w->written != 0 || w->hdrfill != 0 || journal % w->fops.pagesize != 0 || journal < bank ||
+     journal >= bank + w->fops.banksize || (journal + w->fops.pagesize > w->base && journal < w->base + w->size))
+    return -1;
+  w->journal = journal;
+  w->crc = 0xffffffff;
+  memset(&w->cp, 0, sizeof(w->cp));
+
+  if(OtaJournalLoad(w)){
+    UARTDEBUGPRINTF("OTA image carries on from %lu\r\n", (unsigned long)w->cp.offset);
+    return 0;
+  }
+  /* Nothing to carry on with, start from the beginning */
+  w->failed = false;
+  w->hdrfill = 0;
+  w->imagelen = 0;
+  w->flags = 0;
+  w->oldlen = 0;
+  memset(&w->lz, 0, sizeof(w->lz));
+  w->crc = 0xffffffff;
+  memset(w->hdr, 0, sizeof(w->hdr));
+  memset(&w->cp, 0, sizeof(w->cp));
+  w->jnext = 0;
+  w->jlast = 0;
+  return 0;
+}
+
+int ETMOtaWriterWrite(ETMOtaWriter_t *w, const uint8_t *buf, uint32_t len){
+  uint32_t take;
+
+  if(w->failed)
+    return -1;
+  w->taken += len;
+  if(w->sigctx != NULL){
+    /* The header first, then the image is checked on its way to flash */
+    if(w->hdrfill < ETM_OTA_HDR_SIZE){
+      take = ETM_OTA_HDR_SIZE - w->hdrfill;
+      if(take > len)
+        take = len;
+      memcpy(&w->hdr[w->hdrfill], buf, take);
+      w->hdrfill += take;
+      buf += take;
+      len -= take;
+      if(w->hdrfill == ETM_OTA_HDR_SIZE && OtaHeader(w) != 0)
+        return -1;
+    }
+  }
+  if(w->flags & ETM_OTA_FLAG_LZ)
+    return OtaDecode(w, buf, len);
+  return OtaImage(w, buf, len);
+}
+
+int ETMOtaWriterFinish(ETMOtaWriter_t *w){
+  uint16_t x;
+  int rc = w->failed ? -1 : 0;
+  bool stopped = (w->journal != 0 && !w->failed && w->cp.offset < w->cp.len);
+
+  /* What is gathered of a download that stopped short is read again when it carries on */
+  if(rc == 0 && w->fill > 0 && !stopped){
+    memset((uint8_t *)w->row + w->fill, 0xff, sizeof(w->row) - w->fill);
+    /* Fast programming only takes whole rows, the rest goes a double word at a time */
+    for(x = 0; x < w->fill && rc == 0; x += 8)
+      rc = OtaProgram(w, (const uint8_t *)w->row + x, 8);
+    w->fill = 0;
+  }
+  if(w->sigctx != NULL && OtaCheck(w) != 0)
+    rc = -1;
+  /* Keep the journal only for a download that can still be carried on with */
+  if(w->journal != 0 && !stopped && !OtaBlank(w, w->journal, w->fops.pagesize)){
+    if(w->fops.ErasePage(w->journal) != 0)
+      UARTDEBUGPRINTF("OTA journal erase failed\r\n");
+  }
+  return rc;
+}
+
+int ETMOtaWriterSink(void *ctx, uint32_t offset, const uint8_t *data, uint16_t len){
+  ETMOtaWriter_t *w = ctx;
+
+  if(offset == 0 && w->taken != 0 && OtaRestart(w) != 0)
+    return -1;
+  if(offset != w->taken)
+    return OtaFail(w, "out of order write");
+  return ETMOtaWriterWrite(w, data, len);
+}
+
+void ETMOtaWriterCheckpoint(void *ctx, const ETMFwCheckpoint_t *cp){
+  ETMOtaWriter_t *w = ctx;
+
+  w->cp = *cp;
+  /* Only what is in flash can be carried on from, and the header has to be kept with it */
+  if(w->journal == 0 || w->failed || w->fill != 0 || cp->offset != w->taken ||
+     cp->offset - w->jlast < ETM_OTA_JOURNAL_INTERVAL || (w->sigctx != NULL && w->hdrfill < ETM_OTA_HDR_SIZE))
+    return;
+  if(OtaJournalRecord(w) != 0){
+    UARTDEBUGPRINTF("OTA journal write failed, no more checkpoints\r\n");
+    w->journal = 0;
+  }
+}
+
+/* Percentage last reported by OtaProgress() */
+static uint8_t OtaReportPc;
+
+static void OtaProgress(void *ctx, uint32_t done, uint32_t total){
+  uint8_t pc = (uint8_t)((uint64_t)done * 100 / total);
+
+  (void)ctx;
+  if(pc - OtaReportPc >= 5){
+    OtaReportPc = pc;
+    UARTDEBUGPRINTF("%d%%\r\n", pc);
+  }
+}
+
+/* After a failed read give an ETM which is rebooting time to come back */
+static void OtaWaitForETM(ETMObject_t *Obj){
+  uint32_t tickstart = Obj->GetTickCb();
+
+  if(Obj->urcseen & ETM_REBOOT){
+    Obj->urcseen &= ~(ETM_REBOOT | ETM_READY_URC);
+    while((Obj->GetTickCb() - tickstart) < pdMS_TO_TICKS(30000) && !(Obj->urcseen & ETM_READY_URC))
+      ETMpoll(Obj);
+  }else{
+    while((Obj->GetTickCb() - tickstart) < pdMS_TO_TICKS(1000))
+      ETMpoll(Obj);
+  }
+}
+
+int ETMOtaDownload(ETMObject_t *Obj, ETMOtaWriter_t *w, ETMFwDownload_t *Dl, uint32_t journal, int attempts){
+  ETMFwResult_t result;
+  int attempt;
+
+  if(journal != 0 && ETMOtaWriterResume(w, journal) != 0){
+    ETMOtaWriterFinish(w);
+    return -1;
+  }
+  OtaReportPc = 0;
+  Dl->sink = ETMOtaWriterSink;
+  Dl->checkpoint = ETMOtaWriterCheckpoint;
+  if(Dl->progress == NULL)
+    Dl->progress = OtaProgress;
+  Dl->ctx = w;
+
+  for(attempt = 1; ; attempt++){
+    Dl->resume = w->cp;
+    result = ETMFwDownload(Obj, Dl);
+    if(result == ETM_FW_OK || result == ETM_FW_ERR_SINK || result == ETM_FW_ERR_CHECKSUM || attempt >= attempts)
+      break;
+    UARTDEBUGPRINTF("Download stopped at %lu, trying again\r\n", (unsigned long)w->cp.offset);
+    OtaWaitForETM(Obj);
+  }
+  if(result != ETM_FW_OK){
+    ETMOtaWriterFinish(w);
+    return -1;
+  }
+  if(ETMOtaWriterFinish(w) != 0){
+    UARTDEBUGPRINTF("Image failed its length, CRC or signature check\r\n");
+    return -1;
+  }
+  UARTDEBUGPRINTF("Firmware length is %lu, cs is %x, read from %lu in %lu ms, %lu pages erased\r\n",
+                  (unsigned long)Dl->len, Dl->cs, (unsigned long)Dl->stats.resumed, (unsigned long)Dl->stats.ms,
+                  (unsigned long)w->stats.erases);
+  return 0;
+}
@@ -6,25 +6,28 @@
   */
 /* Includes ------------------------------------------------------------------*/
 #include <stdio.h>
-#include <stdlib.h>
 #include <string.h>
 #include <stdbool.h>
-#include <ctype.h>
 
 #include "FreeRTOS.h"
 #include "task.h"
 
 #include "etm.h"
 #include "etm_conf.h"
+#include "etm_cmd.h"
 
 static void ETMProcessReceived(ETMObject_t *Obj, uint32_t match);
+static void AT_AsyncFlush(ETMObject_t *Obj);
+static int AT_SendPublish(ETMObject_t *Obj, int tpcidx, uint8_t qos, uint8_t *data, uint16_t datalen);
+static void ETMTopicRemove(ETMObject_t *Obj, int idx);
+static int AT_InflightAdd(ETMObject_t *Obj, int seq, int8_t tpcidx, uint8_t qos, uint8_t *data, uint16_t datalen, uint8_t retries, _pubcb cb, void *ctx);
+static bool AT_InflightFull(ETMObject_t *Obj);
 
 #ifdef TIMEOUT_RESPONSES
 static bool ETMcheckTimeout(ETMObject_t *Obj);
 #endif
 
 /* Private variable ---------------------------------------------------------*/
-char CmdString[ETM_CMD_SIZE];
 
 /* Exported variable ---------------------------------------------------------*/
 
@@ -41,8 +44,7 @@ char CmdString[ETM_CMD_SIZE];
 
 
 const ETM_RetKeywords_t ReturnKeywords[] = {
-    { RET_SENDOK,       ":SEND OK\r\n"},
-    { RET_SENDFAIL,     ":SEND FAIL\r\n"},
+    { RET_PUBACK,       "+EMQPUB:"},
     { RET_IDLE,         "+ETM:IDLE\r\n"},
     { RET_MQTTREC,      "+EMQ:"},
     { RET_EMQRDY,       "+ETM:EMQRDY\r\n"},
@@ -54,12 +56,14 @@ const ETM_RetKeywords_t ReturnKeywords[] = {
     { RET_STATEURC,     "+ETMSTATE:"},
     { RET_APPRDY,       "APP RDY"},
     { RET_FWAVAILABLE,  "+ETMHFWGET:"},
+    { RET_FWREAD,       "+ETMHFWREAD:"},
     { RET_REBOOT_REQ,   "+ETM:REBOOT REQUIRED"},
     { RET_REBOOTING,    "+ETM:REBOOTING"},
     { RET_OK,           "OK\r\n" },
     { RET_CME_ERROR,    "+CME ERROR\r\n" },
     { RET_ERROR,        "ERROR\r\n" },
     { RET_CRLF,         "\r\n" },
+    { RET_PROMPT,       "> " },
 };
 
 /* Private functions ---------------------------------------------------------*/
@@ -84,11 +88,92 @@ static int32_t TimeLeftFromExpiration(uint32_t init, uint32_t now, uint32_t time
   return ret;
 }
 
-/* persistScanVals holds bits for scan values which are persistent. i.e. even if a call to AT_RetrieveData
- * does not include these flags they will be scanned for. Any text matching a ScanVal flag will be returned
- * to the caller but any text matching a persistScanVal will be dispatched to ETMProcessReceived().
+/* Response matcher. ReturnKeywords is compiled once into an Aho-Corasick automaton whose failure
+ * links are folded into a dense transition table, so the receive loop advances exactly one state
+ * per byte and never rescans. Bytes are mapped to character classes first (one class per character
+ * used by any keyword plus class 0 for everything else) to keep the table small. MatchOut holds,
+ * for each state, a bitmask of the ReturnKeywords indices which end at that state; bit order is
+ * array order so matches are reported with the same priority as the table above. The tables are
+ * shared by every ETMObject_t and never change once built.
  */
-static uint32_t persistScanVals = 0;
+static uint8_t  MatchClass[256];
+static uint8_t  MatchDelta[ETM_MATCH_MAX_STATES][ETM_MATCH_MAX_CLASSES];
+static uint32_t MatchOut[ETM_MATCH_MAX_STATES];
+static bool     MatchBuilt = false;
+
+/**
+  * @brief  Compile ReturnKeywords into the response matcher tables.
+  *         Safe to call more than once, the tables are only built on the first call.
+  *         Doesn't log, ETM_Init() runs it with the scheduler suspended.
+  * @retval true if the matcher is ready, false if the keywords exceed the table limits.
+  */
+static bool AT_MatchBuild(void){
+  uint8_t fail[ETM_MATCH_MAX_STATES];
+  uint8_t queue[ETM_MATCH_MAX_STATES];
+  uint16_t states = 1, classes = 1;
+  uint16_t head = 0, tail = 0;
+  uint16_t x, c;
+
+  if(MatchBuilt)
+    return true;
+
+  memset(MatchClass, 0, sizeof(MatchClass));
+  memset(MatchDelta, 0, sizeof(MatchDelta));
+  memset(MatchOut, 0, sizeof(MatchOut));
+
+  /* Build the keyword trie (state 0 is the root, a zero transition means no edge yet) */
+  for(x = 0; x < NUM_RESPONSES; x++){
+    const uint8_t *kw = (const uint8_t *)ReturnKeywords[x].retstr;
+    uint8_t state = 0;
+    for(; *kw != 0; kw++){
+      if(MatchClass[*kw] == 0){
+        if(classes >= ETM_MATCH_MAX_CLASSES)
+          return false;
+        MatchClass[*kw] = classes++;
+      }
+      c = MatchClass[*kw];
+      if(MatchDelta[state][c] == 0){
+        if(states >= ETM_MATCH_MAX_STATES)
+          return false;
+        MatchDelta[state][c] = states++;
+      }
+      state = MatchDelta[state][c];
+    }
+    MatchOut[state] |= (1UL << x);
+  }
+
+  /* Breadth-first pass: resolve failure links and fill in the missing transitions. When a
+   * state is dequeued its row still only holds trie edges (children are never state 0). */
+  for(c = 0; c < classes; c++){
+    uint8_t child = MatchDelta[0][c];
+    if(child != 0){
+      fail[child] = 0;
+      queue[tail++] = child;
+    }
+  }
+  while(head < tail){
+    uint8_t state = queue[head++];
+    for(c = 0; c < classes; c++){
+      uint8_t child = MatchDelta[state][c];
+      if(child != 0){
+        fail[child] = MatchDelta[fail[state]][c];
+        MatchOut[child] |= MatchOut[fail[child]];
+        queue[tail++] = child;
+      }else{
+        MatchDelta[state][c] = MatchDelta[fail[state]][c];
+      }
+    }
+  }
+
+  MatchBuilt = true;
+  return true;
+}
+
+/* Release octets taken from a peeked run (IO_ReceiveOne removes them as it goes) */
+static void AT_Release(ETMObject_t *Obj, uint16_t used){
+  if(Obj->fops.IO_Peek != NULL && used > 0)
+    Obj->fops.IO_Consume(used);
+}
 
 /**
   * @brief  Retrieve Data from the C2C module over the UART interface.
@@ -106,12 +191,15 @@ static uint32_t persistScanVals = 0;
 static int32_t AT_RetrieveData(ETMObject_t *Obj, uint8_t* pData, uint16_t Length, uint32_t ScanVals, uint32_t Timeout){
   uint32_t tickstart = Obj->GetTickCb();
   int16_t ReadData = 0;
-  uint16_t x;
-  uint16_t index[NUM_RESPONSES];
-  uint16_t lens[NUM_RESPONSES];
-  uint16_t pos;
+  uint8_t x;
+  uint8_t state = 0;
+  uint32_t hits;
+  bool dispatched;
   uint8_t c;
-  int32_t min_requested_time;
+  uint8_t *span;
+  uint16_t avail, used;
+  int32_t left;
+  uint32_t min_requested_time;
 
   if(Length == 0 && ScanVals == 0){
 	  /* Can't have no buffer && scan values */
@@ -126,48 +214,88 @@ static int32_t AT_RetrieveData(ETMObject_t *Obj, uint8_t* pData, uint16_t Length
      //ETM_DBG(("UART_C2C: Timeout forced to respect UART speed %d: %ld\r\n", UG96_DEFAULT_BAUDRATE, min_requested_time));
   }
 
-  for (x = 0; x < NUM_RESPONSES; x++){
-    index[x] = 0;
-    lens[x] = strlen(ReturnKeywords[x].retstr);
-  }
-
   /* Clear out the response array (implicit null termination) */
   memset(pData, 0, Length);
 
   /* Read characters from uart buffer until match or timeout */
-  while (TimeLeftFromExpiration(tickstart, Obj->GetTickCb(), Timeout) > 0){
-    if(Obj->fops.IO_ReceiveOne(&c) == 0){
+  while ((left = TimeLeftFromExpiration(tickstart, Obj->GetTickCb(), Timeout)) > 0){
+    /* Take the next run of received data, a single octet if block receive isn't available */
+    if(Obj->fops.IO_Peek != NULL){
+      avail = Obj->fops.IO_Peek(&span);
+    }else{
+      span = &c;
+      avail = (Obj->fops.IO_ReceiveOne(&c) == 0) ? 1 : 0;
+    }
+    if(avail == 0){
+      /* An idle poll gives way when the application has work for the ETM */
+      if(ScanVals == RET_ANY && Obj->pollwake)
+        break;
+      if(Obj->fops.IO_Wait != NULL){
+        /* Sleep until the transport has a line (or the octets a plain read still needs). A
+         * prompt has no line end so wait on octets while one is expected. */
+        if(ScanVals == 0)
+          Obj->fops.IO_Wait((uint16_t)(Length - ReadData), left);
+        else
+          Obj->fops.IO_Wait((ScanVals & RET_PROMPT) ? 1 : 0, left);
+      }else{
+        vTaskDelay(pdMS_TO_TICKS(1));
+      }
+      continue;
+    }
+
+    if (ScanVals == 0){
+      /* Plain read - copy as much of the run as the buffer takes */
+      used = MIN(avail, (uint16_t)(Length - ReadData));
+      memcpy(&pData[ReadData], span, used);
+      ReadData += used;
+      AT_Release(Obj, used);
+      if (ReadData >= Length){
+        return ReadData;
+      }
+      continue;
+    }
+
+    for(used = 0; used < avail; ){
+      c = span[used++];
       /* If we're scanning for fixed strings don't overflow the supplied buffer */
       if(ReadData < Length)
           pData[ReadData++] = c;
 
-      if (ScanVals != 0){
-        /* Check whether we hit any ESP return values */
-        for(x = 0; x < NUM_RESPONSES; x++){
-          if (c == ReturnKeywords[x].retstr[index[x]]){
-            pos = ++(index[x]);
-            if( pos >= lens[x]){
-              if (ScanVals & ReturnKeywords[x].retval){
-            	/* We have matched a response - return it here */
-                return ReturnKeywords[x].retval;
-              }else if(persistScanVals & ReturnKeywords[x].retval){
-            	ETMProcessReceived(Obj, ReturnKeywords[x].retval);
-            	/* Any collated buffer is no good with URCs embedded so flush */
-            	ReadData = 0;
-            	memset(pData, 0, Length);
-              }
-            }
-          }else{
-        	index[x] = 0;
+      /* Check whether we hit any ESP return values */
+      state = MatchDelta[state][MatchClass[c]];
+      hits = MatchOut[state];
+      dispatched = false;
+      for(x = 0; hits != 0; x++, hits >>= 1){
+        if(hits & 1){
+          if (ScanVals & ReturnKeywords[x].retval){
+            /* We have matched a response - return it here */
+            AT_Release(Obj, used);
+            return ReturnKeywords[x].retval;
+          }else if(Obj->persistScanVals & ReturnKeywords[x].retval){
+            /* Hand back what we've scanned, the URC handler reads on from here */
+            AT_Release(Obj, used);
+            avail = used = 0;
+            ETMProcessReceived(Obj, ReturnKeywords[x].retval);
+            /* Any collated buffer is no good with URCs embedded so flush */
+            ReadData = 0;
+            memset(pData, 0, Length);
+            /* Shorter keywords ending here are part of the URC (the CRLF of +ETM:IDLE) */
+            dispatched = true;
+            break;
           }
         }
       }
+      if(dispatched){
+        /* The URC handler may have consumed further input so restart matching on a fresh run */
+        state = 0;
+        break;
+      }
       if (ReadData >= Length){
+        AT_Release(Obj, used);
         return ReadData;
       }
-    }else{
-        vTaskDelay(pdMS_TO_TICKS(1));
     }
+    AT_Release(Obj, used);
   }
   if ((ScanVals == 0) && (ReadData > 0)){
     ETM_DBG(("AT_Read: Warning: timeout occurred before all data was read (%d/%u)\r\n", ReadData, Length));
@@ -188,7 +316,10 @@ static int32_t  AT_ExecuteCommand(ETMObject_t *Obj, uint32_t timeout, uint8_t* c
   if (timeout == 0){
     timeout = ETM_TOUT_300;
   }
+  /* Queued commands go first, the link only carries one command at a time */
+  AT_AsyncFlush(Obj);
   ETM_DBG_AT(("AT Request: %s\r\n", cmd));
+  Obj->syncdepth++;
   if(Obj->fops.IO_Send(cmd, strlen((char*)cmd)) >= 0){
     ret = (AT_RetrieveData(Obj, Obj->CmdResp, ETM_CMD_SIZE, resp, timeout));
     if (ret < RET_NONE)    {
@@ -199,9 +330,301 @@ static int32_t  AT_ExecuteCommand(ETMObject_t *Obj, uint32_t timeout, uint8_t* c
   }else{
     ETM_DBG(("ETM AT_ExecuteCommand() send ERROR: %s\r\n", cmd));
   }
+  Obj->syncdepth--;
   return ret;
 }
 
+/* Take the command at the head of the queue off and report its result */
+static void AT_AsyncRetire(ETMObject_t *Obj, int32_t result){
+  struct etmcmd *cmd;
+  _cmdcb cb;
+  void *ctx;
+  int handle;
+
+  if(Obj->cmdcount == 0)
+    return;
+  cmd = &Obj->cmdqueue[Obj->cmdhead];
+  Obj->cmdhead = (Obj->cmdhead + 1) % ETM_ASYNC_QUEUE_SIZE;
+  Obj->cmdcount--;
+  /* The slot may be reused from a callback */
+  cb = cmd->cb;
+  ctx = cmd->ctx;
+  handle = cmd->handle;
+
+  /* Topic slots are reserved when queued, release them if the command failed */
+  if(cmd->kind == ETM_CMD_SUBOPEN && Obj->topics.substate[cmd->tpcidx] == SUB_TOPIC_SUBSCRIBING && result != RET_OK){
+    Obj->topics.substate[cmd->tpcidx] = SUB_TOPIC_NOT_IN_USE;
+  }else if(cmd->kind == ETM_CMD_PUBOPEN && Obj->topics.pubstate[cmd->tpcidx] == PUB_TOPIC_REGISTERING){
+    if(result != RET_OK){
+      ETMTopicRemove(Obj, cmd->tpcidx);
+      Obj->topics.pubstate[cmd->tpcidx] = PUB_TOPIC_NOT_IN_USE;
+    }
+#ifdef TIMEOUT_RESPONSES
+    else
+      Obj->topics.pubsenttime[cmd->tpcidx] = Obj->GetTickCb();
+#endif
+  }else if(cmd->kind == ETM_CMD_PUBLISH && cmd->qos > 0 && result == RET_OK){
+    AT_InflightAdd(Obj, -1, cmd->tpcidx, cmd->qos, NULL, 0, 0, NULL, NULL);
+  }else if(cmd->kind == ETM_CMD_REPUBLISH){
+    /* Back to awaiting acknowledgement, or failed without reaching the ETM */
+    if(result == RET_OK)
+      AT_InflightAdd(Obj, cmd->seq, cmd->tpcidx, cmd->qos, cmd->data, cmd->datalen, cmd->retries, cmd->pubcb, ctx);
+    else if(cmd->pubcb != NULL)
+      cmd->pubcb(ctx, cmd->seq, RET_SENDFAIL);
+  }
+  if(result != RET_OK)
+    ETM_DBG(("ETM queued command %d failed (%ld)\r\n", handle, (long)result));
+
+  if(cb != NULL)
+    cb(ctx, handle, result);
+}
+
+/* Send the command at the head of the queue unless it is already in flight */
+static void AT_AsyncKick(ETMObject_t *Obj){
+  struct etmcmd *cmd;
+  int rc;
+
+  while(Obj->cmdcount > 0 && !Obj->cmdqueue[Obj->cmdhead].sent){
+    cmd = &Obj->cmdqueue[Obj->cmdhead];
+    cmd->sent = true;
+    cmd->senttime = Obj->GetTickCb();
+    if(cmd->kind == ETM_CMD_PUBLISH || cmd->kind == ETM_CMD_REPUBLISH){
+      /* A QoS 1 or 2 publish fails rather than go into a full window */
+      rc = (cmd->qos > 0 && AT_InflightFull(Obj)) ? -1 : AT_SendPublish(Obj, cmd->tpcidx, cmd->qos, cmd->data, cmd->datalen);
+    }else{
+      ETM_DBG_AT(("AT Request: %s\r\n", cmd->cmd));
+      rc = Obj->fops.IO_Send((uint8_t *)cmd->cmd, strlen(cmd->cmd));
+    }
+    if(rc >= 0)
+      break;
+    AT_AsyncRetire(Obj, ETM_RETURN_SEND_ERROR);
+  }
+}
+
+/* Is the command at the head of the queue on the wire */
+static bool AT_AsyncInFlight(ETMObject_t *Obj){
+  return Obj->cmdcount > 0 && Obj->cmdqueue[Obj->cmdhead].sent;
+}
+
+/* Wait up to limit ms for the final result of the command in flight, if there is one */
+static void AT_AsyncCollect(ETMObject_t *Obj, int32_t limit){
+  int32_t left, ret = ETM_RETURN_NO_DATA;
+
+  if(!AT_AsyncInFlight(Obj))
+    return;
+  left = TimeLeftFromExpiration(Obj->cmdqueue[Obj->cmdhead].senttime, Obj->GetTickCb(), ETM_TOUT_300);
+  if(left > 0)
+    ret = AT_RetrieveData(Obj, Obj->CmdResp, ETM_CMD_SIZE, RET_OK | RET_ERROR, MIN(left, limit));
+  /* A URC handler may have completed the command we were waiting on, a result always belongs
+   * to whichever command is now in flight. One queued since hasn't been sent yet. */
+  if(!AT_AsyncInFlight(Obj))
+    return;
+  if(ret == RET_OK || ret == RET_ERROR){
+    AT_AsyncRetire(Obj, ret);
+  }else if(TimeLeftFromExpiration(Obj->cmdqueue[Obj->cmdhead].senttime, Obj->GetTickCb(), ETM_TOUT_300) <= 0){
+    AT_AsyncRetire(Obj, ETM_RETURN_NO_DATA);
+  }
+}
+
+/* Send the next queued command if need be and wait up to limit ms for its result */
+static void AT_AsyncStep(ETMObject_t *Obj, int32_t limit){
+  AT_AsyncKick(Obj);
+  AT_AsyncCollect(Obj, limit);
+  AT_AsyncKick(Obj);
+}
+
+/* Wait for every queued command to complete */
+static void AT_AsyncFlush(ETMObject_t *Obj){
+  /* Inside a URC handler (ATE0 on APP RDY, the link negotiation on +ETM:IDLE) the caller being
+   * interrupted may itself be stepping the queue, so nothing more is sent from it. A command
+   * already on the wire is still answered before the handler sends its own. */
+  if(Obj->urcdepth > 0){
+    while(AT_AsyncInFlight(Obj))
+      AT_AsyncCollect(Obj, ETM_TOUT_300);
+    return;
+  }
+  while(Obj->cmdcount > 0){
+    AT_AsyncStep(Obj, ETM_TOUT_300);
+  }
+}
+
+/* Get the next free queue element, NULL if the queue is full. It is queued by AT_AsyncSubmit() */
+static struct etmcmd *AT_AsyncAlloc(ETMObject_t *Obj, tetmCmdKind kind, _cmdcb cb, void *ctx){
+  struct etmcmd *cmd;
+
+  if(Obj->cmdcount == ETM_ASYNC_QUEUE_SIZE){
+    ETM_DBG(("ETM command queue full\r\n"));
+    return NULL;
+  }
+  cmd = &Obj->cmdqueue[(Obj->cmdhead + Obj->cmdcount) % ETM_ASYNC_QUEUE_SIZE];
+  cmd->kind = kind;
+  cmd->tpcidx = -1;
+  cmd->qos = 0;
+  cmd->sent = false;
+  cmd->data = NULL;
+  cmd->datalen = 0;
+  cmd->cb = cb;
+  cmd->ctx = ctx;
+  cmd->seq = -1;
+  cmd->retries = 0;
+  cmd->pubcb = NULL;
+  cmd->cmd[0] = 0;
+  return cmd;
+}
+
+/* Queue a command from AT_AsyncAlloc() to be sent by the next ETMpoll() or command */
+static int AT_AsyncQueue(ETMObject_t *Obj, struct etmcmd *cmd){
+  int handle = Obj->cmdhandle;
+
+  Obj->cmdhandle = (Obj->cmdhandle + 1) & 0x7FFFFFFF;
+  cmd->handle = handle;
+  Obj->cmdcount++;
+  return handle;
+}
+
+/* Queue a command from AT_AsyncAlloc(), sending it now if nothing is in flight. From a URC
+ * handler or a callback while a blocking command awaits its answer it is only queued. */
+static int AT_AsyncSubmit(ETMObject_t *Obj, struct etmcmd *cmd){
+  int handle = AT_AsyncQueue(Obj, cmd);
+
+  if(Obj->urcdepth == 0 && Obj->syncdepth == 0)
+    AT_AsyncKick(Obj);
+  return handle;
+}
+
+/* Take the publish pos places from the oldest awaiting acknowledgement off, later ones move up */
+static void AT_InflightTake(ETMObject_t *Obj, uint8_t pos, struct etminflight *pub){
+  uint8_t x;
+
+  *pub = Obj->inflight[(Obj->inflighthead + pos) % ETM_INFLIGHT_SIZE];
+  for(x = pos; x + 1 < Obj->inflightcount; x++)
+    Obj->inflight[(Obj->inflighthead + x) % ETM_INFLIGHT_SIZE] = Obj->inflight[(Obj->inflighthead + x + 1) % ETM_INFLIGHT_SIZE];
+  Obj->inflightcount--;
+}
+
+/* Take a publish awaiting acknowledgement off and report its result */
+static void AT_InflightRetire(ETMObject_t *Obj, uint8_t pos, int32_t result){
+  struct etminflight pub;
+
+  /* The slot may be reused from the callback */
+  AT_InflightTake(Obj, pos, &pub);
+  if(pub.cb != NULL)
+    pub.cb(pub.ctx, pub.seq, result);
+}
+
+/* Whether the window is too full for another QoS 1 or 2 publish. Acknowledgements are matched by
+ * topic index, so none is pushed out to make room: its acknowledgement would be taken by the next
+ * publish to its topic. */
+static bool AT_InflightFull(ETMObject_t *Obj){
+  if(Obj->inflightcount < ETM_INFLIGHT_SIZE)
+    return false;
+  UARTDEBUGPRINTF("%d publishes awaiting acknowledgement\r\n", Obj->inflightcount);
+  return true;
+}
+
+/* Add a publish the ETM has accepted to those awaiting acknowledgement (seq < 0 for a new
+ * publish) and return its sequence id, -1 if the window is full (see AT_InflightFull()) */
+static int AT_InflightAdd(ETMObject_t *Obj, int seq, int8_t tpcidx, uint8_t qos, uint8_t *data, uint16_t datalen, uint8_t retries, _pubcb cb, void *ctx){
+  struct etminflight *pub;
+
+  if(AT_InflightFull(Obj))
+    return -1;
+  if(seq < 0){
+    seq = Obj->pubseq;
+    Obj->pubseq = (Obj->pubseq + 1) & 0x7FFFFFFF;
+  }
+  pub = &Obj->inflight[(Obj->inflighthead + Obj->inflightcount) % ETM_INFLIGHT_SIZE];
+  pub->seq = seq;
+  pub->tpcidx = tpcidx;
+  pub->qos = qos;
+  pub->retries = retries;
+  pub->expired = false;
+  pub->senttime = Obj->GetTickCb();
+  pub->data = data;
+  pub->datalen = datalen;
+  pub->cb = cb;
+  pub->ctx = ctx;
+  Obj->inflightcount++;
+  return seq;
+}
+
+/* SEND OK or SEND FAIL for the oldest publish to topic idx. A tracked publish which failed is
+ * queued to be sent again rather than sent from here, the URC may have arrived in the middle of
+ * a command. */
+static void AT_InflightAck(ETMObject_t *Obj, int idx, bool sent){
+  struct etminflight *pub, taken;
+  struct etmcmd *cmd;
+  uint8_t pos;
+
+  for(pos = 0; pos < Obj->inflightcount; pos++){
+    if(Obj->inflight[(Obj->inflighthead + pos) % ETM_INFLIGHT_SIZE].tpcidx == idx)
+      break;
+  }
+  if(pos == Obj->inflightcount){
+    UARTDEBUGPRINTF("Acknowledgement without a publish to %d\r\n", idx);
+    return;
+  }
+  pub = &Obj->inflight[(Obj->inflighthead + pos) % ETM_INFLIGHT_SIZE];
+  if(pub->expired){
+    /* Already reported, it only held the slot for this */
+    UARTDEBUGPRINTF("Publish %d acknowledged after it was given up on\r\n", pub->seq);
+    AT_InflightRetire(Obj, pos, ETM_RETURN_NO_DATA);
+    return;
+  }
+  if(sent || pub->cb == NULL || pub->retries >= ETM_INFLIGHT_RETRIES){
+    AT_InflightRetire(Obj, pos, sent ? RET_SENDOK : RET_SENDFAIL);
+    return;
+  }
+  cmd = AT_AsyncAlloc(Obj, ETM_CMD_REPUBLISH, NULL, pub->ctx);
+  if(cmd == NULL){
+    AT_InflightRetire(Obj, pos, RET_SENDFAIL);
+    return;
+  }
+  UARTDEBUGPRINTF("Publish %d failed, sending again\r\n", pub->seq);
+  cmd->tpcidx = pub->tpcidx;
+  cmd->qos = pub->qos;
+  cmd->data = pub->data;
+  cmd->datalen = pub->datalen;
+  cmd->seq = pub->seq;
+  cmd->retries = pub->retries + 1;
+  cmd->pubcb = pub->cb;
+  /* It is awaiting the ETM again, not an acknowledgement */
+  AT_InflightTake(Obj, pos, &taken);
+  AT_AsyncQueue(Obj, cmd);
+}
+
+/* Give up on publishes which have waited too long for their acknowledgement. Each keeps its slot
+ * for as long again, so an acknowledgement which does come is taken by it and not by the next
+ * publish to its topic. */
+static void AT_InflightExpire(ETMObject_t *Obj){
+  struct etminflight *pub;
+  _pubcb cb;
+  void *ctx;
+  int seq;
+  uint8_t pos = 0;
+
+  while(pos < Obj->inflightcount){
+    pub = &Obj->inflight[(Obj->inflighthead + pos) % ETM_INFLIGHT_SIZE];
+    if(TimeLeftFromExpiration(pub->senttime, Obj->GetTickCb(), ETM_INFLIGHT_TIMEOUT) > 0){
+      pos++;
+    }else if(pub->expired){
+      AT_InflightRetire(Obj, pos, ETM_RETURN_NO_DATA);
+    }else{
+      UARTDEBUGPRINTF("Publish %d not acknowledged\r\n", pub->seq);
+      cb = pub->cb;
+      ctx = pub->ctx;
+      seq = pub->seq;
+      pub->expired = true;
+      pub->cb = NULL;
+      pub->data = NULL;
+      pub->senttime = Obj->GetTickCb();
+      pos++;
+      if(cb != NULL)
+        cb(ctx, seq, ETM_RETURN_NO_DATA);
+    }
+  }
+}
+
 #ifdef removed
 static int32_t AT_Synchro(ETMObject_t *Obj){
   int32_t ret = ETM_RETURN_SEND_ERROR;
@@ -227,6 +650,145 @@ static int32_t AT_Synchro(ETMObject_t *Obj){
 }
 #endif
 
+/* Rates AT+IPR is asked for, highest first */
+static const uint32_t AT_LinkRates[] = {921600, 460800, 230400};
+
+static uint16_t AT_LineErrors(ETMObject_t *Obj){
+  return (Obj->fops.IO_LineErrors != NULL) ? Obj->fops.IO_LineErrors() : 0;
+}
+
+/* Link control command, sent straight away rather than behind queued commands */
+static int32_t AT_LinkCommand(ETMObject_t *Obj, const char *cmd){
+  ETM_DBG_AT(("AT Request: %s\r\n", cmd));
+  if(Obj->fops.IO_Send((uint8_t *)cmd, strlen(cmd)) < 0)
+    return ETM_RETURN_SEND_ERROR;
+  return AT_RetrieveData(Obj, Obj->CmdResp, ETM_CMD_SIZE, RET_OK | RET_ERROR, ETM_TOUT_300);
+}
+
+/* With the UART at rate, whether the ETM answers AT (clean: three times without line errors) */
+static bool AT_LinkProbe(ETMObject_t *Obj, uint32_t rate, bool clean){
+  int tries;
+
+  if(rate != Obj->UART_Config.BaudRate){
+    if(Obj->fops.IO_Baudrate(rate) != 0)
+      return false;
+    Obj->UART_Config.BaudRate = rate;
+  }
+  for(tries = 0; tries < 3; tries++){
+    Obj->fops.IO_FlushBuffer();
+    AT_LineErrors(Obj);
+    if(AT_LinkCommand(Obj, "AT\r\n") == RET_OK && (!clean || AT_LineErrors(Obj) == 0)){
+      if(!clean)
+        return true;
+    }else if(clean){
+      return false;
+    }
+  }
+  return clean;
+}
+
+/* Move the link to rate. The ETM answers AT+IPR at the old rate and then changes, if the link
+ * isn't clean at the new one it is asked to change back. The answer may be lost on a noisy line
+ * so anything but ERROR is taken as a change. Returns 1 if the link moved, 0 if it stayed at
+ * the old rate or -1 if the ETM can't be heard at either. */
+static int AT_LinkSetRate(ETMObject_t *Obj, uint32_t rate){
+  uint32_t old = Obj->UART_Config.BaudRate;
+  ETM_CmdBuf_t cmd;
+
+  ETMcmdStart(&cmd, Obj->CmdString, ETM_CMD_SIZE);
+  ETMcmdLiteral(&cmd, "AT+IPR=");
+  ETMcmdUnsigned(&cmd, rate);
+  ETMcmdLiteral(&cmd, "\r\n");
+  ETMcmdEnd(&cmd);
+  if(AT_LinkCommand(Obj, Obj->CmdString) == RET_ERROR)
+    return 0;
+  if(AT_LinkProbe(Obj, rate, true)){
+    UARTDEBUGPRINTF("Link at %lu baud\r\n", (unsigned long)rate);
+    return 1;
+  }
+  UARTDEBUGPRINTF("Link not clean at %lu baud\r\n", (unsigned long)rate);
+  ETMcmdStart(&cmd, Obj->CmdString, ETM_CMD_SIZE);
+  ETMcmdLiteral(&cmd, "AT+IPR=");
+  ETMcmdUnsigned(&cmd, old);
+  ETMcmdLiteral(&cmd, "\r\n");
+  ETMcmdEnd(&cmd);
+  AT_LinkCommand(Obj, Obj->CmdString);
+  if(AT_LinkProbe(Obj, old, false))
+    return 0;
+  /* It didn't hear the second AT+IPR, line errors will bring the rate down again */
+  if(AT_LinkProbe(Obj, rate, false))
+    return 1;
+  UARTDEBUGPRINTF("Link lost\r\n");
+  return -1;
+}
+
+/* Turn on flow control and move to the highest rate both ends manage, up to baudlimit. A port
+ * without link control can't see line errors so it stays at the default rate. */
+static void AT_LinkNegotiate(ETMObject_t *Obj){
+  unsigned x;
+
+  if(Obj->fops.IO_LineErrors == NULL)
+    return;
+#if ETM_FLOW_CONTROL
+  /* The host end first, so it is known to be available before the ETM is changed */
+  if(!Obj->UART_Config.FlowControl && Obj->fops.IO_FlowControl != NULL && Obj->fops.IO_FlowControl(1) == 0){
+    if(AT_LinkCommand(Obj, "AT+IFC=2,2\r\n") == RET_OK)
+      Obj->UART_Config.FlowControl = 1;
+    else
+      Obj->fops.IO_FlowControl(0);
+  }
+#endif
+  for(x = 0; x < sizeof(AT_LinkRates) / sizeof(AT_LinkRates[0]); x++){
+    if(AT_LinkRates[x] > Obj->baudlimit || AT_LinkRates[x] <= Obj->UART_Config.BaudRate)
+      continue;
+    if(AT_LinkSetRate(Obj, AT_LinkRates[x]) != 0)
+      break;
+  }
+}
+
+/* Back to the ETM's power on settings, for when it restarts */
+static void AT_LinkReset(ETMObject_t *Obj){
+  if(Obj->UART_Config.FlowControl && Obj->fops.IO_FlowControl != NULL)
+    Obj->fops.IO_FlowControl(0);
+  Obj->UART_Config.FlowControl = 0;
+  if(Obj->UART_Config.BaudRate != ETM_DEFAULT_BAUDRATE && Obj->fops.IO_Baudrate(ETM_DEFAULT_BAUDRATE) == 0)
+    Obj->UART_Config.BaudRate = ETM_DEFAULT_BAUDRATE;
+}
+
+/* Drop the link to a lower rate when line errors appear, or back to the default rate if the ETM
+ * has restarted (its APP RDY is lost at the higher rate) */
+static void AT_LinkCheck(ETMObject_t *Obj){
+  uint16_t errors;
+  uint32_t rate = Obj->UART_Config.BaudRate;
+  unsigned x;
+
+  if(Obj->fops.IO_LineErrors == NULL || rate == ETM_DEFAULT_BAUDRATE)
+    return;
+  errors = Obj->fops.IO_LineErrors();
+  if(errors < ETM_LINE_ERRORS_MAX)
+    return;
+  UARTDEBUGPRINTF("%u line errors at %lu baud\r\n", errors, (unsigned long)rate);
+  if(AT_LinkProbe(Obj, rate, false)){
+    /* The ETM is there, the line isn't clean enough at this rate */
+    Obj->baudlimit = ETM_DEFAULT_BAUDRATE;
+    for(x = 0; x < sizeof(AT_LinkRates) / sizeof(AT_LinkRates[0]); x++){
+      if(AT_LinkRates[x] < rate){
+        Obj->baudlimit = AT_LinkRates[x];
+        break;
+      }
+    }
+    AT_LinkSetRate(Obj, Obj->baudlimit);
+    return;
+  }
+  AT_LinkReset(Obj);
+  if(!AT_LinkProbe(Obj, ETM_DEFAULT_BAUDRATE, false)){
+    UARTDEBUGPRINTF("Link lost\r\n");
+    return;
+  }
+  ETMProcessReceived(Obj, RET_APPRDY);
+  AT_LinkNegotiate(Obj);
+}
+
 /* --------------------------------------------------------------------------*/
 /* --- Public functions -----------------------------------------------------*/
 /* --------------------------------------------------------------------------*/
@@ -252,6 +814,86 @@ ETM_Return_t  ETM_RegisterBusIO(ETMObject_t *Obj, IO_Init_Func        IO_Init,
   return ETM_RETURN_OK;
 }
 
+ETM_Return_t  ETM_RegisterBusPeekIO(ETMObject_t *Obj, IO_Peek_Func IO_Peek, IO_Consume_Func IO_Consume){
+  if(!Obj || !IO_Peek || !IO_Consume){
+    return ETM_RETURN_ERROR;
+  }
+
+  Obj->fops.IO_Peek = IO_Peek;
+  Obj->fops.IO_Consume = IO_Consume;
+
+  return ETM_RETURN_OK;
+}
+
+ETM_Return_t  ETM_RegisterBusWaitIO(ETMObject_t *Obj, IO_Wait_Func IO_Wait, IO_Wake_Func IO_Wake){
+  if(!Obj || !IO_Wait){
+    return ETM_RETURN_ERROR;
+  }
+
+  Obj->fops.IO_Wait = IO_Wait;
+  Obj->fops.IO_Wake = IO_Wake;
+
+  return ETM_RETURN_OK;
+}
+
+ETM_Return_t  ETM_RegisterBusLinkIO(ETMObject_t *Obj, IO_FlowControl_Func IO_FlowControl, IO_LineErrors_Func IO_LineErrors){
+  if(!Obj || !IO_FlowControl || !IO_LineErrors){
+    return ETM_RETURN_ERROR;
+  }
+
+  Obj->fops.IO_FlowControl = IO_FlowControl;
+  Obj->fops.IO_LineErrors = IO_LineErrors;
+
+  return ETM_RETURN_OK;
+}
+
+ETM_Return_t  ETM_RegisterBusStatsIO(ETMObject_t *Obj, IO_RxStats_Func IO_RxStats){
+  if(!Obj || !IO_RxStats){
+    return ETM_RETURN_ERROR;
+  }
+
+  Obj->fops.IO_RxStats = IO_RxStats;
+
+  return ETM_RETURN_OK;
+}
+
+ETM_Return_t  ETM_GetRxStats(ETMObject_t *Obj, ETM_RxStats_t *Stats){
+  if(!Obj || !Stats || !Obj->fops.IO_RxStats){
+    return ETM_RETURN_ERROR;
+  }
+
+  Obj->fops.IO_RxStats(Stats);
+
+  return ETM_RETURN_OK;
+}
+
+int32_t ETM_MatchScan(const uint8_t *pData, uint32_t Length){
+  uint8_t state = 0;
+  uint32_t hits;
+  int32_t found = 0;
+
+  if(!MatchBuilt)
+    return -1;
+  while(Length-- > 0){
+    state = MatchDelta[state][MatchClass[*pData++]];
+    for(hits = MatchOut[state]; hits != 0; hits &= hits - 1)
+      found++;
+  }
+
+  return found;
+}
+
+ETM_Return_t ETM_RegisterTopicTables(ETMObject_t *Obj, const ETM_TopicTables_t *tables){
+  if(!Obj || !tables || tables->subcount == 0 || tables->subcount > ETM_MAX_TOPICS ||
+     tables->pubcount == 0 || tables->pubcount > ETM_MAX_TOPICS){
+    return ETM_RETURN_ERROR;
+  }
+
+  Obj->topics = *tables;
+
+  return ETM_RETURN_OK;
+}
+
 ETM_Return_t ETM_RegisterTickCb(ETMObject_t *Obj, App_GetTickCb_Func GetTickCb){
   if(!Obj || !GetTickCb){
     return ETM_RETURN_ERROR;
@@ -266,9 +908,20 @@ ETM_InitRet_t ETM_Init(ETMObject_t *Obj, _atcb urccallback){
   ETM_InitRet_t fret = ETM_INIT_OTHER_ERR;
 //  int32_t ret = RET_ERROR;
   uint32_t tickstart;
+  bool built;
 
   ETM_DBG(("ETM init\r\n"));
 
+  /* Several ETMs may start at once, build the shared matcher tables without interruption */
+  vTaskSuspendAll();
+  built = AT_MatchBuild();
+  xTaskResumeAll();
+  if(!built){
+    ETM_DBG(("Response keywords need more than %d matcher states or %d classes\r\n",
+             ETM_MATCH_MAX_STATES, ETM_MATCH_MAX_CLASSES));
+    return fret;
+  }
+
   Obj->fops.IO_FlushBuffer();  /* Flush Uart intermediate buffer */
 
   if (Obj->fops.IO_Init() == 0) /* configure and initialize UART */
@@ -280,15 +933,37 @@ ETM_InitRet_t ETM_Init(ETMObject_t *Obj, _atcb urccallback){
 //      fret = ETM_INIT_RET_AT_ERR; /* if does not respond to AT command set specific return status */
 //    }else{
 
-      int i;
-      for(i = 0; i < MAX_SUB_TOPICS; i++){
-        Obj->subtopics[i].messagecb = NULL;
-        Obj->subtopics[i].substate = SUB_TOPIC_NOT_IN_USE;
-      }
-      for(i = 0; i < MAX_PUB_TOPICS; i++){
-        Obj->pubtopics[i].pubstate = PUB_TOPIC_NOT_IN_USE;
+      if(Obj->topics.subcount == 0){
+        Obj->topics.subcount = MAX_SUB_TOPICS;
+        Obj->topics.pubcount = MAX_PUB_TOPICS;
+        Obj->topics.arenasize = ETM_TOPIC_ARENA_SIZE;
+        Obj->topics.substate = Obj->deftopics.substate;
+        Obj->topics.subtopics = Obj->deftopics.subtopics;
+        Obj->topics.pubstate = Obj->deftopics.pubstate;
+        Obj->topics.pubtopics = Obj->deftopics.pubtopics;
+#ifdef TIMEOUT_RESPONSES
+        Obj->topics.pubsenttime = Obj->deftopics.pubsenttime;
+#endif
+        Obj->topics.topichash = Obj->deftopics.topichash;
+        Obj->topics.topicarena = Obj->deftopics.topicarena;
       }
+      Obj->topichashmask = ETM_TOPIC_HASH_ENTRIES(Obj->topics.pubcount) - 1;
+      memset(Obj->topics.substate, SUB_TOPIC_NOT_IN_USE, Obj->topics.subcount);
+      memset(Obj->topics.subtopics, 0, Obj->topics.subcount * sizeof(struct subtpc));
+      memset(Obj->topics.pubstate, PUB_TOPIC_NOT_IN_USE, Obj->topics.pubcount);
+      memset(Obj->topics.pubtopics, 0, Obj->topics.pubcount * sizeof(struct pubtpc));
+      memset(Obj->topics.topichash, 0, Obj->topichashmask + 1);
+      Obj->topicarenalen = 0;
       Obj->fixedsubcb = NULL;
+      Obj->fixedsubchunkcb = NULL;
+      Obj->cmdhead = 0;
+      Obj->cmdcount = 0;
+      Obj->cmdhandle = 0;
+      Obj->inflighthead = 0;
+      Obj->inflightcount = 0;
+      Obj->pubseq = 0;
+      Obj->persistScanVals = 0;
+      Obj->pollwake = false;
 
       Obj->atcallback = urccallback;
       Obj->binaryread = 0;
@@ -298,6 +973,10 @@ ETM_InitRet_t ETM_Init(ETMObject_t *Obj, _atcb urccallback){
       Obj->currentstate = ETM_UNKNOWN;
       Obj->statecallback = NULL;
       Obj->fwupdcb = NULL;
+      /* IO_Init() starts the UART at the ETM's power on settings */
+      Obj->UART_Config.BaudRate = ETM_DEFAULT_BAUDRATE;
+      Obj->UART_Config.FlowControl = 0;
+      Obj->baudlimit = ETM_BAUDRATE_MAX;
     
 //    }
 
@@ -320,6 +999,30 @@ ETM_InitRet_t ETM_Init(ETMObject_t *Obj, _atcb urccallback){
   return fret;
 }
 
+/* Build AT+EMQSUBOPEN/AT+EMQPUBOPEN=<idx>,"<topic>", returns the length or -1 if it doesn't fit */
+static int AT_BuildOpen(char *buf, uint16_t size, const char *cmdname, int idx, const char *topic){
+  ETM_CmdBuf_t cmd;
+
+  ETMcmdStart(&cmd, buf, size);
+  ETMcmdLiteral(&cmd, cmdname);
+  ETMcmdUnsigned(&cmd, idx);
+  ETMcmdLiteral(&cmd, ",");
+  ETMcmdQuoted(&cmd, topic);
+  ETMcmdLiteral(&cmd, "\r\n");
+  return ETMcmdEnd(&cmd);
+}
+
+/* Build AT+EMQSUBCLOSE/AT+EMQPUBCLOSE=<idx> */
+static int AT_BuildClose(char *buf, uint16_t size, const char *cmdname, int idx){
+  ETM_CmdBuf_t cmd;
+
+  ETMcmdStart(&cmd, buf, size);
+  ETMcmdLiteral(&cmd, cmdname);
+  ETMcmdUnsigned(&cmd, idx);
+  ETMcmdLiteral(&cmd, "\r\n");
+  return ETMcmdEnd(&cmd);
+}
+
 /* Subscribe topic API */
 
 /* Pass a fixed subscription callback function pointer */
@@ -327,35 +1030,89 @@ void ETMfixedsubsetcallback(ETMObject_t *Obj, _msgcb callback){
     Obj->fixedsubcb = callback;
 }
 
-/* Subscribe to a topic using the first available topic index */
-int ETMsubscribe(ETMObject_t *Obj, char *topic, _msgcb callback){
+/* Pass a fixed subscription chunked callback function pointer (used in preference to the whole
+ * message callback) */
+void ETMfixedsubsetchunkcallback(ETMObject_t *Obj, _msgchunkcb callback, void *ctx){
+    Obj->fixedsubchunkctx = ctx;
+    Obj->fixedsubchunkcb = callback;
+}
+
+/* Find the first available subscription topic index */
+static int ETMsubslot(ETMObject_t *Obj){
   int topiccount = 0;
+  while(topiccount < Obj->topics.subcount && Obj->topics.substate[topiccount] != SUB_TOPIC_NOT_IN_USE && Obj->topics.substate[topiccount] != SUB_TOPIC_ERROR){
+    topiccount++;
+  }
+  if(topiccount == Obj->topics.subcount)
+    return -1;
+  return topiccount;
+}
+
+/* Subscribe to a topic using the first available topic index */
+static int ETMsubopen(ETMObject_t *Obj, char *topic, _msgcb callback, _msgchunkcb chunkcb, void *ctx){
+  int topiccount;
   uint32_t ret;
 #ifdef TIMEOUT_RESPONSES
   ETMcheckTimeout(Obj);
 #endif
-  while(Obj->subtopics[topiccount].substate != SUB_TOPIC_NOT_IN_USE && Obj->subtopics[topiccount].substate != SUB_TOPIC_ERROR && topiccount < MAX_SUB_TOPICS){
-    topiccount++;
-  }
-  if(topiccount == MAX_SUB_TOPICS)
+  topiccount = ETMsubslot(Obj);
+  if(topiccount < 0)
+    return -1;
+  if(AT_BuildOpen(Obj->CmdString, ETM_CMD_SIZE, "AT+EMQSUBOPEN=", topiccount, topic) < 0)
     return -1;
   UARTDEBUGPRINTF("Subscribe to %s\r\n", topic);
-  
-  sprintf(CmdString, "AT+EMQSUBOPEN=%d,\"%s\"\r\n", topiccount, topic);
-  ret = AT_ExecuteCommand(Obj, ETM_TOUT_300, (uint8_t *)CmdString, RET_OK | RET_ERROR);
+
+  ret = AT_ExecuteCommand(Obj, ETM_TOUT_300, (uint8_t *)Obj->CmdString, RET_OK | RET_ERROR);
   if(ret == RET_OK){
-    Obj->subtopics[topiccount].substate = SUB_TOPIC_SUBSCRIBING;
-    Obj->subtopics[topiccount].messagecb = callback;
+    Obj->topics.substate[topiccount] = SUB_TOPIC_SUBSCRIBING;
+    Obj->topics.subtopics[topiccount].messagecb = callback;
+    Obj->topics.subtopics[topiccount].chunkcb = chunkcb;
+    Obj->topics.subtopics[topiccount].chunkctx = ctx;
   }
   return topiccount;
 }
 
+int ETMsubscribe(ETMObject_t *Obj, char *topic, _msgcb callback){
+  return ETMsubopen(Obj, topic, callback, NULL, NULL);
+}
+
+/* Subscribe to a topic with messages delivered in chunks of up to ETM_CMD_SIZE / 2 octets, so
+ * messages of any size can be received */
+int ETMsubscribeChunked(ETMObject_t *Obj, char *topic, _msgchunkcb callback, void *ctx){
+  return ETMsubopen(Obj, topic, NULL, callback, ctx);
+}
+
+/* Queue a subscription, the topic index is reserved straight away */
+int ETMsubscribeAsync(ETMObject_t *Obj, char *topic, _msgcb callback, int *tpcidx, _cmdcb donecb, void *ctx){
+  struct etmcmd *cmd;
+  int topiccount;
+#ifdef TIMEOUT_RESPONSES
+  ETMcheckTimeout(Obj);
+#endif
+  topiccount = ETMsubslot(Obj);
+  if(topiccount < 0)
+    return -1;
+  cmd = AT_AsyncAlloc(Obj, ETM_CMD_SUBOPEN, donecb, ctx);
+  if(cmd == NULL)
+    return -1;
+  if(AT_BuildOpen(cmd->cmd, ETM_ASYNC_CMD_SIZE, "AT+EMQSUBOPEN=", topiccount, topic) < 0)
+    return -1;
+  UARTDEBUGPRINTF("Subscribe to %s\r\n", topic);
+  cmd->tpcidx = topiccount;
+  Obj->topics.substate[topiccount] = SUB_TOPIC_SUBSCRIBING;
+  Obj->topics.subtopics[topiccount].messagecb = callback;
+  Obj->topics.subtopics[topiccount].chunkcb = NULL;
+  if(tpcidx != NULL)
+    *tpcidx = topiccount;
+  return AT_AsyncSubmit(Obj, cmd);
+}
+
 /* Have we successfully subscribed */
 tsubTopicState ETMsubstate(ETMObject_t *Obj, int idx){
 #ifdef TIMEOUT_RESPONSES
   ETMcheckTimeout(Obj);
 #endif
-  return Obj->subtopics[idx].substate;
+  return (tsubTopicState)Obj->topics.substate[idx];
 }
 
 /* Unsubscribe from a topic index */
@@ -364,13 +1121,13 @@ int ETMunsubscribe(ETMObject_t *Obj, int idx){
 #ifdef TIMEOUT_RESPONSES
   ETMcheckTimeout(Obj);
 #endif
-  if(idx >= MAX_SUB_TOPICS)
+  if(idx >= Obj->topics.subcount)
     return -1;
-  if(Obj->subtopics[idx].substate == SUB_TOPIC_SUBSCRIBED){
-    sprintf(CmdString, "AT+EMQSUBCLOSE=%d\r\n", idx);
-    ret = AT_ExecuteCommand(Obj, ETM_TOUT_300, (uint8_t *)CmdString, RET_OK | RET_ERROR);
+  if(Obj->topics.substate[idx] == SUB_TOPIC_SUBSCRIBED){
+    AT_BuildClose(Obj->CmdString, ETM_CMD_SIZE, "AT+EMQSUBCLOSE=", idx);
+    ret = AT_ExecuteCommand(Obj, ETM_TOUT_300, (uint8_t *)Obj->CmdString, RET_OK | RET_ERROR);
     if(ret == RET_OK){
-      Obj->subtopics[idx].substate = SUB_TOPIC_UNSUBSCRIBING;
+      Obj->topics.substate[idx] = SUB_TOPIC_UNSUBSCRIBING;
     }  
     return 0;
   }
@@ -383,37 +1140,209 @@ int ETMunsubscribe(ETMObject_t *Obj, int idx){
 #define TOPIC_REGISTERING    1
 #define TOPIC_REGISTERED     2
 
+/* Publish topic names. Names are appended to topicarena and found through topichash, a
+ * linear probed table of topic index + 1. Removed names leave a tombstone in the table and
+ * their arena space is reclaimed when the arena next fills. */
+#define TOPIC_HASH_EMPTY     0
+#define TOPIC_HASH_REMOVED   0xff
+
+/* FNV-1a */
+static uint32_t ETMTopicHash(const char *name, uint16_t len){
+  uint32_t hash = 2166136261UL;
+  while(len-- > 0){
+    hash ^= (uint8_t)*name++;
+    hash *= 16777619UL;
+  }
+  return hash;
+}
+
+/* Publish topic index holding name, -1 if none */
+static int ETMTopicFind(ETMObject_t *Obj, const char *name){
+  uint16_t len = strlen(name);
+  uint32_t h = ETMTopicHash(name, len);
+  uint8_t entry;
+  int probe;
+  struct pubtpc *tpc;
+
+  for(probe = 0; probe <= Obj->topichashmask; probe++, h++){
+    entry = Obj->topics.topichash[h & Obj->topichashmask];
+    if(entry == TOPIC_HASH_EMPTY)
+      break;
+    if(entry == TOPIC_HASH_REMOVED)
+      continue;
+    tpc = &Obj->topics.pubtopics[entry - 1];
+    if(tpc->namelen == len && memcmp(&Obj->topics.topicarena[tpc->nameoff], name, len) == 0)
+      return entry - 1;
+  }
+  return -1;
+}
+
+static void ETMTopicIndex(ETMObject_t *Obj, int idx){
+  struct pubtpc *tpc = &Obj->topics.pubtopics[idx];
+  uint32_t h = ETMTopicHash(&Obj->topics.topicarena[tpc->nameoff], tpc->namelen);
+  uint8_t *entry;
+
+  for(;; h++){
+    entry = &Obj->topics.topichash[h & Obj->topichashmask];
+    if(*entry == TOPIC_HASH_EMPTY || *entry == TOPIC_HASH_REMOVED){
+      *entry = idx + 1;
+      return;
+    }
+  }
+}
+
+/* Close the gaps left by removed names and rebuild the index without tombstones */
+static void ETMTopicCompact(ETMObject_t *Obj){
+  uint16_t used = 0, lowest;
+  int x, next;
+
+  /* Names are moved down in arena order so none is overwritten before it is moved */
+  for(;;){
+    next = -1;
+    lowest = 0xffff;
+    for(x = 0; x < Obj->topics.pubcount; x++){
+      if(Obj->topics.pubtopics[x].namelen != 0 && Obj->topics.pubtopics[x].nameoff >= used && Obj->topics.pubtopics[x].nameoff < lowest){
+        lowest = Obj->topics.pubtopics[x].nameoff;
+        next = x;
+      }
+    }
+    if(next < 0)
+      break;
+    memmove(&Obj->topics.topicarena[used], &Obj->topics.topicarena[lowest], Obj->topics.pubtopics[next].namelen);
+    Obj->topics.pubtopics[next].nameoff = used;
+    used += Obj->topics.pubtopics[next].namelen;
+  }
+  Obj->topicarenalen = used;
+  memset(Obj->topics.topichash, TOPIC_HASH_EMPTY, Obj->topichashmask + 1);
+  for(x = 0; x < Obj->topics.pubcount; x++){
+    if(Obj->topics.pubtopics[x].namelen != 0)
+      ETMTopicIndex(Obj, x);
+  }
+}
+
+/* Record the name of a publish topic index, false if there is no room for it */
+static bool ETMTopicAdd(ETMObject_t *Obj, int idx, const char *name){
+  size_t len = strlen(name);
+
+  if(len == 0 || len > 0xff)
+    return false;
+  if(Obj->topicarenalen + len > Obj->topics.arenasize)
+    ETMTopicCompact(Obj);
+  if(Obj->topicarenalen + len > Obj->topics.arenasize)
+    return false;
+  memcpy(&Obj->topics.topicarena[Obj->topicarenalen], name, len);
+  Obj->topics.pubtopics[idx].nameoff = Obj->topicarenalen;
+  Obj->topics.pubtopics[idx].namelen = len;
+  Obj->topicarenalen += len;
+  ETMTopicIndex(Obj, idx);
+  return true;
+}
+
+/* Forget the name of a publish topic index */
+static void ETMTopicRemove(ETMObject_t *Obj, int idx){
+  int x;
+
+  if(Obj->topics.pubtopics[idx].namelen == 0)
+    return;
+  for(x = 0; x <= Obj->topichashmask; x++){
+    if(Obj->topics.topichash[x] == idx + 1)
+      Obj->topics.topichash[x] = TOPIC_HASH_REMOVED;
+  }
+  Obj->topics.pubtopics[idx].namelen = 0;
+}
+
+/* Find the first available publish topic index. Indices still holding the name of a topic lost
+ * to an ETM restart are kept for ETMpublishTopic() until there are no others. */
+static int ETMpubslot(ETMObject_t *Obj){
+  int topiccount, named = -1;
+
+  for(topiccount = 0; topiccount < Obj->topics.pubcount; topiccount++){
+    if(Obj->topics.pubstate[topiccount] != PUB_TOPIC_NOT_IN_USE && Obj->topics.pubstate[topiccount] != PUB_TOPIC_ERROR)
+      continue;
+    if(Obj->topics.pubtopics[topiccount].namelen == 0)
+      return topiccount;
+    if(named < 0)
+      named = topiccount;
+  }
+  if(named >= 0)
+    ETMTopicRemove(Obj, named);
+  return named;
+}
+
+/* Index for a publish topic registration: the index already holding the name unless it is
+ * being unregistered, otherwise a free one */
+static int ETMpubindex(ETMObject_t *Obj, const char *topic){
+  int idx = ETMTopicFind(Obj, topic);
+
+  if(idx >= 0 && Obj->topics.pubstate[idx] != PUB_TOPIC_UNREGISTERING)
+    return idx;
+  return ETMpubslot(Obj);
+}
+
 /* Register a publish topic */
 int ETMpubreg(ETMObject_t *Obj, char *topic){
   uint32_t ret;
-  int topiccount = 0;
+  int topiccount;
 #ifdef TIMEOUT_RESPONSES
   ETMcheckTimeout(Obj);
 #endif
-  while(Obj->pubtopics[topiccount].pubstate != PUB_TOPIC_NOT_IN_USE && Obj->pubtopics[topiccount].pubstate != PUB_TOPIC_ERROR && topiccount < MAX_PUB_TOPICS){
-    topiccount++;
-  }
-  if(topiccount == MAX_PUB_TOPICS)
+  topiccount = ETMpubindex(Obj, topic);
+  if(topiccount < 0)
+    return -1;
+  if(Obj->topics.pubstate[topiccount] == PUB_TOPIC_REGISTERED || Obj->topics.pubstate[topiccount] == PUB_TOPIC_REGISTERING)
+    return topiccount;
+  if(AT_BuildOpen(Obj->CmdString, ETM_CMD_SIZE, "AT+EMQPUBOPEN=", topiccount, topic) < 0)
     return -1;
-  sprintf(CmdString, "AT+EMQPUBOPEN=%d,\"%s\"\r\n", topiccount, topic);
-  ret = AT_ExecuteCommand(Obj, ETM_TOUT_300, (uint8_t *)CmdString, RET_OK | RET_ERROR);
+  ret = AT_ExecuteCommand(Obj, ETM_TOUT_300, (uint8_t *)Obj->CmdString, RET_OK | RET_ERROR);
   if(ret == RET_OK){
     UARTDEBUGPRINTF("Pubreg %s\r\n", topic);
 
-    Obj->pubtopics[topiccount].pubstate = PUB_TOPIC_REGISTERING;
+    if(Obj->topics.pubtopics[topiccount].namelen == 0 && !ETMTopicAdd(Obj, topiccount, topic))
+      UARTDEBUGPRINTF("No room for topic name %s (arena %d octets)\r\n", topic, Obj->topics.arenasize);
+    Obj->topics.pubstate[topiccount] = PUB_TOPIC_REGISTERING;
 #ifdef TIMEOUT_RESPONSES
-    Obj->pubtopics[topiccount].senttime = Obj->GetTickCb();
+    Obj->topics.pubsenttime[topiccount] = Obj->GetTickCb();
 #endif
   }
   return topiccount;
 }
 
+/* Queue a publish topic registration, the topic index is reserved straight away */
+int ETMpubregAsync(ETMObject_t *Obj, char *topic, int *tpcidx, _cmdcb donecb, void *ctx){
+  struct etmcmd *cmd;
+  int topiccount;
+#ifdef TIMEOUT_RESPONSES
+  ETMcheckTimeout(Obj);
+#endif
+  /* A name already registered is opened again at its index, the ETM answers that it is
+   * already registered which completes the command */
+  topiccount = ETMpubindex(Obj, topic);
+  if(topiccount < 0)
+    return -1;
+  cmd = AT_AsyncAlloc(Obj, ETM_CMD_PUBOPEN, donecb, ctx);
+  if(cmd == NULL)
+    return -1;
+  if(AT_BuildOpen(cmd->cmd, ETM_ASYNC_CMD_SIZE, "AT+EMQPUBOPEN=", topiccount, topic) < 0)
+    return -1;
+  if(Obj->topics.pubtopics[topiccount].namelen == 0 && !ETMTopicAdd(Obj, topiccount, topic))
+    UARTDEBUGPRINTF("No room for topic name %s (arena %d octets)\r\n", topic, Obj->topics.arenasize);
+  UARTDEBUGPRINTF("Pubreg %s\r\n", topic);
+  cmd->tpcidx = topiccount;
+  Obj->topics.pubstate[topiccount] = PUB_TOPIC_REGISTERING;
+#ifdef TIMEOUT_RESPONSES
+  Obj->topics.pubsenttime[topiccount] = Obj->GetTickCb();
+#endif
+  if(tpcidx != NULL)
+    *tpcidx = topiccount;
+  return AT_AsyncSubmit(Obj, cmd);
+}
+
 /* Check if publish topic is registered */
 tpubTopicState ETMpubstate(ETMObject_t *Obj, int idx){
 #ifdef TIMEOUT_RESPONSES
   ETMcheckTimeout(Obj);
 #endif
-  return Obj->pubtopics[idx].pubstate;
+  return (tpubTopicState)Obj->topics.pubstate[idx];
 }
 
 /* Unregister a publish topic */
@@ -422,15 +1351,16 @@ int ETMpubunreg(ETMObject_t *Obj, int idx){
 #ifdef TIMEOUT_RESPONSES
   ETMcheckTimeout(Obj);
 #endif
-  if(idx >= MAX_PUB_TOPICS)
+  if(idx >= Obj->topics.pubcount)
     return -1;
-  if(Obj->pubtopics[idx].pubstate == PUB_TOPIC_REGISTERED){
-    sprintf(CmdString, "AT+EMQPUBCLOSE=%d\r\n", idx);
-    ret = AT_ExecuteCommand(Obj, ETM_TOUT_300, (uint8_t *)CmdString, RET_OK | RET_ERROR);
+  if(Obj->topics.pubstate[idx] == PUB_TOPIC_REGISTERED){
+    AT_BuildClose(Obj->CmdString, ETM_CMD_SIZE, "AT+EMQPUBCLOSE=", idx);
+    ret = AT_ExecuteCommand(Obj, ETM_TOUT_300, (uint8_t *)Obj->CmdString, RET_OK | RET_ERROR);
     if(ret == RET_OK){
-      Obj->pubtopics[idx].pubstate = PUB_TOPIC_UNREGISTERING; 
+      ETMTopicRemove(Obj, idx);
+      Obj->topics.pubstate[idx] = PUB_TOPIC_UNREGISTERING; 
 #ifdef TIMEOUT_RESPONSES
-      Obj->pubtopics[idx].senttime = Obj->GetTickCb();
+      Obj->topics.pubsenttime[idx] = Obj->GetTickCb();
 #endif
     }
     return 0;
@@ -438,85 +1368,271 @@ int ETMpubunreg(ETMObject_t *Obj, int idx){
   return -1;
 }
 
-/* Given an octet convert it to a two-character string ascii-hex representation */
-static void octettohex(uint8_t octet, char *dest){
-    uint8_t nibble = (octet >> 4) & 0x0f;
-    if(nibble < 10)
-        dest[0] = '0' + nibble;
-    else
-        dest[0] = 'A' + (nibble - 10);
-    nibble = octet & 0x0f;
-    if(nibble < 10)
-        dest[1] = '0' + nibble;
-    else
-        dest[1] = 'A' + (nibble - 10);
-    dest[2] = 0;
-}
-
-/* Take two characters and convert to an octet assuming they are ascii-hex */
-static int hextooctet(char *hex){
-	int octet;
-	if(hex[0] >= '0' && hex[0] <= '9')
-		octet = (hex[0] - '0') << 4;
-	else if(hex[0] >= 'a' && hex[0] <= 'f')
-		octet = (hex[0] - 'a' + 10) << 4;
-	else if(hex[0] >= 'A' && hex[0] <= 'F')
-		octet = (hex[0] - 'A' + 10) << 4;
-	else
-		return -1;
-	if(hex[1] >= '0' && hex[1] <= '9')
-		octet |= (hex[1] - '0');
-	else if(hex[1] >= 'a' && hex[1] <= 'f')
-		octet |= (hex[1] - 'a' + 10);
-	else if(hex[1] >= 'A' && hex[1] <= 'F')
-		octet |= (hex[1] - 'A' + 10);
-	else
-		octet = -1;
-	return octet;
+/* Send an AT+EMQPUBLISH command, building the frame in CmdString and converting data to
+ * ascii-hex in place. A frame larger than CmdString goes out in CmdString sized pieces, the
+ * last one with the closing quote. */
+static int AT_SendPublish(ETMObject_t *Obj, int tpcidx, uint8_t qos, uint8_t *data, uint16_t datalen){
+  ETM_CmdBuf_t cmd;
+  uint16_t chunk, done = 0;
+
+  ETMcmdStart(&cmd, Obj->CmdString, ETM_CMD_SIZE);
+  ETMcmdLiteral(&cmd, "AT+EMQPUBLISH=");
+  ETMcmdUnsigned(&cmd, tpcidx);
+  ETMcmdLiteral(&cmd, ",");
+  ETMcmdUnsigned(&cmd, qos);
+  ETMcmdLiteral(&cmd, ",\"");
+  while(1){
+      /* Leave room for the closing quote and CRLF */
+      chunk = MIN(datalen - done, (ETMcmdRoom(&cmd) - 3) / 2);
+      ETMcmdHex(&cmd, &data[done], chunk);
+      done += chunk;
+      if(done == datalen){
+          ETMcmdLiteral(&cmd, "\"\r\n");
+          break;
+      }
+      if(Obj->fops.IO_Send((uint8_t *)Obj->CmdString, cmd.len) < 0){
+          return -1;
+      }
+      ETMcmdStart(&cmd, Obj->CmdString, ETM_CMD_SIZE);
+  }
+  ETM_DBG_AT(("AT Request: publish %u octets to %d\r\n", datalen, tpcidx));
+  return Obj->fops.IO_Send((uint8_t *)Obj->CmdString, cmd.len);
 }
 
 /* Publish a message to a topic by index */
 int ETMpublish(ETMObject_t *Obj, int tpcidx, uint8_t qos, uint8_t *data, uint16_t datalen){
-  char hexbyte[3];
+  return (ETMpublishTracked(Obj, tpcidx, qos, data, datalen, NULL, NULL) < 0) ? -1 : 0;
+}
+
+/* Publish a message to a topic by index, the acknowledgement is reported to donecb */
+int ETMpublishTracked(ETMObject_t *Obj, int tpcidx, uint8_t qos, uint8_t *data, uint16_t datalen, _pubcb donecb, void *ctx){
   uint32_t ret;
+  int seq;
 #ifdef TIMEOUT_RESPONSES
   ETMcheckTimeout(Obj);
 #endif  
-  /* TODO - check we're not already sending something */
-  
-  if(tpcidx < MAX_PUB_TOPICS && Obj->pubtopics[tpcidx].pubstate == PUB_TOPIC_REGISTERED){   
-    sprintf(CmdString, "AT+EMQPUBLISH=%d,%d,\"", tpcidx, qos);
-
-    UARTDEBUGPRINTF("Publishing %s to idx %d\r\n", (char *)data, tpcidx);
-
-    if(Obj->fops.IO_Send((uint8_t *)CmdString, strlen((char*)CmdString)) >= 0){
-        /* Convert data to ascii-hex */
-        for(uint16_t countlen=0; countlen < datalen; countlen++){
-            octettohex(data[countlen], hexbyte);
-            if(Obj->fops.IO_Send((uint8_t *)hexbyte, 2) < 0){
-                /* This is an error */
-                
-            }
-        }
-        ret = AT_ExecuteCommand(Obj, ETM_TOUT_300, (uint8_t *)"\"\r\n", RET_OK | RET_ERROR);
-        if(ret == RET_OK){
-            return 0;
-        }
+  if(tpcidx >= 0 && tpcidx < Obj->topics.pubcount && Obj->topics.pubstate[tpcidx] == PUB_TOPIC_REGISTERED){   
+    /* Only the length, the payload is binary and has no terminator (a stored record) */
+    UARTDEBUGPRINTF("Publishing %u octets to idx %d\r\n", datalen, tpcidx);
+
+    /* Queued commands go first, they may fill the window */
+    AT_AsyncFlush(Obj);
+    if(qos > 0 && AT_InflightFull(Obj))
+      return -1;
+    Obj->syncdepth++;
+    ret = (AT_SendPublish(Obj, tpcidx, qos, data, datalen) >= 0) ?
+          AT_RetrieveData(Obj, Obj->CmdResp, ETM_CMD_SIZE, RET_OK | RET_ERROR, ETM_TOUT_300) : RET_ERROR;
+    Obj->syncdepth--;
+    if(ret == RET_OK){
+        if(qos > 0)
+            return AT_InflightAdd(Obj, -1, tpcidx, qos, (donecb != NULL) ? data : NULL, datalen, 0, donecb, ctx);
+        /* Nothing further comes for QoS 0 */
+        seq = Obj->pubseq;
+        Obj->pubseq = (Obj->pubseq + 1) & 0x7FFFFFFF;
+        if(donecb != NULL)
+            donecb(ctx, seq, RET_OK);
+        return seq;
+    }
+  }else if(tpcidx < 0 || tpcidx >= Obj->topics.pubcount){
+	  UARTDEBUGPRINTF("Topic %d out of range\r\n", tpcidx);
+  }else{
+	  UARTDEBUGPRINTF("Topic %d not registered (%d)\r\n", tpcidx, Obj->topics.pubstate[tpcidx]);
+  }
+  return -1;
+}
+
+int ETMpubInflight(ETMObject_t *Obj){
+  return Obj->inflightcount;
+}
+
+/* Publish a message to a topic by name, registering the topic first if need be */
+int ETMpublishTopic(ETMObject_t *Obj, const char *topic, uint8_t qos, uint8_t *data, uint16_t datalen){
+  uint32_t tickstart;
+  int32_t left;
+  int tpcidx;
+
+#ifdef TIMEOUT_RESPONSES
+  ETMcheckTimeout(Obj);
+#endif
+  tpcidx = ETMTopicFind(Obj, topic);
+  if(tpcidx < 0 || Obj->topics.pubstate[tpcidx] != PUB_TOPIC_REGISTERED){
+    /* ETMpubreg() reuses the index of a known name */
+    tpcidx = ETMpubreg(Obj, (char *)topic);
+    if(tpcidx < 0)
+      return -1;
+    tickstart = Obj->GetTickCb();
+    while(Obj->topics.pubstate[tpcidx] == PUB_TOPIC_REGISTERING &&
+          (left = TimeLeftFromExpiration(tickstart, Obj->GetTickCb(), ETM_TOUT_5000)) > 0){
+      if(AT_RetrieveData(Obj, Obj->CmdResp, ETM_CMD_SIZE, RET_PUBOPEN, left) == RET_PUBOPEN)
+        ETMProcessReceived(Obj, RET_PUBOPEN);
+    }
+  }
+  return ETMpublish(Obj, tpcidx, qos, data, datalen);
+}
+
+/* Publish several items, writing up to ETM_PUB_BATCH_WINDOW frames ahead of their results so
+ * the UART and the ETM are not idle between them (by default one frame at a time, see etm.h).
+ * Results come back in order. */
+int ETMpublishBatch(ETMObject_t *Obj, const ETM_PubItem_t *items, size_t n, int32_t *results){
+  size_t inflight[ETM_PUB_BATCH_WINDOW];
+  uint8_t head = 0, count = 0;
+  size_t next = 0;
+  uint8_t acks = 0;
+  int published = 0;
+  int32_t ret;
+  const ETM_PubItem_t *item;
+#ifdef TIMEOUT_RESPONSES
+  ETMcheckTimeout(Obj);
+#endif
+  /* Queued commands go first */
+  AT_AsyncFlush(Obj);
+
+  Obj->syncdepth++;
+  while(next < n || count > 0){
+    /* Fill the window */
+    while(next < n && count < ETM_PUB_BATCH_WINDOW){
+      item = &items[next];
+      if(item->tpcidx < 0 || item->tpcidx >= Obj->topics.pubcount || Obj->topics.pubstate[item->tpcidx] != PUB_TOPIC_REGISTERED){
+        UARTDEBUGPRINTF("Topic %d not registered\r\n", item->tpcidx);
+        ret = ETM_RETURN_SEND_ERROR;
+      }else if(item->qos > 0 && Obj->inflightcount + acks >= ETM_INFLIGHT_SIZE){
+        UARTDEBUGPRINTF("%d publishes awaiting acknowledgement\r\n", Obj->inflightcount + acks);
+        ret = ETM_RETURN_SEND_ERROR;
+      }else if(AT_SendPublish(Obj, item->tpcidx, item->qos, (uint8_t *)item->data, item->datalen) < 0){
+        ret = ETM_RETURN_SEND_ERROR;
+      }else{
+        if(item->qos > 0)
+          acks++;
+        inflight[(head + count++) % ETM_PUB_BATCH_WINDOW] = next++;
+        continue;
+      }
+      if(results != NULL)
+        results[next] = ret;
+      next++;
     }
+    if(count == 0)
+      break;
+
+    /* Collect the oldest result */
+    ret = AT_RetrieveData(Obj, Obj->CmdResp, ETM_CMD_SIZE, RET_OK | RET_ERROR, ETM_TOUT_300);
+    if(ret == RET_OK || ret == RET_ERROR){
+      item = &items[inflight[head]];
+      if(item->qos > 0)
+        acks--;
+      if(ret == RET_OK){
+        published++;
+        if(item->qos > 0)
+          AT_InflightAdd(Obj, -1, item->tpcidx, item->qos, NULL, 0, 0, NULL, NULL);
+      }
+      if(results != NULL)
+        results[inflight[head]] = ret;
+      head = (head + 1) % ETM_PUB_BATCH_WINDOW;
+      count--;
+    }else{
+      /* Nothing more is coming for the frames in flight */
+      UARTDEBUGPRINTF("No publish result for %u frames\r\n", count);
+      acks = 0;
+      while(count > 0){
+        if(results != NULL)
+          results[inflight[head]] = ETM_RETURN_NO_DATA;
+        head = (head + 1) % ETM_PUB_BATCH_WINDOW;
+        count--;
+      }
+    }
+  }
+  Obj->syncdepth--;
+  return published;
+}
+
+/* Queue a publish to a topic by index. The topic may still be registering (ETMpubregAsync()),
+ * data is not copied and must stay valid until the command completes. */
+int ETMpublishAsync(ETMObject_t *Obj, int tpcidx, uint8_t qos, uint8_t *data, uint16_t datalen, _cmdcb donecb, void *ctx){
+  struct etmcmd *cmd;
+#ifdef TIMEOUT_RESPONSES
+  ETMcheckTimeout(Obj);
+#endif
+  if(tpcidx < 0 || tpcidx >= Obj->topics.pubcount ||
+     (Obj->topics.pubstate[tpcidx] != PUB_TOPIC_REGISTERED && Obj->topics.pubstate[tpcidx] != PUB_TOPIC_REGISTERING)){
+	  UARTDEBUGPRINTF("Topic %d not registered\r\n", tpcidx);
+	  return -1;
+  }
+  cmd = AT_AsyncAlloc(Obj, ETM_CMD_PUBLISH, donecb, ctx);
+  if(cmd == NULL)
+    return -1;
+  cmd->tpcidx = tpcidx;
+  cmd->qos = qos;
+  cmd->data = data;
+  cmd->datalen = datalen;
+  return AT_AsyncSubmit(Obj, cmd);
+}
+
+/* Publish a message to a topic by index sending the octets verbatim (half the UART traffic
+ * of ascii-hex). The ETM answers the counted publish with a "> " prompt and then reads
+ * exactly datalen octets. */
+int ETMpublishRaw(ETMObject_t *Obj, int tpcidx, uint8_t qos, uint8_t *data, uint16_t datalen){
+  uint32_t ret;
+#ifdef TIMEOUT_RESPONSES
+  ETMcheckTimeout(Obj);
+#endif
+
+  if(tpcidx >= 0 && tpcidx < Obj->topics.pubcount && Obj->topics.pubstate[tpcidx] == PUB_TOPIC_REGISTERED){
+    ETM_CmdBuf_t cmd;
+
+    /* Queued commands go first, they may fill the window */
+    AT_AsyncFlush(Obj);
+    if(qos > 0 && AT_InflightFull(Obj))
+      return -1;
+    ETMcmdStart(&cmd, Obj->CmdString, ETM_CMD_SIZE);
+    ETMcmdLiteral(&cmd, "AT+EMQPUBLISH=");
+    ETMcmdUnsigned(&cmd, tpcidx);
+    ETMcmdLiteral(&cmd, ",");
+    ETMcmdUnsigned(&cmd, qos);
+    ETMcmdLiteral(&cmd, ",");
+    ETMcmdUnsigned(&cmd, datalen);
+    ETMcmdLiteral(&cmd, "\r\n");
+    /* Nothing queued goes out between the prompt and the payload */
+    Obj->syncdepth++;
+    ret = AT_ExecuteCommand(Obj, ETM_TOUT_300, (uint8_t *)Obj->CmdString, RET_PROMPT | RET_ERROR);
+    if(ret == RET_PROMPT){
+        ret = (Obj->fops.IO_Send(data, datalen) >= 0) ?
+              AT_RetrieveData(Obj, Obj->CmdResp, ETM_CMD_SIZE, RET_OK | RET_ERROR, ETM_TOUT_300) : RET_ERROR;
+    }else{
+        UARTDEBUGPRINTF("No publish prompt for idx %d\r\n", tpcidx);
+    }
+    Obj->syncdepth--;
+    if(ret == RET_OK){
+        if(qos > 0)
+            AT_InflightAdd(Obj, -1, tpcidx, qos, NULL, 0, 0, NULL, NULL);
+        return 0;
+    }
+  }else if(tpcidx < 0 || tpcidx >= Obj->topics.pubcount){
+	  UARTDEBUGPRINTF("Topic %d out of range\r\n", tpcidx);
   }else{
-	  UARTDEBUGPRINTF("Topic %d not registered (%d)\r\n", tpcidx, Obj->pubtopics[tpcidx].pubstate);
+	  UARTDEBUGPRINTF("Topic %d not registered (%d)\r\n", tpcidx, Obj->topics.pubstate[tpcidx]);
   }
   return -1;
 }
 
 /* Polling loop - the work is done here */
 void ETMpoll(ETMObject_t *Obj){
-  persistScanVals = RET_SENDOK | RET_SENDFAIL | RET_IDLE | RET_CRLF | RET_MQTTREC | RET_EMQRDY | RET_SUBOPEN | RET_SUBCLOSE | RET_PUBOPEN | RET_PUBCLOSE | RET_EURDY | RET_STATEURC | RET_APPRDY | RET_FWAVAILABLE | RET_REBOOT_REQ;
+  uint32_t tickstart = Obj->GetTickCb();
+  int32_t left;
+
+  Obj->persistScanVals = RET_PUBACK | RET_IDLE | RET_CRLF | RET_MQTTREC | RET_EMQRDY | RET_SUBOPEN | RET_SUBCLOSE | RET_PUBOPEN | RET_PUBCLOSE | RET_EURDY | RET_STATEURC | RET_APPRDY | RET_FWAVAILABLE | RET_REBOOT_REQ;
 #ifdef TIMEOUT_RESPONSES
   ETMcheckTimeout(Obj);
 #endif 
+  AT_InflightExpire(Obj);
+  AT_LinkCheck(Obj);
   
-  AT_RetrieveData(Obj, Obj->CmdResp, ETM_CMD_SIZE, RET_ANY, ETM_TOUT_300);
+  while((left = TimeLeftFromExpiration(tickstart, Obj->GetTickCb(), ETM_TOUT_300)) > 0){
+    if(Obj->cmdcount == 0){
+      AT_RetrieveData(Obj, Obj->CmdResp, ETM_CMD_SIZE, RET_ANY, left);
+      break;
+    }
+    /* Collect queued command results, each completion sends the next command */
+    AT_AsyncStep(Obj, left);
+  }
   //int32_t ret = AT_RetrieveData(Obj, Obj->CmdResp, ETM_CMD_SIZE, RET_ANY, ETM_TOUT_300);
   //if(ret == ETM_RETURN_NO_DATA && strlen(Obj->CmdResp) > 0){
   //UARTDEBUGPRINTF("Ignoring %s\r\n", Obj->CmdResp);
@@ -524,22 +1640,71 @@ void ETMpoll(ETMObject_t *Obj){
   
 }
 
+/* Cut short an idle poll */
+void ETMpollwake(ETMObject_t *Obj){
+  Obj->pollwake = true;
+  if(Obj->fops.IO_Wake != NULL)
+    Obj->fops.IO_Wake();
+}
+
+/* Read the next count octets of an inbound message payload into CmdResp, decoding ascii-hex in
+ * place. For raw payloads the first 'have' octets are already at the start of CmdResp. */
+static bool ETMReadPayload(ETMObject_t *Obj, bool hex, uint16_t count, uint16_t have){
+  int32_t want;
+
+  if(hex){
+    want = count * 2;
+    if(AT_RetrieveData(Obj, Obj->CmdResp, want, RET_NONE, ETM_TOUT_300) != want)
+      return false;
+    /* Overwrite the received (char)string with (uint8_t)binary data. This works
+     * as there are two characters for each binary octet. */
+    if(!ETMhexDecode((char *)Obj->CmdResp, count, Obj->CmdResp)){
+      UARTDEBUGPRINTF("Error decoding ascii-hex message\r\n");
+      return false;
+    }
+  }else if(count > have){
+    want = count - have;
+    if(AT_RetrieveData(Obj, &Obj->CmdResp[have], want, RET_NONE, ETM_TOUT_300) != want)
+      return false;
+  }
+  /* Terminate so text payloads can be used as strings */
+  Obj->CmdResp[count] = 0;
+  return true;
+}
+
+/* Parse the <idx>,<err> payload of an open/close URC from CmdResp, false if it is malformed or
+ * idx is not below max */
+static bool ETMParseIdxErr(ETMObject_t *Obj, int max, int8_t *idx, int8_t *err){
+  ETM_Tok_t tok;
+  int32_t i, e;
+
+  ETMtokStart(&tok, (char *)Obj->CmdResp);
+  if(!ETMtokSigned(&tok, &i) || !ETMtokSigned(&tok, &e) || i < 0 || i >= max)
+    return false;
+  *idx = (int8_t)i;
+  *err = (int8_t)e;
+  return true;
+}
+
 /* Process a received buffer which contains a match to a persistent scan string */
 /* This is used to handle ETM URCs which can automate transfers or set state flags */
 static void ETMProcessReceived(ETMObject_t *Obj, uint32_t match){
   int32_t ret;
-  char *errptr;
   int8_t idx;
   int8_t err;
+  ETM_Tok_t tok;
+  int32_t value;
 
   //if(ret != RET_NONE && ret != ETM_RETURN_RETRIEVE_ERROR)
 	//  UARTDEBUGPRINTF("Received URC >%s<\r\n", Obj->CmdResp);
 
+  Obj->urcdepth++;
   switch(match){
       case RET_IDLE:
           /* ETM is ready */
           Obj->urcseen |= ETM_READY_URC;
           UARTDEBUGPRINTF("ETM READY\r\n");
+          AT_LinkNegotiate(Obj);
           break;
       case RET_EMQRDY:
           /* MQTT mode is ready */
@@ -555,14 +1720,17 @@ static void ETMProcessReceived(ETMObject_t *Obj, uint32_t match){
     	  break;
       case RET_REBOOTING:
     	  Obj->urcseen |= ETM_REBOOT;
+    	  /* It comes back at its power on rate */
+    	  AT_LinkReset(Obj);
     	  break;
       case RET_STATEURC:
     	  ret = AT_RetrieveData(Obj, Obj->CmdResp, ETM_CMD_SIZE, RET_CRLF, ETM_TOUT_300);
     	  if(ret == RET_CRLF){
-    		  char *resp = (char *)Obj->CmdResp;
-    		  if(*resp == ':')
-    			  resp++;
-              Obj->currentstate = (tetmState)strtol(resp, NULL, 10);
+    		  ETMtokStart(&tok, (char *)Obj->CmdResp);
+    		  if(*tok.pos == ':')
+    			  tok.pos++;
+    		  if(ETMtokSigned(&tok, &value))
+                  Obj->currentstate = (tetmState)value;
               if(Obj->statecallback != NULL)
                   Obj->statecallback();
     	  }
@@ -571,52 +1739,44 @@ static void ETMProcessReceived(ETMObject_t *Obj, uint32_t match){
       case RET_SUBOPEN:
     	  /* We've got the start of a subopen urc - now get the status */
     	  ret = AT_RetrieveData(Obj, Obj->CmdResp, ETM_CMD_SIZE, RET_CRLF, ETM_TOUT_300);
-          if(ret == RET_CRLF){
-    	      idx = strtol((char *)Obj->CmdResp, &errptr, 10);
-              err = strtol(errptr + 1, NULL, 10);
+          if(ret == RET_CRLF && ETMParseIdxErr(Obj, Obj->topics.subcount, &idx, &err)){
               UARTDEBUGPRINTF("subscribe %d err %d\r\n", idx, err);
               /* If we get an already subscribed error assume it was us from before a reboot */
               if(err == 0 || err == -2)
-                  Obj->subtopics[idx].substate = SUB_TOPIC_SUBSCRIBED;
+                  Obj->topics.substate[idx] = SUB_TOPIC_SUBSCRIBED;
               else
-                  Obj->subtopics[idx].substate = SUB_TOPIC_ERROR;
+                  Obj->topics.substate[idx] = SUB_TOPIC_ERROR;
           }else{
         	  UARTDEBUGPRINTF("Error decoding subopen urc\r\n");
           }
           break;
       case RET_SUBCLOSE:
     	  ret = AT_RetrieveData(Obj, Obj->CmdResp, ETM_CMD_SIZE, RET_CRLF, ETM_TOUT_300);
-    	  if(ret == RET_CRLF){
-              idx = strtol((char *)Obj->CmdResp, &errptr, 10);
-              err = strtol(errptr + 1, NULL, 10);
+    	  if(ret == RET_CRLF && ETMParseIdxErr(Obj, Obj->topics.subcount, &idx, &err)){
               UARTDEBUGPRINTF("unsubscribe %d err %d\r\n", idx, err);
-              Obj->subtopics[idx].substate = SUB_TOPIC_NOT_IN_USE;
+              Obj->topics.substate[idx] = SUB_TOPIC_NOT_IN_USE;
     	  }else{
     		  UARTDEBUGPRINTF("Error decoding subclose urc\r\n");
     	  }
           break;
       case RET_PUBOPEN:
     	  ret = AT_RetrieveData(Obj, Obj->CmdResp, ETM_CMD_SIZE, RET_CRLF, ETM_TOUT_300);
-    	  if(ret == RET_CRLF){
-              idx = strtol((char *)Obj->CmdResp, &errptr, 10);
-              err = strtol(errptr + 1, NULL, 10);
+    	  if(ret == RET_CRLF && ETMParseIdxErr(Obj, Obj->topics.pubcount, &idx, &err)){
               UARTDEBUGPRINTF("pubreg %d err %d\r\n", idx, err);
               /* If we get an already registered error assume it was us from before a reboot */
               if(err == 0 || err == -2)
-                  Obj->pubtopics[idx].pubstate = PUB_TOPIC_REGISTERED;
+                  Obj->topics.pubstate[idx] = PUB_TOPIC_REGISTERED;
               else
-                  Obj->pubtopics[idx].pubstate = PUB_TOPIC_ERROR;
+                  Obj->topics.pubstate[idx] = PUB_TOPIC_ERROR;
     	  }else{
     		  UARTDEBUGPRINTF("Error decoding pubopen urc (ret %d)\r\n", ret);
     	  }
           break;
       case RET_PUBCLOSE:
     	  ret = AT_RetrieveData(Obj, Obj->CmdResp, ETM_CMD_SIZE, RET_CRLF, ETM_TOUT_300);
-    	  if(ret == RET_CRLF){
-              idx = strtol((char *)Obj->CmdResp, &errptr, 10);
-              err = strtol(errptr + 1, NULL, 10);
+    	  if(ret == RET_CRLF && ETMParseIdxErr(Obj, Obj->topics.pubcount, &idx, &err)){
               UARTDEBUGPRINTF("pubunreg %d err %d\r\n", idx, err);
-              Obj->pubtopics[idx].pubstate = PUB_TOPIC_NOT_IN_USE;
+              Obj->topics.pubstate[idx] = PUB_TOPIC_NOT_IN_USE;
     	  }else{
     		  UARTDEBUGPRINTF("Error decoding pubclose urc\r\n");
     	  }
@@ -625,95 +1785,123 @@ static void ETMProcessReceived(ETMObject_t *Obj, uint32_t match){
       {
           /* Handle received mqtt here */
           /* <idx>,<len>\r\n<message>\r\n
-           * If message is quoted it's ascii-hex
-           * len is number of binary octets so x2 for number of ascii characters within quotes */
-    	  char *nextptr = NULL;
+           * If message is quoted it's ascii-hex and len is the number of binary octets so there are
+           * len x2 characters within the quotes. Otherwise the message is exactly len raw octets.
+           * The payload is read through CmdResp in windows and handed to a chunked callback as it
+           * arrives, a message which fits in one window can also go to a whole message callback. */
     	  int len = 0;
+    	  bool hex;
+    	  _msgcb msgcb = NULL;
+    	  _msgchunkcb chunkcb = NULL;
+    	  void *chunkctx = NULL;
+    	  int offset;
+    	  uint16_t count, window, have;
 
     	  ret = AT_RetrieveData(Obj, Obj->CmdResp, ETM_CMD_SIZE, RET_CRLF, ETM_TOUT_300);
     	  if(ret == RET_CRLF){
-    		  if(*(char *)Obj->CmdResp == 'S'){
+    		  ETMtokStart(&tok, (char *)Obj->CmdResp);
+    		  if(*tok.pos == 'S'){
     			  /* This is from the preconfigured single-subscription-topic */
     			  idx = -1;
-    			  nextptr = (char *)Obj->CmdResp;
-    			  while(*nextptr != ',' && *nextptr != 0)
-    			      nextptr++;
-    		  }else{
+    			  ETMtokSkipPast(&tok, ',');
+    		  }else if(ETMtokSigned(&tok, &value) && value >= 0 && value < Obj->topics.subcount){
     			  /* This must be from a dynamic subscription (subopen) */
-    	          idx = strtol((char *)Obj->CmdResp, &nextptr, 10);
+    	          idx = (int8_t)value;
+    		  }else{
+    	          idx = Obj->topics.subcount;
     		  }
-    		  if(nextptr != NULL && *nextptr != 0)
-    	          len = strtol(nextptr + 1, &nextptr, 10);
+    		  if(ETMtokSigned(&tok, &value))
+    	          len = value;
 
     	      //UARTDEBUGPRINTF("mqtt received >%s<\r\n", Obj->CmdResp);
 
-    	      /* TODO - check validity of len */
-
-    	      ret = AT_RetrieveData(Obj, Obj->CmdResp, len, RET_NONE, ETM_TOUT_300);
-    	      if(ret == len){
-    	          if(idx == -1 || Obj->subtopics[idx].substate == SUB_TOPIC_SUBSCRIBED){
-    		          uint8_t *msg;
-    		          uint32_t msglen = 0;
-    		          nextptr = (char *)Obj->CmdResp;
-    	              //while(*nextptr != 0 && (*nextptr == '\r' || *nextptr == '\n'))
-    		          //    nextptr++;
-    	              if(*nextptr != 0){
-    	    	          msg = (uint8_t *)nextptr;
-    		              if(*nextptr == '"'){
-    		    	          uint8_t *writemsg = ++msg;
-    			              /* This is in ascii-hex format but len indicates the number of binary octets */
-    		    	          /* Overwrite the received (char)string with (uint8_t)binary data. This works
-    		    	           * as there are two characters for each binary octet. */
-    		    	          while(msglen < len && msg[msglen * 2] != '"'){
-    		    	              *writemsg = hextooctet((char *)&msg[msglen * 2]);
-    		    	              if(*writemsg == -1){
-    		    		              /* Error - fail here */
-    		    	    	          UARTDEBUGPRINTF("Error decoding ascii-hex message for %d (%d characters expected - %d found)\r\n", idx, len * 2, msglen * 2);
-    		    		              msg = NULL;
-    		    		              break;
-    		    	              }
-    		    	              writemsg++;
-    		    	              msglen++;
-    		    	          }
-    		              }else{
-    			              /* This is ascii data */
-                              msg[len] = 0;
-                              msglen = len;
-    		              }
-    	                  if(msg != NULL && msglen > 0){
-    	                      if(idx != -1){
-    	                          /* Normal dynamic (subopen) subscription */
-    	                	  if(Obj->subtopics[idx].messagecb != NULL){
-    	    	                      Obj->subtopics[idx].messagecb(msg, msglen);
-    	                	  }
-    	                      }else{
-    	                	  /* Single subscription topic publish received */
-    	                	  if(Obj->fixedsubcb != NULL){
-                                      Obj->fixedsubcb(msg, msglen);
-                                  }
-    	                      }
-    	                  }
-    	              }
-    	          }else{
-    		          UARTDEBUGPRINTF("Received publish on non-subscribed topic %d\r\n", idx);
-    	          }
-    	      }else{
+    	      if(len <= 0 || idx < -1 || idx >= Obj->topics.subcount){
+    	    	  UARTDEBUGPRINTF("Bad mqtt receive header (idx %d len %d)\r\n", idx, len);
+    	    	  break;
+    	      }
+
+    	      /* The first octet tells us the encoding */
+    	      if(AT_RetrieveData(Obj, Obj->CmdResp, 1, RET_NONE, ETM_TOUT_300) != 1){
     	    	  UARTDEBUGPRINTF("Failed to read %d published octets\r\n", len);
+    	    	  break;
+    	      }
+    	      hex = (Obj->CmdResp[0] == '"');
+    	      have = hex ? 0 : 1;
+    	      window = hex ? ETM_CMD_SIZE / 2 : ETM_CMD_SIZE - 1;
+
+    	      if(idx == -1){
+    	    	  /* Single subscription topic publish received */
+    	    	  msgcb = Obj->fixedsubcb;
+    	    	  chunkcb = Obj->fixedsubchunkcb;
+    	    	  chunkctx = Obj->fixedsubchunkctx;
+    	      }else if(Obj->topics.substate[idx] == SUB_TOPIC_SUBSCRIBED){
+    	    	  /* Normal dynamic (subopen) subscription */
+    	    	  msgcb = Obj->topics.subtopics[idx].messagecb;
+    	    	  chunkcb = Obj->topics.subtopics[idx].chunkcb;
+    	    	  chunkctx = Obj->topics.subtopics[idx].chunkctx;
+    	      }else{
+    	    	  UARTDEBUGPRINTF("Received publish on non-subscribed topic %d\r\n", idx);
+    	      }
+    	      if(chunkcb == NULL && msgcb != NULL && len > window){
+    	    	  UARTDEBUGPRINTF("Dropping %d octet publish for %d (ETM_CMD_SIZE %d)\r\n", len, idx, ETM_CMD_SIZE);
+    	    	  msgcb = NULL;
+    	      }
+
+    	      /* Read the payload a window at a time (undelivered messages are still read out of the way) */
+    	      for(offset = 0; offset < len; offset += count){
+    	    	  count = MIN(len - offset, window);
+    	    	  if(!ETMReadPayload(Obj, hex, count, have)){
+    	    		  UARTDEBUGPRINTF("Failed to read %d published octets for %d\r\n", len, idx);
+    	    		  break;
+    	    	  }
+    	    	  have = 0;
+    	    	  if(chunkcb != NULL){
+    	    		  chunkcb(chunkctx, offset, Obj->CmdResp, count, len);
+    	    	  }else if(msgcb != NULL){
+    	    		  msgcb(Obj->CmdResp, len);
+    	    	  }
+    	      }
+    	      if(hex && offset == len){
+    	    	  /* Closing quote */
+    	    	  AT_RetrieveData(Obj, Obj->CmdResp, 1, RET_NONE, ETM_TOUT_300);
     	      }
     	  }
 
       }
       break;
           
-      case RET_SENDOK:
-          UARTDEBUGPRINTF("Send OK\r\n");
-          break;
-          
-      case RET_SENDFAIL:
-          UARTDEBUGPRINTF("Send Fail\r\n");
-          break;
+      case RET_PUBACK:
+    	  /* +EMQPUB:<idx>:SEND OK or +EMQPUB:<idx>:SEND FAIL */
+    	  ret = AT_RetrieveData(Obj, Obj->CmdResp, ETM_CMD_SIZE, RET_CRLF, ETM_TOUT_300);
+    	  ETMtokStart(&tok, (char *)Obj->CmdResp);
+    	  if(ret == RET_CRLF && ETMtokSigned(&tok, &value) && value >= 0 && value < Obj->topics.pubcount){
+    		  if(strncmp(tok.pos, ":SEND OK", 8) == 0){
+    			  UARTDEBUGPRINTF("Send OK %d\r\n", (int)value);
+    			  AT_InflightAck(Obj, value, true);
+    			  break;
+    		  }
+    		  if(strncmp(tok.pos, ":SEND FAIL", 10) == 0){
+    			  UARTDEBUGPRINTF("Send Fail %d\r\n", (int)value);
+    			  AT_InflightAck(Obj, value, false);
+    			  break;
+    		  }
+    	  }
+    	  UARTDEBUGPRINTF("Error decoding publish acknowledgement\r\n");
+    	  break;
           
       case RET_APPRDY:
+          /* The ETM has restarted without its publish topics. Their names are kept so
+           * ETMpublishTopic() registers them again at the same index. One still registering
+           * is answered by the restarted ETM. */
+          for(idx = 0; idx < Obj->topics.pubcount; idx++){
+              if(Obj->topics.pubstate[idx] != PUB_TOPIC_REGISTERING)
+                  Obj->topics.pubstate[idx] = PUB_TOPIC_NOT_IN_USE;
+          }
+          /* Publishes it had not acknowledged may or may not have reached the broker */
+          while(Obj->inflightcount > 0){
+              AT_InflightRetire(Obj, 0, ETM_RETURN_NO_DATA);
+          }
+          /* After the answer to a command already on the wire */
           AT_ExecuteCommand(Obj, ETM_TOUT_300, (uint8_t *)"ATE0\r\n", RET_OK | RET_ERROR);
           UARTDEBUGPRINTF("BG96 found\r\n");
           break;
@@ -740,6 +1928,7 @@ static void ETMProcessReceived(ETMObject_t *Obj, uint32_t match){
     	      UARTDEBUGPRINTF("Got URC %d\r\n", match);
     	  break;
   }
+  Obj->urcdepth--;
 }
 
 #ifdef removed
@@ -758,9 +1947,9 @@ uint8_t *ETMSendATCommand(ETMObject_t *Obj, uint8_t *cmdstr, uint32_t retflags,
 	/* Ensure we are looking for OK/ERROR in addition to user options */
 	retflags |= (RET_OK | RET_ERROR);
 	/* Prevent CR detection for URCs as we may be expecting a multi-line response */
-	persistScanVals &= ~RET_CRLF;
+	Obj->persistScanVals &= ~RET_CRLF;
 	ret = AT_ExecuteCommand(Obj, timeout, cmdstr, retflags);
-	persistScanVals |= RET_CRLF;
+	Obj->persistScanVals |= RET_CRLF;
 	if(ret == RET_OK)
 		return Obj->CmdResp;
 	return NULL;
@@ -782,6 +1971,31 @@ void ETMupdateState(ETMObject_t *Obj, tetmRequestState streq){
     }
 }
 
+int ETMupdateStateAsync(ETMObject_t *Obj, tetmRequestState streq, _cmdcb donecb, void *ctx){
+    struct etmcmd *cmd = AT_AsyncAlloc(Obj, ETM_CMD_AT, donecb, ctx);
+    if(cmd == NULL)
+        return -1;
+    if(streq == ETM_STATE_ONCE){
+        Obj->currentstate = ETM_UNKNOWN;
+        strcpy(cmd->cmd, "AT+ETMSTATE?\r\n");
+    }else if(streq == ETM_STATE_ON){
+        strcpy(cmd->cmd, "AT+ETMSTATE=1\r\n");
+    }else{
+        strcpy(cmd->cmd, "AT+ETMSTATE=0\r\n");
+    }
+    return AT_AsyncSubmit(Obj, cmd);
+}
+
+/* Is a queued command still waiting to complete */
+bool ETMcmdpending(ETMObject_t *Obj, int handle){
+    uint8_t i;
+    for(i = 0; i < Obj->cmdcount; i++){
+        if(Obj->cmdqueue[(Obj->cmdhead + i) % ETM_ASYNC_QUEUE_SIZE].handle == handle)
+            return true;
+    }
+    return false;
+}
+
 void ETMstatecb(ETMObject_t *Obj, _statecb stateupdatecb){
     Obj->statecallback = stateupdatecb;
 }
@@ -808,11 +2022,11 @@ static bool ETMcheckTimeout(ETMObject_t *Obj){
     int topiccount = 0;
     bool waiting = false;
     uint32_t now = Obj->GetTickCb(), diff;
-    while(topiccount < MAX_PUB_TOPICS){
-        diff = now - Obj->pubtopics[topiccount].senttime;
-        if(Obj->pubtopics[topiccount].pubstate == PUB_TOPIC_REGISTERING || Obj->pubtopics[topiccount].pubstate == PUB_TOPIC_UNREGISTERING){
+    while(topiccount < Obj->topics.pubcount){
+        diff = now - Obj->topics.pubsenttime[topiccount];
+        if(Obj->topics.pubstate[topiccount] == PUB_TOPIC_REGISTERING || Obj->topics.pubstate[topiccount] == PUB_TOPIC_UNREGISTERING){
             if(diff >= pdMS_TO_TICKS(PUB_TIMEOUT)){
-                Obj->pubtopics[topiccount].pubstate = PUB_TOPIC_ERROR;
+                Obj->topics.pubstate[topiccount] = PUB_TOPIC_ERROR;
                 UARTDEBUGPRINTF("Pub idx %d timed out\n", topiccount);
             }else{
                 waiting = true;
@@ -828,12 +2042,18 @@ int ETMGetHostFW(ETMObject_t *Obj, char *url, _fwupdcb cb){
 	int rc = -1;
 	uint32_t ret = RET_OK;
 	if(url != NULL){
-	    sprintf(CmdString, "AT+ETMCFG=host,updateurl,%s\r\n", url);
-	    ret = AT_ExecuteCommand(Obj, ETM_TOUT_300, (uint8_t *)CmdString, RET_OK | RET_ERROR);
+	    ETM_CmdBuf_t cmd;
+
+	    ETMcmdStart(&cmd, Obj->CmdString, ETM_CMD_SIZE);
+	    ETMcmdLiteral(&cmd, "AT+ETMCFG=host,updateurl,");
+	    ETMcmdLiteral(&cmd, url);
+	    ETMcmdLiteral(&cmd, "\r\n");
+	    if(ETMcmdEnd(&cmd) < 0)
+	        return rc;
+	    ret = AT_ExecuteCommand(Obj, ETM_TOUT_300, (uint8_t *)Obj->CmdString, RET_OK | RET_ERROR);
 	}
 	if(ret == RET_OK){
-	    sprintf(CmdString, "AT+ETMHFWGET\r\n");
-	    ret = AT_ExecuteCommand(Obj, ETM_TOUT_300, (uint8_t *)CmdString, RET_OK | RET_ERROR);
+	    ret = AT_ExecuteCommand(Obj, ETM_TOUT_300, (uint8_t *)"AT+ETMHFWGET\r\n", RET_OK | RET_ERROR);
 	    Obj->fwupdcb = cb;
 	    rc = 0;
 	}
@@ -843,68 +2063,129 @@ int ETMGetHostFW(ETMObject_t *Obj, char *url, _fwupdcb cb){
 int ETMGetHostFWDetails(ETMObject_t *Obj, uint32_t *len, uint16_t *cs){
 	uint32_t ret = RET_NONE;
 	int rc = -1;
-	persistScanVals &= ~RET_CRLF;
-    sprintf(CmdString, "AT+ETMHFWREAD?\r\n");
-    ret = AT_ExecuteCommand(Obj, ETM_TOUT_300, (uint8_t *)CmdString, RET_OK | RET_ERROR);
-    persistScanVals |= RET_CRLF;
+	Obj->persistScanVals &= ~RET_CRLF;
+    ret = AT_ExecuteCommand(Obj, ETM_TOUT_300, (uint8_t *)"AT+ETMHFWREAD?\r\n", RET_OK | RET_ERROR);
+    Obj->persistScanVals |= RET_CRLF;
     if(ret == RET_OK){
-    	char *parsestr = (char *)Obj->CmdResp;
-
-    	configPRINTF(("Response is %s\r\n", parsestr));
-
-    	while(*parsestr != ':' && *parsestr != 0)
-    		parsestr++;
-    	if(*parsestr == ':'){
-    		parsestr++;
-    		*len = strtol(parsestr, &parsestr, 10);
-    		if(*parsestr == ','){
-    			parsestr++;
-    			*cs = strtol(parsestr, &parsestr, 16);
-    			rc = 0;
-    		}
+    	ETM_Tok_t tok;
+    	uint32_t value;
+
+    	configPRINTF(("Response is %s\r\n", (char *)Obj->CmdResp));
+
+    	/* +ETMHFWREAD:<len>,<checksum in hex> */
+    	ETMtokStart(&tok, (char *)Obj->CmdResp);
+    	if(ETMtokSkipPast(&tok, ':') && ETMtokUnsigned(&tok, len) && ETMtokHex(&tok, &value)){
+    		*cs = (uint16_t)value;
+    		rc = 0;
     	}
     }
     return rc;
 }
 
 int ETMReadHostFW(ETMObject_t *Obj, uint32_t offset, uint16_t len, uint8_t *respbuf){
-	int rc = -1, octets = 0;
-	uint32_t ret = RET_OK;
-	persistScanVals &= ~RET_CRLF;
-	sprintf(CmdString, "AT+ETMHFWREAD=%lu,%d\r\n", offset, len);
-	ret = AT_ExecuteCommand(Obj, ETM_TOUT_500, (uint8_t *)CmdString, RET_OK | RET_ERROR);
-	persistScanVals |= RET_CRLF;
-	if(ret == RET_OK){
-		char *parsestr = (char *)Obj->CmdResp;
-		while(*parsestr != ':' && *parsestr != 0)
-			parsestr++;
-		if(*parsestr == ':'){
-			parsestr++;
-			/* Now decode ascii hex into binary */
-            while(1){
-            	if(isxdigit(parsestr[0]) && isxdigit(parsestr[1])){
-            		*respbuf++ = hextooctet(parsestr);
-            		parsestr += 2;
-            		octets++;
-            	}else{
-            		break;
-            	}
+	if(ETMReadHostFWRequest(Obj, offset, len) != 0)
+		return -1;
+	return ETMReadHostFWCollect(Obj, respbuf, len, ETM_TOUT_500);
+}
 
-            }
+int ETMReadHostFWRequest(ETMObject_t *Obj, uint32_t offset, uint16_t len){
+	ETM_CmdBuf_t cmd;
+	int sent;
+
+	ETMcmdStart(&cmd, Obj->CmdString, ETM_CMD_SIZE);
+	ETMcmdLiteral(&cmd, "AT+ETMHFWREAD=");
+	ETMcmdUnsigned(&cmd, offset);
+	ETMcmdLiteral(&cmd, ",");
+	ETMcmdUnsigned(&cmd, len);
+	ETMcmdLiteral(&cmd, "\r\n");
+	if((sent = ETMcmdEnd(&cmd)) < 0)
+		return -1;
+	/* Queued commands go first, the link only carries one command at a time */
+	AT_AsyncFlush(Obj);
+	ETM_DBG_AT(("AT Request: %s\r\n", Obj->CmdString));
+	return (Obj->fops.IO_Send((uint8_t *)Obj->CmdString, sent) >= 0) ? 0 : -1;
+}
+
+/* Decode count octets of ascii-hex from the receive buffer into dest. Runs are decoded where
+ * they lie, a pair split over the end of one run is completed from the next. */
+static bool AT_RetrieveHex(ETMObject_t *Obj, uint8_t *dest, uint16_t count, uint32_t Timeout){
+	uint32_t tickstart = Obj->GetTickCb();
+	uint16_t done = 0, avail, used, pairs;
+	uint8_t c, *span;
+	char pair[2];
+	bool half = false, bad = false;
+	int32_t left;
+
+	while(!bad && done < count && (left = TimeLeftFromExpiration(tickstart, Obj->GetTickCb(), Timeout)) > 0){
+		if(Obj->fops.IO_Peek != NULL){
+			avail = Obj->fops.IO_Peek(&span);
+		}else{
+			span = &c;
+			avail = (Obj->fops.IO_ReceiveOne(&c) == 0) ? 1 : 0;
+		}
+		if(avail == 0){
+			if(Obj->fops.IO_Wait != NULL)
+				Obj->fops.IO_Wait((uint16_t)MIN((uint32_t)(count - done) * 2 - half, 0xFFFF), left);
+			else
+				vTaskDelay(pdMS_TO_TICKS(1));
+			continue;
+		}
+		used = 0;
+		if(half){
+			pair[1] = (char)span[used++];
+			bad = !ETMhexDecode(pair, 1, &dest[done]);
+			done++;
+			half = false;
+		}
+		pairs = MIN((uint16_t)((avail - used) / 2), (uint16_t)(count - done));
+		if(!bad && ETMhexDecode((const char *)&span[used], pairs, &dest[done])){
+			used += pairs * 2;
+			done += pairs;
+			if(done < count && used < avail){
+				pair[0] = (char)span[used++];
+				half = true;
+			}
+		}else{
+			bad = true;
 		}
-		if(octets == len)
-	        rc = 0;
+		AT_Release(Obj, used);
+	}
+	if(bad || done < count){
+		UARTDEBUGPRINTF("Host firmware read short or malformed (%u/%u)\r\n", done, count);
+		return false;
+	}
+	return true;
+}
+
+int ETMReadHostFWCollect(ETMObject_t *Obj, uint8_t *respbuf, uint16_t len, uint32_t timeout){
+	int32_t ret;
+	int rc = -1;
+
+	/* +ETMHFWREAD:<hex>\r\n\r\nOK\r\n */
+	Obj->persistScanVals &= ~RET_CRLF;
+	Obj->syncdepth++;
+	ret = AT_RetrieveData(Obj, Obj->CmdResp, ETM_CMD_SIZE, RET_FWREAD | RET_ERROR, timeout);
+	if(ret == RET_FWREAD && AT_RetrieveHex(Obj, respbuf, len, timeout)){
+		/* More hex before the OK is an answer longer than the one asked for */
+		if(AT_RetrieveData(Obj, Obj->CmdResp, ETM_CMD_SIZE, RET_OK | RET_ERROR, timeout) == RET_OK &&
+		   Obj->CmdResp[0] == '\r')
+			rc = 0;
+	}else if(ret != RET_ERROR){
+		/* A late or damaged answer is read up to its end, so a read asked for again isn't
+		 * answered with what is left of it */
+		AT_RetrieveData(Obj, Obj->CmdResp, ETM_CMD_SIZE, RET_OK | RET_ERROR, timeout);
 	}
+	Obj->syncdepth--;
+	Obj->persistScanVals |= RET_CRLF;
 	return rc;
 }
   
 int ETMAckHostFW(ETMObject_t *Obj){
 	int rc = -1;
 	uint32_t ret = RET_OK;
-	persistScanVals &= ~RET_CRLF;
-	sprintf(CmdString, "AT+ETMHFWCONF\r\n");
-	ret = AT_ExecuteCommand(Obj, ETM_TOUT_5000, (uint8_t *)CmdString, RET_OK | RET_ERROR);
-	persistScanVals |= RET_CRLF;
+	Obj->persistScanVals &= ~RET_CRLF;
+	ret = AT_ExecuteCommand(Obj, ETM_TOUT_5000, (uint8_t *)"AT+ETMHFWCONF\r\n", RET_OK | RET_ERROR);
+	Obj->persistScanVals |= RET_CRLF;
 	if(ret == RET_OK){
         UARTDEBUGPRINTF("Host firmware acknowledged\r\n");
 	    rc = 0;
@@ -30,7 +30,7 @@
 #define  RET_EURDY          0x0010  
 #define  RET_EMQRDY         0x0020
 #define  RET_MQTTREC        0x0040  
-#define  RET_SENDFAIL       0x0080
+#define  RET_SENDFAIL       0x0080  /* Tracked publish results (the URC is RET_PUBACK) */
 #define  RET_SENDOK         0x0100
 #define  RET_SUBOPEN        0x0200
 #define  RET_SUBCLOSE       0x0400
@@ -42,8 +42,27 @@
 #define  RET_REBOOT_REQ     0x10000
 #define  RET_REBOOTING      0x10001
 #define  RET_CME_ERROR      0x10002
+#define  RET_PROMPT         0x20000
+#define  RET_FWREAD         0x40000
+#define  RET_PUBACK         0x80000
 #define  RET_ANY            0x80000000  /* Scan for persistent responses (normally URCs) only */
-#define  NUM_RESPONSES      19
+#define  NUM_RESPONSES      20
+
+/* Limits for the compiled response matcher (see AT_MatchBuild() in etm.c). The keyword set
+ * currently needs 127 states and 29 character classes. */
+#ifndef ETM_MATCH_MAX_STATES
+#define ETM_MATCH_MAX_STATES               160
+#endif
+#ifndef ETM_MATCH_MAX_CLASSES
+#define ETM_MATCH_MAX_CLASSES               32
+#endif
+/* States and classes are held in uint8_t, keyword sets in a uint32_t */
+#if ETM_MATCH_MAX_STATES > 256 || ETM_MATCH_MAX_CLASSES > 256
+#error "ETM_MATCH_MAX_STATES and ETM_MATCH_MAX_CLASSES can't be above 256"
+#endif
+#if NUM_RESPONSES > 32
+#error "The response matcher takes at most 32 keywords"
+#endif
 
 #define ETM_TOUT_SHORT                         50  /* 50 ms */
 #define ETM_TOUT_300                          350  /* 0,3 sec + margin */
@@ -68,6 +87,30 @@ typedef int8_t (*IO_Baudrate_Func)(uint32_t BaudRate);
 typedef void (*IO_Flush_Func)(void);
 typedef int16_t (*IO_Send_Func)( uint8_t *, uint16_t);
 typedef int16_t (*IO_ReceiveOne_Func)(uint8_t* pSingleData);
+/* Optional block receive: IO_Peek returns the length of the contiguous run of received data
+ * available at *pData (0 if none) without removing it, IO_Consume then releases Length octets */
+typedef uint16_t (*IO_Peek_Func)(uint8_t **pData);
+typedef void (*IO_Consume_Func)(uint16_t Length);
+/* Optional receive wait: block for up to Timeout ms until a line end arrives or, if Needed is
+ * non-zero, until Needed octets have arrived. Returns 0 if data is available, -1 on timeout */
+typedef int8_t (*IO_Wait_Func)(uint16_t Needed, uint32_t Timeout);
+/* Optional, called from another task to end an IO_Wait early. It only wakes a task blocked in
+ * IO_Wait, the IO layer owns whatever the wait blocks on. */
+typedef void (*IO_Wake_Func)(void);
+/* Optional link control: IO_FlowControl turns RTS/CTS on or off (0 on success, -1 if it isn't
+ * available), IO_LineErrors returns the framing, noise and overrun errors since the last call */
+typedef int8_t (*IO_FlowControl_Func)(uint8_t Enable);
+typedef uint16_t (*IO_LineErrors_Func)(void);
+/* Receive buffer counters kept by the IO layer, to size the buffer for the bursts it sees */
+typedef struct {
+  uint32_t received;    /* Octets received into the buffer */
+  uint32_t overflows;   /* Times unread data was written over */
+  uint32_t dropped;     /* Octets lost to overflows */
+  uint16_t highwater;   /* Most octets waiting to be read at once */
+  uint16_t size;        /* Buffer capacity */
+} ETM_RxStats_t;
+/* Optional receive statistics: fill in Stats */
+typedef void (*IO_RxStats_Func)(ETM_RxStats_t *Stats);
 typedef uint32_t (*App_GetTickCb_Func)(void);
 
 
@@ -99,15 +142,84 @@ typedef struct {
   IO_Flush_Func      IO_FlushBuffer;  
   IO_Send_Func       IO_Send;
   IO_ReceiveOne_Func IO_ReceiveOne;  
+  IO_Peek_Func       IO_Peek;
+  IO_Consume_Func    IO_Consume;
+  IO_Wait_Func       IO_Wait;
+  IO_Wake_Func       IO_Wake;
+  IO_FlowControl_Func IO_FlowControl;
+  IO_LineErrors_Func IO_LineErrors;
+  IO_RxStats_Func    IO_RxStats;
 } ETM_IO_t;
 
+/* Topic table capacity of an object which isn't given its own tables (ETM_RegisterTopicTables) */
+#ifndef MAX_SUB_TOPICS
 #define MAX_SUB_TOPICS 8
+#endif
+#ifndef MAX_PUB_TOPICS
 #define MAX_PUB_TOPICS 8
+#endif
+/* Largest topic table, indices must fit the 8 bit fields that carry them */
+#define ETM_MAX_TOPICS 127
+
+/* Asynchronous command queue depth and the longest queued command line */
+#ifndef ETM_ASYNC_QUEUE_SIZE
+#define ETM_ASYNC_QUEUE_SIZE 8
+#endif
+#ifndef ETM_ASYNC_CMD_SIZE
+#define ETM_ASYNC_CMD_SIZE 128
+#endif
+/* Batch publish frames written ahead of their results. 1 waits for each result before the
+ * next frame is written. Larger windows are opt in, only for ETM firmware which has been
+ * confirmed to buffer command lines that arrive while it is busy with the previous one. */
+#ifndef ETM_PUB_BATCH_WINDOW
+#define ETM_PUB_BATCH_WINDOW 1
+#endif
+/* QoS 1 and 2 publishes awaiting the broker's acknowledgement (SEND OK or SEND FAIL) */
+#ifndef ETM_INFLIGHT_SIZE
+#define ETM_INFLIGHT_SIZE 8
+#endif
+/* Times a tracked publish answered with SEND FAIL is sent again before it fails */
+#ifndef ETM_INFLIGHT_RETRIES
+#define ETM_INFLIGHT_RETRIES 2
+#endif
+/* Longest wait for an acknowledgement (ms) */
+#ifndef ETM_INFLIGHT_TIMEOUT
+#define ETM_INFLIGHT_TIMEOUT 30000
+#endif
+/* Highest UART rate ETM_Init() moves the link to (ETM_DEFAULT_BAUDRATE to stay there), whether
+ * to use RTS/CTS flow control (off unless the board routes both lines) and the line errors seen
+ * in one ETMpoll() which make the link drop to a lower rate */
+#ifndef ETM_BAUDRATE_MAX
+#define ETM_BAUDRATE_MAX 921600
+#endif
+#ifndef ETM_FLOW_CONTROL
+#define ETM_FLOW_CONTROL 0
+#endif
+#ifndef ETM_LINE_ERRORS_MAX
+#define ETM_LINE_ERRORS_MAX 4
+#endif
+/* Space for the names of registered publish topics in the default topic tables */
+#ifndef ETM_TOPIC_ARENA_SIZE
+#define ETM_TOPIC_ARENA_SIZE 256
+#endif
+/* Entries in the hash index of n publish topic names, the power of two at least 2 * n */
+#define ETM_TOPIC_HASH_ENTRIES(n) ((n) <= 4 ? 8 : (n) <= 8 ? 16 : (n) <= 16 ? 32 : (n) <= 32 ? 64 : (n) <= 64 ? 128 : 256)
 
 /* Prototype for the AT command response callback function */
 typedef void (*_atcb)(char *data);
 /* Prototype for the message callback function */	
 typedef void (*_msgcb)(uint8_t *data, uint32_t length);
+/* Prototype for the chunked message callback function. Messages are delivered in order as one or
+ * more chunks of chunk_len octets starting at offset, the message is complete when
+ * offset + chunk_len == total_len */
+typedef void (*_msgchunkcb)(void *ctx, uint32_t offset, uint8_t *chunk, uint32_t chunk_len, uint32_t total_len);
+/* Prototype for the asynchronous command completion callback function. result is RET_OK,
+ * RET_ERROR, ETM_RETURN_NO_DATA (no final result in time) or ETM_RETURN_SEND_ERROR */
+typedef void (*_cmdcb)(void *ctx, int handle, int32_t result);
+/* Prototype for the tracked publish completion callback function. result is RET_SENDOK,
+ * RET_SENDFAIL (after ETM_INFLIGHT_RETRIES resends), RET_OK for QoS 0 or ETM_RETURN_NO_DATA if
+ * the outcome is unknown (no acknowledgement in time or the ETM restarted) */
+typedef void (*_pubcb)(void *ctx, int seq, int32_t result);
 /* Prototype for the host-firmware-available callback function */
 typedef void (*_fwupdcb)(bool available);
 /* Publish topic state */
@@ -131,18 +243,111 @@ typedef enum {ETM_MQTT, ETM_UDP} tetmProto;
 /* Subscribed topic array element */	
 struct subtpc{
   _msgcb messagecb;
-  tsubTopicState substate;
+  _msgchunkcb chunkcb;
+  void *chunkctx;
 };
 
 #define PUB_TIMEOUT 2000
 
-/* Publish topic array element */
+/* Publish topic array element, the topic name in the name arena (namelen 0 if the name isn't
+ * known) */
 struct pubtpc{
-  tpubTopicState pubstate;
+  uint16_t nameoff;
+  uint8_t namelen;
+};
+
+#ifdef TIMEOUT_RESPONSES
+#define ETM_TOPIC_SENTTIME(name, npub)  uint32_t pubsenttime[npub];
+#define ETM_TOPIC_SENTTIME_PTR(name)    name##_storage.pubsenttime,
+#else
+#define ETM_TOPIC_SENTTIME(name, npub)
+#define ETM_TOPIC_SENTTIME_PTR(name)
+#endif
+
+/* Topic tables. The states (tsubTopicState and tpubTopicState) are byte arrays of their own so
+ * the scans for a free or matching topic read a few cache lines rather than stepping over the
+ * callbacks. ETM_TOPIC_TABLES() declares the storage for a given capacity. */
+typedef struct {
+  uint8_t subcount;
+  uint8_t pubcount;
+  uint16_t arenasize;
+  int8_t *substate;
+  struct subtpc *subtopics;
+  int8_t *pubstate;
+  struct pubtpc *pubtopics;
 #ifdef TIMEOUT_RESPONSES
   /* Include a senttime for each pub to enable timeout */
-  unsigned long senttime;
+  uint32_t *pubsenttime;
 #endif
+  /* Hash index of the publish topic names, ETM_TOPIC_HASH_ENTRIES(pubcount) entries */
+  uint8_t *topichash;
+  /* Publish topic names packed end to end */
+  char *topicarena;
+} ETM_TopicTables_t;
+
+/* Declare topic tables called name for nsub subscriptions and npub publish topics with arena
+ * octets of publish topic names, for ETM_RegisterTopicTables(Obj, &name) */
+#define ETM_TOPIC_TABLES(name, nsub, npub, arena)                                          \
+  static struct {                                                                          \
+    int8_t substate[nsub];                                                                 \
+    struct subtpc subtopics[nsub];                                                         \
+    int8_t pubstate[npub];                                                                 \
+    struct pubtpc pubtopics[npub];                                                         \
+    ETM_TOPIC_SENTTIME(name, npub)                                                         \
+    uint8_t topichash[ETM_TOPIC_HASH_ENTRIES(npub)];                                       \
+    char topicarena[arena];                                                                \
+  } name##_storage;                                                                        \
+  static const ETM_TopicTables_t name = {                                                  \
+    (nsub), (npub), (arena), name##_storage.substate, name##_storage.subtopics,            \
+    name##_storage.pubstate, name##_storage.pubtopics, ETM_TOPIC_SENTTIME_PTR(name)        \
+    name##_storage.topichash, name##_storage.topicarena                                    \
+  }
+
+/* Batch publish item */
+typedef struct {
+  int tpcidx;
+  uint8_t qos;
+  const uint8_t *data;
+  uint16_t datalen;
+} ETM_PubItem_t;
+
+/* Queued command kind */
+typedef enum {ETM_CMD_AT = 0, ETM_CMD_SUBOPEN, ETM_CMD_PUBOPEN, ETM_CMD_PUBLISH, ETM_CMD_REPUBLISH} tetmCmdKind;
+
+/* Asynchronous command queue element. Publish data is not copied, it is converted to ascii-hex
+ * as the command is sent so must stay valid until the completion callback. */
+struct etmcmd{
+  int handle;
+  tetmCmdKind kind;
+  int8_t tpcidx;
+  uint8_t qos;
+  bool sent;
+  uint32_t senttime;
+  uint8_t *data;
+  uint16_t datalen;
+  _cmdcb cb;
+  void *ctx;
+  /* Tracked publish being sent again (ETM_CMD_REPUBLISH), ctx is its callback's */
+  int seq;
+  uint8_t retries;
+  _pubcb pubcb;
+  char cmd[ETM_ASYNC_CMD_SIZE];
+};
+
+/* Publish awaiting its acknowledgement. The ETM reports +EMQPUB:<idx>:SEND OK / SEND FAIL, the
+ * oldest publish to idx is the one acknowledged. Only tracked publishes keep their data (for a
+ * resend) and a callback. One given up on (expired) keeps its slot for a late acknowledgement. */
+struct etminflight{
+  int seq;
+  int8_t tpcidx;
+  uint8_t qos;
+  uint8_t retries;
+  bool expired;
+  uint32_t senttime;
+  uint8_t *data;
+  uint16_t datalen;
+  _pubcb cb;
+  void *ctx;
 };
 
 typedef struct
@@ -152,13 +357,51 @@ typedef struct
 }ETM_UARTConfig_t;
 
 typedef struct {
+  /* Current link rate and flow control, and the highest rate line errors still allow */
   ETM_UARTConfig_t   UART_Config;
+  uint32_t           baudlimit;
   ETM_IO_t           fops;
   App_GetTickCb_Func  GetTickCb;
   uint8_t             CmdResp[ETM_CMD_SIZE];
+  /* Outgoing command buffer */
+  char                CmdString[ETM_CMD_SIZE];
+  /* Bits for scan values which are persistent. i.e. even if a call to AT_RetrieveData does not
+   * include these flags they will be scanned for. Any text matching a ScanVal flag will be returned
+   * to the caller but any text matching a persistScanVal will be dispatched to ETMProcessReceived(). */
+  uint32_t            persistScanVals;
   _msgcb fixedsubcb;
-  struct subtpc subtopics[MAX_SUB_TOPICS];
-  struct pubtpc pubtopics[MAX_PUB_TOPICS];
+  _msgchunkcb fixedsubchunkcb;
+  void *fixedsubchunkctx;
+  /* Topic tables in use, and the storage for the default ones. The name hash index is open
+   * addressed and holds topic index + 1 (0 for an empty entry). */
+  ETM_TopicTables_t topics;
+  uint8_t topichashmask;
+  uint16_t topicarenalen;
+  struct {
+    int8_t substate[MAX_SUB_TOPICS];
+    struct subtpc subtopics[MAX_SUB_TOPICS];
+    int8_t pubstate[MAX_PUB_TOPICS];
+    struct pubtpc pubtopics[MAX_PUB_TOPICS];
+    ETM_TOPIC_SENTTIME(deftopics, MAX_PUB_TOPICS)
+    uint8_t topichash[ETM_TOPIC_HASH_ENTRIES(MAX_PUB_TOPICS)];
+    char topicarena[ETM_TOPIC_ARENA_SIZE];
+  } deftopics;
+  /* Commands awaiting a final result, the one at cmdhead is in flight once sent */
+  struct etmcmd cmdqueue[ETM_ASYNC_QUEUE_SIZE];
+  uint8_t cmdhead;
+  uint8_t cmdcount;
+  int cmdhandle;
+  /* URC handlers running. Commands they send don't flush the queue, that is left to the
+   * outermost caller. */
+  uint8_t urcdepth;
+  /* Blocking commands awaiting their answer. A command queued from a callback meanwhile waits
+   * for ETMpoll() or the next command rather than go out over it. */
+  uint8_t syncdepth;
+  /* QoS 1 and 2 publishes awaiting acknowledgement, oldest at inflighthead */
+  struct etminflight inflight[ETM_INFLIGHT_SIZE];
+  uint8_t inflighthead;
+  uint8_t inflightcount;
+  int pubseq;
   unsigned int urcseen;
   _atcb atcallback;
   _statecb statecallback;
@@ -167,6 +410,8 @@ typedef struct {
   unsigned char buffered;
   uint8_t readingsub;
   tetmState currentstate;
+  /* Set by ETMpollwake() to end an idle ETMpoll() early */
+  volatile bool pollwake;
 }ETMObject_t;
 
 /* Exported functions --------------------------------------------------------*/
@@ -179,9 +424,30 @@ ETM_Return_t  ETM_RegisterBusIO(ETMObject_t *Obj, IO_Init_Func IO_Init,
                                                      IO_Send_Func IO_Send,
                                                      IO_ReceiveOne_Func IO_ReceiveOne,
                                                      IO_Flush_Func IO_Flush);
+/* Optionally register block receive functions, used in preference to IO_ReceiveOne */
+ETM_Return_t  ETM_RegisterBusPeekIO(ETMObject_t *Obj, IO_Peek_Func IO_Peek, IO_Consume_Func IO_Consume);
+/* Optionally register a receive wait function, used instead of sleeping a tick when idle, and
+ * the function ETMpollwake() ends it early with (NULL if the wait can't be woken) */
+ETM_Return_t  ETM_RegisterBusWaitIO(ETMObject_t *Obj, IO_Wait_Func IO_Wait, IO_Wake_Func IO_Wake);
+/* Optionally register link control, with which ETM_Init() turns on flow control and raises the
+ * rate (AT+IFC, AT+IPR) and ETMpoll() lowers it again if line errors appear */
+ETM_Return_t  ETM_RegisterBusLinkIO(ETMObject_t *Obj, IO_FlowControl_Func IO_FlowControl, IO_LineErrors_Func IO_LineErrors);
+/* Optionally register receive buffer statistics, read with ETM_GetRxStats() */
+ETM_Return_t  ETM_RegisterBusStatsIO(ETMObject_t *Obj, IO_RxStats_Func IO_RxStats);
+/* Receive buffer statistics, ETM_RETURN_ERROR if the IO layer doesn't keep them */
+ETM_Return_t  ETM_GetRxStats(ETMObject_t *Obj, ETM_RxStats_t *Stats);
+/* Run data through the response matcher and count the keywords found, -1 until ETM_Init() has
+ * built the matcher (for the matcher benchmark in tools/etm_sim) */
+int32_t       ETM_MatchScan(const uint8_t *pData, uint32_t Length);
 
 ETM_InitRet_t ETM_Init(ETMObject_t *Obj, _atcb urccallback);
+/* Use tables (see ETM_TOPIC_TABLES) in place of the default MAX_SUB_TOPICS and MAX_PUB_TOPICS
+ * entries. Call before ETM_Init(), the tables are kept by reference. */
+ETM_Return_t  ETM_RegisterTopicTables(ETMObject_t *Obj, const ETM_TopicTables_t *tables);
 void ETMpoll(ETMObject_t *Obj);
+/* Make an idle ETMpoll() return early (from another task, a polling task blocked in IO_Wait
+ * is woken through IO_Wake) */
+void ETMpollwake(ETMObject_t *Obj);
 
 uint8_t *ETMSendATCommand(ETMObject_t *Obj, uint8_t *cmdstr, uint32_t retflags, uint32_t timeout);
 
@@ -191,12 +457,51 @@ void ETMupdateState(ETMObject_t *Obj, tetmRequestState streq);
 void ETMstatecb(ETMObject_t *Obj, _statecb stateupdatecb);
 
 void ETMfixedsubsetcallback(ETMObject_t *Obj, _msgcb callback);
+void ETMfixedsubsetchunkcallback(ETMObject_t *Obj, _msgchunkcb callback, void *ctx);
 int ETMsubscribe(ETMObject_t *Obj, char *topic, _msgcb callback);
+/* Subscribe with chunked delivery, for messages which may be larger than ETM_CMD_SIZE */
+int ETMsubscribeChunked(ETMObject_t *Obj, char *topic, _msgchunkcb callback, void *ctx);
 int ETMunsubscribe(ETMObject_t *Obj, int idx);
+tsubTopicState ETMsubstate(ETMObject_t *Obj, int idx);
 
+/* Register a publish topic, a name which is already registered keeps its index */
 int ETMpubreg(ETMObject_t *Obj, char *topic);
 int ETMpubunreg(ETMObject_t *Obj, int idx);
+tpubTopicState ETMpubstate(ETMObject_t *Obj, int idx);
 int ETMpublish(ETMObject_t *Obj, int tpcidx, uint8_t qos, uint8_t *data, uint16_t datalen);
+int ETMpublishRaw(ETMObject_t *Obj, int tpcidx, uint8_t qos, uint8_t *data, uint16_t datalen);
+/* Publish a message to a topic by name. The topic is registered on first use (and again after
+ * the ETM restarts), waiting up to ETM_TOUT_5000 for the registration. */
+int ETMpublishTopic(ETMObject_t *Obj, const char *topic, uint8_t qos, uint8_t *data, uint16_t datalen);
+/* Publish a message and report the broker's acknowledgement to donecb. Returns the publish's
+ * sequence id, or -1 if it wasn't accepted or ETM_INFLIGHT_SIZE publishes are already awaiting
+ * acknowledgement. data is not copied and must stay valid until donecb as a publish answered
+ * with SEND FAIL is sent again. QoS 0 publishes complete before this returns. */
+int ETMpublishTracked(ETMObject_t *Obj, int tpcidx, uint8_t qos, uint8_t *data, uint16_t datalen, _pubcb donecb, void *ctx);
+/* Publishes awaiting acknowledgement. Untracked QoS 1 and 2 publishes are counted too, and while
+ * the window is full no QoS 1 or 2 publish is accepted. Publishes given up on after
+ * ETM_INFLIGHT_TIMEOUT are counted for as long again, in case their acknowledgement comes. */
+int ETMpubInflight(ETMObject_t *Obj);
+/* Publish n items, with up to ETM_PUB_BATCH_WINDOW frames written ahead of their results.
+ * Returns the number published, the optional results array gets each item's RET_OK,
+ * RET_ERROR, ETM_RETURN_NO_DATA or ETM_RETURN_SEND_ERROR (also for a QoS 1 or 2 item while
+ * ETMpubInflight() is at ETM_INFLIGHT_SIZE). */
+int ETMpublishBatch(ETMObject_t *Obj, const ETM_PubItem_t *items, size_t n, int32_t *results);
+
+/* ==== Asynchronous commands ==== */
+/* These queue the command and return its handle (-1 on failure) without waiting for the result.
+ * The next queued command is sent as soon as the previous one completes, results are collected
+ * by ETMpoll() and reported to the optional completion callback. The blocking functions above
+ * wait for any queued commands to complete first. Called from a message or state callback the
+ * command is only queued, it is sent by the next ETMpoll() or blocking command. */
+int ETMsubscribeAsync(ETMObject_t *Obj, char *topic, _msgcb callback, int *tpcidx, _cmdcb donecb, void *ctx);
+int ETMpubregAsync(ETMObject_t *Obj, char *topic, int *tpcidx, _cmdcb donecb, void *ctx);
+/* A QoS 1 or 2 publish whose turn comes with the acknowledgement window full completes with
+ * ETM_RETURN_SEND_ERROR */
+int ETMpublishAsync(ETMObject_t *Obj, int tpcidx, uint8_t qos, uint8_t *data, uint16_t datalen, _cmdcb donecb, void *ctx);
+int ETMupdateStateAsync(ETMObject_t *Obj, tetmRequestState streq, _cmdcb donecb, void *ctx);
+/* Is a queued command still waiting to complete */
+bool ETMcmdpending(ETMObject_t *Obj, int handle);
 
 /* Application must provide callback function that gives a Timer Tick in ms (e.g. HAL_GetTick())*/
 ETM_Return_t ETM_RegisterTickCb(ETMObject_t *Obj, App_GetTickCb_Func  GetTickCb);
@@ -207,6 +512,13 @@ int ETMGetHostFW(ETMObject_t *Obj, char *url, _fwupdcb cb);
 int ETMGetHostFWDetails(ETMObject_t *Obj, uint32_t *len, uint16_t *cs);
 /* Read a section of the host fw */
 int ETMReadHostFW(ETMObject_t *Obj, uint32_t offset, uint16_t len, uint8_t *respbuf);
+/* The two halves of ETMReadHostFW() for pipelined reads: send the read, then later take its
+ * answer, decoding the ascii-hex straight from the receive buffer so len isn't limited by
+ * ETM_CMD_SIZE. Nothing else may be sent in between. Both return 0 or -1. An answer of another
+ * length fails, and a late or damaged one is read to its end (waiting up to timeout again) so the
+ * read can be asked for again. */
+int ETMReadHostFWRequest(ETMObject_t *Obj, uint32_t offset, uint16_t len);
+int ETMReadHostFWCollect(ETMObject_t *Obj, uint8_t *respbuf, uint16_t len, uint32_t timeout);
 /* Acknowledge the firmware has been downloaded and accepted */
 int ETMAckHostFW(ETMObject_t *Obj);
 #ifdef __cplusplus
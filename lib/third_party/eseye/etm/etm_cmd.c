@@ -0,0 +1,269 @@
+/**
+  ******************************************************************************
+  * @file    etm_cmd.c
+  ******************************************************************************
+  */
+/* Includes ------------------------------------------------------------------*/
+#include <string.h>
+#include <stdbool.h>
+
+#include "etm_cmd.h"
+
+/* Private variable ---------------------------------------------------------*/
+
+/* Ascii-hex representation of every octet value, two characters per octet */
+static const char HexPairs[512 + 1] =
+  "000102030405060708090A0B0C0D0E0F"
+  "101112131415161718191A1B1C1D1E1F"
+  "202122232425262728292A2B2C2D2E2F"
+  "303132333435363738393A3B3C3D3E3F"
+  "404142434445464748494A4B4C4D4E4F"
+  "505152535455565758595A5B5C5D5E5F"
+  "606162636465666768696A6B6C6D6E6F"
+  "707172737475767778797A7B7C7D7E7F"
+  "808182838485868788898A8B8C8D8E8F"
+  "909192939495969798999A9B9C9D9E9F"
+  "A0A1A2A3A4A5A6A7A8A9AAABACADAEAF"
+  "B0B1B2B3B4B5B6B7B8B9BABBBCBDBEBF"
+  "C0C1C2C3C4C5C6C7C8C9CACBCCCDCECF"
+  "D0D1D2D3D4D5D6D7D8D9DADBDCDDDEDF"
+  "E0E1E2E3E4E5E6E7E8E9EAEBECEDEEEF"
+  "F0F1F2F3F4F5F6F7F8F9FAFBFCFDFEFF";
+
+/* Private functions ---------------------------------------------------------*/
+
+/* Value of an ascii-hex character, -1 if it isn't one */
+static int hexvalue(char c){
+  if(c >= '0' && c <= '9')
+    return c - '0';
+  if(c >= 'a' && c <= 'f')
+    return c - 'a' + 10;
+  if(c >= 'A' && c <= 'F')
+    return c - 'A' + 10;
+  return -1;
+}
+
+/* Take two characters and convert to an octet assuming they are ascii-hex */
+static int hextooctet(const char *hex){
+  int hi = hexvalue(hex[0]), lo;
+
+  if(hi < 0)
+    return -1;
+  lo = hexvalue(hex[1]);
+  if(lo < 0)
+    return -1;
+  return (hi << 4) | lo;
+}
+
+/* Reserve len characters, false (and the command marked overflowed) if they don't fit.
+ * len is wider than the buffer so a length that overruns 16 bits can't wrap past the check */
+static bool ETMcmdReserve(ETM_CmdBuf_t *cmd, uint32_t len){
+  if(cmd->overflow || len > ETMcmdRoom(cmd)){
+    cmd->overflow = true;
+    return false;
+  }
+  return true;
+}
+
+static void ETMcmdAppend(ETM_CmdBuf_t *cmd, const char *str, uint32_t len){
+  if(!ETMcmdReserve(cmd, len))
+    return;
+  memcpy(&cmd->buf[cmd->len], str, len);
+  cmd->len += len;
+  cmd->buf[cmd->len] = 0;
+}
+
+/* Decimal digits, built from the right */
+static void ETMcmdNumber(ETM_CmdBuf_t *cmd, uint32_t value, bool negative){
+  char digits[11];
+  char *p = &digits[sizeof(digits)];
+
+  do{
+    *--p = '0' + (value % 10);
+    value /= 10;
+  }while(value != 0);
+  if(negative)
+    *--p = '-';
+  ETMcmdAppend(cmd, p, &digits[sizeof(digits)] - p);
+}
+
+/* Skip leading spaces then the digits of a number, the caller converts them */
+static const char *ETMtokDigits(ETM_Tok_t *tok, bool hex, bool *negative){
+  const char *p = tok->pos;
+
+  while(*p == ' ')
+    p++;
+  *negative = false;
+  if(*p == '-'){
+    *negative = true;
+    p++;
+  }
+  if(hex ? (hexvalue(*p) < 0) : (*p < '0' || *p > '9'))
+    return NULL;
+  return p;
+}
+
+/* End a field, skipping the ',' separating it from the next */
+static void ETMtokEndField(ETM_Tok_t *tok, const char *p){
+  if(*p == ',')
+    p++;
+  tok->pos = p;
+}
+
+/* --------------------------------------------------------------------------*/
+/* --- Public functions -----------------------------------------------------*/
+/* --------------------------------------------------------------------------*/
+
+void ETMcmdStart(ETM_CmdBuf_t *cmd, char *buf, uint16_t size){
+  cmd->buf = buf;
+  cmd->size = size;
+  cmd->len = 0;
+  cmd->overflow = (size == 0);
+  if(size > 0)
+    buf[0] = 0;
+}
+
+uint16_t ETMcmdRoom(const ETM_CmdBuf_t *cmd){
+  /* One character is kept for the terminator */
+  if(cmd->size == 0)
+    return 0;
+  return cmd->size - 1 - cmd->len;
+}
+
+void ETMcmdLiteral(ETM_CmdBuf_t *cmd, const char *str){
+  ETMcmdAppend(cmd, str, strlen(str));
+}
+
+void ETMcmdUnsigned(ETM_CmdBuf_t *cmd, uint32_t value){
+  ETMcmdNumber(cmd, value, false);
+}
+
+void ETMcmdSigned(ETM_CmdBuf_t *cmd, int32_t value){
+  if(value < 0)
+    ETMcmdNumber(cmd, 0 - (uint32_t)value, true);
+  else
+    ETMcmdNumber(cmd, (uint32_t)value, false);
+}
+
+void ETMcmdQuoted(ETM_CmdBuf_t *cmd, const char *str){
+  uint32_t len = strlen(str);
+
+  if(!ETMcmdReserve(cmd, len + 2))
+    return;
+  ETMcmdAppend(cmd, "\"", 1);
+  ETMcmdAppend(cmd, str, len);
+  ETMcmdAppend(cmd, "\"", 1);
+}
+
+/* One lookup in the hex pair table per octet, the loop unrolled to four octets per pass */
+void ETMcmdHex(ETM_CmdBuf_t *cmd, const uint8_t *data, uint16_t len){
+  char *dest;
+
+  if(!ETMcmdReserve(cmd, (uint32_t)len * 2))
+    return;
+  dest = &cmd->buf[cmd->len];
+  cmd->len += (uint32_t)len * 2;
+  while(len >= 4){
+    memcpy(&dest[0], &HexPairs[data[0] * 2], 2);
+    memcpy(&dest[2], &HexPairs[data[1] * 2], 2);
+    memcpy(&dest[4], &HexPairs[data[2] * 2], 2);
+    memcpy(&dest[6], &HexPairs[data[3] * 2], 2);
+    data += 4;
+    dest += 8;
+    len -= 4;
+  }
+  while(len-- > 0){
+    memcpy(dest, &HexPairs[*data++ * 2], 2);
+    dest += 2;
+  }
+  *dest = 0;
+}
+
+int ETMcmdEnd(ETM_CmdBuf_t *cmd){
+  return cmd->overflow ? -1 : cmd->len;
+}
+
+void ETMtokStart(ETM_Tok_t *tok, const char *str){
+  tok->pos = str;
+}
+
+bool ETMtokSigned(ETM_Tok_t *tok, int32_t *value){
+  bool negative;
+  uint32_t v = 0;
+  const char *p = ETMtokDigits(tok, false, &negative);
+
+  if(p == NULL)
+    return false;
+  while(*p >= '0' && *p <= '9')
+    v = v * 10 + (*p++ - '0');
+  *value = negative ? -(int32_t)v : (int32_t)v;
+  ETMtokEndField(tok, p);
+  return true;
+}
+
+bool ETMtokUnsigned(ETM_Tok_t *tok, uint32_t *value){
+  bool negative;
+  uint32_t v = 0;
+  const char *p = ETMtokDigits(tok, false, &negative);
+
+  if(p == NULL || negative)
+    return false;
+  while(*p >= '0' && *p <= '9')
+    v = v * 10 + (*p++ - '0');
+  *value = v;
+  ETMtokEndField(tok, p);
+  return true;
+}
+
+bool ETMtokHex(ETM_Tok_t *tok, uint32_t *value){
+  bool negative;
+  uint32_t v = 0;
+  int digit;
+  const char *p = ETMtokDigits(tok, true, &negative);
+
+  if(p == NULL || negative)
+    return false;
+  while((digit = hexvalue(*p)) >= 0){
+    v = (v << 4) | digit;
+    p++;
+  }
+  *value = v;
+  ETMtokEndField(tok, p);
+  return true;
+}
+
+bool ETMtokSkipPast(ETM_Tok_t *tok, char c){
+  const char *p = strchr(tok->pos, c);
+
+  if(p == NULL)
+    return false;
+  tok->pos = p + 1;
+  return true;
+}
+
+uint16_t ETMtokHexOctets(ETM_Tok_t *tok, uint8_t *dest, uint16_t max){
+  const char *p = tok->pos;
+  uint16_t count = 0;
+  int octet;
+
+  while(count < max && (octet = hextooctet(p)) >= 0){
+    dest[count++] = (uint8_t)octet;
+    p += 2;
+  }
+  ETMtokEndField(tok, p);
+  return count;
+}
+
+bool ETMhexDecode(const char *src, uint16_t count, uint8_t *dest){
+  uint16_t x;
+  int octet;
+
+  /* Forwards so dest may be src, octet x is written after characters 2x and 2x+1 are read */
+  for(x = 0; x < count; x++){
+    octet = hextooctet(&src[x * 2]);
+    if(octet < 0)
+      return false;
+    dest[x] = (uint8_t)octet;
+  }
+  return true;
+}
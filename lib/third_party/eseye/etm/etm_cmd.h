@@ -0,0 +1,71 @@
+/**
+  ******************************************************************************
+  * @file    etm_cmd.h
+  ******************************************************************************
+  */
+/* Define to prevent recursive inclusion -------------------------------------*/
+#ifndef __ETM_CMD_H
+#define __ETM_CMD_H
+
+#ifdef __cplusplus
+ extern "C" {
+#endif
+
+/* Includes ------------------------------------------------------------------*/
+#include "stdint.h"
+#include "stdbool.h"
+
+/* AT command builder and URC tokenizer. Commands are built in a caller's buffer without the
+ * printf family and URC payloads are parsed where they lie in the response buffer. */
+
+/* Exported typedef ----------------------------------------------------------*/
+
+/* Command being built. A piece which doesn't fit is left out whole and the command marked as
+ * overflowed, the buffer is always terminated. */
+typedef struct {
+  char *buf;
+  uint16_t size;
+  uint16_t len;
+  bool overflow;
+} ETM_CmdBuf_t;
+
+/* Position in a (null terminated) URC payload */
+typedef struct {
+  const char *pos;
+} ETM_Tok_t;
+
+/* Exported functions --------------------------------------------------------*/
+
+/* Command builder */
+void ETMcmdStart(ETM_CmdBuf_t *cmd, char *buf, uint16_t size);
+void ETMcmdLiteral(ETM_CmdBuf_t *cmd, const char *str);
+void ETMcmdUnsigned(ETM_CmdBuf_t *cmd, uint32_t value);
+void ETMcmdSigned(ETM_CmdBuf_t *cmd, int32_t value);
+/* str enclosed in double quotes */
+void ETMcmdQuoted(ETM_CmdBuf_t *cmd, const char *str);
+/* len octets as ascii-hex (2 * len characters) */
+void ETMcmdHex(ETM_CmdBuf_t *cmd, const uint8_t *data, uint16_t len);
+/* Characters that can still be added */
+uint16_t ETMcmdRoom(const ETM_CmdBuf_t *cmd);
+/* Finish the command, returns its length or -1 if it overflowed */
+int ETMcmdEnd(ETM_CmdBuf_t *cmd);
+
+/* URC tokenizer. Number fields skip leading spaces and the ',' which ends them, and return
+ * false (leaving the position alone) if there are no digits. */
+void ETMtokStart(ETM_Tok_t *tok, const char *str);
+bool ETMtokSigned(ETM_Tok_t *tok, int32_t *value);
+bool ETMtokUnsigned(ETM_Tok_t *tok, uint32_t *value);
+bool ETMtokHex(ETM_Tok_t *tok, uint32_t *value);
+/* Move past the next c, false if there isn't one */
+bool ETMtokSkipPast(ETM_Tok_t *tok, char c);
+/* Decode an ascii-hex field into up to max octets, returns the number decoded */
+uint16_t ETMtokHexOctets(ETM_Tok_t *tok, uint8_t *dest, uint16_t max);
+
+/* Decode count octets of ascii-hex from src to dest, which may be src (decoding in place).
+ * Returns false at the first pair that isn't ascii-hex. */
+bool ETMhexDecode(const char *src, uint16_t count, uint8_t *dest);
+
+#ifdef __cplusplus
+}
+#endif
+#endif /*__ETM_CMD_H */
@@ -21,6 +21,38 @@
 
 #define ETM_DEFAULT_BAUDRATE                   115200 
 
+/* Highest rate the link is raised to after start-up (ETM_DEFAULT_BAUDRATE to stay put), whether
+   to use RTS/CTS flow control (only where the board routes both lines, see UART_C2C_FLOW_CONTROL)
+   and the line errors in one poll which drop the link a rate */
+#define ETM_BAUDRATE_MAX                       921600
+#define ETM_FLOW_CONTROL                       0
+#define ETM_LINE_ERRORS_MAX                    4
+
+/* Asynchronous command queue depth and the longest queued (non publish) command */
+#define ETM_ASYNC_QUEUE_SIZE                   8
+#define ETM_ASYNC_CMD_SIZE                     128
+
+/* Batch publish frames written ahead of their results. 1 waits for each result in turn, raise
+ * it only for ETM firmware confirmed to buffer commands sent while it is busy. */
+#define ETM_PUB_BATCH_WINDOW                   1
+
+/* QoS 1 publishes awaiting SEND OK / SEND FAIL, resends after SEND FAIL and the longest wait (ms) */
+#define ETM_INFLIGHT_SIZE                      8
+#define ETM_INFLIGHT_RETRIES                   2
+#define ETM_INFLIGHT_TIMEOUT                   30000
+
+/* Default topic tables, ETM_RegisterTopicTables() gives an object tables of any size up to
+ * ETM_MAX_TOPICS */
+#define MAX_SUB_TOPICS                         8
+#define MAX_PUB_TOPICS                         8
+/* Space for the names of registered publish topics (ETMpublishTopic) in the default tables */
+#define ETM_TOPIC_ARENA_SIZE                   256
+
+/* Store-and-forward (etm_store.c): flash page programmed at once and the longest stored topic
+ * name plus payload */
+#define ETM_STORE_PAGE_SIZE                    256
+#define ETM_STORE_RECORD_SIZE                  512
+
 /* Rx and Tx buffer size, depend as the applic handles the buffer */
 #define ETM_TX_DATABUF_SIZE                    1460 
 #define ETM_RX_DATABUF_SIZE                    1500                        1
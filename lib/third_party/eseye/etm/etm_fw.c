@@ -0,0 +1,124 @@
+/**
+  ******************************************************************************
+  * @file    etm_fw.c
+  ******************************************************************************
+  */
+/* Includes ------------------------------------------------------------------*/
+#include <stdio.h>
+#include <string.h>
+#include <stdbool.h>
+
+#include "FreeRTOS.h"
+
+#include "etm.h"
+#include "etm_fw.h"
+
+#define UARTDEBUGPRINTF(x...) configPRINTF((x))
+
+/* Private functions ---------------------------------------------------------*/
+
+/* The ETM's image checksum: big-endian 16 bit words XORed, an odd last octet as the low byte.
+ * offset must be even, which holds as every chunk but the last is an even length. */
+static uint16_t FwChecksum(uint16_t cs, const uint8_t *data, uint16_t len){
+  uint16_t x;
+
+  for(x = 0; x + 1 < len; x += 2)
+    cs ^= (uint16_t)((data[x] << 8) | data[x + 1]);
+  if(x < len)
+    cs ^= data[x];
+  return cs;
+}
+
+static ETMFwResult_t FwFail(ETMFwDownload_t *Dl, ETMFwResult_t err, uint32_t offset){
+  UARTDEBUGPRINTF("Host firmware download failed (%d) at %lu\r\n", (int)err, (unsigned long)offset);
+  if(Dl->error != NULL)
+    Dl->error(Dl->ctx, err, offset);
+  return err;
+}
+
+/* Take the answer to the read in flight, asking again if it is lost or damaged. The collect reads
+ * a late or damaged answer to its end first, so it isn't taken for the answer to the new read. */
+static bool FwCollect(ETMObject_t *Obj, ETMFwDownload_t *Dl, uint32_t offset, uint16_t len, uint8_t *buf){
+  int tries;
+
+  for(tries = 0; ; tries++){
+    if(ETMReadHostFWCollect(Obj, buf, len, ETM_TOUT_500) == 0){
+      Dl->stats.reads++;
+      return true;
+    }
+    if(tries >= ETM_FW_RETRIES)
+      return false;
+    Dl->stats.retries++;
+    UARTDEBUGPRINTF("Reading host firmware at %lu again\r\n", (unsigned long)offset);
+    ETMReadHostFWRequest(Obj, offset, len);
+  }
+}
+
+/* Exported functions --------------------------------------------------------*/
+
+ETMFwResult_t ETMFwDownload(ETMObject_t *Obj, ETMFwDownload_t *Dl){
+  uint32_t offset = 0, next, start;
+  uint16_t chunk, len, cs = 0;
+  ETMFwCheckpoint_t cp;
+  uint8_t *buf;
+  int stage = 0;
+
+  chunk = (Dl->chunk < 2 || Dl->chunk > ETM_FW_CHUNK_SIZE) ? ETM_FW_CHUNK_SIZE : Dl->chunk;
+  chunk &= ~1;
+  memset(&Dl->stats, 0, sizeof(Dl->stats));
+  start = Obj->GetTickCb();
+
+  if(ETMGetHostFWDetails(Obj, &Dl->len, &Dl->cs) != 0 || Dl->len == 0)
+    return FwFail(Dl, ETM_FW_ERR_DETAILS, 0);
+  cp.len = Dl->len;
+  cp.cs = Dl->cs;
+
+  /* Only the same image can be carried on with, chunks start at even offsets */
+  if(Dl->resume.offset != 0){
+    if(Dl->resume.len == Dl->len && Dl->resume.cs == Dl->cs && Dl->resume.offset <= Dl->len &&
+       ((Dl->resume.offset & 1) == 0 || Dl->resume.offset == Dl->len)){
+      offset = Dl->resume.offset;
+      cs = Dl->resume.sofar;
+      UARTDEBUGPRINTF("Carrying on with the host firmware at %lu\r\n", (unsigned long)offset);
+    }else{
+      UARTDEBUGPRINTF("Host firmware has changed, reading it from the start\r\n");
+    }
+  }
+  Dl->stats.resumed = offset;
+
+  if(offset < Dl->len)
+    ETMReadHostFWRequest(Obj, offset, MIN(chunk, Dl->len - offset));
+  while(offset < Dl->len){
+    buf = Dl->stage[stage];
+    len = MIN(chunk, Dl->len - offset);
+    if(!FwCollect(Obj, Dl, offset, len, buf))
+      return FwFail(Dl, ETM_FW_ERR_READ, offset);
+
+    /* Ask for the next chunk before handing this one on, it arrives in the other buffer */
+    next = offset + len;
+    if(next < Dl->len)
+      ETMReadHostFWRequest(Obj, next, MIN(chunk, Dl->len - next));
+
+    cs = FwChecksum(cs, buf, len);
+    if(Dl->sink(Dl->ctx, offset, buf, len) != 0){
+      /* Take the read in flight so the link is left clean */
+      if(next < Dl->len)
+        ETMReadHostFWCollect(Obj, Dl->stage[stage ^ 1], MIN(chunk, Dl->len - next), ETM_TOUT_500);
+      return FwFail(Dl, ETM_FW_ERR_SINK, offset);
+    }
+    offset = next;
+    stage ^= 1;
+    if(Dl->checkpoint != NULL){
+      cp.sofar = cs;
+      cp.offset = offset;
+      Dl->checkpoint(Dl->ctx, &cp);
+    }
+    if(Dl->progress != NULL)
+      Dl->progress(Dl->ctx, offset, Dl->len);
+  }
+  Dl->stats.ms = Obj->GetTickCb() - start;
+
+  if(cs != Dl->cs)
+    return FwFail(Dl, ETM_FW_ERR_CHECKSUM, Dl->len);
+  return ETM_FW_OK;
+}
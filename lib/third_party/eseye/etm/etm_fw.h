@@ -0,0 +1,103 @@
+/**
+  ******************************************************************************
+  * @file    etm_fw.h
+  ******************************************************************************
+  */
+/* Define to prevent recursive inclusion -------------------------------------*/
+#ifndef __ETM_FW_H
+#define __ETM_FW_H
+
+#ifdef __cplusplus
+ extern "C" {
+#endif
+
+/* Includes ------------------------------------------------------------------*/
+#include "stdint.h"
+#include "stdbool.h"
+
+#include "etm.h"
+
+/* Streamed download of the host firmware image the ETM has fetched (see ETMGetHostFW()). The
+ * image is read in chunks of up to ETM_FW_CHUNK_SIZE octets, each decoded from the receive
+ * buffer straight into one of two staging buffers. The read of the next chunk is sent before the
+ * current one is handed to the sink, so the ETM reads and sends it while the sink writes to
+ * flash. The download is checked against the checksum the ETM reports.
+ *
+ * After each chunk the sink takes the checkpoint callback is given where the download has got
+ * to. A download that was cut short (the link dropped, the ETM rebooted or the host restarted
+ * with the checkpoint kept somewhere) carries on from a checkpoint given as resume, as long as
+ * the ETM still has the same image. */
+
+/* Largest chunk read at once, even. The ascii-hex of a chunk (twice its size) should fit the
+ * transport's receive buffer as it arrives while the sink is busy. */
+#ifndef ETM_FW_CHUNK_SIZE
+#define ETM_FW_CHUNK_SIZE                   512
+#endif
+/* Times a chunk is asked for again before the download fails */
+#ifndef ETM_FW_RETRIES
+#define ETM_FW_RETRIES                      3
+#endif
+
+/* Exported typedef ----------------------------------------------------------*/
+
+typedef enum {
+  ETM_FW_OK = 0,
+  ETM_FW_ERR_DETAILS,     /* The ETM has no image or didn't give its length and checksum */
+  ETM_FW_ERR_READ,        /* A chunk couldn't be read in ETM_FW_RETRIES + 1 tries */
+  ETM_FW_ERR_SINK,        /* The sink refused a chunk */
+  ETM_FW_ERR_CHECKSUM,    /* The image read doesn't match the ETM's checksum */
+} ETMFwResult_t;
+
+/* Take len octets of the image at offset, chunks come in order. data isn't overwritten until the
+ * sink's next call has returned. Returns 0 or -1 to give up. */
+typedef int (*ETMFw_Sink_Func)(void *ctx, uint32_t offset, const uint8_t *data, uint16_t len);
+/* Called after each chunk with the octets taken so far */
+typedef void (*ETMFw_Progress_Func)(void *ctx, uint32_t done, uint32_t total);
+/* Called once when the download fails, offset is the chunk being read or written */
+typedef void (*ETMFw_Error_Func)(void *ctx, ETMFwResult_t err, uint32_t offset);
+
+typedef struct {
+  uint32_t reads;           /* Chunks read */
+  uint32_t retries;         /* Chunks asked for again */
+  uint32_t ms;              /* Time taken, from the image details to the last chunk */
+  uint32_t resumed;         /* Offset the download carried on from, 0 from the start */
+} ETMFwStats_t;
+
+/* Where a download has got to, enough to carry on from there */
+typedef struct {
+  uint32_t len;             /* The image's length and checksum, as the ETM gave them */
+  uint16_t cs;
+  uint16_t sofar;           /* Checksum of the octets before offset */
+  uint32_t offset;          /* Octets the sink has taken, even unless it is the whole image */
+} ETMFwCheckpoint_t;
+
+/* Called after each chunk the sink has taken */
+typedef void (*ETMFw_Checkpoint_Func)(void *ctx, const ETMFwCheckpoint_t *cp);
+
+typedef struct {
+  ETMFw_Sink_Func     sink;
+  ETMFw_Progress_Func progress;   /* Optional */
+  ETMFw_Error_Func    error;      /* Optional */
+  ETMFw_Checkpoint_Func checkpoint; /* Optional */
+  void               *ctx;
+  uint16_t            chunk;      /* Octets per read (even), 0 for ETM_FW_CHUNK_SIZE */
+  /* Carry on from a checkpoint, zero to start at the beginning. If the ETM's image doesn't
+   * match it the download starts again, and the sink's first chunk is at offset 0. */
+  ETMFwCheckpoint_t   resume;
+  /* Filled in by ETMFwDownload() */
+  uint32_t            len;
+  uint16_t            cs;
+  ETMFwStats_t        stats;
+  uint8_t             stage[2][ETM_FW_CHUNK_SIZE];
+} ETMFwDownload_t;
+
+/* Exported functions --------------------------------------------------------*/
+
+/* Read the whole image into the sink. Set sink, ctx and any of progress, error, checkpoint, chunk
+ * and resume first. */
+ETMFwResult_t ETMFwDownload(ETMObject_t *Obj, ETMFwDownload_t *Dl);
+
+#ifdef __cplusplus
+}
+#endif
+#endif /*__ETM_FW_H */
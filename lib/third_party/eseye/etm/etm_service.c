@@ -0,0 +1,238 @@
+/**
+  ******************************************************************************
+  * @file    etm_service.c
+  ******************************************************************************
+  */
+/* Includes ------------------------------------------------------------------*/
+#include <stdio.h>
+#include <string.h>
+#include <stdbool.h>
+
+#include "FreeRTOS.h"
+#include "task.h"
+#include "semphr.h"
+#include "message_buffer.h"
+
+#include "etm.h"
+#include "etm_service.h"
+
+#define UARTDEBUGPRINTF(x...) configPRINTF((x))
+
+/* Private functions ---------------------------------------------------------*/
+
+/* Chunked message callback for service subscriptions. Chunks are collected and the whole
+ * message written to the subscriber's inbox, a full inbox drops the message rather than
+ * holding up the service. */
+static void ETMServiceDeliver(void *ctx, uint32_t offset, uint8_t *chunk, uint32_t chunk_len, uint32_t total_len){
+  struct etmsubscriber *sub = (struct etmsubscriber *)ctx;
+  ETMService_t *Svc = sub->svc;
+
+  if(sub->inbox == NULL || sub->closing)
+    return;
+  if(total_len > ETM_SERVICE_MSG_SIZE){
+    if(offset == 0)
+      UARTDEBUGPRINTF("Dropping %lu octet message (ETM_SERVICE_MSG_SIZE %d)\r\n", (unsigned long)total_len, ETM_SERVICE_MSG_SIZE);
+    return;
+  }
+  memcpy(&Svc->msg[offset], chunk, chunk_len);
+  if(offset + chunk_len == total_len){
+    if(xMessageBufferSend(sub->inbox, Svc->msg, total_len, 0) != total_len)
+      UARTDEBUGPRINTF("Subscriber inbox full, message dropped\r\n");
+  }
+}
+
+/* Give back the slots of subscriptions the ETM refused, or which have closed */
+static void ETMServiceSweep(ETMService_t *Svc){
+  tsubTopicState state;
+  int i;
+
+  for(i = 0; i < ETM_SERVICE_SUBSCRIBERS; i++){
+    if(Svc->subscribers[i].inbox == NULL)
+      continue;
+    state = ETMsubstate(Svc->Obj, Svc->subscribers[i].tpcidx);
+    if(state == SUB_TOPIC_NOT_IN_USE || state == SUB_TOPIC_ERROR){
+      Svc->subscribers[i].inbox = NULL;
+      Svc->subscribers[i].closing = false;
+    }
+  }
+}
+
+/* Carry out a request in the service task */
+static void ETMServiceHandle(ETMService_t *Svc, ETMServiceReq_t *req, uint8_t *data){
+  tsubTopicState state;
+  int32_t result = -1;
+  int i;
+
+  switch(req->kind){
+    case ETM_SVC_PUBLISH:
+      result = ETMpublish(Svc->Obj, req->tpcidx, req->qos, data, req->datalen);
+      break;
+    case ETM_SVC_PUBREG:
+      result = ETMpubreg(Svc->Obj, (char *)data);
+      break;
+    case ETM_SVC_SUBSCRIBE:
+      ETMServiceSweep(Svc);
+      for(i = 0; i < ETM_SERVICE_SUBSCRIBERS; i++){
+        if(Svc->subscribers[i].inbox == NULL)
+          break;
+      }
+      if(i == ETM_SERVICE_SUBSCRIBERS)
+        break;
+      result = ETMsubscribeChunked(Svc->Obj, (char *)data, ETMServiceDeliver, &Svc->subscribers[i]);
+      /* The topic index comes back even if AT+EMQSUBOPEN was refused, the state tells */
+      if(result >= 0){
+        state = ETMsubstate(Svc->Obj, result);
+        if(state != SUB_TOPIC_SUBSCRIBING && state != SUB_TOPIC_SUBSCRIBED)
+          result = -1;
+      }
+      if(result >= 0){
+        Svc->subscribers[i].svc = Svc;
+        Svc->subscribers[i].inbox = req->inbox;
+        Svc->subscribers[i].tpcidx = (int8_t)result;
+        Svc->subscribers[i].closing = false;
+      }
+      break;
+    case ETM_SVC_UNSUBSCRIBE:
+      for(i = 0; i < ETM_SERVICE_SUBSCRIBERS; i++){
+        if(Svc->subscribers[i].inbox != NULL && !Svc->subscribers[i].closing && Svc->subscribers[i].tpcidx == req->tpcidx)
+          break;
+      }
+      if(i == ETM_SERVICE_SUBSCRIBERS)
+        break;
+      result = ETMunsubscribe(Svc->Obj, req->tpcidx);
+      if(result == 0 && ETMsubstate(Svc->Obj, req->tpcidx) != SUB_TOPIC_UNSUBSCRIBING)
+        result = -1;
+      /* Messages still arriving for the topic are dropped, the sweep frees the slot once the
+       * ETM has closed the subscription */
+      if(result == 0)
+        Svc->subscribers[i].closing = true;
+      break;
+    default:
+      break;
+  }
+  if(req->reply != NULL)
+    xTaskNotify(req->reply, ((uint32_t)req->seq << 16) | ((uint32_t)result & 0xffff), eSetValueWithOverwrite);
+}
+
+static void ETMServiceTask(void *pvParameters){
+  ETMService_t *Svc = (ETMService_t *)pvParameters;
+  ETMServiceReq_t req;
+  size_t len;
+
+  for(;;){
+    /* Clear the wake request before looking so a request arriving now still cuts the poll short */
+    Svc->Obj->pollwake = false;
+    while((len = xMessageBufferReceive(Svc->Requests, Svc->reqin, sizeof(Svc->reqin), 0)) >= sizeof(req)){
+      memcpy(&req, Svc->reqin, sizeof(req));
+      ETMServiceHandle(Svc, &req, &Svc->reqin[sizeof(req)]);
+    }
+    ETMpoll(Svc->Obj);
+    ETMServiceSweep(Svc);
+  }
+}
+
+/* Queue a request and, if wait is non-zero, wait for its result */
+static int ETMServiceRequest(ETMService_t *Svc, ETMServiceReq_t *req, const uint8_t *data, TickType_t wait){
+  TimeOut_t timeout;
+  uint32_t value;
+  size_t len = sizeof(*req) + req->datalen;
+  bool queued;
+
+  if(req->datalen > ETM_SERVICE_REQ_SIZE)
+    return -1;
+  req->reply = (wait != 0) ? xTaskGetCurrentTaskHandle() : NULL;
+  if(req->reply != NULL)
+    xTaskNotifyStateClear(NULL);
+  vTaskSetTimeOutState(&timeout);
+
+  if(xSemaphoreTake(Svc->RequestLock, wait) != pdTRUE)
+    return -1;
+  req->seq = ++Svc->seq;
+  memcpy(Svc->reqout, req, sizeof(*req));
+  if(req->datalen > 0)
+    memcpy(&Svc->reqout[sizeof(*req)], data, req->datalen);
+  queued = (xMessageBufferSend(Svc->Requests, Svc->reqout, len, wait) == len);
+  xSemaphoreGive(Svc->RequestLock);
+  if(!queued)
+    return -1;
+
+  /* Cut the service's idle poll short (the IO layer wakes it if it is blocked in IO_Wait) */
+  ETMpollwake(Svc->Obj);
+
+  if(req->reply == NULL)
+    return 0;
+  /* The reply to an earlier request which gave up waiting may still come, only ours counts */
+  while(xTaskCheckForTimeOut(&timeout, &wait) == pdFALSE){
+    if(xTaskNotifyWait(0, 0xffffffffUL, &value, wait) != pdTRUE)
+      break;
+    if((uint16_t)(value >> 16) == req->seq)
+      return (int)(int16_t)(value & 0xffff);
+  }
+  return -1;
+}
+
+/* --------------------------------------------------------------------------*/
+/* --- Public functions -----------------------------------------------------*/
+/* --------------------------------------------------------------------------*/
+
+BaseType_t ETMServiceStart(ETMService_t *Svc, ETMObject_t *Obj){
+  int i;
+
+  Svc->Obj = Obj;
+  Svc->seq = 0;
+  for(i = 0; i < ETM_SERVICE_SUBSCRIBERS; i++){
+    Svc->subscribers[i].svc = Svc;
+    Svc->subscribers[i].inbox = NULL;
+    Svc->subscribers[i].tpcidx = -1;
+    Svc->subscribers[i].closing = false;
+  }
+  Svc->Requests = xMessageBufferCreate(ETM_SERVICE_QUEUE_SIZE);
+  Svc->RequestLock = xSemaphoreCreateMutex();
+  if(Svc->Requests == NULL || Svc->RequestLock == NULL)
+    return pdFAIL;
+  return xTaskCreate(ETMServiceTask, "ETMService", ETM_SERVICE_STACK_SIZE, Svc, ETM_SERVICE_PRIORITY, &Svc->Task);
+}
+
+int ETMServicePublish(ETMService_t *Svc, int tpcidx, uint8_t qos, const uint8_t *data, uint16_t datalen, TickType_t wait){
+  ETMServiceReq_t req;
+
+  req.kind = ETM_SVC_PUBLISH;
+  req.tpcidx = tpcidx;
+  req.qos = qos;
+  req.datalen = datalen;
+  req.inbox = NULL;
+  return ETMServiceRequest(Svc, &req, data, wait);
+}
+
+int ETMServicePubreg(ETMService_t *Svc, const char *topic, TickType_t wait){
+  ETMServiceReq_t req;
+
+  req.kind = ETM_SVC_PUBREG;
+  req.tpcidx = -1;
+  req.qos = 0;
+  req.datalen = strlen(topic) + 1;
+  req.inbox = NULL;
+  return ETMServiceRequest(Svc, &req, (const uint8_t *)topic, wait);
+}
+
+int ETMServiceSubscribe(ETMService_t *Svc, const char *topic, MessageBufferHandle_t inbox, TickType_t wait){
+  ETMServiceReq_t req;
+
+  req.kind = ETM_SVC_SUBSCRIBE;
+  req.tpcidx = -1;
+  req.qos = 0;
+  req.datalen = strlen(topic) + 1;
+  req.inbox = inbox;
+  return ETMServiceRequest(Svc, &req, (const uint8_t *)topic, wait);
+}
+
+int ETMServiceUnsubscribe(ETMService_t *Svc, int tpcidx, TickType_t wait){
+  ETMServiceReq_t req;
+
+  req.kind = ETM_SVC_UNSUBSCRIBE;
+  req.tpcidx = tpcidx;
+  req.qos = 0;
+  req.datalen = 0;
+  req.inbox = NULL;
+  return ETMServiceRequest(Svc, &req, NULL, wait);
+}
@@ -0,0 +1,114 @@
+/**
+  ******************************************************************************
+  * @file    etm_service.h
+  ******************************************************************************
+  */
+/* Define to prevent recursive inclusion -------------------------------------*/
+#ifndef __ETM_SERVICE_H
+#define __ETM_SERVICE_H
+
+#ifdef __cplusplus
+ extern "C" {
+#endif
+
+/* Includes ------------------------------------------------------------------*/
+#include "FreeRTOS.h"
+#include "task.h"
+#include "semphr.h"
+#include "message_buffer.h"
+
+#include "etm.h"
+
+/* Optional ETM service task. The task owns the ETMObject_t (and so the UART) and runs ETMpoll(),
+ * other tasks hand it requests through a message buffer and receive inbound messages on their
+ * own message buffers. Once the service is started only the ETMService functions may be used. */
+
+/* Largest publish payload or topic name carried by a request */
+#ifndef ETM_SERVICE_REQ_SIZE
+#define ETM_SERVICE_REQ_SIZE                256
+#endif
+/* Size of the request message buffer in bytes */
+#ifndef ETM_SERVICE_QUEUE_SIZE
+#define ETM_SERVICE_QUEUE_SIZE              1024
+#endif
+/* Largest inbound message delivered to a subscriber, larger ones are dropped */
+#ifndef ETM_SERVICE_MSG_SIZE
+#define ETM_SERVICE_MSG_SIZE                ETM_CMD_SIZE
+#endif
+/* Subscriptions the service can deliver, raise with the object's topic tables */
+#ifndef ETM_SERVICE_SUBSCRIBERS
+#define ETM_SERVICE_SUBSCRIBERS             MAX_SUB_TOPICS
+#endif
+#ifndef ETM_SERVICE_STACK_SIZE
+#define ETM_SERVICE_STACK_SIZE              ( configMINIMAL_STACK_SIZE * 4 )
+#endif
+#ifndef ETM_SERVICE_PRIORITY
+#define ETM_SERVICE_PRIORITY                ( tskIDLE_PRIORITY + 2 )
+#endif
+
+/* Exported typedef ----------------------------------------------------------*/
+typedef enum {ETM_SVC_PUBLISH = 0, ETM_SVC_PUBREG, ETM_SVC_SUBSCRIBE, ETM_SVC_UNSUBSCRIBE} tetmSvcReqKind;
+
+/* Request header, followed in the message buffer by datalen octets of payload or topic */
+typedef struct {
+  uint8_t kind;
+  int8_t tpcidx;
+  uint8_t qos;
+  uint16_t datalen;
+  /* Task to notify with the result (NULL for none). The notification value carries seq in
+   * its top 16 bits and the result in the bottom 16, so a reply to a request which has
+   * already given up is told apart from the reply to the next one. */
+  TaskHandle_t reply;
+  uint16_t seq;
+  /* Message buffer for inbound messages of a subscription */
+  MessageBufferHandle_t inbox;
+} ETMServiceReq_t;
+
+/* Subscriber element, inbound messages for subscription tpcidx are written whole to inbox. A
+ * slot is in use while inbox is set, once closing nothing more is delivered and the slot is
+ * given back when the ETM confirms the unsubscribe. */
+struct etmsubscriber{
+  struct ETMService *svc;
+  MessageBufferHandle_t inbox;
+  int8_t tpcidx;
+  bool closing;
+};
+
+typedef struct ETMService {
+  ETMObject_t *Obj;
+  TaskHandle_t Task;
+  MessageBufferHandle_t Requests;
+  /* Message buffers allow a single writer, requesting tasks take turns */
+  SemaphoreHandle_t RequestLock;
+  /* Sequence number of the last request (under RequestLock) */
+  uint16_t seq;
+  struct etmsubscriber subscribers[ETM_SERVICE_SUBSCRIBERS];
+  /* Request being written (under RequestLock) and request being handled (service task) */
+  uint8_t reqout[sizeof(ETMServiceReq_t) + ETM_SERVICE_REQ_SIZE];
+  uint8_t reqin[sizeof(ETMServiceReq_t) + ETM_SERVICE_REQ_SIZE];
+  /* Inbound message being collected from its chunks */
+  uint8_t msg[ETM_SERVICE_MSG_SIZE];
+} ETMService_t;
+
+/* Exported functions --------------------------------------------------------*/
+
+/* Start the service task for an initialised ETM */
+BaseType_t ETMServiceStart(ETMService_t *Svc, ETMObject_t *Obj);
+
+/* Requests wait up to wait ticks for their result (-1 if none), with wait 0 the request is
+ * only queued and 0 returned. Waiting uses the calling task's notification. */
+/* Publish to a topic index, returns the result of ETMpublish() */
+int ETMServicePublish(ETMService_t *Svc, int tpcidx, uint8_t qos, const uint8_t *data, uint16_t datalen, TickType_t wait);
+/* Register a publish topic, returns the topic index or -1 */
+int ETMServicePubreg(ETMService_t *Svc, const char *topic, TickType_t wait);
+/* Subscribe to a topic, each inbound message is written to inbox. Returns the topic index or -1.
+ * The subscriber slot is given back if the ETM rejects the subscription. */
+int ETMServiceSubscribe(ETMService_t *Svc, const char *topic, MessageBufferHandle_t inbox, TickType_t wait);
+/* Unsubscribe from a topic index returned by ETMServiceSubscribe(), no more messages are
+ * written to its inbox. Returns the result of ETMunsubscribe(). */
+int ETMServiceUnsubscribe(ETMService_t *Svc, int tpcidx, TickType_t wait);
+
+#ifdef __cplusplus
+}
+#endif
+#endif /*__ETM_SERVICE_H */
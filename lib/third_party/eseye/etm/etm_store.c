@@ -0,0 +1,372 @@
+/**
+  ******************************************************************************
+  * @file    etm_store.c
+  ******************************************************************************
+  */
+/* Includes ------------------------------------------------------------------*/
+#include <stdio.h>
+#include <string.h>
+#include <stdbool.h>
+
+#include "FreeRTOS.h"
+
+#include "etm.h"
+#include "etm_store.h"
+
+#define UARTDEBUGPRINTF(x...) configPRINTF((x))
+
+/* Each sector starts with a header: magic, sequence number (one more than the previous sector's)
+ * and a word programmed to zero once every record in the sector has been sent */
+#define STORE_SECTOR_MAGIC      0x51535445
+#define STORE_SECTOR_HDR        12
+#define STORE_SECTOR_DONE       8
+
+/* Records follow: magic, state (0xff until sent, then programmed to 0), topic name length, qos,
+ * payload length and a CRC-32 over all of the record except the state. Then the topic name and
+ * the payload. Records don't cross sectors. */
+#define STORE_RECORD_MAGIC      0xa5
+#define STORE_RECORD_HDR        10
+#define STORE_RECORD_STATE      1
+#define STORE_RECORD_CRC        6
+
+/* ReadRecord results */
+#define STORE_RECORD_VALID      1
+#define STORE_RECORD_END        0
+#define STORE_RECORD_BAD        -2
+
+/* Private functions ---------------------------------------------------------*/
+
+static const uint32_t StoreCrcTable[16] = {
+  0x00000000, 0x1db71064, 0x3b6e20c8, 0x26d930ac, 0x76dc4190, 0x6b6b51f4, 0x4db26158, 0x5005713c,
+  0xedb88320, 0xf00f9344, 0xd6d6a3e8, 0xcb61b38c, 0x9b64c2b0, 0x86d3d2d4, 0xa00ae278, 0xbdbdf21c
+};
+
+/* CRC-32 (IEEE), a nibble at a time. Start with 0xffffffff and invert the result. */
+static uint32_t StoreCrc(uint32_t crc, const uint8_t *data, uint32_t len){
+  while(len--){
+    crc ^= *data++;
+    crc = (crc >> 4) ^ StoreCrcTable[crc & 0x0f];
+    crc = (crc >> 4) ^ StoreCrcTable[crc & 0x0f];
+  }
+  return crc;
+}
+
+static void StorePut32(uint8_t *p, uint32_t value){
+  p[0] = value;
+  p[1] = value >> 8;
+  p[2] = value >> 16;
+  p[3] = value >> 24;
+}
+
+static uint32_t StoreGet32(const uint8_t *p){
+  return p[0] | ((uint32_t)p[1] << 8) | ((uint32_t)p[2] << 16) | ((uint32_t)p[3] << 24);
+}
+
+static uint32_t StoreAddr(ETMStore_t *Store, uint16_t sector, uint32_t offset){
+  return Store->fops.base + sector * Store->fops.sectorsize + offset;
+}
+
+/* Record CRC, the topic name and payload being in the record buffer */
+static uint32_t StoreRecordCrc(ETMStore_t *Store, const uint8_t *hdr, uint8_t topiclen, uint16_t datalen){
+  uint32_t crc;
+
+  crc = StoreCrc(0xffffffff, hdr, STORE_RECORD_STATE);
+  crc = StoreCrc(crc, &hdr[STORE_RECORD_STATE + 1], STORE_RECORD_CRC - STORE_RECORD_STATE - 1);
+  crc = StoreCrc(crc, Store->record, topiclen);
+  crc = StoreCrc(crc, &Store->record[topiclen + 1], datalen);
+  return ~crc;
+}
+
+/* Sector header, returns 1 if the sector is in the log, 0 if not or -1 */
+static int StoreSectorHeader(ETMStore_t *Store, uint16_t sector, uint32_t *seq, bool *done){
+  uint8_t hdr[STORE_SECTOR_HDR];
+
+  if(Store->fops.Read(StoreAddr(Store, sector, 0), hdr, sizeof(hdr)) < 0)
+    return -1;
+  if(StoreGet32(hdr) != STORE_SECTOR_MAGIC)
+    return 0;
+  *seq = StoreGet32(&hdr[4]);
+  *done = (StoreGet32(&hdr[STORE_SECTOR_DONE]) != 0xffffffff);
+  return 1;
+}
+
+/* Read and check the record at offset, leaving its topic name (null terminated) and payload in
+ * the record buffer. Returns STORE_RECORD_VALID with the record's length in *len, STORE_RECORD_END
+ * at erased flash, STORE_RECORD_BAD or -1. */
+static int StoreReadRecord(ETMStore_t *Store, uint16_t sector, uint32_t offset, uint8_t *hdr, uint32_t *len){
+  uint32_t addr = StoreAddr(Store, sector, offset);
+  uint8_t topiclen;
+  uint16_t datalen;
+
+  if(offset + STORE_RECORD_HDR > Store->fops.sectorsize)
+    return STORE_RECORD_END;
+  if(Store->fops.Read(addr, hdr, STORE_RECORD_HDR) < 0)
+    return -1;
+  if(hdr[0] == 0xff)
+    return STORE_RECORD_END;
+  topiclen = hdr[2];
+  datalen = hdr[4] | (hdr[5] << 8);
+  if(hdr[0] != STORE_RECORD_MAGIC || topiclen == 0 || topiclen + datalen > ETM_STORE_RECORD_SIZE ||
+     offset + STORE_RECORD_HDR + topiclen + datalen > Store->fops.sectorsize)
+    return STORE_RECORD_BAD;
+  if(Store->fops.Read(addr + STORE_RECORD_HDR, Store->record, topiclen) < 0)
+    return -1;
+  Store->record[topiclen] = '\0';
+  if(datalen > 0 && Store->fops.Read(addr + STORE_RECORD_HDR + topiclen, &Store->record[topiclen + 1], datalen) < 0)
+    return -1;
+  if(StoreRecordCrc(Store, hdr, topiclen, datalen) != StoreGet32(&hdr[STORE_RECORD_CRC]))
+    return STORE_RECORD_BAD;
+  *len = STORE_RECORD_HDR + topiclen + datalen;
+  return STORE_RECORD_VALID;
+}
+
+/* Program the part of the gathered page not yet in flash. A failure closes the head sector. */
+static int StoreFlushPage(ETMStore_t *Store){
+  if(Store->pagefill == Store->pageflushed)
+    return 0;
+  if(Store->fops.Program(StoreAddr(Store, Store->head, Store->pageoff + Store->pageflushed),
+                         &Store->page[Store->pageflushed], Store->pagefill - Store->pageflushed) < 0){
+    UARTDEBUGPRINTF("Store program failed, sector %d\r\n", Store->head);
+    Store->writeoff = Store->fops.sectorsize;
+    Store->pageflushed = Store->pagefill;
+    return -1;
+  }
+  Store->pageflushed = Store->pagefill;
+  return 0;
+}
+
+/* Gather octets for the head sector, programming each page as it fills */
+static int StoreWrite(ETMStore_t *Store, const uint8_t *data, uint32_t len){
+  uint32_t n;
+
+  while(len > 0){
+    n = ETM_STORE_PAGE_SIZE - Store->pagefill;
+    if(n > len)
+      n = len;
+    memcpy(&Store->page[Store->pagefill], data, n);
+    Store->pagefill += n;
+    data += n;
+    len -= n;
+    if(Store->pagefill == ETM_STORE_PAGE_SIZE){
+      if(StoreFlushPage(Store) < 0)
+        return -1;
+      Store->pageoff += ETM_STORE_PAGE_SIZE;
+      Store->pagefill = Store->pageflushed = 0;
+    }
+  }
+  return 0;
+}
+
+/* Start the page buffer at an offset in the head sector */
+static void StorePageAt(ETMStore_t *Store, uint32_t offset){
+  Store->pageoff = offset - (offset % ETM_STORE_PAGE_SIZE);
+  Store->pagefill = Store->pageflushed = offset - Store->pageoff;
+}
+
+static int StoreSeek(ETMStore_t *Store, uint8_t *hdr, uint32_t *len);
+
+/* Erase the sector after the head and make it the head, giving up the tail if the log is full */
+static int StoreOpenSector(ETMStore_t *Store){
+  uint16_t next = (Store->head + 1) % Store->nsectors;
+  uint8_t hdr[8], rec[STORE_RECORD_HDR];
+  uint32_t len;
+
+  if(Store->used == Store->nsectors){
+    /* Settle the cursor so a tail which has all been sent isn't counted as dropped */
+    if(StoreSeek(Store, rec, &len) < 0)
+      return -1;
+    if(Store->rdsector == Store->tail){
+      UARTDEBUGPRINTF("Store full, dropping sector %d\r\n", Store->tail);
+      Store->stats.droppedsectors++;
+      Store->rdsector = (Store->tail + 1) % Store->nsectors;
+      Store->rdoff = STORE_SECTOR_HDR;
+    }
+    Store->tail = (Store->tail + 1) % Store->nsectors;
+    Store->used--;
+  }
+  if(Store->fops.EraseSector(StoreAddr(Store, next, 0)) < 0){
+    UARTDEBUGPRINTF("Store erase failed, sector %d\r\n", next);
+    return -1;
+  }
+  StorePut32(hdr, STORE_SECTOR_MAGIC);
+  StorePut32(&hdr[4], Store->seq + 1);
+  if(Store->fops.Program(StoreAddr(Store, next, 0), hdr, sizeof(hdr)) < 0)
+    return -1;
+  if(Store->used == 0){
+    Store->tail = Store->rdsector = next;
+    Store->rdoff = STORE_SECTOR_HDR;
+  }
+  Store->head = next;
+  Store->used++;
+  Store->seq++;
+  Store->writeoff = STORE_SECTOR_HDR;
+  StorePageAt(Store, STORE_SECTOR_HDR);
+  return 0;
+}
+
+/* Move the read cursor to the oldest unsent record, marking sectors left behind as done.
+ * Returns 1 with the record in the record buffer, 0 if there is none or -1. */
+static int StoreSeek(ETMStore_t *Store, uint8_t *hdr, uint32_t *len){
+  uint8_t zero[4] = {0, 0, 0, 0};
+  uint32_t seq;
+  bool done;
+  int ret;
+
+  while(Store->used > 0){
+    if(Store->rdoff == STORE_SECTOR_HDR && Store->rdsector != Store->head){
+      ret = StoreSectorHeader(Store, Store->rdsector, &seq, &done);
+      if(ret < 0)
+        return -1;
+      if(ret == 0 || done){
+        Store->rdsector = (Store->rdsector + 1) % Store->nsectors;
+        continue;
+      }
+    }
+    if(Store->rdsector == Store->head && Store->rdoff >= Store->writeoff)
+      return 0;
+    ret = StoreReadRecord(Store, Store->rdsector, Store->rdoff, hdr, len);
+    if(ret == -1)
+      return -1;
+    if(ret == STORE_RECORD_VALID){
+      if(hdr[STORE_RECORD_STATE] == 0xff)
+        return 1;
+      Store->rdoff += *len;
+      continue;
+    }
+    if(ret == STORE_RECORD_BAD){
+      UARTDEBUGPRINTF("Bad store record, sector %d offset %lu\r\n", Store->rdsector, (unsigned long)Store->rdoff);
+      Store->stats.badrecords++;
+    }
+    /* End of the sector */
+    if(Store->rdsector == Store->head){
+      Store->rdoff = Store->writeoff;
+      return 0;
+    }
+    if(Store->fops.Program(StoreAddr(Store, Store->rdsector, STORE_SECTOR_DONE), zero, sizeof(zero)) < 0)
+      return -1;
+    Store->rdsector = (Store->rdsector + 1) % Store->nsectors;
+    Store->rdoff = STORE_SECTOR_HDR;
+  }
+  return 0;
+}
+
+/* Exported functions --------------------------------------------------------*/
+
+int ETMStoreInit(ETMStore_t *Store, const ETM_Flash_t *fops){
+  uint8_t hdr[STORE_RECORD_HDR];
+  uint32_t seq, headseq = 0, tailseq = 0, offset, len;
+  bool done, found = false;
+  uint16_t sector;
+  int ret;
+
+  memset(Store, 0, sizeof(ETMStore_t));
+  Store->fops = *fops;
+  if(fops->sectorsize % ETM_STORE_PAGE_SIZE != 0 || fops->size / fops->sectorsize < 2 ||
+     fops->size / fops->sectorsize > 0xffff)
+    return -1;
+  Store->nsectors = fops->size / fops->sectorsize;
+
+  /* The log runs from the lowest sequence number to the highest */
+  for(sector = 0; sector < Store->nsectors; sector++){
+    ret = StoreSectorHeader(Store, sector, &seq, &done);
+    if(ret < 0)
+      return -1;
+    if(ret == 0)
+      continue;
+    if(!found || seq > headseq){
+      Store->head = sector;
+      headseq = seq;
+    }
+    if(!found || seq < tailseq){
+      Store->tail = sector;
+      tailseq = seq;
+    }
+    found = true;
+  }
+  if(!found){
+    Store->head = Store->nsectors - 1;
+    Store->writeoff = fops->sectorsize;
+    return 0;
+  }
+  Store->seq = headseq;
+  Store->used = (Store->head + Store->nsectors - Store->tail) % Store->nsectors + 1;
+
+  /* Appends carry on after the last good record, a bad one closes the sector */
+  offset = STORE_SECTOR_HDR;
+  while((ret = StoreReadRecord(Store, Store->head, offset, hdr, &len)) == STORE_RECORD_VALID)
+    offset += len;
+  if(ret == -1)
+    return -1;
+  Store->writeoff = (ret == STORE_RECORD_END) ? offset : fops->sectorsize;
+  StorePageAt(Store, Store->writeoff);
+
+  Store->rdsector = Store->tail;
+  Store->rdoff = STORE_SECTOR_HDR;
+  return (StoreSeek(Store, hdr, &len) < 0) ? -1 : 0;
+}
+
+int ETMStoreAppend(ETMStore_t *Store, const char *topic, uint8_t qos, const uint8_t *data, uint16_t datalen){
+  uint8_t hdr[STORE_RECORD_HDR];
+  size_t topiclen = strlen(topic);
+  uint32_t len = STORE_RECORD_HDR + topiclen + datalen;
+
+  if(topiclen == 0 || topiclen > 0xff || topiclen + datalen > ETM_STORE_RECORD_SIZE ||
+     len > Store->fops.sectorsize - STORE_SECTOR_HDR)
+    return -1;
+  if(Store->writeoff + len > Store->fops.sectorsize){
+    if(StoreFlushPage(Store) < 0 || StoreOpenSector(Store) < 0)
+      return -1;
+  }
+  hdr[0] = STORE_RECORD_MAGIC;
+  hdr[STORE_RECORD_STATE] = 0xff;
+  hdr[2] = topiclen;
+  hdr[3] = qos;
+  hdr[4] = datalen;
+  hdr[5] = datalen >> 8;
+  memcpy(Store->record, topic, topiclen);
+  memcpy(&Store->record[topiclen + 1], data, datalen);
+  StorePut32(&hdr[STORE_RECORD_CRC], StoreRecordCrc(Store, hdr, topiclen, datalen));
+
+  /* A failed program closes the sector, so account for the record first */
+  Store->writeoff += len;
+  if(StoreWrite(Store, hdr, STORE_RECORD_HDR) < 0 || StoreWrite(Store, (const uint8_t *)topic, topiclen) < 0 ||
+     StoreWrite(Store, data, datalen) < 0)
+    return -1;
+  Store->stats.stored++;
+  return 0;
+}
+
+int ETMStoreSync(ETMStore_t *Store){
+  return StoreFlushPage(Store);
+}
+
+bool ETMStorePending(ETMStore_t *Store){
+  return Store->used > 0 && (Store->rdsector != Store->head || Store->rdoff < Store->writeoff);
+}
+
+int ETMStoreDrain(ETMStore_t *Store, ETMObject_t *Obj, int max){
+  uint8_t hdr[STORE_RECORD_HDR];
+  uint8_t zero = 0;
+  uint32_t len;
+  uint8_t topiclen;
+  int sent = 0, ret;
+
+  if(Obj->currentstate != ETM_MQTTREADY || !ETMStorePending(Store))
+    return 0;
+  if(StoreFlushPage(Store) < 0)
+    return -1;
+  while(sent < max){
+    ret = StoreSeek(Store, hdr, &len);
+    if(ret <= 0)
+      return (ret < 0) ? -1 : sent;
+    topiclen = hdr[2];
+    if(ETMpublishTopic(Obj, (const char *)Store->record, hdr[3], &Store->record[topiclen + 1], hdr[4] | (hdr[5] << 8)) < 0)
+      break;
+    if(Store->fops.Program(StoreAddr(Store, Store->rdsector, Store->rdoff + STORE_RECORD_STATE), &zero, 1) < 0)
+      return -1;
+    Store->rdoff += len;
+    Store->stats.sent++;
+    sent++;
+  }
+  return sent;
+}
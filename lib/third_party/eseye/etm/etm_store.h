@@ -0,0 +1,98 @@
+/**
+  ******************************************************************************
+  * @file    etm_store.h
+  ******************************************************************************
+  */
+/* Define to prevent recursive inclusion -------------------------------------*/
+#ifndef __ETM_STORE_H
+#define __ETM_STORE_H
+
+#ifdef __cplusplus
+ extern "C" {
+#endif
+
+/* Includes ------------------------------------------------------------------*/
+#include "stdint.h"
+#include "stdbool.h"
+
+#include "etm.h"
+
+/* Store-and-forward queue for outbound publishes in NOR flash (e.g. the Discovery board's QSPI
+ * flash). Messages are appended to a log of sectors used in turn, each record carrying its
+ * topic name and a CRC, and are sent with ETMpublishTopic() once the ETM is ready again. A sent
+ * record is marked consumed where it lies, so the flash only sees one erase per sector each time
+ * round the log. When the log is full the oldest sector is given up. All state is in the
+ * ETMStore_t, nothing is allocated. */
+
+/* Page programmed at once, appends are gathered in RAM until a page fills or ETMStoreSync() */
+#ifndef ETM_STORE_PAGE_SIZE
+#define ETM_STORE_PAGE_SIZE                 256
+#endif
+/* Longest topic name plus payload of a stored message */
+#ifndef ETM_STORE_RECORD_SIZE
+#define ETM_STORE_RECORD_SIZE               512
+#endif
+
+/* Exported typedef ----------------------------------------------------------*/
+
+/* Flash access, addresses are device addresses. Program only needs to clear bits of erased
+ * flash and must not cross a page. Each returns 0 on success or -1. */
+typedef int8_t (*Flash_Read_Func)(uint32_t Addr, uint8_t *pData, uint32_t Size);
+typedef int8_t (*Flash_Program_Func)(uint32_t Addr, const uint8_t *pData, uint32_t Size);
+typedef int8_t (*Flash_EraseSector_Func)(uint32_t Addr);
+
+typedef struct {
+  Flash_Read_Func        Read;
+  Flash_Program_Func     Program;
+  Flash_EraseSector_Func EraseSector;
+  uint32_t               base;         /* Sector aligned start of the store */
+  uint32_t               size;         /* Whole number of sectors, at least two */
+  uint32_t               sectorsize;   /* Multiple of ETM_STORE_PAGE_SIZE */
+} ETM_Flash_t;
+
+typedef struct {
+  uint32_t stored;          /* Messages appended */
+  uint32_t sent;            /* Messages published from the store */
+  uint32_t droppedsectors;  /* Sectors holding unsent messages given up when the log was full */
+  uint32_t badrecords;      /* Records failing their check, the rest of their sector is skipped */
+} ETMStoreStats_t;
+
+typedef struct {
+  ETM_Flash_t fops;
+  uint16_t    nsectors;
+  uint16_t    used;         /* Sectors in the log, from tail to head */
+  uint16_t    tail;         /* Oldest sector */
+  uint16_t    head;         /* Sector being written */
+  uint32_t    seq;          /* Sequence number of the head sector */
+  uint32_t    writeoff;     /* Next record in the head sector, sectorsize once it is closed */
+  uint16_t    rdsector;     /* Oldest unsent record */
+  uint32_t    rdoff;
+  /* Page being gathered: its offset in the head sector, octets filled and octets programmed */
+  uint32_t    pageoff;
+  uint16_t    pagefill;
+  uint16_t    pageflushed;
+  uint8_t     page[ETM_STORE_PAGE_SIZE];
+  /* Record being sent, topic name (null terminated) followed by the payload */
+  uint8_t     record[ETM_STORE_RECORD_SIZE + 1];
+  ETMStoreStats_t stats;
+} ETMStore_t;
+
+/* Exported functions --------------------------------------------------------*/
+
+/* Find the log in flash (an erased or unrecognised area is an empty log), returns 0 or -1 */
+int ETMStoreInit(ETMStore_t *Store, const ETM_Flash_t *fops);
+/* Queue a message, returns 0 or -1. The message may still be in RAM until ETMStoreSync(). */
+int ETMStoreAppend(ETMStore_t *Store, const char *topic, uint8_t qos, const uint8_t *data, uint16_t datalen);
+/* Program any messages still gathered in RAM, returns 0 or -1 */
+int ETMStoreSync(ETMStore_t *Store);
+/* Whether any message is waiting to be sent */
+bool ETMStorePending(ETMStore_t *Store);
+/* Publish up to max stored messages, oldest first, if the ETM is in ETM_MQTTREADY. Stops at the
+ * first publish the ETM doesn't accept, which is tried again next time. Returns the number sent
+ * or -1 on a flash error. */
+int ETMStoreDrain(ETMStore_t *Store, ETMObject_t *Obj, int max);
+
+#ifdef __cplusplus
+}
+#endif
+#endif /*__ETM_STORE_H */
@@ -0,0 +1,227 @@
+#!/usr/bin/env python3
+"""Pack a host firmware image for the ETM OTA demos.
+
+Prefixes the image with the header ETMOtaWriterVerify() expects (see
+lib/include/etm_ota_writer.h): magic, image length, CRC-32 and an ECDSA
+signature over the image's SHA-256, made with openssl from the code signing
+key whose certificate the device holds.
+
+With -z the image is compressed into the token stream the writer decodes as
+it arrives. With -d it is also made a delta against the image the device is
+running, copying what hasn't changed from there.
+
+    etm_ota_pack.py -k signer_key.pem aws_demos.bin aws_demos.ota
+    etm_ota_pack.py -k signer_key.pem -d running.bin aws_demos.bin aws_demos.ota
+"""
+import argparse
+import struct
+import subprocess
+import sys
+import zlib
+
+OTA_MAGIC = 0x41544f45      # "EOTA"
+OTA_HDR_SIZE = 96
+OTA_SIG_MAX = OTA_HDR_SIZE - 24
+OTA_FLAG_LZ = 0x0001
+OTA_FLAG_DELTA = 0x0002
+
+# Token operations, the top two bits of a token octet
+OP_LITERAL, OP_MATCH, OP_OLD, OP_SEEK = range(4)
+MIN_MATCH = 3           # Shortest copy from the image itself
+MIN_OLD = 4             # Shortest copy from the running image after a move
+MAX_DIST = 1 << 16      # Furthest back a copy from the image looks
+CHAIN = 32              # Earlier positions tried for each match
+
+
+def sign(image, keyfile):
+    """DER encoded ECDSA signature of the image's SHA-256"""
+    return subprocess.run(["openssl", "dgst", "-sha256", "-sign", keyfile],
+                          input=image, stdout=subprocess.PIPE, check=True).stdout
+
+
+def header(image, sig, flags=0, old=b""):
+    if len(sig) > OTA_SIG_MAX:
+        raise ValueError("signature is %d octets, at most %d fit" % (len(sig), OTA_SIG_MAX))
+    oldcrc = zlib.crc32(old) & 0xffffffff if flags & OTA_FLAG_DELTA else 0
+    hdr = struct.pack("<IIIHHII", OTA_MAGIC, len(image), zlib.crc32(image) & 0xffffffff, len(sig), flags,
+                      len(old) if flags & OTA_FLAG_DELTA else 0, oldcrc) + sig
+    return hdr.ljust(OTA_HDR_SIZE, b"\xff")
+
+
+def leb128(n):
+    out = bytearray()
+    while True:
+        if n < 0x80:
+            out.append(n)
+            return out
+        out.append((n & 0x7f) | 0x80)
+        n >>= 7
+
+
+def token(op, count, arg=None):
+    """A token with its count (already less the operation's minimum) and any argument"""
+    out = bytearray([(op << 6) | min(count, 0x3f)])
+    if count >= 0x3f:
+        out += leb128(count - 0x3f)
+    if arg is not None:
+        out += leb128(arg)
+    return out
+
+
+def matchlen(a, i, b, j, limit):
+    """Length of the run at a[i:] matching b[j:], at most limit"""
+    n = 0
+    step = 256
+    while n < limit:
+        m = min(step, limit - n)
+        if a[i + n:i + n + m] == b[j + n:j + n + m]:
+            n += m
+            continue
+        if m == 1:
+            break
+        step = max(1, m // 8)
+    return n
+
+
+class Encoder:
+    def __init__(self, image, old):
+        self.image = image
+        self.old = old
+        self.out = bytearray()
+        self.literals = bytearray()
+        self.oldpos = 0
+        self.chains = {}
+        self.oldidx = {}
+        for x in range(0, len(old) - 3):
+            self.oldidx.setdefault(old[x:x + 4], []).append(x)
+
+    def flush(self):
+        while self.literals:
+            run = self.literals[:0x3f + 0x10000]
+            self.out += token(OP_LITERAL, len(run) - 1) + run
+            self.literals = self.literals[len(run):]
+
+    def best(self, pos):
+        """Cheapest copy at pos: (saving, length, op, argument)"""
+        image, old = self.image, self.old
+        left = len(image) - pos
+        best = (0, 0, None, None)
+        if old:
+            # Carrying on through the running image costs a token octet
+            if self.oldpos < len(old):
+                n = matchlen(image, pos, old, self.oldpos, min(left, len(old) - self.oldpos))
+                if n >= 1 and n - 1 > best[0]:
+                    best = (n - 1, n, OP_OLD, None)
+            for x in self.oldidx.get(image[pos:pos + 4], [])[-CHAIN:]:
+                n = matchlen(image, pos, old, x, min(left, len(old) - x))
+                move = x - self.oldpos
+                cost = 1 + len(leb128((move << 1) ^ (move >> 63)))
+                if n >= MIN_OLD and n - cost > best[0]:
+                    best = (n - cost, n, OP_SEEK, move)
+        for x in reversed(self.chains.get(image[pos:pos + 3], [])[-CHAIN:]):
+            if pos - x > MAX_DIST:
+                break
+            n = matchlen(image, pos, image, x, left)
+            cost = 1 + len(leb128(pos - x))
+            if n >= MIN_MATCH and n - cost > best[0]:
+                best = (n - cost, n, OP_MATCH, pos - x)
+        return best
+
+    def encode(self):
+        image = self.image
+        pos = 0
+        while pos < len(image):
+            saving, n, op, arg = self.best(pos)
+            if op is None:
+                self.literals.append(image[pos])
+                n = 1
+            else:
+                self.flush()
+                if op == OP_MATCH:
+                    self.out += token(OP_MATCH, n - MIN_MATCH, arg)
+                elif op == OP_OLD:
+                    self.out += token(OP_OLD, n - 1)
+                    self.oldpos += n
+                else:
+                    self.out += token(OP_SEEK, n - 1, (arg << 1) ^ (arg >> 63))
+                    self.oldpos += arg + n
+            # Only the start of long copies goes in the chains, which keeps this quick enough
+            for x in range(pos, min(pos + n, pos + 16, len(image) - 2)):
+                self.chains.setdefault(image[x:x + 3], []).append(x)
+            pos += n
+        self.flush()
+        return bytes(self.out)
+
+
+def decode(data, old):
+    """What the writer makes of a token stream, to check the encoder"""
+    out = bytearray()
+    pos = oldpos = 0
+
+    def leb(pos):
+        n = shift = 0
+        while True:
+            c = data[pos]
+            pos += 1
+            n |= (c & 0x7f) << shift
+            shift += 7
+            if not c & 0x80:
+                return n, pos
+
+    while pos < len(data):
+        c = data[pos]
+        pos += 1
+        op, count = c >> 6, (c & 0x3f) + (3 if c >> 6 == OP_MATCH else 1)
+        if c & 0x3f == 0x3f:
+            extra, pos = leb(pos)
+            count += extra
+        if op == OP_LITERAL:
+            out += data[pos:pos + count]
+            pos += count
+        elif op == OP_MATCH:
+            dist, pos = leb(pos)
+            for _ in range(count):
+                out.append(out[-dist])
+        else:
+            if op == OP_SEEK:
+                move, pos = leb(pos)
+                oldpos += (move >> 1) ^ -(move & 1)
+            out += old[oldpos:oldpos + count]
+            oldpos += count
+    return bytes(out)
+
+
+def main():
+    parser = argparse.ArgumentParser(description=__doc__.splitlines()[0])
+    parser.add_argument("-k", "--key", required=True, help="ECDSA P-256 private key (PEM)")
+    parser.add_argument("-z", "--compress", action="store_true", help="compress the image")
+    parser.add_argument("-d", "--delta", metavar="RUNNING", help="make a delta against the running image (.bin)")
+    parser.add_argument("image", help="firmware image (.bin)")
+    parser.add_argument("output", help="packed image to give the ETM")
+    args = parser.parse_args()
+
+    with open(args.image, "rb") as f:
+        image = f.read()
+    old = b""
+    flags = 0
+    if args.delta:
+        with open(args.delta, "rb") as f:
+            old = f.read()
+        flags = OTA_FLAG_LZ | OTA_FLAG_DELTA
+    elif args.compress:
+        flags = OTA_FLAG_LZ
+    body = image
+    if flags:
+        body = Encoder(image, old).encode()
+        if decode(body, old) != image:
+            raise RuntimeError("encoded image doesn't decode")
+    packed = header(image, sign(image, args.key), flags, old) + body
+    with open(args.output, "wb") as f:
+        f.write(packed)
+    print("%s: %d octets, CRC-32 %08x, %d octets packed (%.1fx)" %
+          (args.output, len(image), zlib.crc32(image) & 0xffffffff, len(packed), len(image) / len(packed)))
+    return 0
+
+
+if __name__ == "__main__":
+    sys.exit(main())
@@ -0,0 +1,576 @@
+/**
+  ******************************************************************************
+  * @file    etm_bench.c
+  * @brief   ETM driver benchmarks against the simulator: ascii-hex encoding,
+  *          publish throughput and transport writes, +EMQ: delivery latency, ETM_Init time, response matcher speed over
+  *          a recorded AT transcript and host firmware read and streamed
+  *          download throughput. Rates and latencies are in simulated time (what the
+  *          UART and ETM allow), host CPU time per operation is given as well.
+  ******************************************************************************
+  */
+/* Includes ------------------------------------------------------------------*/
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdarg.h>
+#include <stdbool.h>
+#include <time.h>
+
+#include "FreeRTOS.h"
+#include "task.h"
+
+#include "etm.h"
+#include "etm_cmd.h"
+#include "etm_fw.h"
+#include "etm_sim.h"
+
+#define BENCH_MAX_SAMPLES       4096
+
+typedef struct {
+  double p50, p90, p99, max, mean;
+} BenchPct_t;
+
+static ETMObject_t ETMC2cObj;
+static ETMSim_Config_t Cfg;
+static uint32_t Iterations = 200;
+/* Time to erase and program a KB of internal flash (an STM32L4 double word takes about 82us and
+ * a 2KB page erase about 22ms) */
+static uint32_t FlashUsPerKb = 21000;
+static uint64_t FlashUsOwed;
+static FILE *Json;
+
+static uint8_t Payload[4096];
+static uint8_t FwImage[64 * 1024];
+static uint8_t Transcript[256 * 1024];
+
+extern const ETM_RetKeywords_t ReturnKeywords[];
+
+static volatile uint32_t Delivered;
+static uint64_t DeliveredAt;
+
+static double BenchHostNs(void){
+  struct timespec ts;
+
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return ts.tv_sec * 1e9 + ts.tv_nsec;
+}
+
+static int BenchCompare(const void *a, const void *b){
+  double x = *(const double *)a, y = *(const double *)b;
+  return (x > y) - (x < y);
+}
+
+static BenchPct_t BenchPercentiles(double *samples, uint32_t n){
+  BenchPct_t pct = {0};
+  double sum = 0;
+  uint32_t x;
+
+  if(n == 0)
+    return pct;
+  qsort(samples, n, sizeof(double), BenchCompare);
+  for(x = 0; x < n; x++)
+    sum += samples[x];
+  pct.p50 = samples[(n - 1) * 50 / 100];
+  pct.p90 = samples[(n - 1) * 90 / 100];
+  pct.p99 = samples[(n - 1) * 99 / 100];
+  pct.max = samples[n - 1];
+  pct.mean = sum / n;
+  return pct;
+}
+
+/* Machine readable results, one JSON object per line */
+static void BenchJson(const char *format, ...) __attribute__((format(printf, 1, 2)));
+static void BenchJson(const char *format, ...){
+  va_list args;
+
+  if(Json == NULL)
+    return;
+  va_start(args, format);
+  vfprintf(Json, format, args);
+  va_end(args);
+  fputc('\n', Json);
+}
+
+/* Chunked so messages larger than ETM_CMD_SIZE are delivered too, timed at the last chunk */
+static void BenchMessage(void *ctx, uint32_t offset, uint8_t *chunk, uint32_t chunk_len, uint32_t total_len){
+  (void)ctx;
+  (void)chunk;
+  if(offset + chunk_len == total_len){
+    DeliveredAt = ETMSim_Micros();
+    Delivered++;
+  }
+}
+
+/* Start the simulator and bring the ETM up to MQTT ready, returns false if it didn't get there */
+static bool BenchStart(const ETMSim_Config_t *cfg){
+  uint32_t start;
+
+  ETMSim_Start(cfg);
+  memset(&ETMC2cObj, 0, sizeof(ETMC2cObj));
+  ETMSim_Register(&ETMC2cObj);
+  ETM_Init(&ETMC2cObj, NULL);
+  if(!(ETMC2cObj.urcseen & ETM_READY_URC))
+    return false;
+  ETMstartproto(&ETMC2cObj, ETM_MQTT);
+  start = ETMSim_Millis();
+  while(!(ETMC2cObj.urcseen & ETM_MQTTREADY_URC) && ETMSim_Millis() - start < 30000)
+    ETMpoll(&ETMC2cObj);
+  return (ETMC2cObj.urcseen & ETM_MQTTREADY_URC) != 0;
+}
+
+static void BenchPoll(bool (*done)(void), uint32_t ms){
+  uint32_t start = ETMSim_Millis();
+
+  while(!done() && ETMSim_Millis() - start < ms)
+    ETMpoll(&ETMC2cObj);
+}
+
+static int BenchPubidx;
+static bool BenchPubRegistered(void){
+  return ETMpubstate(&ETMC2cObj, BenchPubidx) == PUB_TOPIC_REGISTERED;
+}
+
+/* The ascii-hex conversion ETMpublish had before the frame was built in one buffer */
+static void BenchOctetToHex(uint8_t octet, char *dest){
+  uint8_t nibble = (octet >> 4) & 0x0f;
+  if(nibble < 10)
+    dest[0] = '0' + nibble;
+  else
+    dest[0] = 'A' + (nibble - 10);
+  nibble = octet & 0x0f;
+  if(nibble < 10)
+    dest[1] = '0' + nibble;
+  else
+    dest[1] = 'A' + (nibble - 10);
+  dest[2] = 0;
+}
+
+/* Host CPU time per payload octet of the ascii-hex encoding, per octet as ETMpublish used to
+ * and through ETMcmdHex() (a pair table lookup per octet, unrolled four octets per pass) */
+static void BenchEncode(uint16_t size){
+  static char out[2 * sizeof(Payload) + 1];
+  static const char *names[] = {"nibble", "pair-table"};
+  ETM_CmdBuf_t cmd;
+  uint32_t reps = (64u << 20) / size + 1, r, x, n;
+  double h0, ns[2];
+  char check = 0;
+
+  for(n = 0; n < 2; n++){
+    h0 = BenchHostNs();
+    for(r = 0; r < reps; r++){
+      if(n == 0){
+        for(x = 0; x < size; x++)
+          BenchOctetToHex(Payload[(x + r) % sizeof(Payload)], &out[x * 2]);
+      }else{
+        ETMcmdStart(&cmd, out, sizeof(out));
+        ETMcmdHex(&cmd, &Payload[r % (sizeof(Payload) - size + 1)], size);
+      }
+      check ^= out[r % (2 * size)];
+    }
+    ns[n] = (BenchHostNs() - h0) / ((double)reps * size);
+  }
+
+  for(n = 0; n < 2; n++){
+    printf("hex encode %-10s %5u octets  %7.2f ns host/octet  %8.1f MB/s\n", names[n], size, ns[n], 1e3 / ns[n]);
+    BenchJson("{\"bench\":\"hex_encode\",\"encoder\":\"%s\",\"size\":%u,\"host_ns_per_octet\":%.3f,\"mb_per_s\":%.1f,\"check\":%d}",
+              names[n], size, ns[n], 1e3 / ns[n], check);
+  }
+}
+
+static int BenchPublishHex(uint16_t size){
+  return ETMpublish(&ETMC2cObj, BenchPubidx, 0, Payload, size);
+}
+
+static int BenchPublishRaw(uint16_t size){
+  return ETMpublishRaw(&ETMC2cObj, BenchPubidx, 0, Payload, size);
+}
+
+/* ETMpublish as it was before the frame was built in one buffer: the command prefix, a transport
+ * write for each payload octet and the closing quote sent as the command */
+static int BenchPublishOld(uint16_t size){
+  char prefix[32], hexbyte[3];
+  uint16_t x;
+
+  sprintf(prefix, "AT+EMQPUBLISH=%d,%d,\"", BenchPubidx, 0);
+  if(ETMC2cObj.fops.IO_Send((uint8_t *)prefix, strlen(prefix)) < 0)
+    return -1;
+  for(x = 0; x < size; x++){
+    BenchOctetToHex(Payload[x], hexbyte);
+    ETMC2cObj.fops.IO_Send((uint8_t *)hexbyte, 2);
+  }
+  return ETMSendATCommand(&ETMC2cObj, (uint8_t *)"\"\r\n", 0, ETM_TOUT_300) != NULL ? 0 : -1;
+}
+
+/* Publishes per second, payload octets per second and transport writes per publish */
+static void BenchPublish(const char *mode, int (*publish)(uint16_t), uint16_t size){
+  ETMSim_Config_t cfg = Cfg;
+  ETMSim_Stats_t before, after;
+  uint64_t t0;
+  double h0, secs, hostns, sends;
+  uint32_t x, ok = 0;
+
+  cfg.loopback_ms = 0;
+  if(!BenchStart(&cfg))
+    return;
+  BenchPubidx = ETMpubreg(&ETMC2cObj, "bench/pub");
+  BenchPoll(BenchPubRegistered, 2000);
+  if(!BenchPubRegistered())
+    return;
+
+  ETMSim_GetStats(&before);
+  t0 = ETMSim_Micros();
+  h0 = BenchHostNs();
+  for(x = 0; x < Iterations; x++){
+    if(publish(size) == 0)
+      ok++;
+  }
+  hostns = (BenchHostNs() - h0) / Iterations;
+  secs = (ETMSim_Micros() - t0) / 1e6;
+  ETMSim_GetStats(&after);
+  sends = (double)(after.sends - before.sends) / Iterations;
+
+  printf("publish %-4s %5u octets  %8.1f pub/s  %9.0f octet/s  %7.0f ns host/pub  %6.1f sends/pub  %u/%u ok\n",
+         mode, size, ok / secs, ok * (double)size / secs, hostns, sends, ok, Iterations);
+  BenchJson("{\"bench\":\"publish\",\"mode\":\"%s\",\"size\":%u,\"count\":%u,\"ok\":%u,"
+            "\"pub_per_s\":%.2f,\"bytes_per_s\":%.1f,\"host_ns_per_pub\":%.0f,\"sends_per_pub\":%.1f}",
+            mode, size, Iterations, ok, ok / secs, ok * (double)size / secs, hostns, sends);
+}
+
+static uint32_t BenchWant;
+static bool BenchDelivered(void){
+  return Delivered >= BenchWant;
+}
+
+/* Time from a message leaving the ETM to the subscription callback */
+static void BenchLatency(bool raw, uint16_t size){
+  static double samples[BENCH_MAX_SAMPLES];
+  ETMSim_Config_t cfg = Cfg;
+  BenchPct_t pct;
+  uint64_t sent;
+  double h0, hostns;
+  uint32_t x, n = 0, delay;
+  int sub;
+
+  cfg.rawdelivery = raw;
+  if(!BenchStart(&cfg))
+    return;
+  sub = ETMsubscribeChunked(&ETMC2cObj, "bench/sub", BenchMessage, NULL);
+  if(sub < 0)
+    return;
+  ETMpoll(&ETMC2cObj);
+
+  Delivered = 0;
+  h0 = BenchHostNs();
+  for(x = 0; x < Iterations && n < BENCH_MAX_SAMPLES; x++){
+    /* Spread arrivals over the driver's poll cycle */
+    delay = x % 37;
+    sent = ETMSim_Micros() + delay * 1000ULL;
+    ETMSim_Publish("bench/sub", Payload, size, delay);
+    BenchWant = Delivered + 1;
+    BenchPoll(BenchDelivered, 5000);
+    if(BenchDelivered())
+      samples[n++] = (DeliveredAt - sent) / 1000.0;
+  }
+  hostns = (BenchHostNs() - h0) / Iterations;
+  pct = BenchPercentiles(samples, n);
+
+  printf("+EMQ: %-4s  %5u octets  p50 %7.2f  p90 %7.2f  p99 %7.2f  max %7.2f ms  %7.0f ns host/msg  %u/%u\n",
+         raw ? "raw" : "hex", size, pct.p50, pct.p90, pct.p99, pct.max, hostns, n, Iterations);
+  BenchJson("{\"bench\":\"urc_latency\",\"mode\":\"%s\",\"size\":%u,\"count\":%u,\"delivered\":%u,"
+            "\"p50_ms\":%.3f,\"p90_ms\":%.3f,\"p99_ms\":%.3f,\"max_ms\":%.3f,\"mean_ms\":%.3f,\"host_ns_per_msg\":%.0f}",
+            raw ? "raw" : "hex", size, Iterations, n, pct.p50, pct.p90, pct.p99, pct.max, pct.mean, hostns);
+}
+
+/* ETM_Init to +ETM:IDLE seen, and how long after the URC was sent init returned */
+static void BenchInit(void){
+  static double total[BENCH_MAX_SAMPLES], after[BENCH_MAX_SAMPLES];
+  ETMSim_Config_t cfg = Cfg;
+  BenchPct_t tp, ap;
+  uint32_t x, n = 0, runs = MIN(Iterations, 50), link = 0;
+  uint64_t t0, idle;
+
+  for(x = 0; x < runs; x++){
+    cfg.seed = Cfg.seed + x;
+    /* Vary the boot so init is caught at different points of its poll */
+    cfg.boot_ms = Cfg.boot_ms + x * 7;
+    ETMSim_Start(&cfg);
+    memset(&ETMC2cObj, 0, sizeof(ETMC2cObj));
+    ETMSim_Register(&ETMC2cObj);
+    t0 = ETMSim_Micros();
+    ETM_Init(&ETMC2cObj, NULL);
+    if(!(ETMC2cObj.urcseen & ETM_READY_URC))
+      continue;
+    idle = (uint64_t)(cfg.boot_ms + cfg.idle_ms) * 1000;
+    total[n] = (ETMSim_Micros() - t0) / 1000.0;
+    after[n] = (ETMSim_Micros() - idle) / 1000.0;
+    link = ETMC2cObj.UART_Config.BaudRate;
+    n++;
+  }
+  tp = BenchPercentiles(total, n);
+  ap = BenchPercentiles(after, n);
+
+  printf("ETM_Init to ready  p50 %8.2f  p90 %8.2f  max %8.2f ms   after +ETM:IDLE p50 %6.2f  max %6.2f ms  %u/%u  link %lu\n",
+         tp.p50, tp.p90, tp.max, ap.p50, ap.max, n, runs, (unsigned long)link);
+  BenchJson("{\"bench\":\"init\",\"count\":%u,\"ready\":%u,\"p50_ms\":%.3f,\"p90_ms\":%.3f,\"p99_ms\":%.3f,\"max_ms\":%.3f,"
+            "\"after_idle_p50_ms\":%.3f,\"after_idle_p99_ms\":%.3f,\"after_idle_max_ms\":%.3f,\"link_baud\":%lu}",
+            runs, n, tp.p50, tp.p90, tp.p99, tp.max, ap.p50, ap.p99, ap.max, (unsigned long)link);
+}
+
+/* The response matcher etm.c had before the keyword automaton, one prefix counter per keyword
+ * stepped for every octet (strlen() is taken once here, the old driver took it on every call) */
+static int32_t BenchMatchOld(const uint8_t *data, uint32_t len){
+  uint8_t index[NUM_RESPONSES] = {0};
+  uint8_t lens[NUM_RESPONSES];
+  int32_t found = 0;
+  uint32_t x;
+  uint8_t c;
+
+  for(x = 0; x < NUM_RESPONSES; x++)
+    lens[x] = strlen(ReturnKeywords[x].retstr);
+  while(len-- > 0){
+    c = *data++;
+    for(x = 0; x < NUM_RESPONSES; x++){
+      if(c == (uint8_t)ReturnKeywords[x].retstr[index[x]]){
+        if(++index[x] >= lens[x]){
+          found++;
+          index[x] = 0;
+        }
+      }else{
+        index[x] = 0;
+      }
+    }
+  }
+  return found;
+}
+
+/* Host CPU time per octet of the old and new response matchers over what the host received in a
+ * session: start-up, MQTT start, subscribe, hex and raw publishes with their loopback deliveries,
+ * firmware reads. Keywords found differ where the old matcher missed one starting inside a
+ * failed partial match. */
+static void BenchMatch(void){
+  static const char *names[] = {"prefix", "automaton"};
+  ETMSim_Config_t cfg = Cfg;
+  ETMSim_Stats_t stats;
+  uint32_t x, len, reps, r;
+  int32_t found[2] = {0};
+  double h0, ns[2];
+  uint8_t buf[512];
+  int sub, pub;
+
+  cfg.record = Transcript;
+  cfg.recordsize = sizeof(Transcript);
+  cfg.fwimage = FwImage;
+  cfg.fwlen = sizeof(FwImage);
+  if(!BenchStart(&cfg))
+    return;
+  sub = ETMsubscribe(&ETMC2cObj, "bench/match", NULL);
+  pub = ETMpubreg(&ETMC2cObj, "bench/match");
+  if(sub < 0 || pub < 0)
+    return;
+  BenchPubidx = pub;
+  BenchPoll(BenchPubRegistered, 2000);
+  for(x = 0; x < 64; x++){
+    if(x & 1)
+      ETMpublishRaw(&ETMC2cObj, pub, 1, Payload, 16 + x * 8);
+    else
+      ETMpublish(&ETMC2cObj, pub, 0, Payload, 16 + x);
+    ETMpoll(&ETMC2cObj);
+  }
+  for(x = 0; x < 32; x++)
+    ETMReadHostFW(&ETMC2cObj, x * sizeof(buf), sizeof(buf), buf);
+  ETMSim_Advance(1000);
+  for(x = 0; x < 20; x++)
+    ETMpoll(&ETMC2cObj);
+  ETMSim_GetStats(&stats);
+  len = (uint32_t)MIN(stats.rxoctets, sizeof(Transcript));
+
+  /* At least 16MB through each matcher */
+  reps = (16u << 20) / len + 1;
+  for(x = 0; x < 2; x++){
+    h0 = BenchHostNs();
+    for(r = 0; r < reps; r++)
+      found[x] = (x == 0) ? BenchMatchOld(Transcript, len) : ETM_MatchScan(Transcript, len);
+    ns[x] = (BenchHostNs() - h0) / ((double)reps * len);
+  }
+
+  for(x = 0; x < 2; x++){
+    printf("match %-9s %7lu octets  %7.2f ns host/octet  %8.1f MB/s  %ld keywords\n",
+           names[x], (unsigned long)len, ns[x], 1e3 / ns[x], (long)found[x]);
+    BenchJson("{\"bench\":\"match\",\"matcher\":\"%s\",\"transcript\":%lu,\"host_ns_per_octet\":%.3f,"
+              "\"mb_per_s\":%.1f,\"keywords\":%ld}",
+              names[x], (unsigned long)len, ns[x], 1e3 / ns[x], (long)found[x]);
+  }
+}
+
+/* Host firmware read throughput for a read size */
+/* Spend the time writing len octets to flash would take, the ETM carries on meanwhile */
+static void BenchFlash(uint32_t len){
+  FlashUsOwed += (uint64_t)len * FlashUsPerKb / 1024;
+  if(FlashUsOwed >= 1000){
+    ETMSim_Advance(FlashUsOwed / 1000);
+    FlashUsOwed %= 1000;
+  }
+}
+
+static int BenchFwSink(void *ctx, uint32_t offset, const uint8_t *data, uint16_t len){
+  (void)ctx;
+  if(memcmp(data, &FwImage[offset], len) != 0)
+    return -1;
+  BenchFlash(len);
+  return 0;
+}
+
+/* Whole image by ETMReadHostFW() with each chunk written to flash before the next is read, as
+ * the OTA demos used to */
+static void BenchFwRead(uint16_t chunk){
+  static uint8_t buf[1024];
+  ETMSim_Config_t cfg = Cfg;
+  uint32_t offset, len;
+  uint16_t cs;
+  uint64_t t0;
+  double h0, secs, hostns;
+  uint32_t reads = 0;
+  bool ok = true;
+
+  if(chunk > sizeof(buf))
+    return;
+  FlashUsOwed = 0;
+  cfg.fwimage = FwImage;
+  cfg.fwlen = sizeof(FwImage);
+  if(!BenchStart(&cfg) || ETMGetHostFWDetails(&ETMC2cObj, &len, &cs) != 0)
+    return;
+
+  t0 = ETMSim_Micros();
+  h0 = BenchHostNs();
+  for(offset = 0; offset < len; offset += chunk){
+    uint16_t want = MIN(len - offset, chunk);
+    if(ETMReadHostFW(&ETMC2cObj, offset, want, buf) != 0 || memcmp(buf, &FwImage[offset], want) != 0){
+      ok = false;
+      break;
+    }
+    BenchFlash(want);
+    reads++;
+  }
+  hostns = (BenchHostNs() - h0) / (reads ? reads : 1);
+  secs = (ETMSim_Micros() - t0) / 1e6;
+
+  printf("fw read     %5u octets  %8.1f read/s %9.0f octet/s  %7.0f ns host/read  %s\n",
+         chunk, reads / secs, offset / secs, hostns, ok ? "ok" : "FAILED");
+  BenchJson("{\"bench\":\"fw_read\",\"chunk\":%u,\"image\":%lu,\"ok\":%s,\"reads_per_s\":%.2f,"
+            "\"bytes_per_s\":%.1f,\"host_ns_per_read\":%.0f}",
+            chunk, (unsigned long)len, ok ? "true" : "false", reads / secs, offset / secs, hostns);
+}
+
+/* Whole image through ETMFwDownload(), flash writes overlap the next read */
+static void BenchFwStream(uint16_t chunk){
+  static ETMFwDownload_t dl;
+  ETMSim_Config_t cfg = Cfg;
+  ETMFwResult_t res;
+  uint64_t t0;
+  double h0, secs, hostns;
+
+  if(chunk > ETM_FW_CHUNK_SIZE)
+    return;
+  FlashUsOwed = 0;
+  cfg.fwimage = FwImage;
+  cfg.fwlen = sizeof(FwImage);
+  if(!BenchStart(&cfg))
+    return;
+
+  memset(&dl, 0, sizeof(dl));
+  dl.sink = BenchFwSink;
+  dl.chunk = chunk;
+  t0 = ETMSim_Micros();
+  h0 = BenchHostNs();
+  res = ETMFwDownload(&ETMC2cObj, &dl);
+  hostns = (BenchHostNs() - h0) / (dl.stats.reads ? dl.stats.reads : 1);
+  secs = (ETMSim_Micros() - t0) / 1e6;
+
+  printf("fw stream   %5u octets  %8.1f read/s %9.0f octet/s  %7.0f ns host/read  %s\n",
+         chunk, dl.stats.reads / secs, dl.len / secs, hostns, res == ETM_FW_OK ? "ok" : "FAILED");
+  BenchJson("{\"bench\":\"fw_stream\",\"chunk\":%u,\"image\":%lu,\"ok\":%s,\"reads_per_s\":%.2f,"
+            "\"bytes_per_s\":%.1f,\"host_ns_per_read\":%.0f,\"retries\":%lu}",
+            chunk, (unsigned long)dl.len, res == ETM_FW_OK ? "true" : "false", dl.stats.reads / secs,
+            dl.len / secs, hostns, (unsigned long)dl.stats.retries);
+}
+
+static void BenchUsage(const char *name){
+  printf("usage: %s [-n iterations] [-b max_baudrate] [-l latency_us] [-j jitter_us] [-r rxbuffer] [-f flash_us_per_kb] [-o results.json]\n", name);
+}
+
+int main(int argc, char **argv){
+  static const uint16_t sizes[] = {16, 64, 256, 1024};
+  static const uint16_t chunks[] = {50, 128, 256, 512};
+  const char *jsonpath = NULL;
+  uint32_t x;
+  int opt;
+
+  ETMSim_DefaultConfig(&Cfg);
+  for(opt = 1; opt < argc; opt++){
+    if(opt + 1 < argc && strcmp(argv[opt], "-n") == 0)
+      Iterations = strtoul(argv[++opt], NULL, 0);
+    else if(opt + 1 < argc && strcmp(argv[opt], "-b") == 0)
+      Cfg.maxbaud = strtoul(argv[++opt], NULL, 0);
+    else if(opt + 1 < argc && strcmp(argv[opt], "-l") == 0)
+      Cfg.latency_us = strtoul(argv[++opt], NULL, 0);
+    else if(opt + 1 < argc && strcmp(argv[opt], "-j") == 0)
+      Cfg.jitter_us = strtoul(argv[++opt], NULL, 0);
+    else if(opt + 1 < argc && strcmp(argv[opt], "-r") == 0)
+      Cfg.rxbuffer = strtoul(argv[++opt], NULL, 0);
+    else if(opt + 1 < argc && strcmp(argv[opt], "-f") == 0)
+      FlashUsPerKb = strtoul(argv[++opt], NULL, 0);
+    else if(opt + 1 < argc && strcmp(argv[opt], "-o") == 0)
+      jsonpath = argv[++opt];
+    else{
+      BenchUsage(argv[0]);
+      return 2;
+    }
+  }
+  if(Iterations == 0)
+    Iterations = 1;
+  if(jsonpath != NULL){
+    Json = (strcmp(jsonpath, "-") == 0) ? stdout : fopen(jsonpath, "w");
+    if(Json == NULL){
+      perror(jsonpath);
+      return 2;
+    }
+  }
+
+  for(x = 0; x < sizeof(Payload); x++)
+    Payload[x] = (uint8_t)(x * 31 + 7);
+  for(x = 0; x < sizeof(FwImage); x++)
+    FwImage[x] = (uint8_t)(x ^ (x >> 8));
+
+  printf("ETM_CMD_SIZE %d  baud %lu up to %lu  latency %lu us  jitter %lu us  rx buffer %lu  flash %lu us/KB  %u iterations\n",
+         ETM_CMD_SIZE, (unsigned long)Cfg.baudrate, (unsigned long)Cfg.maxbaud, (unsigned long)Cfg.latency_us,
+         (unsigned long)Cfg.jitter_us, (unsigned long)Cfg.rxbuffer, (unsigned long)FlashUsPerKb, Iterations);
+  BenchJson("{\"bench\":\"config\",\"etm_cmd_size\":%d,\"baudrate\":%lu,\"maxbaud\":%lu,\"latency_us\":%lu,\"jitter_us\":%lu,"
+            "\"rxbuffer\":%lu,\"flash_us_per_kb\":%lu,\"iterations\":%u}",
+            ETM_CMD_SIZE, (unsigned long)Cfg.baudrate, (unsigned long)Cfg.maxbaud, (unsigned long)Cfg.latency_us,
+            (unsigned long)Cfg.jitter_us, (unsigned long)Cfg.rxbuffer, (unsigned long)FlashUsPerKb, Iterations);
+
+  BenchInit();
+  BenchMatch();
+  for(x = 0; x < sizeof(sizes) / sizeof(sizes[0]); x++)
+    BenchEncode(sizes[x]);
+  for(x = 0; x < sizeof(sizes) / sizeof(sizes[0]); x++){
+    /* The ascii-hex command has to fit in CmdString */
+    if(sizes[x] * 2 + 32 <= ETM_CMD_SIZE){
+      BenchPublish("old", BenchPublishOld, sizes[x]);
+      BenchPublish("hex", BenchPublishHex, sizes[x]);
+    }
+    BenchPublish("raw", BenchPublishRaw, sizes[x]);
+  }
+  for(x = 0; x < sizeof(sizes) / sizeof(sizes[0]); x++){
+    BenchLatency(false, sizes[x]);
+    BenchLatency(true, sizes[x]);
+  }
+  for(x = 0; x < sizeof(chunks) / sizeof(chunks[0]); x++)
+    BenchFwRead(chunks[x]);
+  for(x = 0; x < sizeof(chunks) / sizeof(chunks[0]); x++)
+    BenchFwStream(chunks[x]);
+
+  if(Json != NULL && Json != stdout)
+    fclose(Json);
+  return 0;
+}
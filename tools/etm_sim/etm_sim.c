@@ -0,0 +1,1174 @@
+/**
+  ******************************************************************************
+  * @file    etm_sim.c
+  * @brief   Host-side simulation of a BG96 running the Eseye ETM firmware.
+  ******************************************************************************
+  */
+/* Includes ------------------------------------------------------------------*/
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdarg.h>
+#include <stdbool.h>
+#include <ctype.h>
+#include <ucontext.h>
+
+#include "FreeRTOS.h"
+#include "task.h"
+#include "semphr.h"
+#include "message_buffer.h"
+
+#include "etm.h"
+#include "etm_sim.h"
+
+#define SIM_NEVER               UINT64_MAX
+/* Tasks, the first being the one main() runs in, and the stack each other task gets */
+#define SIM_TASKS               4
+#define SIM_STACK_SIZE          ( 256 * 1024 )
+
+/* Output of the simulated ETM waiting for its time to go out on the UART */
+typedef struct {
+  uint64_t at;
+  uint32_t seq;
+  uint32_t len;
+  uint8_t *data;
+  /* Non-zero for a change of the ETM's rate (AT+IPR) rather than output */
+  uint32_t baud;
+} ETMSimEvent_t;
+
+typedef struct {
+  bool inuse;
+  char name[ETMSIM_TOPIC_SIZE];
+} ETMSimTopic_t;
+
+static struct {
+  ETMSim_Config_t cfg;
+  ETMSim_Stats_t stats;
+  uint64_t now;
+  /* Rates and octet times of each end of the UART */
+  uint32_t etmbaud, hostbaud;
+  uint32_t octetus, hostoctetus;
+  /* Framing errors not yet collected by IO_LineErrors */
+  uint16_t lineerrors;
+  uint32_t rand;
+  uint32_t seq;
+
+  /* Scheduled output, kept in (at, seq) order */
+  ETMSimEvent_t *events;
+  uint32_t nevents, maxevents;
+
+  /* Octets on the wire to the host with their arrival times */
+  uint8_t wire[ETMSIM_WIRE_SIZE];
+  uint64_t wireat[ETMSIM_WIRE_SIZE];
+  uint32_t wirebaud[ETMSIM_WIRE_SIZE];
+  uint32_t wirehead, wirecount;
+  uint64_t wirefree;
+
+  /* Host UART receive ring */
+  uint8_t *rx;
+  uint32_t rxhead, rxcount, rxlines;
+  /* For ETM_GetRxStats(): times the ring was lapped and the most octets held at once */
+  uint32_t rxoverflows;
+  uint32_t rxhighwater;
+
+  /* Command line being received, or the octets of a counted (raw) publish */
+  char line[ETMSIM_LINE_SIZE];
+  uint32_t linelen;
+  uint32_t rawleft;
+  int rawidx, rawqos;
+  bool skiplf;
+
+  /* Until +ETM:IDLE after a restart the ETM takes no notice of the host */
+  uint64_t bootedat;
+
+  /* Reply time and fault decision for the command being handled, and the latest reply time so
+   * far which later replies can't come before */
+  uint64_t respat;
+  uint64_t busyuntil;
+  bool mute;
+
+  bool echo;
+  bool stateurcs;
+  int state;
+  ETMSimTopic_t subs[ETMSIM_MAX_TOPICS];
+  ETMSimTopic_t pubs[ETMSIM_MAX_TOPICS];
+
+  /* IO_Wake was called since the last IO_Wait returned */
+  bool iowake;
+} Sim;
+
+/* A task runs until it has to wait, then the task due soonest goes on. A task is due when its
+ * wait ends or, if it has been readied (notified, or something it may be waiting for changed),
+ * straight away. Kept apart from Sim, which ETMSim_Start() clears. */
+struct ETMSimTask {
+  bool inuse;
+  bool ready;
+  uint64_t wakeat;
+  ucontext_t ctx;
+  void *stack;
+  TaskFunction_t code;
+  void *param;
+  /* Notification */
+  uint32_t value;
+  bool pending;
+};
+
+static struct {
+  struct ETMSimTask tasks[SIM_TASKS];
+  int current;
+} SimTasks = {.tasks = {{.inuse = true}}};
+
+struct ETMSimMutex {
+  TaskHandle_t holder;
+};
+
+struct ETMSimMessageBuffer {
+  size_t size;
+  size_t used;
+  uint8_t *data;
+};
+
+/* Private functions ---------------------------------------------------------*/
+
+void ETMSim_Log(const char *format, ...){
+  va_list args;
+
+  if(!Sim.cfg.verbose)
+    return;
+  va_start(args, format);
+  printf("[%9.3f] ", Sim.now / 1000.0);
+  vprintf(format, args);
+  va_end(args);
+}
+
+static uint32_t ETMSimRand(void){
+  /* xorshift32, deterministic for a given seed */
+  Sim.rand ^= Sim.rand << 13;
+  Sim.rand ^= Sim.rand >> 17;
+  Sim.rand ^= Sim.rand << 5;
+  return Sim.rand;
+}
+
+static bool ETMSimChance(uint32_t ppm){
+  return ppm != 0 && (ETMSimRand() % 1000000) < ppm;
+}
+
+/* Queue output of the simulated ETM to start no earlier than at */
+static ETMSimEvent_t *ETMSimEmitAt(uint64_t at, const void *data, uint32_t len){
+  ETMSimEvent_t *ev;
+  uint32_t x;
+
+  if(len == 0)
+    return NULL;
+  if(Sim.nevents == Sim.maxevents){
+    Sim.maxevents = Sim.maxevents ? Sim.maxevents * 2 : 64;
+    Sim.events = realloc(Sim.events, Sim.maxevents * sizeof(ETMSimEvent_t));
+  }
+  /* Insert after any event due at the same time so output keeps its order */
+  for(x = Sim.nevents; x > 0 && Sim.events[x - 1].at > at; x--)
+    ;
+  memmove(&Sim.events[x + 1], &Sim.events[x], (Sim.nevents - x) * sizeof(ETMSimEvent_t));
+  ev = &Sim.events[x];
+  ev->at = at;
+  ev->seq = Sim.seq++;
+  ev->len = len;
+  ev->data = malloc(len);
+  memcpy(ev->data, data, len);
+  ev->baud = 0;
+  Sim.nevents++;
+  return ev;
+}
+
+/* Change the ETM's rate once the output queued before it has gone */
+static void ETMSimBaudAt(uint64_t at, uint32_t baud){
+  uint8_t none = 0;
+
+  ETMSimEmitAt(at, &none, 1)->baud = baud;
+}
+
+static uint32_t ETMSimOctetTime(uint32_t baud){
+  return (10000000 + baud - 1) / baud;
+}
+
+/* Reply to the command being handled */
+static void ETMSimReply(const char *format, ...){
+  char buf[512];
+  va_list args;
+  int len;
+
+  if(Sim.mute)
+    return;
+  va_start(args, format);
+  len = vsnprintf(buf, sizeof(buf), format, args);
+  va_end(args);
+  if(len >= (int)sizeof(buf))
+    len = sizeof(buf) - 1;
+  ETMSimEmitAt(Sim.respat, buf, len);
+}
+
+/* Unsolicited line delay_ms after the reply time */
+static void ETMSimUrcAfter(uint32_t delay_ms, const char *format, ...){
+  char buf[512];
+  va_list args;
+  int len;
+
+  va_start(args, format);
+  len = vsnprintf(buf, sizeof(buf), format, args);
+  va_end(args);
+  if(len >= (int)sizeof(buf))
+    len = sizeof(buf) - 1;
+  ETMSimEmitAt(Sim.respat + (uint64_t)delay_ms * 1000, buf, len);
+}
+
+/* Put an event's octets on the wire, applying the line rate and any injected faults */
+static void ETMSimTransmit(ETMSimEvent_t *ev){
+  uint64_t t = (ev->at > Sim.wirefree) ? ev->at : Sim.wirefree;
+  uint32_t x, pos;
+  uint8_t c;
+
+  if(ev->baud != 0){
+    if(ev->baud != Sim.etmbaud)
+      Sim.stats.ratechanges++;
+    Sim.etmbaud = ev->baud;
+    Sim.octetus = ETMSimOctetTime(ev->baud);
+    free(ev->data);
+    return;
+  }
+  for(x = 0; x < ev->len; x++){
+    c = ev->data[x];
+    t += Sim.octetus;
+    if(ETMSimChance(Sim.cfg.drop_ppm)){
+      Sim.stats.dropped++;
+      continue;
+    }
+    if(ETMSimChance(Sim.cfg.corrupt_ppm)){
+      c ^= (uint8_t)(1 << (ETMSimRand() % 8));
+      Sim.stats.corrupted++;
+    }
+    if(Sim.wirecount == ETMSIM_WIRE_SIZE){
+      Sim.stats.wirefull++;
+      continue;
+    }
+    pos = (Sim.wirehead + Sim.wirecount) % ETMSIM_WIRE_SIZE;
+    Sim.wire[pos] = c;
+    Sim.wireat[pos] = t;
+    Sim.wirebaud[pos] = Sim.etmbaud;
+    Sim.wirecount++;
+  }
+  Sim.wirefree = t;
+  free(ev->data);
+}
+
+/* Bring the wire and host receive buffer up to the current time */
+static void ETMSimUpdate(void){
+  uint32_t baud;
+  uint8_t c;
+
+  while(Sim.nevents > 0 && Sim.events[0].at <= Sim.now){
+    ETMSimTransmit(&Sim.events[0]);
+    Sim.nevents--;
+    memmove(&Sim.events[0], &Sim.events[1], Sim.nevents * sizeof(ETMSimEvent_t));
+  }
+  while(Sim.wirecount > 0 && Sim.wireat[Sim.wirehead] <= Sim.now){
+    c = Sim.wire[Sim.wirehead];
+    baud = Sim.wirebaud[Sim.wirehead];
+    Sim.wirehead = (Sim.wirehead + 1) % ETMSIM_WIRE_SIZE;
+    Sim.wirecount--;
+    if(baud != Sim.hostbaud || (Sim.cfg.noisybaud != 0 && baud >= Sim.cfg.noisybaud && ETMSimChance(Sim.cfg.noise_ppm))){
+      /* Framing error, the octet is garbage */
+      c = (uint8_t)(0x80 | ETMSimRand());
+      Sim.stats.framingerrors++;
+      Sim.lineerrors++;
+    }
+    /* As on the board, RTS/CTS doesn't hold the ETM off for a full ring: RTS only follows the
+     * UART's receive register, which the DMA empties as each octet arrives. An octet arriving
+     * with the ring full laps it and everything unread is lost. */
+    if(Sim.rxcount == Sim.cfg.rxbuffer){
+      Sim.stats.overruns += Sim.rxcount;
+      Sim.rxoverflows++;
+      Sim.rxhead = (Sim.rxhead + Sim.rxcount) % Sim.cfg.rxbuffer;
+      Sim.rxcount = Sim.rxlines = 0;
+    }
+    Sim.rx[(Sim.rxhead + Sim.rxcount) % Sim.cfg.rxbuffer] = c;
+    Sim.rxcount++;
+    if(Sim.rxcount > Sim.rxhighwater)
+      Sim.rxhighwater = Sim.rxcount;
+    if(c == '\n')
+      Sim.rxlines++;
+    if(Sim.stats.rxoctets < Sim.cfg.recordsize)
+      Sim.cfg.record[Sim.stats.rxoctets] = c;
+    Sim.stats.rxoctets++;
+  }
+}
+
+/* Time the next octet reaches the host */
+static uint64_t ETMSimNextArrival(void){
+  uint64_t t;
+
+  if(Sim.wirecount > 0)
+    return Sim.wireat[Sim.wirehead];
+  if(Sim.nevents > 0){
+    t = (Sim.events[0].at > Sim.wirefree) ? Sim.events[0].at : Sim.wirefree;
+    return t + Sim.octetus;
+  }
+  return SIM_NEVER;
+}
+
+static void ETMSimTopicName(char *dst, const char *src){
+  size_t len = 0;
+
+  while(*src != 0 && *src != '"' && len < ETMSIM_TOPIC_SIZE - 1)
+    dst[len++] = *src++;
+  dst[len] = 0;
+}
+
+/* MQTT topic filter match with + and # wildcards */
+static bool ETMSimTopicMatch(const char *filter, const char *topic){
+  while(*filter != 0){
+    if(*filter == '#')
+      return true;
+    if(*filter == '+'){
+      while(*topic != 0 && *topic != '/')
+        topic++;
+      filter++;
+      continue;
+    }
+    if(*filter != *topic)
+      return false;
+    filter++;
+    topic++;
+  }
+  return *topic == 0;
+}
+
+/* Send a message to a subscription, quoted ascii-hex unless raw delivery is configured */
+static void ETMSimDeliver(uint64_t at, const char *sub, const uint8_t *data, uint32_t len){
+  static const char hexchars[] = "0123456789ABCDEF";
+  char head[64];
+  uint8_t *msg, *p;
+  uint32_t x, hlen, mlen;
+
+  hlen = snprintf(head, sizeof(head), "\r\n+EMQ:%s,%lu\r\n", sub, (unsigned long)len);
+  mlen = hlen + (Sim.cfg.rawdelivery ? len : len * 2 + 2) + 2;
+  msg = p = malloc(mlen);
+  memcpy(p, head, hlen);
+  p += hlen;
+  if(Sim.cfg.rawdelivery){
+    memcpy(p, data, len);
+    p += len;
+  }else{
+    *p++ = '"';
+    for(x = 0; x < len; x++){
+      *p++ = hexchars[data[x] >> 4];
+      *p++ = hexchars[data[x] & 0x0f];
+    }
+    *p++ = '"';
+  }
+  *p++ = '\r';
+  *p++ = '\n';
+  ETMSimEmitAt(at, msg, mlen);
+  free(msg);
+  Sim.stats.delivered++;
+}
+
+static int ETMSimPublishAt(uint64_t at, const char *topic, const uint8_t *data, uint32_t len){
+  char sub[12];
+  int x, count = 0;
+
+  if(topic == NULL){
+    ETMSimDeliver(at, "S", data, len);
+    return 1;
+  }
+  for(x = 0; x < ETMSIM_MAX_TOPICS; x++){
+    if(Sim.subs[x].inuse && ETMSimTopicMatch(Sim.subs[x].name, topic)){
+      snprintf(sub, sizeof(sub), "%d", x);
+      ETMSimDeliver(at, sub, data, len);
+      count++;
+    }
+  }
+  return count;
+}
+
+static void ETMSimSetState(int state, uint32_t delay_ms){
+  Sim.state = state;
+  if(Sim.stateurcs)
+    ETMSimUrcAfter(delay_ms, "\r\n+ETMSTATE:%d\r\n", state);
+}
+
+static void ETMSimBoot(uint64_t at){
+  int x;
+
+  for(x = 0; x < ETMSIM_MAX_TOPICS; x++){
+    Sim.subs[x].inuse = false;
+    Sim.pubs[x].inuse = false;
+  }
+  /* Power on settings, the rate changes once the output before the restart has gone */
+  ETMSimBaudAt(at, Sim.cfg.baudrate);
+  Sim.echo = true;
+  Sim.stateurcs = false;
+  Sim.state = ETM_IDLE;
+  Sim.linelen = 0;
+  Sim.rawleft = 0;
+  Sim.respat = at;
+  Sim.bootedat = at + (uint64_t)(Sim.cfg.boot_ms + Sim.cfg.idle_ms) * 1000;
+  ETMSimUrcAfter(Sim.cfg.boot_ms, "\r\nAPP RDY\r\n");
+  ETMSimUrcAfter(Sim.cfg.boot_ms + Sim.cfg.idle_ms, "\r\n+ETM:IDLE\r\n");
+}
+
+/* A publish has been received in full */
+static void ETMSimPublished(int idx, int qos, const uint8_t *data, uint32_t len){
+  bool fail = false;
+
+  Sim.stats.publishes++;
+  ETMSimReply("\r\nOK\r\n");
+  if(qos > 0 && !Sim.mute){
+    /* Acknowledgements come in publish order */
+    fail = ETMSimChance(Sim.cfg.sendfail_ppm);
+    if(fail)
+      Sim.stats.sendfails++;
+    ETMSimUrcAfter(Sim.cfg.puback_ms, "\r\n+EMQPUB:%d:%s\r\n", idx, fail ? "SEND FAIL" : "SEND OK");
+  }
+  if(Sim.cfg.loopback_ms != 0 && !fail)
+    ETMSimPublishAt(Sim.respat + (uint64_t)Sim.cfg.loopback_ms * 1000, Sim.pubs[idx].name, data, len);
+}
+
+static int ETMSimHexOctet(const char *s){
+  char pair[3] = {s[0], s[1], 0};
+
+  if(!isxdigit((unsigned char)s[0]) || !isxdigit((unsigned char)s[1]))
+    return -1;
+  return (int)strtol(pair, NULL, 16);
+}
+
+static void ETMSimPublishCmd(const char *args){
+  int idx, qos, n, octet;
+  unsigned len;
+  const char *hex;
+  uint32_t x, count;
+  uint8_t *data;
+
+  if(sscanf(args, "%d,%d,%n", &idx, &qos, &n) < 2 || idx < 0 || idx >= ETMSIM_MAX_TOPICS || !Sim.pubs[idx].inuse){
+    ETMSimReply("\r\nERROR\r\n");
+    return;
+  }
+  if(args[n] != '"'){
+    /* Counted publish, the raw payload follows the prompt */
+    if(sscanf(&args[n], "%u", &len) != 1 || len == 0 || len > 65535){
+      ETMSimReply("\r\nERROR\r\n");
+      return;
+    }
+    Sim.rawleft = len;
+    Sim.rawidx = idx;
+    Sim.rawqos = qos;
+    Sim.linelen = 0;
+    ETMSimReply("\r\n> ");
+    return;
+  }
+  hex = &args[n + 1];
+  for(count = 0; isxdigit((unsigned char)hex[count]); count++)
+    ;
+  if(hex[count] != '"' || (count & 1) != 0){
+    ETMSimReply("\r\nERROR\r\n");
+    return;
+  }
+  data = malloc(count / 2 + 1);
+  for(x = 0; x < count / 2; x++){
+    octet = ETMSimHexOctet(&hex[x * 2]);
+    data[x] = (uint8_t)octet;
+  }
+  ETMSimPublished(idx, qos, data, count / 2);
+  free(data);
+}
+
+static void ETMSimOpenCmd(const char *args, ETMSimTopic_t *topics, const char *urc){
+  int idx, n;
+
+  if(sscanf(args, "%d,\"%n", &idx, &n) < 1 || n == 0 || idx < 0 || idx >= ETMSIM_MAX_TOPICS){
+    ETMSimReply("\r\nERROR\r\n");
+    return;
+  }
+  ETMSimReply("\r\nOK\r\n");
+  if(topics[idx].inuse){
+    ETMSimReply("\r\n%s:%d,-2\r\n", urc, idx);
+    return;
+  }
+  topics[idx].inuse = true;
+  ETMSimTopicName(topics[idx].name, &args[n]);
+  ETMSimReply("\r\n%s:%d,0\r\n", urc, idx);
+}
+
+static void ETMSimCloseCmd(const char *args, ETMSimTopic_t *topics, const char *urc){
+  int idx;
+
+  if(sscanf(args, "%d", &idx) != 1 || idx < 0 || idx >= ETMSIM_MAX_TOPICS || !topics[idx].inuse){
+    ETMSimReply("\r\nERROR\r\n");
+    return;
+  }
+  topics[idx].inuse = false;
+  ETMSimReply("\r\nOK\r\n");
+  ETMSimReply("\r\n%s:%d,0\r\n", urc, idx);
+}
+
+static void ETMSimFwReadCmd(const char *args){
+  static const char hexchars[] = "0123456789ABCDEF";
+  unsigned long offset;
+  unsigned len;
+  uint16_t cs = 0;
+  uint32_t x;
+  char *resp, *p;
+
+  if(*args == '?'){
+    for(x = 0; x + 1 < Sim.cfg.fwlen; x += 2)
+      cs ^= (uint16_t)((Sim.cfg.fwimage[x] << 8) | Sim.cfg.fwimage[x + 1]);
+    if(x < Sim.cfg.fwlen)
+      cs ^= Sim.cfg.fwimage[x];
+    ETMSimReply("\r\n+ETMHFWREAD:%lu,%x\r\n\r\nOK\r\n", (unsigned long)Sim.cfg.fwlen, cs);
+    return;
+  }
+  if(sscanf(args, "=%lu,%u", &offset, &len) != 2 || Sim.cfg.fwimage == NULL || len == 0 ||
+     offset + len > Sim.cfg.fwlen){
+    ETMSimReply("\r\nERROR\r\n");
+    return;
+  }
+  resp = p = malloc(len * 2 + 64);
+  p += sprintf(p, "\r\n+ETMHFWREAD:");
+  for(x = 0; x < len; x++){
+    *p++ = hexchars[Sim.cfg.fwimage[offset + x] >> 4];
+    *p++ = hexchars[Sim.cfg.fwimage[offset + x] & 0x0f];
+  }
+  p += sprintf(p, "\r\n\r\nOK\r\n");
+  if(!Sim.mute)
+    ETMSimEmitAt(Sim.respat, resp, p - resp);
+  free(resp);
+}
+
+static void ETMSimStateCmd(const char *args){
+  if(strcmp(args, "?") == 0){
+    ETMSimReply("\r\n+ETMSTATE:%d\r\n\r\nOK\r\n", Sim.state);
+  }else if(strcmp(args, "=1") == 0){
+    Sim.stateurcs = true;
+    ETMSimReply("\r\nOK\r\n");
+  }else if(strcmp(args, "=0") == 0){
+    Sim.stateurcs = false;
+    ETMSimReply("\r\nOK\r\n");
+  }else if(strcmp(args, "=startmqtt") == 0 || strcmp(args, "=startudp") == 0){
+    bool mqtt = (args[6] == 'm');
+    ETMSimReply("\r\nOK\r\n");
+    ETMSimSetState(ETM_NETWORKSTART, 0);
+    ETMSimSetState(mqtt ? ETM_MQTTREADY : ETM_UDPACTIVE, Sim.cfg.connect_ms);
+    ETMSimUrcAfter(Sim.cfg.connect_ms, mqtt ? "\r\n+ETM:EMQRDY\r\n" : "\r\n+ETM:EURDY\r\n");
+  }else{
+    ETMSimReply("\r\nERROR\r\n");
+  }
+}
+
+/* AT+IPR=<rate> is answered at the old rate, AT+IFC=2,2 (RTS/CTS) and AT+IFC=0,0 are accepted */
+static void ETMSimLinkCmd(const char *cmd){
+  uint32_t rate;
+
+  if(strncmp(cmd, "+IPR=", 5) == 0){
+    rate = strtoul(cmd + 5, NULL, 10);
+    if(rate != 115200 && rate != 230400 && rate != 460800 && rate != 921600){
+      ETMSimReply("\r\nERROR\r\n");
+    }else if(rate > Sim.cfg.maxbaud && rate != Sim.cfg.baudrate){
+      ETMSimReply("\r\nERROR\r\n");
+    }else{
+      ETMSimReply("\r\nOK\r\n");
+      if(!Sim.mute)
+        ETMSimBaudAt(Sim.respat, rate);
+    }
+  }else if(strcmp(cmd, "+IPR?") == 0){
+    ETMSimReply("\r\n+IPR: %lu\r\n\r\nOK\r\n", (unsigned long)Sim.etmbaud);
+  }else if(strcmp(cmd, "+IFC=2,2") == 0 || strcmp(cmd, "+IFC=0,0") == 0){
+    ETMSimReply("\r\nOK\r\n");
+  }else{
+    ETMSimReply("\r\nERROR\r\n");
+  }
+}
+
+/* Handle a complete command line */
+static void ETMSimCommand(char *cmd){
+  Sim.stats.commands++;
+  if(Sim.now < Sim.busyuntil)
+    Sim.stats.overlaps++;
+  Sim.respat = Sim.now + Sim.cfg.latency_us;
+  if(Sim.cfg.jitter_us != 0)
+    Sim.respat += ETMSimRand() % Sim.cfg.jitter_us;
+  if(ETMSimChance(Sim.cfg.late_ppm)){
+    Sim.respat += (uint64_t)Sim.cfg.late_ms * 1000;
+    Sim.stats.delayed++;
+  }
+  if(Sim.respat < Sim.busyuntil)
+    Sim.respat = Sim.busyuntil;
+  Sim.busyuntil = Sim.respat;
+  Sim.mute = ETMSimChance(Sim.cfg.silent_ppm);
+  if(Sim.mute)
+    Sim.stats.silenced++;
+  if(Sim.cfg.verbose)
+    ETMSim_Log("ETM <- %.*s\r\n", 80, cmd);
+
+  if(strncmp(cmd, "AT", 2) != 0){
+    ETMSimReply("\r\nERROR\r\n");
+    Sim.stats.errors++;
+    return;
+  }
+  if(ETMSimChance(Sim.cfg.error_ppm)){
+    Sim.stats.injectederrors++;
+    ETMSimReply("\r\nERROR\r\n");
+    return;
+  }
+  cmd += 2;
+  if(*cmd == 0){
+    ETMSimReply("\r\nOK\r\n");
+  }else if(strcmp(cmd, "E0") == 0 || strcmp(cmd, "E1") == 0){
+    Sim.echo = (cmd[1] == '1');
+    ETMSimReply("\r\nOK\r\n");
+  }else if(strncmp(cmd, "+EMQPUBLISH=", 12) == 0){
+    ETMSimPublishCmd(cmd + 12);
+  }else if(strncmp(cmd, "+EMQSUBOPEN=", 12) == 0){
+    ETMSimOpenCmd(cmd + 12, Sim.subs, "+EMQSUBOPEN");
+  }else if(strncmp(cmd, "+EMQPUBOPEN=", 12) == 0){
+    ETMSimOpenCmd(cmd + 12, Sim.pubs, "+EMQPUBOPEN");
+  }else if(strncmp(cmd, "+EMQSUBCLOSE=", 13) == 0){
+    ETMSimCloseCmd(cmd + 13, Sim.subs, "+EMQSUBCLOSE");
+  }else if(strncmp(cmd, "+EMQPUBCLOSE=", 13) == 0){
+    ETMSimCloseCmd(cmd + 13, Sim.pubs, "+EMQPUBCLOSE");
+  }else if(strncmp(cmd, "+ETMSTATE", 9) == 0){
+    ETMSimStateCmd(cmd + 9);
+  }else if(strncmp(cmd, "+ETMHFWREAD", 11) == 0){
+    ETMSimFwReadCmd(cmd + 11);
+  }else if(strcmp(cmd, "+ETMHFWGET") == 0){
+    ETMSimReply("\r\nOK\r\n");
+    ETMSimUrcAfter(Sim.cfg.fwget_ms, "\r\n+ETMHFWGET:%s\r\n", Sim.cfg.fwimage != NULL ? "available" : "unavailable");
+  }else if(strcmp(cmd, "+ETMHFWCONF") == 0 || strncmp(cmd, "+ETMCFG=", 8) == 0){
+    ETMSimReply("\r\nOK\r\n");
+  }else if(strncmp(cmd, "+IPR", 4) == 0 || strncmp(cmd, "+IFC", 4) == 0){
+    ETMSimLinkCmd(cmd);
+  }else if(strcmp(cmd, "+CSQ") == 0){
+    ETMSimReply("\r\n+CSQ: 20,99\r\n\r\nOK\r\n");
+  }else{
+    ETMSimReply("\r\nERROR\r\n");
+    Sim.stats.errors++;
+  }
+}
+
+/* Octets from the host in order of arrival */
+static void ETMSimInput(const uint8_t *data, uint16_t len){
+  uint16_t x;
+  uint32_t take;
+
+  if(Sim.now < Sim.bootedat)
+    return;
+  for(x = 0; x < len; ){
+    if(Sim.skiplf){
+      /* The LF of a CRLF ending the previous command */
+      Sim.skiplf = false;
+      if(data[x] == '\n'){
+        if(Sim.echo)
+          ETMSimEmitAt(Sim.now, &data[x], 1);
+        x++;
+        continue;
+      }
+    }
+    if(Sim.rawleft > 0){
+      /* Payload of a counted publish */
+      take = MIN(Sim.rawleft, (uint32_t)(len - x));
+      memcpy(&Sim.line[Sim.linelen], &data[x], take);
+      Sim.linelen += take;
+      Sim.rawleft -= take;
+      x += take;
+      if(Sim.rawleft == 0){
+        Sim.respat = Sim.now + Sim.cfg.latency_us;
+        ETMSimPublished(Sim.rawidx, Sim.rawqos, (uint8_t *)Sim.line, Sim.linelen);
+        Sim.linelen = 0;
+      }
+      continue;
+    }
+    if(Sim.echo)
+      ETMSimEmitAt(Sim.now, &data[x], 1);
+    if(data[x] == '\r' || data[x] == '\n'){
+      if(Sim.linelen > 0){
+        Sim.line[Sim.linelen] = 0;
+        Sim.linelen = 0;
+        Sim.skiplf = (data[x] == '\r');
+        ETMSimCommand(Sim.line);
+      }
+    }else if(Sim.linelen < ETMSIM_LINE_SIZE - 1){
+      Sim.line[Sim.linelen++] = (char)data[x];
+    }
+    x++;
+  }
+}
+
+/* IO callbacks --------------------------------------------------------------*/
+
+static int8_t ETMSimIOInit(void){
+  Sim.hostbaud = Sim.cfg.baudrate;
+  Sim.hostoctetus = ETMSimOctetTime(Sim.hostbaud);
+  return 0;
+}
+
+static int8_t ETMSimIODeInit(void){
+  return 0;
+}
+
+/* As on the board, the receive buffer is emptied */
+static int8_t ETMSimIOBaudrate(uint32_t BaudRate){
+  ETMSimUpdate();
+  Sim.hostbaud = BaudRate;
+  Sim.hostoctetus = ETMSimOctetTime(BaudRate);
+  Sim.rxhead = Sim.rxcount = Sim.rxlines = 0;
+  return 0;
+}
+
+static int8_t ETMSimIOFlowControl(uint8_t Enable){
+  (void)Enable;
+  return 0;
+}
+
+static uint16_t ETMSimIOLineErrors(void){
+  uint16_t errors;
+
+  ETMSimUpdate();
+  errors = Sim.lineerrors;
+  Sim.lineerrors = 0;
+  return errors;
+}
+
+static void ETMSimIOFlush(void){
+  ETMSimUpdate();
+  Sim.rxhead = Sim.rxcount = Sim.rxlines = 0;
+}
+
+/* Blocking transmit, the clock moves on by the time the octets take on the wire. The ETM takes
+ * each octet as it arrives, so its echo goes out while the rest is still being sent. At the wrong
+ * rate the ETM sees nothing it can use. */
+static int16_t ETMSimIOSend(uint8_t *pData, uint16_t Length){
+  uint16_t x;
+
+  Sim.stats.txoctets += Length;
+  Sim.stats.sends++;
+  for(x = 0; x < Length; x++){
+    Sim.now += Sim.hostoctetus;
+    ETMSimUpdate();
+    if(Sim.hostbaud == Sim.etmbaud)
+      ETMSimInput(&pData[x], 1);
+  }
+  ETMSimUpdate();
+  return 0;
+}
+
+static void ETMSimConsume(uint16_t Length){
+  uint16_t x;
+
+  for(x = 0; x < Length && Sim.rxcount > 0; x++){
+    if(Sim.rx[Sim.rxhead] == '\n')
+      Sim.rxlines--;
+    Sim.rxhead = (Sim.rxhead + 1) % Sim.cfg.rxbuffer;
+    Sim.rxcount--;
+  }
+}
+
+static int16_t ETMSimIOReceiveOne(uint8_t *pSingleData){
+  ETMSimUpdate();
+  if(Sim.rxcount == 0)
+    return -1;
+  *pSingleData = Sim.rx[Sim.rxhead];
+  ETMSimConsume(1);
+  return 0;
+}
+
+static uint16_t ETMSimIOPeek(uint8_t **pData){
+  ETMSimUpdate();
+  *pData = &Sim.rx[Sim.rxhead];
+  return (uint16_t)MIN(Sim.rxcount, Sim.cfg.rxbuffer - Sim.rxhead);
+}
+
+static void ETMSimIORxStats(ETM_RxStats_t *Stats){
+  ETMSimUpdate();
+  Stats->received = (uint32_t)Sim.stats.rxoctets;
+  Stats->overflows = Sim.rxoverflows;
+  Stats->dropped = Sim.stats.overruns;
+  Stats->highwater = (uint16_t)MIN(Sim.rxhighwater, 0xFFFF);
+  Stats->size = (uint16_t)MIN(Sim.cfg.rxbuffer, 0xFFFF);
+}
+
+/* Let the other tasks run until this one's wait ends at until, or it is readied sooner */
+static void ETMSimTaskWait(uint64_t until){
+  struct ETMSimTask *task;
+  uint64_t at, best = SIM_NEVER;
+  int x, next = SimTasks.current, prev;
+
+  SimTasks.tasks[SimTasks.current].wakeat = until;
+  /* The others first, so one due at the same time goes before this task */
+  for(x = 1; x <= SIM_TASKS; x++){
+    task = &SimTasks.tasks[(SimTasks.current + x) % SIM_TASKS];
+    if(!task->inuse)
+      continue;
+    at = task->ready ? Sim.now : task->wakeat;
+    if(at < best){
+      best = at;
+      next = (SimTasks.current + x) % SIM_TASKS;
+    }
+  }
+  if(best != SIM_NEVER && best > Sim.now)
+    Sim.now = best;
+  SimTasks.tasks[next].ready = false;
+  if(next != SimTasks.current){
+    prev = SimTasks.current;
+    SimTasks.current = next;
+    swapcontext(&SimTasks.tasks[prev].ctx, &SimTasks.tasks[next].ctx);
+  }
+}
+
+/* Something another task may be waiting for has changed */
+static void ETMSimTaskReadyAll(void){
+  int x;
+
+  for(x = 0; x < SIM_TASKS; x++)
+    if(x != SimTasks.current)
+      SimTasks.tasks[x].ready = true;
+}
+
+static void ETMSimTaskStart(void){
+  struct ETMSimTask *task = &SimTasks.tasks[SimTasks.current];
+
+  task->code(task->param);
+  /* A task function must not return, on the target it would be deleted */
+  fprintf(stderr, "etm_sim: task returned\n");
+  abort();
+}
+
+/* Step the clock from arrival to arrival until the wait is satisfied or times out, letting
+ * other tasks run meanwhile. IO_Wake cuts it short. */
+static int8_t ETMSimIOWait(uint16_t Needed, uint32_t Timeout){
+  uint64_t deadline = Sim.now + (uint64_t)Timeout * 1000;
+  uint64_t next;
+
+  for(;;){
+    ETMSimUpdate();
+    if(Needed ? (Sim.rxcount >= Needed) : (Sim.rxlines > 0))
+      return 0;
+    if(Sim.rxcount == Sim.cfg.rxbuffer)
+      return 0;
+    if(Sim.iowake){
+      Sim.iowake = false;
+      return -1;
+    }
+    next = ETMSimNextArrival();
+    if(next > deadline){
+      ETMSimTaskWait(deadline);
+      if(Sim.now >= deadline){
+        ETMSimUpdate();
+        return -1;
+      }
+    }else if(next > Sim.now){
+      ETMSimTaskWait(next);
+    }
+  }
+}
+
+static void ETMSimIOWake(void){
+  Sim.iowake = true;
+  ETMSimTaskReadyAll();
+}
+
+static uint32_t ETMSimGetTick(void){
+  return (uint32_t)(Sim.now / 1000);
+}
+
+/* FreeRTOS shims ------------------------------------------------------------*/
+
+void vTaskDelay(const TickType_t xTicksToDelay){
+  uint64_t until = Sim.now + (uint64_t)(xTicksToDelay ? xTicksToDelay : 1) * 1000;
+
+  while(Sim.now < until)
+    ETMSimTaskWait(until);
+  ETMSimUpdate();
+}
+
+TickType_t xTaskGetTickCount(void){
+  return ETMSimGetTick();
+}
+
+BaseType_t xTaskCreate(TaskFunction_t pxTaskCode, const char * const pcName, const uint16_t usStackDepth,
+                       void * const pvParameters, UBaseType_t uxPriority, TaskHandle_t * const pxCreatedTask){
+  struct ETMSimTask *task;
+  int x;
+
+  (void)pcName;
+  (void)usStackDepth;
+  (void)uxPriority;
+  for(x = 1; x < SIM_TASKS && SimTasks.tasks[x].inuse; x++)
+    ;
+  if(x == SIM_TASKS)
+    return pdFAIL;
+  task = &SimTasks.tasks[x];
+  memset(task, 0, sizeof(*task));
+  if((task->stack = malloc(SIM_STACK_SIZE)) == NULL)
+    return pdFAIL;
+  getcontext(&task->ctx);
+  task->ctx.uc_stack.ss_sp = task->stack;
+  task->ctx.uc_stack.ss_size = SIM_STACK_SIZE;
+  task->ctx.uc_link = NULL;
+  makecontext(&task->ctx, ETMSimTaskStart, 0);
+  task->code = pxTaskCode;
+  task->param = pvParameters;
+  task->ready = true;
+  task->inuse = true;
+  if(pxCreatedTask != NULL)
+    *pxCreatedTask = task;
+  return pdPASS;
+}
+
+void vTaskDelete(TaskHandle_t xTaskToDelete){
+  if(xTaskToDelete == NULL || xTaskToDelete == &SimTasks.tasks[SimTasks.current] || xTaskToDelete == &SimTasks.tasks[0])
+    return;
+  free(xTaskToDelete->stack);
+  memset(xTaskToDelete, 0, sizeof(*xTaskToDelete));
+}
+
+TaskHandle_t xTaskGetCurrentTaskHandle(void){
+  return &SimTasks.tasks[SimTasks.current];
+}
+
+void vTaskSetTimeOutState(TimeOut_t * const pxTimeOut){
+  pxTimeOut->xTimeOnEntering = xTaskGetTickCount();
+}
+
+BaseType_t xTaskCheckForTimeOut(TimeOut_t * const pxTimeOut, TickType_t * const pxTicksToWait){
+  TickType_t now = xTaskGetTickCount(), elapsed = now - pxTimeOut->xTimeOnEntering;
+
+  if(*pxTicksToWait == portMAX_DELAY)
+    return pdFALSE;
+  if(elapsed >= *pxTicksToWait){
+    *pxTicksToWait = 0;
+    return pdTRUE;
+  }
+  *pxTicksToWait -= elapsed;
+  pxTimeOut->xTimeOnEntering = now;
+  return pdFALSE;
+}
+
+BaseType_t xTaskNotify(TaskHandle_t xTaskToNotify, uint32_t ulValue, eNotifyAction eAction){
+  switch(eAction){
+    case eSetBits:
+      xTaskToNotify->value |= ulValue;
+      break;
+    case eIncrement:
+      xTaskToNotify->value++;
+      break;
+    case eSetValueWithOverwrite:
+      xTaskToNotify->value = ulValue;
+      break;
+    case eSetValueWithoutOverwrite:
+      if(xTaskToNotify->pending)
+        return pdFAIL;
+      xTaskToNotify->value = ulValue;
+      break;
+    default:
+      break;
+  }
+  xTaskToNotify->pending = true;
+  xTaskToNotify->ready = true;
+  return pdPASS;
+}
+
+BaseType_t xTaskNotifyWait(uint32_t ulBitsToClearOnEntry, uint32_t ulBitsToClearOnExit,
+                           uint32_t *pulNotificationValue, TickType_t xTicksToWait){
+  struct ETMSimTask *task = &SimTasks.tasks[SimTasks.current];
+  uint64_t until = Sim.now + (uint64_t)xTicksToWait * 1000;
+
+  if(!task->pending)
+    task->value &= ~ulBitsToClearOnEntry;
+  while(!task->pending && Sim.now < until)
+    ETMSimTaskWait(until);
+  if(pulNotificationValue != NULL)
+    *pulNotificationValue = task->value;
+  if(!task->pending)
+    return pdFALSE;
+  task->value &= ~ulBitsToClearOnExit;
+  task->pending = false;
+  return pdTRUE;
+}
+
+BaseType_t xTaskNotifyStateClear(TaskHandle_t xTask){
+  struct ETMSimTask *task = (xTask != NULL) ? xTask : &SimTasks.tasks[SimTasks.current];
+  bool was = task->pending;
+
+  task->pending = false;
+  return was ? pdTRUE : pdFALSE;
+}
+
+SemaphoreHandle_t xSemaphoreCreateMutex(void){
+  return calloc(1, sizeof(struct ETMSimMutex));
+}
+
+void vSemaphoreDelete(SemaphoreHandle_t xSemaphore){
+  free(xSemaphore);
+}
+
+BaseType_t xSemaphoreTake(SemaphoreHandle_t xSemaphore, TickType_t xBlockTime){
+  uint64_t until = Sim.now + (uint64_t)xBlockTime * 1000;
+
+  while(xSemaphore->holder != NULL && Sim.now < until)
+    ETMSimTaskWait(until);
+  if(xSemaphore->holder != NULL)
+    return pdFALSE;
+  xSemaphore->holder = xTaskGetCurrentTaskHandle();
+  return pdTRUE;
+}
+
+BaseType_t xSemaphoreGive(SemaphoreHandle_t xSemaphore){
+  if(xSemaphore->holder != xTaskGetCurrentTaskHandle())
+    return pdFALSE;
+  xSemaphore->holder = NULL;
+  ETMSimTaskReadyAll();
+  return pdTRUE;
+}
+
+MessageBufferHandle_t xMessageBufferCreate(size_t xBufferSizeBytes){
+  MessageBufferHandle_t mb = calloc(1, sizeof(*mb));
+
+  if(mb != NULL && (mb->data = malloc(xBufferSizeBytes)) == NULL){
+    free(mb);
+    return NULL;
+  }
+  if(mb != NULL)
+    mb->size = xBufferSizeBytes;
+  return mb;
+}
+
+void vMessageBufferDelete(MessageBufferHandle_t xMessageBuffer){
+  free(xMessageBuffer->data);
+  free(xMessageBuffer);
+}
+
+size_t xMessageBufferSend(MessageBufferHandle_t xMessageBuffer, const void *pvTxData, size_t xDataLengthBytes,
+                          TickType_t xTicksToWait){
+  MessageBufferHandle_t mb = xMessageBuffer;
+  size_t need = sizeof(size_t) + xDataLengthBytes;
+  uint64_t until = Sim.now + (uint64_t)xTicksToWait * 1000;
+
+  if(need > mb->size)
+    return 0;
+  while(mb->size - mb->used < need && Sim.now < until)
+    ETMSimTaskWait(until);
+  if(mb->size - mb->used < need)
+    return 0;
+  memcpy(&mb->data[mb->used], &xDataLengthBytes, sizeof(size_t));
+  memcpy(&mb->data[mb->used + sizeof(size_t)], pvTxData, xDataLengthBytes);
+  mb->used += need;
+  ETMSimTaskReadyAll();
+  return xDataLengthBytes;
+}
+
+size_t xMessageBufferReceive(MessageBufferHandle_t xMessageBuffer, void *pvRxData, size_t xBufferLengthBytes,
+                             TickType_t xTicksToWait){
+  MessageBufferHandle_t mb = xMessageBuffer;
+  uint64_t until = Sim.now + (uint64_t)xTicksToWait * 1000;
+  size_t len;
+
+  while(mb->used == 0 && Sim.now < until)
+    ETMSimTaskWait(until);
+  if(mb->used == 0)
+    return 0;
+  memcpy(&len, mb->data, sizeof(size_t));
+  /* As on the target a message too long for the buffer is left where it is */
+  if(len > xBufferLengthBytes)
+    return 0;
+  memcpy(pvRxData, &mb->data[sizeof(size_t)], len);
+  mb->used -= sizeof(size_t) + len;
+  memmove(mb->data, &mb->data[sizeof(size_t) + len], mb->used);
+  ETMSimTaskReadyAll();
+  return len;
+}
+
+/* --------------------------------------------------------------------------*/
+/* --- Public functions -----------------------------------------------------*/
+/* --------------------------------------------------------------------------*/
+
+void ETMSim_DefaultConfig(ETMSim_Config_t *cfg){
+  memset(cfg, 0, sizeof(*cfg));
+  cfg->baudrate = ETM_DEFAULT_BAUDRATE;
+  cfg->maxbaud = 921600;
+  cfg->rxbuffer = 4096;
+  cfg->latency_us = 2000;
+  cfg->jitter_us = 0;
+  cfg->boot_ms = 1500;
+  cfg->idle_ms = 500;
+  cfg->connect_ms = 3000;
+  cfg->loopback_ms = 150;
+  cfg->fwget_ms = 2000;
+  cfg->late_ms = 700;
+  cfg->seed = 1;
+}
+
+void ETMSim_Start(const ETMSim_Config_t *cfg){
+  uint32_t x;
+
+  for(x = 0; x < Sim.nevents; x++)
+    free(Sim.events[x].data);
+  free(Sim.events);
+  free(Sim.rx);
+  memset(&Sim, 0, sizeof(Sim));
+  Sim.cfg = *cfg;
+  if(Sim.cfg.baudrate == 0)
+    Sim.cfg.baudrate = ETM_DEFAULT_BAUDRATE;
+  if(Sim.cfg.rxbuffer == 0)
+    Sim.cfg.rxbuffer = 4096;
+  Sim.etmbaud = Sim.hostbaud = Sim.cfg.baudrate;
+  Sim.octetus = Sim.hostoctetus = ETMSimOctetTime(Sim.cfg.baudrate);
+  Sim.rand = Sim.cfg.seed ? Sim.cfg.seed : 1;
+  Sim.rx = malloc(Sim.cfg.rxbuffer);
+  ETMSimBoot(0);
+}
+
+void ETMSim_Register(ETMObject_t *Obj){
+  ETMSim_RegisterBasic(Obj);
+  ETM_RegisterBusPeekIO(Obj, ETMSimIOPeek, ETMSimConsume);
+  ETM_RegisterBusWaitIO(Obj, ETMSimIOWait, ETMSimIOWake);
+  ETM_RegisterBusLinkIO(Obj, ETMSimIOFlowControl, ETMSimIOLineErrors);
+  ETM_RegisterBusStatsIO(Obj, ETMSimIORxStats);
+}
+
+void ETMSim_RegisterBasic(ETMObject_t *Obj){
+  ETM_RegisterBusIO(Obj, ETMSimIOInit, ETMSimIODeInit, ETMSimIOBaudrate, ETMSimIOSend, ETMSimIOReceiveOne, ETMSimIOFlush);
+  ETM_RegisterTickCb(Obj, ETMSimGetTick);
+}
+
+int ETMSim_Publish(const char *topic, const uint8_t *data, uint32_t len, uint32_t delay_ms){
+  return ETMSimPublishAt(Sim.now + (uint64_t)delay_ms * 1000, topic, data, len);
+}
+
+void ETMSim_Urc(const char *line, uint32_t delay_ms){
+  uint64_t at = Sim.now + (uint64_t)delay_ms * 1000;
+
+  ETMSimEmitAt(at, "\r\n", 2);
+  ETMSimEmitAt(at, line, strlen(line));
+  ETMSimEmitAt(at, "\r\n", 2);
+}
+
+void ETMSim_Reboot(void){
+  uint64_t at = Sim.now + Sim.cfg.latency_us;
+
+  ETMSimEmitAt(at, "\r\n+ETM:REBOOTING\r\n", 18);
+  ETMSimBoot(at);
+}
+
+void ETMSim_Advance(uint32_t ms){
+  Sim.now += (uint64_t)ms * 1000;
+  ETMSimUpdate();
+}
+
+uint64_t ETMSim_Micros(void){
+  return Sim.now;
+}
+
+uint32_t ETMSim_Millis(void){
+  return ETMSimGetTick();
+}
+
+void ETMSim_GetStats(ETMSim_Stats_t *stats){
+  *stats = Sim.stats;
+}
@@ -0,0 +1,144 @@
+/**
+  ******************************************************************************
+  * @file    etm_sim.h
+  * @brief   Host-side simulation of a BG96 running the Eseye ETM firmware.
+  *          The simulator stands in for the UART behind the ETM_IO_t callbacks
+  *          so etm.c can be run, tested and measured on a plain Linux box.
+  ******************************************************************************
+  */
+/* Define to prevent recursive inclusion -------------------------------------*/
+#ifndef __ETM_SIM_H
+#define __ETM_SIM_H
+
+#ifdef __cplusplus
+ extern "C" {
+#endif
+
+/* Includes ------------------------------------------------------------------*/
+#include <stdint.h>
+#include <stdbool.h>
+#include <stddef.h>
+
+#include "etm.h"
+
+/* Time is simulated: it only moves when the driver delays, waits for data or transmits, so runs
+ * are deterministic for a given configuration and seed and take no real time. There is a single
+ * simulated modem per process as the ETM_IO_t callbacks carry no context. */
+
+/* Topic slots of the simulated ETM */
+#define ETMSIM_MAX_TOPICS                  32
+#define ETMSIM_TOPIC_SIZE                  128
+/* Longest command line the simulated ETM accepts (a full ascii-hex publish) */
+#define ETMSIM_LINE_SIZE                   ( 2 * 65536 + 256 )
+/* Octets in flight from the simulated ETM to the host UART */
+#define ETMSIM_WIRE_SIZE                   ( 256 * 1024 )
+
+/* Exported typedef ----------------------------------------------------------*/
+typedef struct {
+  /* UART line rate at power on, 10 bit times per octet */
+  uint32_t baudrate;
+  /* Highest rate AT+IPR accepts (baudrate or below for none). While the two ends are at
+   * different rates every octet arrives as a framing error. */
+  uint32_t maxbaud;
+  /* Octets to the host which arrive with a framing error at rates of noisybaud and above, in
+   * parts per million (noisybaud 0 for none) */
+  uint32_t noisybaud;
+  uint32_t noise_ppm;
+  /* Host receive buffer size (the UART ring), an octet arriving with it full laps it and the
+   * unread octets are lost */
+  uint32_t rxbuffer;
+  /* Time from the end of a command to the start of its response, plus up to jitter_us */
+  uint32_t latency_us;
+  uint32_t jitter_us;
+  /* Time from start to APP RDY and from APP RDY to +ETM:IDLE */
+  uint32_t boot_ms;
+  uint32_t idle_ms;
+  /* Time from AT+ETMSTATE=startmqtt/startudp to +ETM:EMQRDY/+ETM:EURDY */
+  uint32_t connect_ms;
+  /* Time for a publish to come back on a matching subscription (0 disables loopback) */
+  uint32_t loopback_ms;
+  /* Time from a QoS 1 or 2 publish to the broker's acknowledgement (SEND OK / SEND FAIL) */
+  uint32_t puback_ms;
+  /* Time from AT+ETMHFWGET to +ETMHFWGET */
+  uint32_t fwget_ms;
+  /* Deliver +EMQ payloads as raw octets rather than quoted ascii-hex */
+  bool rawdelivery;
+  /* Fault injection in parts per million: octets from the ETM lost or corrupted, commands
+   * answered with ERROR or not answered at all */
+  uint32_t drop_ppm;
+  uint32_t corrupt_ppm;
+  uint32_t error_ppm;
+  uint32_t silent_ppm;
+  /* Commands answered late_ms late, in parts per million. The ETM takes commands in turn so
+   * later answers wait behind a late one. */
+  uint32_t late_ppm;
+  uint32_t late_ms;
+  /* QoS 1 and 2 publishes the broker rejects (SEND FAIL), in parts per million */
+  uint32_t sendfail_ppm;
+  uint32_t seed;
+  /* Host firmware image offered through AT+ETMHFWREAD (NULL for none) */
+  const uint8_t *fwimage;
+  uint32_t fwlen;
+  /* Copy of the first recordsize octets the host receives (NULL for none), e.g. an AT
+   * transcript to replay through a matcher */
+  uint8_t *record;
+  uint32_t recordsize;
+  /* Print driver logging and the AT traffic */
+  bool verbose;
+} ETMSim_Config_t;
+
+typedef struct {
+  uint32_t commands;
+  uint32_t errors;
+  uint32_t publishes;
+  uint32_t delivered;
+  uint64_t txoctets;
+  uint64_t rxoctets;
+  /* Transport writes (IO_Send calls) by the host */
+  uint32_t sends;
+  /* Octets lost to a full host receive buffer, a full wire or injected faults */
+  uint32_t overruns;
+  uint32_t wirefull;
+  uint32_t dropped;
+  uint32_t corrupted;
+  uint32_t injectederrors;
+  uint32_t silenced;
+  uint32_t delayed;
+  uint32_t sendfails;
+  /* Octets the host received with a framing error and rate changes by AT+IPR */
+  uint32_t framingerrors;
+  uint32_t ratechanges;
+  /* Commands the host sent before the previous one was answered */
+  uint32_t overlaps;
+} ETMSim_Stats_t;
+
+/* Exported functions --------------------------------------------------------*/
+
+/* Fill in a BG96-like configuration at 115200 baud (921600 after AT+IPR) with no faults */
+void ETMSim_DefaultConfig(ETMSim_Config_t *cfg);
+/* Power on the simulated ETM, the clock restarts at 0 */
+void ETMSim_Start(const ETMSim_Config_t *cfg);
+/* Register the simulator as the bus IO (with block receive, wait, link control and receive
+ * statistics) and tick of an ETM */
+void ETMSim_Register(ETMObject_t *Obj);
+/* As ETMSim_Register without block receive or wait, to exercise IO_ReceiveOne */
+void ETMSim_RegisterBasic(ETMObject_t *Obj);
+
+/* Publish from the network to subscribers of topic (NULL for the fixed subscription) after
+ * delay_ms. Returns the number of subscriptions it was delivered to. */
+int ETMSim_Publish(const char *topic, const uint8_t *data, uint32_t len, uint32_t delay_ms);
+/* Send an unsolicited line (CRLF is added) after delay_ms */
+void ETMSim_Urc(const char *line, uint32_t delay_ms);
+/* Reboot the ETM, topics are lost and it comes back with APP RDY and +ETM:IDLE */
+void ETMSim_Reboot(void);
+
+/* Advance the clock with the driver idle */
+void ETMSim_Advance(uint32_t ms);
+uint64_t ETMSim_Micros(void);
+uint32_t ETMSim_Millis(void);
+void ETMSim_GetStats(ETMSim_Stats_t *stats);
+
+#ifdef __cplusplus
+}
+#endif
+#endif /*__ETM_SIM_H */
@@ -0,0 +1,1083 @@
+/**
+  ******************************************************************************
+  * @file    etm_sim_run.c
+  * @brief   Runs the ETM driver through start-up, topics, publish/receive and
+  *          host firmware reads against the simulator, and the OTA writer
+  *          against flash in RAM. Exits non-zero if any step fails so it can
+  *          gate changes to etm.c.
+  ******************************************************************************
+  */
+/* Includes ------------------------------------------------------------------*/
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdbool.h>
+
+#include "FreeRTOS.h"
+#include "task.h"
+
+#include "etm.h"
+#include "etm_store.h"
+#include "etm_fw.h"
+#include "etm_sim.h"
+#include "etm_service.h"
+#include "etm_ota_writer.h"
+
+static ETMObject_t ETMC2cObj;
+ETM_TOPIC_TABLES(ETMSimTables, 4, 24, 512);
+static uint8_t FwImage[20001];
+static uint8_t Received[4096];
+static uint32_t ReceivedLen;
+static int ReceivedCount;
+static int Failures;
+
+#define CHECK(cond, what) ETMSimCheck((cond), (what))
+
+static void ETMSimCheck(bool ok, const char *what){
+  printf("%-48s %s (%lu ms)\n", what, ok ? "ok" : "FAILED", (unsigned long)ETMSim_Millis());
+  if(!ok)
+    Failures++;
+}
+
+static void ETMSimMessage(uint8_t *data, uint32_t length){
+  memcpy(Received, data, MIN(length, sizeof(Received)));
+  ReceivedLen = length;
+  ReceivedCount++;
+}
+
+static int AsyncDone;
+static int32_t AsyncResult;
+
+static void ETMSimCmdDone(void *ctx, int handle, int32_t result){
+  (void)ctx;
+  (void)handle;
+  AsyncDone++;
+  AsyncResult = result;
+}
+
+/* Subscribes to sim/fromcb from inside the first message it is given */
+static int CbSub = -1, CbSubHandle = -1;
+
+static void ETMSimSubscribingMessage(uint8_t *data, uint32_t length){
+  ETMSimMessage(data, length);
+  if(CbSubHandle < 0)
+    CbSubHandle = ETMsubscribeAsync(&ETMC2cObj, "sim/fromcb", ETMSimMessage, &CbSub, ETMSimCmdDone, NULL);
+}
+
+/* Poll until the condition holds or ms have passed */
+#define POLL_UNTIL(cond, ms) do{ \
+    uint32_t start = ETMSim_Millis(); \
+    while(!(cond) && ETMSim_Millis() - start < (ms)) \
+      ETMpoll(&ETMC2cObj); \
+  }while(0)
+
+static void ETMSimRun(bool basic, bool raw){
+  ETMSim_Config_t cfg;
+  ETMSim_Stats_t stats;
+  uint8_t msg[400], buf[512];
+  uint32_t len, offset, x, overlaps;
+  uint16_t cs, calccs;
+  int sub, pub, x2;
+
+  printf("--- %s receive, %s delivery\n", basic ? "single octet" : "block", raw ? "raw" : "ascii-hex");
+  ETMSim_DefaultConfig(&cfg);
+  cfg.rawdelivery = raw;
+  cfg.fwimage = FwImage;
+  cfg.fwlen = sizeof(FwImage);
+  cfg.verbose = (getenv("ETMSIM_VERBOSE") != NULL);
+  ETMSim_Start(&cfg);
+
+  memset(&ETMC2cObj, 0, sizeof(ETMC2cObj));
+  if(basic)
+    ETMSim_RegisterBasic(&ETMC2cObj);
+  else
+    ETMSim_Register(&ETMC2cObj);
+  ReceivedCount = 0;
+
+  ETM_Init(&ETMC2cObj, NULL);
+  CHECK(ETMC2cObj.urcseen & ETM_READY_URC, "ETM_Init reaches +ETM:IDLE");
+
+  ETMupdateState(&ETMC2cObj, ETM_STATE_ON);
+  CHECK(ETMstartproto(&ETMC2cObj, ETM_MQTT) == 0, "AT+ETMSTATE=startmqtt");
+  POLL_UNTIL(ETMC2cObj.urcseen & ETM_MQTTREADY_URC, 10000);
+  CHECK(ETMC2cObj.urcseen & ETM_MQTTREADY_URC, "+ETM:EMQRDY");
+  CHECK(ETMC2cObj.currentstate == ETM_MQTTREADY, "+ETMSTATE follows");
+
+  sub = ETMsubscribe(&ETMC2cObj, "sim/loop", ETMSimMessage);
+  pub = ETMpubreg(&ETMC2cObj, "sim/loop");
+  POLL_UNTIL(ETMsubstate(&ETMC2cObj, sub) == SUB_TOPIC_SUBSCRIBED &&
+             ETMpubstate(&ETMC2cObj, pub) == PUB_TOPIC_REGISTERED, 2000);
+  CHECK(sub >= 0 && ETMsubstate(&ETMC2cObj, sub) == SUB_TOPIC_SUBSCRIBED, "subscribe");
+  CHECK(pub >= 0 && ETMpubstate(&ETMC2cObj, pub) == PUB_TOPIC_REGISTERED, "publish topic registration");
+
+  for(x = 0; x < sizeof(msg); x++)
+    msg[x] = (uint8_t)(x * 7);
+  CHECK(ETMpublish(&ETMC2cObj, pub, 1, msg, 100) == 0, "ascii-hex publish");
+  POLL_UNTIL(ReceivedCount == 1, 2000);
+  CHECK(ReceivedCount == 1 && ReceivedLen == 100 && memcmp(Received, msg, 100) == 0, "loopback delivery");
+  CHECK(ETMpublishRaw(&ETMC2cObj, pub, 0, msg, sizeof(msg)) == 0, "raw publish");
+  POLL_UNTIL(ReceivedCount == 2, 2000);
+  CHECK(ReceivedCount == 2 && ReceivedLen == sizeof(msg) && memcmp(Received, msg, sizeof(msg)) == 0, "loopback delivery");
+  CHECK(ETMpublish(&ETMC2cObj, -1, 0, msg, 8) < 0 && ETMpublishRaw(&ETMC2cObj, -1, 0, msg, 8) < 0 &&
+        ETMpublishRaw(&ETMC2cObj, MAX_PUB_TOPICS, 0, msg, 8) < 0, "publish to an index out of range");
+
+  ETMSim_Publish("sim/#", (const uint8_t *)"not a match", 11, 0);
+  ETMSim_Publish("sim/loop", (const uint8_t *)"from network", 12, 10);
+  POLL_UNTIL(ReceivedCount == 3, 1000);
+  CHECK(ReceivedCount == 3 && ReceivedLen == 12 && memcmp(Received, "from network", 12) == 0, "network publish");
+
+  /* A message arriving during a blocking publish subscribes from its callback, the subscription
+   * waits for the publish to be answered */
+  x2 = ETMsubscribe(&ETMC2cObj, "sim/cb", ETMSimSubscribingMessage);
+  POLL_UNTIL(ETMsubstate(&ETMC2cObj, x2) == SUB_TOPIC_SUBSCRIBED, 2000);
+  ETMSim_GetStats(&stats);
+  overlaps = stats.overlaps;
+  AsyncDone = 0;
+  CbSubHandle = -1;
+  ETMSim_Publish("sim/cb", (const uint8_t *)"subscribe", 9, 0);
+  CHECK(ETMpublish(&ETMC2cObj, pub, 0, msg, 100) == 0 && CbSubHandle >= 0, "publish while a callback subscribes");
+  ETMSim_GetStats(&stats);
+  CHECK(stats.overlaps == overlaps, "subscription waits for the publish");
+  POLL_UNTIL(AsyncDone > 0 && ETMsubstate(&ETMC2cObj, CbSub) == SUB_TOPIC_SUBSCRIBED, 2000);
+  CHECK(AsyncDone == 1 && AsyncResult == RET_OK && ETMsubstate(&ETMC2cObj, CbSub) == SUB_TOPIC_SUBSCRIBED,
+        "subscription from a callback completes");
+  POLL_UNTIL(false, 100);
+
+  /* APP RDY arrives while a queued command is in flight, its handler sends ATE0 from inside the
+   * wait for the queued result and must leave the queue alone, sending only once it is answered */
+  AsyncDone = 0;
+  ETMSim_GetStats(&stats);
+  overlaps = stats.overlaps;
+  CHECK(ETMpubregAsync(&ETMC2cObj, "sim/async", &x2, ETMSimCmdDone, NULL) >= 0, "queued topic registration");
+  ETMSim_Urc("APP RDY", 0);
+  POLL_UNTIL(AsyncDone > 0 && ETMpubstate(&ETMC2cObj, x2) == PUB_TOPIC_REGISTERED, 2000);
+  CHECK(AsyncDone == 1 && AsyncResult == RET_OK && ETMpubstate(&ETMC2cObj, x2) == PUB_TOPIC_REGISTERED,
+        "queued command completes once across APP RDY");
+  ETMSim_GetStats(&stats);
+  CHECK(stats.overlaps == overlaps, "ATE0 waits for the queued command");
+
+  CHECK(ETMGetHostFWDetails(&ETMC2cObj, &len, &cs) == 0 && len == sizeof(FwImage), "AT+ETMHFWREAD?");
+  calccs = 0;
+  for(offset = 0; offset < len; offset += x){
+    x = MIN(len - offset, sizeof(buf) / 2);
+    if(ETMReadHostFW(&ETMC2cObj, offset, x, buf) != 0 || memcmp(buf, &FwImage[offset], x) != 0)
+      break;
+  }
+  for(x = 0; x + 1 < len; x += 2)
+    calccs ^= (uint16_t)((FwImage[x] << 8) | FwImage[x + 1]);
+  if(x < len)
+    calccs ^= FwImage[x];
+  CHECK(offset >= len && calccs == cs, "AT+ETMHFWREAD= whole image");
+
+  ETMSim_Reboot();
+  ETMC2cObj.urcseen = 0;
+  POLL_UNTIL(ETMC2cObj.urcseen & ETM_READY_URC, 5000);
+  CHECK(ETMC2cObj.urcseen & ETM_READY_URC, "reboot back to +ETM:IDLE");
+  CHECK(ETMpubstate(&ETMC2cObj, pub) == PUB_TOPIC_NOT_IN_USE, "reboot drops publish topics");
+
+  /* By name the topic is registered again, at its old index */
+  ETMC2cObj.urcseen = 0;
+  CHECK(ETMstartproto(&ETMC2cObj, ETM_MQTT) == 0, "AT+ETMSTATE=startmqtt after reboot");
+  POLL_UNTIL(ETMC2cObj.urcseen & ETM_MQTTREADY_URC, 10000);
+  CHECK(ETMpublishTopic(&ETMC2cObj, "sim/loop", 1, msg, 100) == 0, "publish by topic name");
+  CHECK(ETMpubstate(&ETMC2cObj, pub) == PUB_TOPIC_REGISTERED, "topic name keeps its index");
+  CHECK(ETMpubreg(&ETMC2cObj, "sim/loop") == pub, "registering a known name");
+
+  ETMSim_GetStats(&stats);
+  printf("commands %lu publishes %lu delivered %lu tx %llu rx %llu overruns %lu overlaps %lu\n",
+         (unsigned long)stats.commands, (unsigned long)stats.publishes, (unsigned long)stats.delivered,
+         (unsigned long long)stats.txoctets, (unsigned long long)stats.rxoctets, (unsigned long)stats.overruns,
+         (unsigned long)stats.overlaps);
+}
+
+/* More publish topics than the default tables hold */
+static uint8_t FwCopy[sizeof(FwImage)];
+static uint32_t FwProgress;
+static ETMFwResult_t FwError;
+static ETMFwDownload_t FwDl;
+static ETMFwCheckpoint_t FwCp;
+static uint32_t FwFirst;
+static uint32_t FwRebootAt;
+
+/* Copy the image, taking about as long as programming internal flash */
+static int ETMSimFwSink(void *ctx, uint32_t offset, const uint8_t *data, uint16_t len){
+  if(ctx != NULL && offset >= *(uint32_t *)ctx)
+    return -1;
+  if(FwFirst == UINT32_MAX)
+    FwFirst = offset;
+  /* The ETM restarts part way through, the read in flight is lost */
+  if(FwRebootAt != 0 && offset >= FwRebootAt){
+    FwRebootAt = 0;
+    ETMSim_Reboot();
+  }
+  memcpy(&FwCopy[offset], data, len);
+  ETMSim_Advance(len / 50);
+  return 0;
+}
+
+static void ETMSimFwProgress(void *ctx, uint32_t done, uint32_t total){
+  (void)ctx;
+  (void)total;
+  FwProgress = done;
+}
+
+static void ETMSimFwError(void *ctx, ETMFwResult_t err, uint32_t offset){
+  (void)ctx;
+  (void)offset;
+  FwError = err;
+}
+
+static void ETMSimFwCheckpoint(void *ctx, const ETMFwCheckpoint_t *cp){
+  (void)ctx;
+  FwCp = *cp;
+}
+
+/* Carry on from the last checkpoint */
+static ETMFwResult_t ETMSimFwResume(void){
+  FwDl.ctx = NULL;
+  FwDl.resume = FwCp;
+  FwFirst = UINT32_MAX;
+  return ETMFwDownload(&ETMC2cObj, &FwDl);
+}
+
+static bool ETMSimFwStart(uint32_t drop_ppm, uint32_t silent_ppm, uint32_t late_ppm, uint32_t boot_ms){
+  ETMSim_Config_t cfg;
+
+  ETMSim_DefaultConfig(&cfg);
+  cfg.fwimage = FwImage;
+  cfg.fwlen = sizeof(FwImage);
+  cfg.drop_ppm = drop_ppm;
+  cfg.silent_ppm = silent_ppm;
+  cfg.late_ppm = late_ppm;
+  if(boot_ms != 0)
+    cfg.boot_ms = boot_ms;
+  cfg.verbose = (getenv("ETMSIM_VERBOSE") != NULL);
+  ETMSim_Start(&cfg);
+
+  memset(&ETMC2cObj, 0, sizeof(ETMC2cObj));
+  ETMSim_Register(&ETMC2cObj);
+  ETM_Init(&ETMC2cObj, NULL);
+  memset(FwCopy, 0, sizeof(FwCopy));
+  memset(&FwDl, 0, sizeof(FwDl));
+  FwDl.sink = ETMSimFwSink;
+  FwDl.progress = ETMSimFwProgress;
+  FwDl.error = ETMSimFwError;
+  FwDl.checkpoint = ETMSimFwCheckpoint;
+  memset(&FwCp, 0, sizeof(FwCp));
+  FwFirst = UINT32_MAX;
+  FwRebootAt = 0;
+  FwProgress = 0;
+  FwError = ETM_FW_OK;
+  return (ETMC2cObj.urcseen & ETM_READY_URC) != 0;
+}
+
+static void ETMSimRunFw(void){
+  ETMSim_Stats_t stats;
+  uint32_t stop = 4096;
+  ETMFwResult_t res;
+
+  printf("--- streamed host firmware download\n");
+  ETMSimFwStart(0, 0, 0, 0);
+  res = ETMFwDownload(&ETMC2cObj, &FwDl);
+  printf("%lu octets in %lu reads, %lu ms\n", (unsigned long)FwDl.len, (unsigned long)FwDl.stats.reads,
+         (unsigned long)FwDl.stats.ms);
+  CHECK(res == ETM_FW_OK && memcmp(FwCopy, FwImage, sizeof(FwImage)) == 0 && FwProgress == sizeof(FwImage) &&
+        FwDl.stats.reads == (sizeof(FwImage) + ETM_FW_CHUNK_SIZE - 1) / ETM_FW_CHUNK_SIZE, "whole image");
+  CHECK(ETMpubreg(&ETMC2cObj, "sim/after") >= 0, "link clean after the download");
+
+  /* A sink that gives up part way, the read in flight is still taken */
+  ETMSimFwStart(0, 0, 0, 0);
+  FwDl.ctx = &stop;
+  res = ETMFwDownload(&ETMC2cObj, &FwDl);
+  CHECK(res == ETM_FW_ERR_SINK && FwError == ETM_FW_ERR_SINK && FwProgress == stop, "sink refusal reported");
+  CHECK(ETMpubreg(&ETMC2cObj, "sim/after") >= 0, "link clean after the refusal");
+
+  /* Carried on from the last checkpoint, and from the start once the image has changed */
+  CHECK(FwCp.offset == stop && FwCp.len == sizeof(FwImage), "checkpoint at the refusal");
+  res = ETMSimFwResume();
+  CHECK(res == ETM_FW_OK && memcmp(FwCopy, FwImage, sizeof(FwImage)) == 0 && FwDl.stats.resumed == stop &&
+        FwFirst == stop && FwDl.stats.reads == (sizeof(FwImage) - stop + ETM_FW_CHUNK_SIZE - 1) / ETM_FW_CHUNK_SIZE,
+        "download carried on from the checkpoint");
+  FwCp.offset = stop;
+  FwCp.cs ^= 1;
+  res = ETMSimFwResume();
+  CHECK(res == ETM_FW_OK && FwDl.stats.resumed == 0 && FwFirst == 0, "changed image read from the start");
+
+  /* The ETM reboots part way and is gone for longer than the reads are retried, the download
+   * carries on once it is back */
+  ETMSimFwStart(0, 0, 0, 5000);
+  FwRebootAt = 8192;
+  res = ETMFwDownload(&ETMC2cObj, &FwDl);
+  CHECK(res == ETM_FW_ERR_READ && FwCp.offset > 0 && FwCp.offset < sizeof(FwImage), "ETM reboot stops the download");
+  POLL_UNTIL(ETMC2cObj.urcseen & ETM_REBOOT, 5000);
+  ETMC2cObj.urcseen &= ~ETM_READY_URC;
+  POLL_UNTIL(ETMC2cObj.urcseen & ETM_READY_URC, 5000);
+  stop = FwCp.offset;
+  res = ETMSimFwResume();
+  printf("carried on from %lu after the reboot\n", (unsigned long)FwDl.stats.resumed);
+  CHECK(res == ETM_FW_OK && memcmp(FwCopy, FwImage, sizeof(FwImage)) == 0 && FwDl.stats.resumed == stop,
+        "download carried on after the reboot");
+
+  /* Lost octets and unanswered reads are asked for again */
+  ETMSimFwStart(100, 10000, 0, 0);
+  FwDl.chunk = 256;
+  res = ETMFwDownload(&ETMC2cObj, &FwDl);
+  printf("%lu reads, %lu retries\n", (unsigned long)FwDl.stats.reads, (unsigned long)FwDl.stats.retries);
+  CHECK(res == ETM_FW_OK && memcmp(FwCopy, FwImage, sizeof(FwImage)) == 0 && FwDl.stats.retries > 0,
+        "lost octets and reads retried");
+
+  /* A read answered after the collect gave up isn't taken for the answer to the next one */
+  ETMSimFwStart(0, 0, 50000, 0);
+  FwDl.chunk = 256;
+  res = ETMFwDownload(&ETMC2cObj, &FwDl);
+  ETMSim_GetStats(&stats);
+  printf("%lu reads, %lu retries, %lu answers late\n", (unsigned long)FwDl.stats.reads, (unsigned long)FwDl.stats.retries,
+         (unsigned long)stats.delayed);
+  CHECK(res == ETM_FW_OK && memcmp(FwCopy, FwImage, sizeof(FwImage)) == 0 && stats.delayed > 0 &&
+        FwDl.stats.retries > 0, "late answers passed over");
+}
+
+static void ETMSimRunTables(void){
+  ETMSim_Config_t cfg;
+  char topic[32];
+  uint8_t msg[4] = {1, 2, 3, 4};
+  int x, ok = 0;
+
+  printf("--- %d publish topics\n", ETMSimTables.pubcount);
+  ETMSim_DefaultConfig(&cfg);
+  cfg.verbose = (getenv("ETMSIM_VERBOSE") != NULL);
+  ETMSim_Start(&cfg);
+
+  memset(&ETMC2cObj, 0, sizeof(ETMC2cObj));
+  ETMSim_Register(&ETMC2cObj);
+  CHECK(ETM_RegisterTopicTables(&ETMC2cObj, &ETMSimTables) == ETM_RETURN_OK, "register topic tables");
+  ETM_Init(&ETMC2cObj, NULL);
+  ETMupdateState(&ETMC2cObj, ETM_STATE_ON);
+  CHECK(ETMstartproto(&ETMC2cObj, ETM_MQTT) == 0, "AT+ETMSTATE=startmqtt");
+  POLL_UNTIL(ETMC2cObj.urcseen & ETM_MQTTREADY_URC, 10000);
+
+  for(x = 0; x < ETMSimTables.pubcount; x++){
+    snprintf(topic, sizeof(topic), "sim/telemetry/%d", x);
+    if(ETMpublishTopic(&ETMC2cObj, topic, 0, msg, sizeof(msg)) == 0 && ETMpubstate(&ETMC2cObj, x) == PUB_TOPIC_REGISTERED)
+      ok++;
+  }
+  CHECK(ok == ETMSimTables.pubcount, "publish to every topic by name");
+  CHECK(ETMpubreg(&ETMC2cObj, "sim/telemetry/extra") < 0, "topic table full");
+}
+
+/* Tracked QoS 1 publishes with the broker slow to acknowledge and rejecting some */
+static int Completed[32];
+static int CompletedOk;
+
+static void ETMSimPubDone(void *ctx, int seq, int32_t result){
+  (void)ctx;
+  if(seq >= 0 && seq < (int)(sizeof(Completed) / sizeof(Completed[0])))
+    Completed[seq]++;
+  if(result == RET_SENDOK)
+    CompletedOk++;
+}
+
+static void ETMSimRunInflight(void){
+  ETMSim_Config_t cfg;
+  ETMSim_Stats_t stats;
+  uint8_t msg[16] = "tracked publish";
+  int x, pub, sent = 0, most = 0, once = 0;
+
+  printf("--- tracked publishes\n");
+  ETMSim_DefaultConfig(&cfg);
+  cfg.puback_ms = 400;
+  cfg.sendfail_ppm = 200000;
+  cfg.verbose = (getenv("ETMSIM_VERBOSE") != NULL);
+  ETMSim_Start(&cfg);
+
+  memset(&ETMC2cObj, 0, sizeof(ETMC2cObj));
+  ETMSim_Register(&ETMC2cObj);
+  ETM_Init(&ETMC2cObj, NULL);
+  ETMupdateState(&ETMC2cObj, ETM_STATE_ON);
+  CHECK(ETMstartproto(&ETMC2cObj, ETM_MQTT) == 0, "AT+ETMSTATE=startmqtt");
+  POLL_UNTIL(ETMC2cObj.urcseen & ETM_MQTTREADY_URC, 10000);
+  pub = ETMpubreg(&ETMC2cObj, "sim/tracked");
+  POLL_UNTIL(ETMpubstate(&ETMC2cObj, pub) == PUB_TOPIC_REGISTERED, 2000);
+
+  memset(Completed, 0, sizeof(Completed));
+  CompletedOk = 0;
+  while(sent < (int)(sizeof(Completed) / sizeof(Completed[0])) && ETMSim_Millis() < 60000){
+    if(ETMpublishTracked(&ETMC2cObj, pub, 1, msg, sizeof(msg), ETMSimPubDone, NULL) >= 0)
+      sent++;
+    else
+      ETMpoll(&ETMC2cObj);
+    if(ETMpubInflight(&ETMC2cObj) > most)
+      most = ETMpubInflight(&ETMC2cObj);
+  }
+  POLL_UNTIL(ETMpubInflight(&ETMC2cObj) == 0 && ETMC2cObj.cmdcount == 0, 10000);
+  for(x = 0; x < sent; x++){
+    if(Completed[x] == 1)
+      once++;
+  }
+  ETMSim_GetStats(&stats);
+  printf("sent %d acknowledged %d rejected %lu most in flight %d\n", sent, CompletedOk, (unsigned long)stats.sendfails, most);
+  CHECK(sent == (int)(sizeof(Completed) / sizeof(Completed[0])) && once == sent, "every publish completes once");
+  CHECK(most > 1 && stats.sendfails > 0 && CompletedOk > sent - (int)stats.sendfails, "window fills and rejected publishes are resent");
+}
+
+/* Acknowledgements go to the oldest publish to their topic. A full window takes no more QoS 1
+ * publishes rather than losing one, and a publish given up on still takes its late
+ * acknowledgement. The broker's acknowledgements are sent by hand. */
+static int AckSeq, AckCount;
+static int32_t AckResult;
+
+static void ETMSimAckDone(void *ctx, int seq, int32_t result){
+  (void)ctx;
+  AckSeq = seq;
+  AckResult = result;
+  AckCount++;
+}
+
+static void ETMSimAck(int idx, bool ok){
+  char line[32];
+
+  snprintf(line, sizeof(line), "+EMQPUB:%d:%s", idx, ok ? "SEND OK" : "SEND FAIL");
+  ETMSim_Urc(line, 0);
+  POLL_UNTIL(false, 50);
+}
+
+static void ETMSimRunAcks(void){
+  ETMSim_Config_t cfg;
+  uint8_t msg[8] = "reading";
+  int x, bulk, tracked, seq, full = 0;
+
+  printf("--- acknowledgements by topic\n");
+  ETMSim_DefaultConfig(&cfg);
+  cfg.puback_ms = 600000;
+  cfg.verbose = (getenv("ETMSIM_VERBOSE") != NULL);
+  ETMSim_Start(&cfg);
+
+  memset(&ETMC2cObj, 0, sizeof(ETMC2cObj));
+  ETMSim_Register(&ETMC2cObj);
+  ETM_Init(&ETMC2cObj, NULL);
+  ETMupdateState(&ETMC2cObj, ETM_STATE_ON);
+  CHECK(ETMstartproto(&ETMC2cObj, ETM_MQTT) == 0, "AT+ETMSTATE=startmqtt");
+  POLL_UNTIL(ETMC2cObj.urcseen & ETM_MQTTREADY_URC, 10000);
+  bulk = ETMpubreg(&ETMC2cObj, "sim/bulk");
+  tracked = ETMpubreg(&ETMC2cObj, "sim/tracked");
+  POLL_UNTIL(ETMpubstate(&ETMC2cObj, bulk) == PUB_TOPIC_REGISTERED && ETMpubstate(&ETMC2cObj, tracked) == PUB_TOPIC_REGISTERED, 2000);
+
+  /* Untracked publishes fill the window */
+  for(x = 0; x < ETM_INFLIGHT_SIZE; x++){
+    if(ETMpublish(&ETMC2cObj, bulk, 1, msg, sizeof(msg)) == 0)
+      full++;
+  }
+  AsyncDone = 0;
+  AsyncResult = RET_NONE;
+  x = ETMpublishAsync(&ETMC2cObj, bulk, 1, msg, sizeof(msg), ETMSimCmdDone, NULL);
+  POLL_UNTIL(AsyncDone > 0, 1000);
+  CHECK(full == ETM_INFLIGHT_SIZE && ETMpublish(&ETMC2cObj, bulk, 1, msg, sizeof(msg)) < 0 &&
+        ETMpublishTracked(&ETMC2cObj, tracked, 1, msg, sizeof(msg), ETMSimAckDone, NULL) < 0 &&
+        x >= 0 && AsyncDone == 1 && AsyncResult == ETM_RETURN_SEND_ERROR && ETMpubInflight(&ETMC2cObj) == ETM_INFLIGHT_SIZE,
+        "full window takes no more QoS 1 publishes");
+
+  /* A tracked publish acknowledged ahead of the older ones to the other topic */
+  ETMSimAck(bulk, true);
+  AckCount = 0;
+  seq = ETMpublishTracked(&ETMC2cObj, tracked, 1, msg, sizeof(msg), ETMSimAckDone, NULL);
+  ETMSimAck(tracked, true);
+  CHECK(seq >= 0 && AckCount == 1 && AckSeq == seq && AckResult == RET_SENDOK &&
+        ETMpubInflight(&ETMC2cObj) == ETM_INFLIGHT_SIZE - 1, "tracked publish takes its own acknowledgement");
+  for(x = 1; x < ETM_INFLIGHT_SIZE; x++)
+    ETMSimAck(bulk, false);
+  CHECK(AckCount == 1 && ETMpubInflight(&ETMC2cObj) == 0, "other topic's acknowledgements leave it alone");
+
+  /* Given up on, it keeps its slot until its acknowledgement comes */
+  AckCount = 0;
+  seq = ETMpublishTracked(&ETMC2cObj, tracked, 1, msg, sizeof(msg), ETMSimAckDone, NULL);
+  POLL_UNTIL(AckCount > 0, ETM_INFLIGHT_TIMEOUT + 1000);
+  x = ETMpublishTracked(&ETMC2cObj, tracked, 1, msg, sizeof(msg), ETMSimAckDone, NULL);
+  ETMSimAck(tracked, true);
+  CHECK(seq >= 0 && x >= 0 && AckCount == 1 && AckSeq == seq && AckResult == ETM_RETURN_NO_DATA &&
+        ETMpubInflight(&ETMC2cObj) == 1, "late acknowledgement goes to the expired publish");
+  ETMSimAck(tracked, true);
+  CHECK(AckCount == 2 && AckSeq == x && AckResult == RET_SENDOK && ETMpubInflight(&ETMC2cObj) == 0,
+        "next publish takes its own");
+}
+
+/* The link moves up to 921600 with RTS/CTS and settles on a lower rate when the higher ones
+ * give framing errors. RTS/CTS doesn't protect the receive ring, a host which doesn't read it in
+ * time loses data and ETM_GetRxStats() reports it. */
+static void ETMSimRunLink(void){
+  ETMSim_Config_t cfg;
+  ETMSim_Stats_t stats;
+  ETM_RxStats_t rxstats;
+  uint8_t msg[1000];
+  uint32_t x;
+  int sub, pub;
+
+  printf("--- link rate and flow control\n");
+  for(x = 0; x < sizeof(msg); x++)
+    msg[x] = (uint8_t)(x * 3);
+  ETMSim_DefaultConfig(&cfg);
+  cfg.rxbuffer = 256;
+  cfg.rawdelivery = true;
+  cfg.verbose = (getenv("ETMSIM_VERBOSE") != NULL);
+  ETMSim_Start(&cfg);
+  memset(&ETMC2cObj, 0, sizeof(ETMC2cObj));
+  ETMSim_Register(&ETMC2cObj);
+  ReceivedCount = 0;
+  ETM_Init(&ETMC2cObj, NULL);
+  CHECK(ETMC2cObj.UART_Config.BaudRate == 921600 && ETMC2cObj.UART_Config.FlowControl, "AT+IPR=921600 and AT+IFC=2,2");
+  ETMupdateState(&ETMC2cObj, ETM_STATE_ON);
+  ETMstartproto(&ETMC2cObj, ETM_MQTT);
+  POLL_UNTIL(ETMC2cObj.urcseen & ETM_MQTTREADY_URC, 10000);
+  sub = ETMsubscribe(&ETMC2cObj, "sim/link", ETMSimMessage);
+  POLL_UNTIL(ETMsubstate(&ETMC2cObj, sub) == SUB_TOPIC_SUBSCRIBED, 2000);
+  /* Read as it arrives the message passes through a buffer a quarter of its size */
+  ETMSim_Publish("sim/link", msg, sizeof(msg), 10);
+  POLL_UNTIL(ReceivedCount == 1, 2000);
+  ETMSim_GetStats(&stats);
+  CHECK(ReceivedCount == 1 && ReceivedLen == sizeof(msg) && memcmp(Received, msg, sizeof(msg)) == 0 &&
+        stats.overruns == 0, "1000 octets through a 256 octet buffer");
+  /* While the application is busy elsewhere the DMA laps the ring, flow control or not */
+  ETMSim_Publish("sim/link", msg, sizeof(msg), 10);
+  ETMSim_Advance(100);
+  POLL_UNTIL(false, 200);
+  ETM_GetRxStats(&ETMC2cObj, &rxstats);
+  printf("received %lu octets, %lu overflows, %lu octets dropped, high water %u of %u\n", (unsigned long)rxstats.received,
+         (unsigned long)rxstats.overflows, (unsigned long)rxstats.dropped, rxstats.highwater, rxstats.size);
+  CHECK(ReceivedCount == 1 && rxstats.overflows > 0 && rxstats.dropped > 0 && rxstats.size == 256,
+        "busy host laps the ring despite RTS/CTS");
+
+  ETMSim_DefaultConfig(&cfg);
+  cfg.noisybaud = 460800;
+  cfg.noise_ppm = 200000;
+  cfg.verbose = (getenv("ETMSIM_VERBOSE") != NULL);
+  ETMSim_Start(&cfg);
+  memset(&ETMC2cObj, 0, sizeof(ETMC2cObj));
+  ETMSim_Register(&ETMC2cObj);
+  ReceivedCount = 0;
+  ETM_Init(&ETMC2cObj, NULL);
+  ETMupdateState(&ETMC2cObj, ETM_STATE_ON);
+  ETMstartproto(&ETMC2cObj, ETM_MQTT);
+  POLL_UNTIL(ETMC2cObj.urcseen & ETM_MQTTREADY_URC, 10000);
+  sub = ETMsubscribe(&ETMC2cObj, "sim/link", ETMSimMessage);
+  pub = ETMpubreg(&ETMC2cObj, "sim/link");
+  POLL_UNTIL(ETMsubstate(&ETMC2cObj, sub) == SUB_TOPIC_SUBSCRIBED && ETMpubstate(&ETMC2cObj, pub) == PUB_TOPIC_REGISTERED, 2000);
+  ETMpublish(&ETMC2cObj, pub, 0, msg, 200);
+  POLL_UNTIL(ReceivedCount == 1, 2000);
+  ETMSim_GetStats(&stats);
+  printf("link at %lu baud, %lu framing errors, %lu rate changes\n", (unsigned long)ETMC2cObj.UART_Config.BaudRate,
+         (unsigned long)stats.framingerrors, (unsigned long)stats.ratechanges);
+  CHECK(ETMC2cObj.UART_Config.BaudRate == 230400 && ReceivedCount == 1 && memcmp(Received, msg, 200) == 0,
+        "noisy rates given up");
+}
+
+/* NOR flash in RAM for the store: programming only clears bits and doesn't cross a page */
+#define SIMFLASH_SECTOR   1024
+#define SIMFLASH_SECTORS  8
+static uint8_t SimFlash[SIMFLASH_SECTOR * SIMFLASH_SECTORS];
+static uint32_t SimFlashPrograms, SimFlashErases;
+
+static int8_t SimFlashRead(uint32_t Addr, uint8_t *pData, uint32_t Size){
+  if(Addr + Size > sizeof(SimFlash))
+    return -1;
+  memcpy(pData, &SimFlash[Addr], Size);
+  return 0;
+}
+
+static int8_t SimFlashProgram(uint32_t Addr, const uint8_t *pData, uint32_t Size){
+  uint32_t x;
+
+  if(Addr + Size > sizeof(SimFlash) || (Addr % ETM_STORE_PAGE_SIZE) + Size > ETM_STORE_PAGE_SIZE)
+    return -1;
+  for(x = 0; x < Size; x++)
+    SimFlash[Addr + x] &= pData[x];
+  SimFlashPrograms++;
+  return 0;
+}
+
+static int8_t SimFlashErase(uint32_t Addr){
+  if(Addr % SIMFLASH_SECTOR != 0 || Addr >= sizeof(SimFlash))
+    return -1;
+  memset(&SimFlash[Addr], 0xff, SIMFLASH_SECTOR);
+  SimFlashErases++;
+  return 0;
+}
+
+static const ETM_Flash_t SimFlashOps = {SimFlashRead, SimFlashProgram, SimFlashErase, 0, sizeof(SimFlash), SIMFLASH_SECTOR};
+static ETMStore_t Store;
+static int StoreNext, StoreLast, StoreCount, StoreOrder;
+
+/* Stored messages carry "reading <n>", each should follow the last */
+static void ETMSimStoreMessage(uint8_t *data, uint32_t length){
+  int n;
+
+  if(length < 9 || memcmp(data, "reading ", 8) != 0)
+    return;
+  n = atoi((char *)&data[8]);
+  if(StoreNext >= 0 && n != StoreNext)
+    StoreOrder++;
+  StoreNext = n + 1;
+  StoreLast = n;
+  StoreCount++;
+}
+
+static int ETMSimStoreAppend(int n, int pad){
+  char msg[80];
+
+  snprintf(msg, sizeof(msg), "reading %d%*s", n, pad, "");
+  return ETMStoreAppend(&Store, "sim/stored", 1, (uint8_t *)msg, strlen(msg));
+}
+
+/* Drain the store and wait for the loopback */
+static int ETMSimStoreDrain(int expect){
+  int ret, sent = 0;
+
+  do{
+    ret = ETMStoreDrain(&Store, &ETMC2cObj, 16);
+    if(ret > 0)
+      sent += ret;
+    ETMpoll(&ETMC2cObj);
+  }while(ret > 0);
+  POLL_UNTIL(StoreCount >= expect, 5000);
+  return sent;
+}
+
+/* Messages stored while the ETM isn't ready are sent once it is, in order, after a restart,
+ * a full store and a torn record */
+static void ETMSimRunStore(void){
+  ETMSim_Config_t cfg;
+  uint32_t off;
+  uint16_t sector;
+  int x, sub, sent;
+
+  printf("--- store and forward\n");
+  memset(SimFlash, 0xff, sizeof(SimFlash));
+  memset(&ETMC2cObj, 0, sizeof(ETMC2cObj));
+  CHECK(ETMStoreInit(&Store, &SimFlashOps) == 0 && !ETMStorePending(&Store), "empty store");
+  for(x = 0; x < 20; x++)
+    ETMSimStoreAppend(x, 0);
+  CHECK(Store.stats.stored == 20 && ETMStoreDrain(&Store, &ETMC2cObj, 100) == 0, "store while MQTT isn't ready");
+  ETMStoreSync(&Store);
+  CHECK(ETMStoreInit(&Store, &SimFlashOps) == 0 && ETMStorePending(&Store), "stored messages found after restart");
+
+  ETMSim_DefaultConfig(&cfg);
+  cfg.verbose = (getenv("ETMSIM_VERBOSE") != NULL);
+  ETMSim_Start(&cfg);
+  ETMSim_Register(&ETMC2cObj);
+  ETM_Init(&ETMC2cObj, NULL);
+  ETMupdateState(&ETMC2cObj, ETM_STATE_ON);
+  CHECK(ETMstartproto(&ETMC2cObj, ETM_MQTT) == 0, "AT+ETMSTATE=startmqtt");
+  POLL_UNTIL(ETMC2cObj.currentstate == ETM_MQTTREADY, 10000);
+  sub = ETMsubscribe(&ETMC2cObj, "sim/stored", ETMSimStoreMessage);
+  POLL_UNTIL(ETMsubstate(&ETMC2cObj, sub) == SUB_TOPIC_SUBSCRIBED, 2000);
+
+  StoreNext = 0;
+  StoreCount = StoreOrder = 0;
+  sent = ETMSimStoreDrain(20);
+  CHECK(sent == 20 && StoreCount == 20 && StoreOrder == 0 && !ETMStorePending(&Store), "drain in order");
+  CHECK(ETMStoreInit(&Store, &SimFlashOps) == 0 && !ETMStorePending(&Store), "sent messages stay sent");
+
+  /* More than the store holds, the oldest sectors go */
+  SimFlashPrograms = SimFlashErases = 0;
+  for(x = 0; x < 200; x++)
+    ETMSimStoreAppend(x, 40);
+  ETMStoreSync(&Store);
+  printf("200 appends: %lu programs %lu erases, %lu sectors dropped\n", (unsigned long)SimFlashPrograms,
+         (unsigned long)SimFlashErases, (unsigned long)Store.stats.droppedsectors);
+  CHECK(Store.stats.droppedsectors > 0 && SimFlashPrograms < 100, "full store drops the oldest sectors");
+  StoreNext = -1;
+  StoreCount = StoreOrder = 0;
+  sent = ETMSimStoreDrain(1);
+  POLL_UNTIL(StoreLast == 199, 5000);
+  CHECK(sent > 100 && StoreCount == sent && StoreOrder == 0 && StoreLast == 199, "drain the newest in order");
+
+  /* A torn record ends its sector, later appends start a new one */
+  ETMSimStoreAppend(1000, 0);
+  ETMStoreSync(&Store);
+  sector = Store.head;
+  off = Store.writeoff;
+  ETMSimStoreAppend(1001, 0);
+  ETMSimStoreAppend(1002, 0);
+  ETMStoreSync(&Store);
+  SimFlash[sector * SIMFLASH_SECTOR + off + 12] = 0;
+  CHECK(Store.head == sector && ETMStoreInit(&Store, &SimFlashOps) == 0, "restart with a torn record");
+  ETMSimStoreAppend(1003, 0);
+  StoreNext = 1000;
+  StoreCount = StoreOrder = 0;
+  sent = ETMSimStoreDrain(2);
+  CHECK(sent == 2 && StoreLast == 1003 && StoreOrder == 1 && Store.stats.badrecords == 1, "torn record skipped");
+}
+
+/* Run by the service task once it is started, the test waits with vTaskDelay() and the
+ * service's own calls rather than polling */
+static ETMService_t Service;
+
+/* Is idx the publish topic named topic */
+static bool ETMSimPubNamed(int idx, const char *topic){
+  const struct pubtpc *pt;
+
+  if(idx < 0 || idx >= ETMC2cObj.topics.pubcount)
+    return false;
+  pt = &ETMC2cObj.topics.pubtopics[idx];
+  return pt->namelen == strlen(topic) && memcmp(&ETMC2cObj.topics.topicarena[pt->nameoff], topic, pt->namelen) == 0;
+}
+
+static bool ETMSimServiceSlotsFree(void){
+  int x;
+
+  for(x = 0; x < ETM_SERVICE_SUBSCRIBERS; x++)
+    if(Service.subscribers[x].inbox != NULL)
+      return false;
+  return true;
+}
+
+/* Another task owns the ETM through the service: subscribe, register and publish through it,
+ * a request which gives up before its reply and the request after it, and subscriptions
+ * closed and made again more times than there are slots */
+static void ETMSimRunService(void){
+  ETMSim_Config_t cfg;
+  MessageBufferHandle_t inbox;
+  uint8_t msg[64];
+  size_t len;
+  int sub, pub, late, next, ret, x, made;
+
+  printf("--- service task\n");
+  memset(&ETMC2cObj, 0, sizeof(ETMC2cObj));
+  ETMSim_DefaultConfig(&cfg);
+  cfg.verbose = (getenv("ETMSIM_VERBOSE") != NULL);
+  ETMSim_Start(&cfg);
+  ETMSim_Register(&ETMC2cObj);
+  ETM_Init(&ETMC2cObj, NULL);
+  ETMupdateState(&ETMC2cObj, ETM_STATE_ON);
+  ETMstartproto(&ETMC2cObj, ETM_MQTT);
+  POLL_UNTIL(ETMC2cObj.currentstate == ETM_MQTTREADY, 10000);
+
+  inbox = xMessageBufferCreate(512);
+  CHECK(inbox != NULL && ETMServiceStart(&Service, &ETMC2cObj) == pdPASS, "service task started");
+  sub = ETMServiceSubscribe(&Service, "sim/svc", inbox, pdMS_TO_TICKS(2000));
+  pub = ETMServicePubreg(&Service, "sim/svc", pdMS_TO_TICKS(2000));
+  vTaskDelay(pdMS_TO_TICKS(1000));
+  CHECK(sub >= 0 && ETMsubstate(&ETMC2cObj, sub) == SUB_TOPIC_SUBSCRIBED && ETMSimPubNamed(pub, "sim/svc") &&
+        ETMpubstate(&ETMC2cObj, pub) == PUB_TOPIC_REGISTERED, "subscribe and register through the service");
+  ret = ETMServicePublish(&Service, pub, 0, (const uint8_t *)"through the service", 19, pdMS_TO_TICKS(2000));
+  len = xMessageBufferReceive(inbox, msg, sizeof(msg), pdMS_TO_TICKS(2000));
+  CHECK(ret == 0 && len == 19 && memcmp(msg, "through the service", 19) == 0, "publish comes back in the inbox");
+
+  /* The first gives up while its command is still on the wire, its reply comes while the
+   * second is waiting and mustn't be taken as the second's */
+  late = ETMServicePubreg(&Service, "sim/svc/late", 1);
+  next = ETMServicePubreg(&Service, "sim/svc/next", pdMS_TO_TICKS(2000));
+  vTaskDelay(pdMS_TO_TICKS(500));
+  printf("late request %d, next request %d\n", late, next);
+  CHECK(late == -1 && ETMSimPubNamed(next, "sim/svc/next") && !ETMSimPubNamed(next, "sim/svc/late"),
+        "late reply not taken for the next request");
+  ret = ETMServicePublish(&Service, next, 0, (const uint8_t *)"next", 4, pdMS_TO_TICKS(2000));
+  CHECK(ret == 0, "queue still in step after a late reply");
+
+  ret = ETMServiceUnsubscribe(&Service, sub, pdMS_TO_TICKS(2000));
+  vTaskDelay(pdMS_TO_TICKS(1000));
+  ETMServicePublish(&Service, pub, 0, (const uint8_t *)"after", 5, pdMS_TO_TICKS(2000));
+  len = xMessageBufferReceive(inbox, msg, sizeof(msg), pdMS_TO_TICKS(1000));
+  CHECK(ret == 0 && len == 0 && ETMSimServiceSlotsFree(), "unsubscribe gives the slot back");
+
+  for(x = made = 0; x < ETM_SERVICE_SUBSCRIBERS + 2; x++){
+    snprintf((char *)msg, sizeof(msg), "sim/svc/%d", x);
+    sub = ETMServiceSubscribe(&Service, (char *)msg, inbox, pdMS_TO_TICKS(2000));
+    vTaskDelay(pdMS_TO_TICKS(500));
+    if(sub >= 0 && ETMServiceUnsubscribe(&Service, sub, pdMS_TO_TICKS(2000)) == 0)
+      made++;
+    vTaskDelay(pdMS_TO_TICKS(500));
+  }
+  CHECK(made == ETM_SERVICE_SUBSCRIBERS + 2 && ETMSimServiceSlotsFree(), "more subscriptions in turn than slots");
+
+  vTaskDelete(Service.Task);
+  vMessageBufferDelete(Service.Requests);
+  vSemaphoreDelete(Service.RequestLock);
+  vMessageBufferDelete(inbox);
+}
+
+/* Internal flash in RAM for the OTA writer: two banks, the running one first. As on the
+ * STM32L4 a double word can only be programmed once after an erase. */
+#define OTAFLASH_PAGE     2048
+#define OTAFLASH_BANK     (64 * 1024)
+#define OTAFLASH_JOURNAL  (2 * OTAFLASH_BANK - OTAFLASH_PAGE)
+#ifndef ETMSIM_OTA_PACK
+#define ETMSIM_OTA_PACK   "tools/etm_ota/etm_ota_pack.py"
+#endif
+static uint8_t OtaFlash[2 * OTAFLASH_BANK];
+static uint32_t OtaFlashBadCalls;
+
+static int8_t OtaFlashRead(uint32_t Addr, uint8_t *pData, uint32_t Size){
+  if(Addr > sizeof(OtaFlash) || Size > sizeof(OtaFlash) - Addr){
+    OtaFlashBadCalls++;
+    return -1;
+  }
+  memcpy(pData, &OtaFlash[Addr], Size);
+  return 0;
+}
+
+static int8_t OtaFlashProgram(uint32_t Addr, const uint8_t *pData, uint32_t Size){
+  uint32_t x;
+
+  if(Addr % 8 != 0 || Size % 8 != 0 || Size == 0 || Addr >= sizeof(OtaFlash) ||
+     (Addr % OTAFLASH_PAGE) + Size > OTAFLASH_PAGE){
+    OtaFlashBadCalls++;
+    return -1;
+  }
+  for(x = 0; x < Size; x++)
+    if(OtaFlash[Addr + x] != 0xff)
+      return -1;
+  memcpy(&OtaFlash[Addr], pData, Size);
+  return 0;
+}
+
+static int8_t OtaFlashProgramRow(uint32_t Addr, const uint8_t *pData, uint32_t Size){
+  if(Addr % ETM_OTA_ROW_SIZE != 0 || Size != ETM_OTA_ROW_SIZE){
+    OtaFlashBadCalls++;
+    return -1;
+  }
+  return OtaFlashProgram(Addr, pData, Size);
+}
+
+static int8_t OtaFlashErasePage(uint32_t Addr){
+  if(Addr % OTAFLASH_PAGE != 0 || Addr < OTAFLASH_BANK || Addr >= sizeof(OtaFlash)){
+    OtaFlashBadCalls++;
+    return -1;
+  }
+  memset(&OtaFlash[Addr], 0xff, OTAFLASH_PAGE);
+  return 0;
+}
+
+static int8_t OtaFlashEraseBank(uint32_t Addr){
+  if(Addr < OTAFLASH_BANK || Addr >= sizeof(OtaFlash)){
+    OtaFlashBadCalls++;
+    return -1;
+  }
+  memset(&OtaFlash[OTAFLASH_BANK], 0xff, OTAFLASH_BANK);
+  return 0;
+}
+
+/* Bit at a time, as the CRC unit would give it */
+static uint32_t OtaFlashCrc(uint32_t Crc, const uint8_t *pData, uint32_t Size){
+  int bit;
+
+  if(Size % 4 != 0)
+    OtaFlashBadCalls++;
+  for(; Size > 0; Size--){
+    Crc ^= *pData++;
+    for(bit = 0; bit < 8; bit++)
+      Crc = (Crc >> 1) ^ (0xedb88320 & -(Crc & 1));
+  }
+  return Crc;
+}
+
+static const ETMOtaFlash_t OtaFlashOps = {OtaFlashRead, OtaFlashProgram, OtaFlashProgramRow, OtaFlashErasePage,
+                                          OtaFlashEraseBank, OtaFlashCrc, 0, OTAFLASH_BANK, OTAFLASH_BANK,
+                                          OTAFLASH_PAGE};
+static const char OtaCert[] = "host build, signatures aren't checked";
+
+static uint8_t OtaRandom(uint32_t *seed){
+  *seed = *seed * 1103515245 + 12345;
+  return (uint8_t)(*seed >> 16);
+}
+
+static bool OtaSave(const char *path, const uint8_t *data, uint32_t len){
+  FILE *f = fopen(path, "wb");
+  bool ok;
+
+  if(f == NULL)
+    return false;
+  ok = (fwrite(data, 1, len, f) == len);
+  return (fclose(f) == 0) && ok;
+}
+
+static uint8_t *OtaLoad(const char *path, uint32_t *len){
+  FILE *f = fopen(path, "rb");
+  uint8_t *data = NULL;
+  long n;
+
+  if(f == NULL)
+    return NULL;
+  if(fseek(f, 0, SEEK_END) == 0 && (n = ftell(f)) > 0 && fseek(f, 0, SEEK_SET) == 0 &&
+     (data = malloc(n)) != NULL && fread(data, 1, n, f) != (size_t)n){
+    free(data);
+    data = NULL;
+  }
+  fclose(f);
+  *len = (data != NULL) ? (uint32_t)n : 0;
+  return data;
+}
+
+/* Open a writer on the other bank, left full of something that isn't the image */
+static int OtaOpen(ETMOtaWriter_t *w, bool fast){
+  memset(&OtaFlash[OTAFLASH_BANK], 0x5a, OTAFLASH_BANK);
+  if(ETMOtaWriterOpen(w, &OtaFlashOps, OTAFLASH_BANK, OTAFLASH_BANK - OTAFLASH_PAGE, fast) != 0)
+    return -1;
+  return ETMOtaWriterVerify(w, OtaCert, sizeof(OtaCert));
+}
+
+static int OtaFeed(ETMOtaWriter_t *w, const uint8_t *pkg, uint32_t from, uint32_t to, uint32_t chunk){
+  uint32_t n;
+
+  for(; from < to; from += n){
+    n = MIN(chunk, to - from);
+    if(ETMOtaWriterWrite(w, &pkg[from], n) != 0)
+      return -1;
+  }
+  return 0;
+}
+
+/* The whole package in chunks of every size up to a few rows, then of each power of two up to
+ * all of it at once, in fast mode too for some. Returns the sizes which didn't give the image. */
+static int OtaSweep(const uint8_t *pkg, uint32_t pkglen, const uint8_t *image, uint32_t imagelen){
+  ETMOtaWriter_t w;
+  uint32_t chunk;
+  int bad = 0;
+  bool fast;
+
+  for(chunk = 1; chunk <= pkglen; chunk = (chunk < 3 * ETM_OTA_ROW_SIZE) ? chunk + 1 : chunk * 2){
+    for(fast = false; ; fast = true){
+      if(OtaOpen(&w, fast) != 0 || OtaFeed(&w, pkg, 0, pkglen, chunk) != 0 || ETMOtaWriterFinish(&w) != 0 ||
+         w.written != imagelen || memcmp(&OtaFlash[OTAFLASH_BANK], image, imagelen) != 0){
+        if(bad++ == 0)
+          printf("chunks of %lu%s don't give the image\n", (unsigned long)chunk, fast ? " (fast)" : "");
+      }
+      if(fast || chunk % 37 != 1)
+        break;
+    }
+  }
+  return bad;
+}
+
+/* Packages made by tools/etm_ota (-z and -d against the running image) are written to the
+ * other bank whatever size of chunk they arrive in. A download checkpointed part way through a
+ * token and abandoned further on carries on from the journal after a restart. */
+static void ETMSimRunOta(void){
+  static char dir[] = "/tmp/etmotaXXXXXX";
+  char cmd[512], path[160];
+  uint8_t *oldimg, *newimg, *pz = NULL, *pd = NULL;
+  uint32_t oldlen = 40000, newlen, zlen = 0, dlen = 0, x, seed = 1, stop;
+  ETMOtaWriter_t w;
+  ETMFwCheckpoint_t cp;
+  bool made;
+
+  printf("--- OTA writer\n");
+  /* Random runs, repeats of earlier runs and runs of one octet */
+  oldimg = malloc(oldlen);
+  newimg = malloc(oldlen + 4096);
+  for(x = 0; x < oldlen; ){
+    uint32_t run = 16 + OtaRandom(&seed) % 300;
+    uint8_t kind = OtaRandom(&seed) % 4;
+
+    run = MIN(run, oldlen - x);
+    if(kind == 0 && x > 1500){
+      memcpy(&oldimg[x], &oldimg[x - 400 - (OtaRandom(&seed) << 2)], run);
+    }else if(kind == 1){
+      memset(&oldimg[x], OtaRandom(&seed), run);
+    }else{
+      for(stop = x + run; x < stop; x++)
+        oldimg[x] = OtaRandom(&seed);
+      continue;
+    }
+    x += run;
+  }
+  /* The update changes a few octets, moves code along and adds some */
+  memcpy(newimg, oldimg, 10000);
+  for(x = 0; x < 500; x++)
+    newimg[10000 + x] = OtaRandom(&seed);
+  memcpy(&newimg[10500], &oldimg[10000], 15000);
+  memcpy(&newimg[25500], &oldimg[25300], oldlen - 25300);
+  newlen = 25500 + oldlen - 25300;
+  for(x = 0; x < 2000; x++)
+    newimg[newlen++] = OtaRandom(&seed);
+  for(x = 700; x < newlen; x += 1499)
+    newimg[x] ^= 0x21;
+
+  made = (mkdtemp(dir) != NULL);
+  if(made){
+    snprintf(path, sizeof(path), "%s/old.bin", dir);
+    made = OtaSave(path, oldimg, oldlen);
+    snprintf(path, sizeof(path), "%s/new.bin", dir);
+    made = made && OtaSave(path, newimg, newlen);
+    snprintf(cmd, sizeof(cmd), "cd %s && openssl ecparam -name prime256v1 -genkey -noout -out key.pem && "
+             "python3 %s/" ETMSIM_OTA_PACK " -k key.pem -z new.bin new.z >/dev/null && "
+             "python3 %s/" ETMSIM_OTA_PACK " -k key.pem -d old.bin new.bin new.d >/dev/null",
+             dir, getenv("PWD") ? getenv("PWD") : ".", getenv("PWD") ? getenv("PWD") : ".");
+    made = made && system(cmd) == 0;
+    snprintf(path, sizeof(path), "%s/new.z", dir);
+    pz = OtaLoad(path, &zlen);
+    snprintf(path, sizeof(path), "%s/new.d", dir);
+    pd = OtaLoad(path, &dlen);
+    snprintf(cmd, sizeof(cmd), "rm -rf %s", dir);
+    if(system(cmd) != 0)
+      printf("%s left behind\n", dir);
+  }
+  CHECK(made && pz != NULL && pd != NULL, "images packed by " ETMSIM_OTA_PACK);
+  if(pz == NULL || pd == NULL){
+    free(pz);
+    free(pd);
+    free(oldimg);
+    free(newimg);
+    return;
+  }
+  printf("%lu octet image, %lu compressed, %lu as a delta\n", (unsigned long)newlen, (unsigned long)zlen,
+         (unsigned long)dlen);
+
+  memcpy(OtaFlash, oldimg, oldlen);
+  memset(&OtaFlash[oldlen], 0xff, OTAFLASH_BANK - oldlen);
+  OtaFlashBadCalls = 0;
+  CHECK(OtaSweep(pz, zlen, newimg, newlen) == 0, "compressed image in chunks of any size");
+  CHECK(OtaSweep(pd, dlen, newimg, newlen) == 0, "delta image in chunks of any size");
+
+  /* Checkpoint once a journal interval has gone, where the decoder is part way through a token's
+   * count or argument and nothing is left gathered in RAM */
+  memset(&cp, 0, sizeof(cp));
+  cp.len = zlen;
+  cp.cs = 0x1234;
+  made = (OtaOpen(&w, false) == 0 && ETMOtaWriterResume(&w, OTAFLASH_JOURNAL) == 0 && w.cp.offset == 0 &&
+          OtaFeed(&w, pz, 0, ETM_OTA_JOURNAL_INTERVAL + 1000, 100) == 0);
+  for(stop = ETM_OTA_JOURNAL_INTERVAL + 1000; made && stop < zlen && (w.lz.state == 0 || w.lz.state == 3 || w.fill != 0); stop++)
+    made = (ETMOtaWriterWrite(&w, &pz[stop], 1) == 0);
+  cp.offset = stop;
+  cp.sofar = (uint16_t)stop;
+  ETMOtaWriterCheckpoint(&w, &cp);
+  printf("checkpoint at %lu, decoder state %u, %lu octets of image\n", (unsigned long)stop, w.lz.state,
+         (unsigned long)w.written);
+  CHECK(made && (w.lz.state == 1 || w.lz.state == 2) && w.stats.journalled == 1, "checkpoint part way through a token");
+  /* Carry on past the next page, then stop without finishing as a restart would */
+  made = made && (OtaFeed(&w, pz, stop, MIN(stop + 3 * OTAFLASH_PAGE + 5, zlen), 64) == 0);
+
+  memset(&w, 0, sizeof(w));
+  made = made && ETMOtaWriterOpen(&w, &OtaFlashOps, OTAFLASH_BANK, OTAFLASH_BANK - OTAFLASH_PAGE, false) == 0 &&
+         ETMOtaWriterVerify(&w, OtaCert, sizeof(OtaCert)) == 0 && ETMOtaWriterResume(&w, OTAFLASH_JOURNAL) == 0;
+  CHECK(made && w.cp.offset == stop && w.cp.len == zlen && w.cp.sofar == (uint16_t)stop, "carry on from the journal");
+  made = made && OtaFeed(&w, pz, stop, zlen, 333) == 0;
+  cp.offset = zlen;
+  ETMOtaWriterCheckpoint(&w, &cp);
+  CHECK(made && ETMOtaWriterFinish(&w) == 0 && w.written == newlen &&
+        memcmp(&OtaFlash[OTAFLASH_BANK], newimg, newlen) == 0, "image after a restart matches");
+  CHECK(OtaFlashBadCalls == 0, "flash used within its pages and banks");
+
+  free(pz);
+  free(pd);
+  free(oldimg);
+  free(newimg);
+}
+
+int main(void){
+  uint32_t x;
+
+  for(x = 0; x < sizeof(FwImage); x++)
+    FwImage[x] = (uint8_t)(x ^ (x >> 8));
+  ETMSimRun(false, false);
+  ETMSimRun(false, true);
+  ETMSimRun(true, false);
+  ETMSimRunFw();
+  ETMSimRunTables();
+  ETMSimRunInflight();
+  ETMSimRunAcks();
+  ETMSimRunLink();
+  ETMSimRunStore();
+  ETMSimRunService();
+  ETMSimRunOta();
+  printf("%s\n", Failures ? "FAILED" : "PASSED");
+  return Failures ? 1 : 0;
+}
@@ -0,0 +1,39 @@
+/**
+  ******************************************************************************
+  * @file    FreeRTOS.h
+  * @brief   Host shim for building the ETM driver against the simulator.
+  *          Only what etm.c, the ETM service and the OTA writer use is
+  *          provided, time is the simulator's clock.
+  ******************************************************************************
+  */
+#ifndef INC_FREERTOS_H
+#define INC_FREERTOS_H
+
+#include <stdint.h>
+#include <stddef.h>
+#include <stdlib.h>
+
+typedef uint32_t TickType_t;
+typedef long BaseType_t;
+typedef unsigned long UBaseType_t;
+
+#define pdFALSE                 ( ( BaseType_t ) 0 )
+#define pdTRUE                  ( ( BaseType_t ) 1 )
+#define pdPASS                  ( pdTRUE )
+#define pdFAIL                  ( pdFALSE )
+
+/* One tick per ms as on the target */
+#define configTICK_RATE_HZ      1000
+#define pdMS_TO_TICKS( xTimeInMs ) ( ( TickType_t ) ( xTimeInMs ) )
+#define portMAX_DELAY           ( ( TickType_t ) 0xffffffffUL )
+
+#define configMINIMAL_STACK_SIZE ( ( uint16_t ) 128 )
+
+/* Driver logging goes through the simulator so it can be silenced */
+void ETMSim_Log( const char *format, ... );
+#define configPRINTF( X )       ETMSim_Log X
+
+#define pvPortMalloc( xSize )   malloc( xSize )
+#define vPortFree( pv )         free( pv )
+
+#endif /* INC_FREERTOS_H */
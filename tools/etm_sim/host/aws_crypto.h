@@ -0,0 +1,62 @@
+/**
+  ******************************************************************************
+  * @file    aws_crypto.h
+  * @brief   Host shim for building the OTA writer against the simulator.
+  *          Signatures aren't checked: the hash is dropped and every signature
+  *          verifies, so the image's length and CRC-32 are what is tested.
+  ******************************************************************************
+  */
+#ifndef __AWS_CRYPTO__H__
+#define __AWS_CRYPTO__H__
+
+#include <stdint.h>
+#include <stddef.h>
+
+#include "FreeRTOS.h"
+
+#define cryptoSHA1_DIGEST_BYTES      20
+#define cryptoSHA256_DIGEST_BYTES    32
+
+#define cryptoHASH_ALGORITHM_SHA1           1
+#define cryptoHASH_ALGORITHM_SHA256         2
+#define cryptoASYMMETRIC_ALGORITHM_RSA      1
+#define cryptoASYMMETRIC_ALGORITHM_ECDSA    2
+
+static inline void CRYPTO_ConfigureHeap( void ){}
+
+static inline BaseType_t CRYPTO_SignatureVerificationStart( void ** ppvContext,
+                                                            BaseType_t xAsymmetricAlgorithm,
+                                                            BaseType_t xHashAlgorithm )
+{
+    static uint8_t ucContext;
+
+    ( void ) xAsymmetricAlgorithm;
+    ( void ) xHashAlgorithm;
+    *ppvContext = &ucContext;
+    return pdTRUE;
+}
+
+static inline void CRYPTO_SignatureVerificationUpdate( void * pvContext,
+                                                       uint8_t * pucData,
+                                                       size_t xDataLength )
+{
+    ( void ) pvContext;
+    ( void ) pucData;
+    ( void ) xDataLength;
+}
+
+static inline BaseType_t CRYPTO_SignatureVerificationFinal( void * pvContext,
+                                                            char * pcSignerCertificate,
+                                                            size_t xSignerCertificateLength,
+                                                            uint8_t * pucSignature,
+                                                            size_t xSignatureLength )
+{
+    ( void ) pvContext;
+    ( void ) pcSignerCertificate;
+    ( void ) xSignerCertificateLength;
+    ( void ) pucSignature;
+    ( void ) xSignatureLength;
+    return pdTRUE;
+}
+
+#endif /* __AWS_CRYPTO__H__ */
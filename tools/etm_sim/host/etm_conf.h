@@ -0,0 +1,32 @@
+/**
+  ******************************************************************************
+  * @file    etm_conf.h
+  * @brief   ETM configuration for host builds, values can be overridden with -D
+  ******************************************************************************
+  */
+
+#ifndef __ETM_CONF_H
+#define __ETM_CONF_H
+
+#ifdef __cplusplus
+ extern "C" {
+#endif
+
+/* Same as the STM32L475 Discovery demo by default */
+#ifndef ETM_CMD_SIZE
+#define ETM_CMD_SIZE                           1024
+#endif
+
+#ifndef ETM_DEFAULT_BAUDRATE
+#define ETM_DEFAULT_BAUDRATE                   115200
+#endif
+
+/* The simulated link has RTS/CTS wired, so the negotiation is exercised */
+#ifndef ETM_FLOW_CONTROL
+#define ETM_FLOW_CONTROL                       1
+#endif
+
+#ifdef __cplusplus
+}
+#endif
+#endif /* __ETM_CONF_H */
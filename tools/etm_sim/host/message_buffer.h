@@ -0,0 +1,24 @@
+/**
+  ******************************************************************************
+  * @file    message_buffer.h
+  * @brief   Host shim for building the ETM service against the simulator.
+  *          Each message takes its length (a size_t) as well as its octets, as
+  *          on the target.
+  ******************************************************************************
+  */
+#ifndef FREERTOS_MESSAGE_BUFFER_H
+#define FREERTOS_MESSAGE_BUFFER_H
+
+#include "FreeRTOS.h"
+#include "task.h"
+
+typedef struct ETMSimMessageBuffer *MessageBufferHandle_t;
+
+MessageBufferHandle_t xMessageBufferCreate( size_t xBufferSizeBytes );
+void vMessageBufferDelete( MessageBufferHandle_t xMessageBuffer );
+size_t xMessageBufferSend( MessageBufferHandle_t xMessageBuffer, const void *pvTxData, size_t xDataLengthBytes,
+                           TickType_t xTicksToWait );
+size_t xMessageBufferReceive( MessageBufferHandle_t xMessageBuffer, void *pvRxData, size_t xBufferLengthBytes,
+                              TickType_t xTicksToWait );
+
+#endif /* FREERTOS_MESSAGE_BUFFER_H */
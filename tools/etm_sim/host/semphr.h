@@ -0,0 +1,21 @@
+/**
+  ******************************************************************************
+  * @file    semphr.h
+  * @brief   Host shim for building the ETM service against the simulator.
+  *          Mutexes only, a task waiting for one lets the others run.
+  ******************************************************************************
+  */
+#ifndef SEMAPHORE_H
+#define SEMAPHORE_H
+
+#include "FreeRTOS.h"
+#include "task.h"
+
+typedef struct ETMSimMutex *SemaphoreHandle_t;
+
+SemaphoreHandle_t xSemaphoreCreateMutex( void );
+void vSemaphoreDelete( SemaphoreHandle_t xSemaphore );
+BaseType_t xSemaphoreTake( SemaphoreHandle_t xSemaphore, TickType_t xBlockTime );
+BaseType_t xSemaphoreGive( SemaphoreHandle_t xSemaphore );
+
+#endif /* SEMAPHORE_H */
@@ -0,0 +1,54 @@
+/**
+  ******************************************************************************
+  * @file    task.h
+  * @brief   Host shim for building the ETM driver against the simulator.
+  *          Tasks take turns on the simulated clock: one runs until it delays
+  *          or waits, then the task due soonest carries on, so delays just move
+  *          the clock on when there is only one.
+  ******************************************************************************
+  */
+#ifndef INC_TASK_H
+#define INC_TASK_H
+
+#include "FreeRTOS.h"
+
+#define tskIDLE_PRIORITY        ( ( UBaseType_t ) 0U )
+
+typedef struct ETMSimTask *TaskHandle_t;
+typedef void (*TaskFunction_t)( void * );
+
+typedef struct {
+  TickType_t xTimeOnEntering;
+} TimeOut_t;
+
+typedef enum {
+  eNoAction = 0,
+  eSetBits,
+  eIncrement,
+  eSetValueWithOverwrite,
+  eSetValueWithoutOverwrite
+} eNotifyAction;
+
+void vTaskDelay( const TickType_t xTicksToDelay );
+TickType_t xTaskGetTickCount( void );
+
+static inline void vTaskSuspendAll( void ){}
+static inline BaseType_t xTaskResumeAll( void ){ return pdFALSE; }
+
+/* The stack depth is ignored, each task gets a host sized stack */
+BaseType_t xTaskCreate( TaskFunction_t pxTaskCode, const char * const pcName, const uint16_t usStackDepth,
+                        void * const pvParameters, UBaseType_t uxPriority, TaskHandle_t * const pxCreatedTask );
+/* Only another task can be deleted */
+void vTaskDelete( TaskHandle_t xTaskToDelete );
+TaskHandle_t xTaskGetCurrentTaskHandle( void );
+
+void vTaskSetTimeOutState( TimeOut_t * const pxTimeOut );
+BaseType_t xTaskCheckForTimeOut( TimeOut_t * const pxTimeOut, TickType_t * const pxTicksToWait );
+
+BaseType_t xTaskNotify( TaskHandle_t xTaskToNotify, uint32_t ulValue, eNotifyAction eAction );
+#define xTaskNotifyGive( xTaskToNotify ) xTaskNotify( ( xTaskToNotify ), 0, eIncrement )
+BaseType_t xTaskNotifyWait( uint32_t ulBitsToClearOnEntry, uint32_t ulBitsToClearOnExit,
+                            uint32_t *pulNotificationValue, TickType_t xTicksToWait );
+BaseType_t xTaskNotifyStateClear( TaskHandle_t xTask );
+
+#endif /* INC_TASK_H */